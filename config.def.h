@@ -1,16 +1,19 @@
 char const title[] = "xpaint";
 
 // lag prevention
-// only one drag event per period will be processed
-u32 const DRAG_EVENT_PROC_PERIOD_US = 10000;
-// update rate on screen scroll with mouse drag
-u32 const MOUSE_SCROLL_UPDATE_PERIOD_US = 16000;
+// screen is redrawn at most once per period, events are processed in between
+u32 const FRAME_PERIOD_US = 10000;
+// canvas compositing, can be changed with `:set renderer`
+enum Renderer const RENDERER_DEFAULT = Renderer_XRender;
+u32 const CLIENT_RENDER_THREADS = 0;  // 0 to use all online cpus
 
 u32 const MAX_COLORS = 9;
 u32 const TCS_NUM = 3;
 char const UI_FONT_NAME[] = "monospace:size=10";
 i32 const PNG_DEFAULT_COMPRESSION = 8;
+u32 const PNG_ENCODE_THREADS = 0;  // 0 to use all online cpus
 i32 const JPG_DEFAULT_QUALITY = 80;
+u32 const JPG_PREVIEW_MIN_SCALE = 4;  // preview jpegs this many times larger than window while loading, 0 to disable
 double const CANVAS_ZOOM_SPEED = 1.2;  // must be > 1.0
 // state bits to ignore when matching key or button events.
 // use `xmodmap` to check your keyboard modifier map.
@@ -95,7 +98,7 @@ argb const CANVAS_BACKGROUND = 0xFF000000;
 u32 const CANVAS_DEFAULT_WIDTH = 1000;
 u32 const CANVAS_DEFAULT_HEIGHT = 700;
 i32 const CANVAS_MIN_ZOOM = -10;
-i32 const CANVAS_MAX_ZOOM = 22;  // at high values visual glitches appear
+i32 const CANVAS_MAX_ZOOM = 22;
 
 Bool const CONSOLE_AUTO_COMPLETIONS = True;
 
@@ -1,13 +1,26 @@
 #include <X11/Xatom.h>  // XA_*
 #include <X11/Xft/Xft.h>
 #include <X11/extensions/Xdbe.h>  // back buffer
+#include <X11/extensions/XShm.h>  // shared memory uploads
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/sync.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
+#include <limits.h>  // SHRT_*
+#ifdef __SSE2__
+    #include <emmintrin.h>  // client renderer
+#endif
+#include <poll.h>
+#include <pthread.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/shm.h>
+#include <sys/stat.h>  // fchmod
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 // libs
@@ -17,6 +30,10 @@
 #define INCBIN_PREFIX
 #define INCBIN_STYLE INCBIN_STYLE_SNAKE
 #include "lib/incbin.h"
+// counts allocations, see heap_alloc_count
+static void* heap_realloc(void* ptr, size_t size);
+#define STBDS_REALLOC(context, ptr, size) heap_realloc((ptr), (size))
+#define STBDS_FREE(context, ptr)          free(ptr)
 #define STB_DS_IMPLEMENTATION
 #include "lib/stb_ds.h"
 #undef STB_DS_IMPLEMENTATION
@@ -73,6 +90,8 @@ INCBIN(u8, pic_fig_fill_off, "res/figure-fill-off.png");
 #define IS_PNIL(p_pt)    ((p_pt).x == NIL && (p_pt).y == NIL)
 #define IS_DPNIL(p_dpt)  ((p_dpt).x == NIL && (p_dpt).y == NIL)
 #define PT_EQ(p_a, p_b)  ((p_a).x == (p_b).x && (p_a).y == (p_b).y)
+#define RECT_EQ(p_a, p_b) \
+    ((p_a).l == (p_b).l && (p_a).t == (p_b).t && (p_a).r == (p_b).r && (p_a).b == (p_b).b)
 #define IS_RNIL(p_rect) \
     (((p_rect).l) == INT32_MAX && ((p_rect).t) == INT32_MAX && ((p_rect).r) == INT32_MIN && ((p_rect).b) == INT32_MIN)
 
@@ -102,6 +121,24 @@ enum { NO_MODE = 0 };
 #define RNIL             ((Rect) {.l = INT32_MAX, .t = INT32_MAX, .r = INT32_MIN, .b = INT32_MIN})
 #define DPNIL            ((DPt) {NIL, NIL})
 #define PI               (3.141)
+#define MIP_LEVELS_MAX   16
+#define THREADS_MAX      16
+#define OVR_TILE_SIZE    256
+#define RECTSET_MAX      16
+#define ARENA_BLOCK_MIN  (64 * 1024)
+#define PNG_DEFLATE_PART (128 * 1024)  // filtered bytes compressed by one task
+#define IO_WRITE_BUF     (1024 * 1024)
+#define PNG_WINDOW       32768
+#define PNG_ZHASH        16384
+#define PNG_FAST_BITS    10  // huffman codes decoded by single lookup
+#define JPG_FAST_BITS    9
+#define ARENA_RETAIN_MAX (4 * 1024 * 1024)  // bigger arena is freed on reset
+#define XPR_MAGIC        "\x89XPR\r\n\x1A\n"
+#define XPR_BYTE_ORDER   0x01020304u
+#define XPR_DATA_OFFSET  (64 * 1024)  // largest common page size, so pixels can be mapped
+#define INCR_CHUNK       (256 * 1024)  // selection data sent by one property change
+#define INCR_TIMEOUT_US  (10 * 1000 * 1000)  // idle selection transfer is dropped after
+#define INCR_HINT_MAX    (64 * 1024 * 1024)  // announced incoming selection size reserved at most
 // only one one-byte symbol allowed
 #define ARGB_ALPHA       ((argb)(0xFF000000))
 #define CL_DELIM         " "
@@ -137,11 +174,28 @@ typedef struct {
     i32 b;  // inclusive
 } Rect;
 
+// disjoint rects, closest ones are merged to stay under RECTSET_MAX
+typedef struct {
+    u32 len;
+    Rect rects[RECTSET_MAX];
+} RectSet;
+
 typedef struct {
     double x;
     double y;
 } DPt;
 
+// bump allocator for short-living temporaries, see arena_reset
+struct Arena {
+    struct ArenaBlock {
+        struct ArenaBlock* prev;
+        u8* data;
+        usize cap;
+        usize used;
+    }* head;
+    usize used_total;  // by all blocks
+};
+
 typedef struct {
     KeySym sym;
     u32 mask;
@@ -158,6 +212,12 @@ enum Schm {
     SchmLast,
 };
 
+// where canvas and overlay are composited, see dc_view_compose
+enum Renderer {
+    Renderer_XRender,  // server-side
+    Renderer_Client,  // client-side, uploaded through MIT-SHM when possible
+};
+
 typedef struct {
     enum {
         SLM_Spacer,  // static spacer
@@ -191,6 +251,7 @@ enum {
     A_Targets,
     A_Utf8string,
     A_ImagePng,
+    A_Incr,
     A_TextUriList,
     A_XSelData,
     A_WmProtocols,
@@ -234,10 +295,32 @@ struct Image {
     enum ImageType {
         IMT_Png,
         IMT_Jpg,
+        IMT_Xpr,
+        IMT_Ff,  // farbfeld
+        IMT_Ppm,
+        IMT_Pam,
+        IMT_Qoi,
         IMT_Unknown,
     } type;
 };
 
+// header of native uncompressed format, pixels are rows of canvas argb at data_offset
+struct XprHeader {
+    u8 magic[8];  // XPR_MAGIC
+    u32 byte_order;  // XPR_BYTE_ORDER as stored by writer, pixels are in same order
+    u32 width;
+    u32 height;
+    u32 stride;  // bytes per row, width * 4
+    u64 data_offset;  // XPR_DATA_OFFSET
+};
+
+// encoded image as read from IOCtx
+struct IOData {
+    u8* data;
+    usize len;
+    Bool mapped;  // file is mapped, stdin is read to heap
+};
+
 typedef struct {
     Pt move;
     DPt scale;  // (1, 1) for no scale change
@@ -256,9 +339,16 @@ typedef enum {
     HR_Ok,
 } HdlrResult;
 
+// buffered writer, files are written to temporary file and renamed over target on success
 struct IOCtxWriteCtx {
     struct IOCtx const* ioctx;
-    Bool result_out;
+    Bool result_out;  // stays False after any failed part
+    i32 fd;
+    char* tmp_path_dyn;  // for IO_File
+    u8* buf_dyn;
+    usize buf_len;
+    usize written;  // total
+    u64 start_us;
 };
 
 struct DrawerData {
@@ -287,10 +377,16 @@ struct Ctx {
         Display* dp;
         GC gc;
         GC screen_gc;
+        RectSet const* clip;  // of screen_gc, NULL if unclipped, applied to string drawing too
         Window window;
         u32 width;
         u32 height;
         XdbeBackBuffer back_buffer;  // double buffering
+        struct Shm {
+            Bool available;  // MIT-SHM is supported and usable (e.g. not remote display)
+            i32 completion_type;  // ShmCompletion event type
+            u32 pending;  // XShmPutImage requests not completed yet
+        } shm;
         struct Canvas {
             XImage* im;
             enum ImageType type;
@@ -306,8 +402,60 @@ struct Ctx {
             Pt dims;  // to validate pm and overlay
 
             Pixmap pm;  // pixel buffer to update screen
-            Pixmap overlay;  // extra pixmap for overlay
+            // overlay split into OVR_TILE_SIZE squares, only tiles with overlay content have pixmap
+            struct OverlayTiles {
+                Pt grid;  // tiles per row and column
+                Pixmap* pms_dyn;  // 0 for empty tile
+            } overlay;
+
+            // pm downscaled by 2^level for negative zoom, built lazily in dc_cache_mip
+            struct Mip {
+                Pixmap pm;  // 0 if not built yet, mips[0] is unused
+                Pt dims;
+                Rect dirty;  // canvas coordinates, not propagated to this level yet
+                XImage* im;  // same level of cv.im for client renderer, built lazily in dc_client_mip
+                Rect im_dirty;  // as dirty, for im
+            } mips[MIP_LEVELS_MAX];
+            // canvas damage not uploaded while client renderer doesn't read pixmaps
+            Rect stale;
         } cache;
+        // window area to redraw and present in frame_render
+        struct ScreenDamage {
+            RectSet rects;  // accumulated since last frame_render
+            Rect ui;  // interface drawn on last frame_render (decorations, statusline)
+            i32 sel_circ_item;  // highlighted on last frame_render, circle itself is damaged on open and close
+            RectSet drawn;  // damage of last frame_render, interface drawing is clipped to it
+            // view of last frame_render, whole window is redrawn on change except scroll
+            i32 zoom;
+            Pt scroll;
+            Pt wnd_dims;
+            Pt cv_dims;
+        } scr_damage;
+        struct View {
+            Pixmap pm;  // window sized, 0 if not created yet
+            XImage* im;  // staging image of client renderer, created lazily
+            Pt dims;
+            Pt anchor;  // canvas pixel that transforms are relative to, fixed until view reset
+        } view;
+        // client renderer threads, started on first composite and kept until exit
+        struct RenderPool {
+            Bool started;
+            u32 workers;  // running threads, composing thread takes one more part
+            pthread_t tids[THREADS_MAX];
+            struct RenderWorker {
+                struct RenderPool* pool;
+                u32 index;  // part of jobs it composes
+            } args[THREADS_MAX];
+            pthread_mutex_t mtx;  // guards fields below
+            pthread_cond_t start_cv;  // generation changed or quit set
+            pthread_cond_t done_cv;  // pending dropped to zero
+            u32 generation;
+            u32 pending;  // workers that didn't finish current generation
+            u32 parts;  // jobs for workers in current generation
+            struct ClientJob const* jobs;
+            Bool quit;
+        } render_pool;
+        enum Renderer renderer;
     } dc;
 
     struct Input {
@@ -323,8 +471,9 @@ struct Ctx {
         } c;
 
         Pt prev_c;  // last cursor position
+        Time last_motion_time;  // of last processed motion event
+        Pt* motion_arr;  // pointer positions of coalesced motion events, see motion_coalesce
 
-        u64 last_proc_drag_ev_us;  // optimization to reduce drag events
         Pt anchor;  // cursor position of last processed drawing tool event
 
         i32 png_compression_level;  // FIXME find better place
@@ -339,10 +488,10 @@ struct Ctx {
         } ovr;
 
         // tracks damage to overlay from _on_press to _on_release.
-        Rect damage;
+        RectSet damage;
         // parts of overlay and canvas to redraw in update_screen
         // stores last and previous damages to handle full screen clears, e.g. figure tool or selection tool
-        Rect redraw_track[2];
+        RectSet redraw_track[2];
 
         struct InputMode {
             enum InputTag {
@@ -384,7 +533,8 @@ struct Ctx {
         // returns overlay damage
         Rect (*on_press)(struct Ctx*, XButtonPressedEvent const*);
         Rect (*on_release)(struct Ctx*, XButtonReleasedEvent const*);
-        Rect (*on_drag)(struct Ctx*, XMotionEvent const*);
+        // event is last of coalesced motion events, pts are all pointer positions since previous call
+        RectSet (*on_drag)(struct Ctx*, XMotionEvent const* event, Pt const* pts, u32 pts_len);
         Rect (*on_move)(struct Ctx*, XMotionEvent const*);
 
         argb* colarr;
@@ -397,6 +547,7 @@ struct Ctx {
         // call brush_cache_update before using this field
         struct Brush {
             argb* data;
+            usize cap;  // in pixels, data is reused while new brush fits
             Pt dims;
             struct BrushParams {
                 u32 line_w;
@@ -435,19 +586,27 @@ struct Ctx {
         } t;
         union HistData {
             struct HistDamage {
-                Pt pivot;  // top left corner position
-                XImage* patch;  // changed canvas part
+                struct HistPatch {
+                    Pt pivot;  // top left corner position
+                    XImage* patch;  // changed canvas part
+                }* patches_arr;  // disjoint parts of one action
             } damage;
             struct HistResize {
                 XImage* cv;  // resize can delete canvas contents, need to store
             } resize;
         } d;
     } *hist_prevarr, *hist_nextarr;
+    u32 hist_version;  // changed by every history step
 
     struct SelectionCircle {
         i32 x;
         i32 y;
         Bool draw_separators;
+        Pixmap wheel_pm;  // everything except highlight, rendered on first draw, 0 if not rendered
+        Bool is_hue_wheel;  // items_arr is copy of hue_items_arr and wheel_pm is hue_pm
+        // hue wheel is same on every opening, kept until cleanup
+        struct Item* hue_items_arr;
+        Pixmap hue_pm;
         struct Item {
             void (*on_select)(struct Ctx* ctx, union SCI_Arg arg);
             union SCI_Arg {
@@ -466,13 +625,72 @@ struct Ctx {
         }* items_arr;
     } sc;
 
+    // update_screen requests are collected here and rendered once per frame in run
+    struct Frame {
+        Bool dirty;
+        Bool full_redraw;
+        Pt cur_scr;  // last known pointer position
+        RectSet cv_damage;  // canvas parts to upload to cache
+        u64 deadline_us;  // next frame is not rendered earlier, CLOCK_MONOTONIC
+        char* message_dyn;  // drawn instead of statusline, see show_message
+        Bool message_shown;  // message is cleared on next update_screen after it was rendered
+    } frame;
+
+    // status line layout of last frame, only changed parts are redrawn
+    struct Statusline {
+        u64 key;  // hash of everything except modules, whole line is redrawn on change
+        Rect rect;  // including completions list
+        struct SLModuleCache {
+            u64 key;  // hash of module inputs
+            Rect rect;  // screen position, RNIL if not laid out
+        }* modules_arr;  // LEFT_MODULES then RIGHT_MODULES
+    } statusline;
+
+    // wakeup sources of run besides X connection
+    struct Loop {
+        i32 timer_fd;  // frame clock, armed while frame is dirty
+        Bool timer_armed;
+        i32 wake_fd;  // eventfd, signaled after completion is posted
+        pthread_mutex_t mtx;  // guards done_arr
+        // posted by worker threads, handled on UI thread
+        struct Completion {
+            void (*on_done)(struct Ctx* ctx, void* data);
+            void* data;
+        }* done_arr;
+    } loop;
+
     struct StateXSync {
         XSyncCounter counter;
         XSyncValue last_request_value;
     } xsync;
 
+    // ICCCM INCR transfer of pasted data, see incr_recv_chunk
+    struct IncrRecv {
+        Atom target;  // None if no transfer
+        Atom property;
+        u8* data_arr;
+    } incr_recv;
+
+    // png of im is encoded once per copy on worker thread, see clip_encode_start
     struct SelectionBuffer {
         XImage* im;
+        u32 generation;  // changed by every copy
+        struct ClipPng {
+            u8* data_dyn;  // NULL if encoding failed
+            i32 len;
+            u32 refs;  // by sel_buf and incr transfers
+        }* png;  // NULL while encoding
+        XSelectionRequestEvent* waiting_arr;  // answered when png is encoded
+        u32 encoding;  // jobs not handled by clip_encode_done yet
+        // ICCCM INCR transfers, next chunk is sent when requestor deletes property
+        struct IncrSend {
+            Window requestor;
+            Atom property;
+            struct ClipPng* png;
+            usize offset;
+            usize chunk;  // bytes per property change, fits in one request
+            u64 last_us;  // of last chunk, for timeout
+        }* incr_arr;
     } sel_buf;
 
     struct IOCtx {
@@ -487,6 +705,35 @@ struct Ctx {
             } file;
         } d;
     } inp, out;
+
+    // saved one by one on worker thread, see save_start
+    struct Saves {
+        struct SaveJob {
+            struct Loop* loop;
+            XImage snapshot;  // canvas with copied data
+            enum ImageType type;
+            i32 png_compression_level;
+            i32 jpg_quality_level;
+            struct IOCtx ioctx;
+            Bool result;
+        }** queue_arr;  // first one is running
+        Bool exit_when_done;  // set by :wq, reset if any save fails
+        Bool exiting;  // window may be gone, so results are only traced
+    } saves;
+
+    // full resolution decode of jpeg shown downscaled, see fullres_start
+    struct FullRes {
+        struct FullResJob {
+            struct Loop* loop;
+            struct IOData input;
+            u32 scale_shift;  // of preview
+            u32 hist_version;  // when preview was loaded
+            argb* pixels_dyn;  // NULL on failure
+            Pt dims;
+        }* pending;  // for current canvas, NULL if canvas is not preview
+        struct FullResJob* ready;  // decoded while input was busy, see fullres_apply_ready
+        u32 running;  // jobs not handled by fullres_done yet
+    } fullres;
 };
 
 #define ENUM_DECL_HELPER(p_tag, p_str) p_tag,
@@ -537,12 +784,18 @@ DEFINE_ENUM_WITH_STRING_CONVERSIONS(ClCTag, cl_cmd, FOREACH_ClCTag)
     X(ClCDS_PngCompression, "png_cmpr") \
     X(ClCDS_JpgQuality, "jpg_qlty") \
     X(ClCDS_Spacing, "spacing") \
-    X(ClCDS_Hardness, "hardness")
+    X(ClCDS_Hardness, "hardness") \
+    X(ClCDS_Renderer, "renderer")
 DEFINE_ENUM_WITH_STRING_CONVERSIONS(ClCDSTag, cl_set_prop, FOREACH_ClCDSTag)
 
 #define FOREACH_ClCDSv(X) \
     X(ClCDSv_Png, "png") \
-    X(ClCDSv_Jpg, "jpg")
+    X(ClCDSv_Jpg, "jpg") \
+    X(ClCDSv_Xpr, "xpr") \
+    X(ClCDSv_Ff, "ff") \
+    X(ClCDSv_Ppm, "ppm") \
+    X(ClCDSv_Pam, "pam") \
+    X(ClCDSv_Qoi, "qoi")
 DEFINE_ENUM_WITH_STRING_CONVERSIONS(ClCDSv, cl_save_type, FOREACH_ClCDSv)
 
 struct ClCommand {
@@ -578,6 +831,9 @@ struct ClCommand {
                 struct ClCDSDHardness {
                     double val;
                 } hardness;
+                struct ClCDSDRenderer {
+                    enum Renderer val;
+                } renderer;
             } d;
         } set;
         struct ClCDEcho {
@@ -589,6 +845,7 @@ struct ClCommand {
         } save;
         struct ClCDLoad {
             char* path_dyn;
+            i32 scale_shift;  // NIL for automatic
         } load;
     } d;
 };
@@ -651,6 +908,24 @@ static Pt rect_dims(Rect a);
 // only used in assert's, which breaks release builds
 __attribute__((unused)) static Bool is_subrect(Rect outer, Rect inner);
 __attribute__((unused)) static Bool is_valid_rect(Rect rect);
+// `rect` without `hole`, returns count of pieces written to out
+static u32 rect_subtract(Rect rect, Rect hole, Rect out[4]);
+static u64 rect_area(Rect a);
+
+static RectSet rectset_from_rect(Rect rect);
+// adds part of rect that is not in set yet
+static void rectset_add(RectSet* set, Rect rect);
+static void rectset_add_set(RectSet* set, RectSet const* other);
+// merges pair of rects with least area overhead, set length decreases
+static void rectset_shrink(RectSet* set);
+// set with rects a and b replaced by their bounding rect, stays disjoint and gets shorter
+static RectSet rectset_merged(RectSet const* set, u32 a, u32 b);
+// joins rects with common edge
+static void rectset_coalesce(RectSet* set);
+static Rect rectset_bounds(RectSet const* set);
+static Bool rectset_intersects(RectSet const* set, Rect rect);
+// returns count of written rects
+static u32 rectset_to_xrects(RectSet const* set, XRectangle out[RECTSET_MAX]);
 
 static Transform trans_add(Transform a, Transform b);
 static XTransform xtrans_overlay_transform_mode(struct Input const* input);
@@ -660,9 +935,17 @@ static XTransform xtrans_rotate(double a);
 static XTransform xtrans_from_trans(Transform trans);
 static XTransform xtrans_mult(XTransform a, XTransform b); // transformations are applied from right to left
 static XTransform xtrans_invert(XTransform a);
+static DPt xtrans_apply(XTransform a, DPt p);
 
 static void xwindow_set_cardinal(Display* dp, Window window, Atom key, u32 value);
 
+// memory is not zeroed and lives until arena_reset
+static void* arena_alloc(struct Arena* a, usize n, usize size);
+static char* arena_str_new(struct Arena* a, char const* fmt, ...);
+// keeps one block big enough for everything allocated before, so next use does not allocate
+static void arena_reset(struct Arena* a);
+static void arena_free(struct Arena* a);
+
 // needs to be 'free'd after use
 static char* str_new(char const* fmt, ...);
 static char* str_new_va(char const* fmt, va_list args);
@@ -685,9 +968,13 @@ static void ioctx_set(struct IOCtx* ioctx, char const* input);
 static char const* ioctx_as_str(struct IOCtx const* ioctx);
 static void ioctx_free(struct IOCtx* ioctx);
 
+// whole pixel scroll the view is composited at
+static Pt dc_scroll_px(struct DrawCtx const* dc);
 static Pt pt_from_cv_to_scr(struct DrawCtx const* dc, Pt p);
 static Pt pt_from_cv_to_scr_xy(struct DrawCtx const* dc, i32 x, i32 y);
 static Pt pt_from_scr_to_cv_xy(struct DrawCtx const* dc, i32 x, i32 y);
+// covers every window pixel canvas rect is composited to
+static Rect rect_from_cv_to_scr(struct DrawCtx const* dc, Rect cv_rect);
 static Pt pt_apply_trans(Pt p, Transform trans);
 static Pt pt_apply_trans_pivot(Pt p, Transform trans, Pt pivot);
 static Pt dpt_to_pt(DPt p);
@@ -696,7 +983,7 @@ static DPt dpt_rotate(DPt p, double deg); // clockwise
 static DPt dpt_add(DPt a, DPt b);
 static double dpt_dist(DPt a, DPt b);
 
-static enum ImageType file_type(u8 const* data, u32 len);
+static enum ImageType file_type(u8 const* data, usize len);
 static u8* ximage_to_rgb(XImage const* image, Bool rgba);
 static Bool ximage_is_valid_pt(XImage const* im, i32 x, i32 y);
 static Rect ximage_rect(XImage const* im);
@@ -708,10 +995,74 @@ static argb argb_from_hsl(double hue, double sat, double light);
 // XXX hex non-const because of implementation
 static Bool argb_from_hex_col(char* hex, argb* argb_out);
 static XRenderColor argb_to_xrender_color(argb col);
-static struct Image read_file_from_memory(struct DrawCtx const* dc, u8 const* data, u32 len, argb bg);
+// NULL on failure
+static argb* image_decode(u8 const* data, usize len, argb bg, Pt* dims_out);
+// takes ownership of pixels
+static XImage* ximage_from_argb(struct DrawCtx const* dc, argb* pixels, Pt dims);
+static struct Image read_file_from_memory(struct DrawCtx const* dc, u8 const* data, usize len, argb bg);
+// pixel data size or 0 if header is invalid or file is truncated
+static usize xpr_header_check(struct XprHeader const* hdr, usize file_len);
+// copy of pixels, NULL if data is not valid xpr
+static argb* xpr_decode(u8 const* data, usize len, Pt* dims_out);
+// maps pixels copy-on-write to use them as canvas directly, NULL if file is not valid xpr
+static XImage* xpr_map(struct DrawCtx const* dc, char const* path);
+static int ximage_mapped_destroy(XImage* im);
+static Bool ximage_is_mapped(XImage const* im);
+static Bool io_data_read(struct IOCtx const* ioctx, struct IOData* out);
+static void io_data_free(struct IOData* input);
 static struct Image read_image_io(struct DrawCtx const* dc, struct IOCtx const* ioctx, argb bg);
+// baseline jpeg may be loaded downscaled by 2^scale_shift, then `fullres_out` is set, see fullres_start
+// scale is chosen by `wnd` size if scale_shift is NIL
+static struct Image read_image_io_scaled(struct DrawCtx const* dc, struct IOCtx const* ioctx, i32 scale_shift, Pt wnd, struct FullResJob** fullres_out);
+static Bool ioctx_write_begin(struct IOCtxWriteCtx* ctx, struct IOCtx const* ioctx);
 static void ioctx_write_part(void* pctx, void* data, i32 size);
-static Bool write_io(struct DrawCtx* dc, struct Input const* input, enum ImageType type, struct IOCtx const* ioctx);
+// commits written data if `ok` and all parts were written, frees ctx
+static Bool ioctx_write_end(struct IOCtxWriteCtx* ctx, Bool ok);
+// multithreaded, compression levels are the same as in stb_image_write
+static Bool png_write_parallel(void (*write)(void* ctx, void* data, i32 size), void* ctx, u8 const* rgba, Pt dims, i32 quality);
+// 8-bit non-interlaced RGB and RGBA only, NULL for other images
+static argb* png_decode(u8 const* data, usize len, argb bg, Pt* dims_out);
+// baseline jpeg only
+static Bool jpg_dims(u8 const* data, usize len, Pt* dims_out);
+// baseline jpeg approximately box filtered by 2^scale_shift, in [0 .. 3], NULL for other images
+static argb* jpg_decode_scaled(u8 const* data, usize len, u32 scale_shift, Pt* dims_out);
+// downscale so preview still covers window, 0 if image is not big enough
+static u32 jpg_preview_shift(Pt dims, Pt wnd);
+// thread-safe
+// uncompressed formats and qoi, converted row by row, NULL for other images
+static argb* stream_decode(u8 const* data, usize len, argb bg, Pt* dims_out);
+// farbfeld, ppm, pam or qoi, encoded row by row without rgba copy of image
+static Bool stream_write(XImage const* im, enum ImageType type, struct IOCtx const* ioctx);
+// canvas pixels as is
+static Bool xpr_write(XImage const* im, struct IOCtx const* ioctx);
+static Bool write_io(XImage const* im, enum ImageType type, i32 png_level, i32 jpg_quality, struct IOCtx const* ioctx);
+// snapshots canvas and saves it on worker thread, result is shown in statusline
+// False if canvas can't be saved now
+static Bool save_start(struct Ctx* ctx, struct IOCtx const* ioctx, enum ImageType type);
+static void save_run(struct SaveJob* job);
+static void* save_worker(void* arg);
+static void save_done(struct Ctx* ctx, void* data);
+// decodes full image on worker thread and replaces preview on canvas, job may be NULL
+static void fullres_start(struct Ctx* ctx, struct FullResJob* job);
+static void* fullres_worker(void* arg);
+static void fullres_done(struct Ctx* ctx, void* data);
+// replaces preview with decoded image once no stroke, drag or transform uses the canvas
+static void fullres_apply_ready(struct Ctx* ctx);
+static void fullres_free(struct FullResJob* job);
+// encodes png of sel_buf.im on worker thread, selection requests wait for it
+static void clip_encode_start(struct Ctx* ctx);
+static void* clip_encode_worker(void* arg);
+static void clip_encode_done(struct Ctx* ctx, void* data);
+static void clip_png_release(struct ClipPng** png);
+// replies with png of current selection, using INCR if it doesn't fit in one request
+static void clip_send_png(struct Ctx* ctx, XSelectionRequestEvent const* request);
+// sends next chunk, False if transfer is finished or failed
+static Bool incr_send_next(struct Ctx* ctx, struct IncrSend* incr);
+static void incr_send_free(struct Ctx* ctx, u32 index);
+// drops transfers to requestors that went away, returns ms until next check or -1 if none is running
+static i32 incr_send_expire(struct Ctx* ctx);
+// waits for pending saves, full resolution decodes and selection encodes
+static void workers_wait(struct Ctx* ctx);
 static void image_free(struct Image* im);
 
 static ClCPrcResult cl_cmd_process(struct Ctx* ctx, struct ClCommand const* cl_cmd);
@@ -731,6 +1082,10 @@ static void cl_push(struct InputConsoleData* cl, char c);
 static Bool cl_pop(struct InputConsoleData* cl, Bool force_no_compls);
 
 static void input_set_damage(struct Input* inp, Rect damage);
+static void input_set_damage_rects(struct Input* inp, RectSet const* damage);
+// accumulates damage of continuous action, only new part is redrawn
+static void input_add_damage(struct Input* inp, Rect damage);
+static void input_add_damage_rects(struct Input* inp, RectSet const* damage);
 static void input_mode_set(struct Ctx* ctx, enum InputTag mode_tag);
 static void input_mode_free(struct InputMode* input_mode);
 static char const* input_mode_as_str(enum InputTag mode_tag);
@@ -742,7 +1097,10 @@ static Bool text_mode_pop(struct Ctx* ctx);
 static void text_mode_rerender(struct Ctx* ctx);
 
 static void sel_circ_init_and_show(struct Ctx* ctx, Button button, i32 x, i32 y);
-static void sel_circ_free_and_hide(struct SelectionCircle* sel_circ);
+static void sel_circ_free_and_hide(struct DrawCtx* dc, struct SelectionCircle* sel_circ);
+static Rect sel_circ_rect(struct SelectionCircle const* sc);
+// screen bounds of item segment, RNIL for NIL item
+static Rect sel_circ_item_rect(struct SelectionCircle const* sc, i32 item);
 static i32 sel_circ_curr_item(struct SelectionCircle const* sc, i32 x, i32 y);
 // selection circle item callbacks. Can be unused, if config changed
 __attribute__((unused))
@@ -761,13 +1119,11 @@ static void sel_circ_on_select_set_linew(struct Ctx* ctx, union SCI_Arg num);
 // separate functions, because they are callbacks
 static Rect tool_selection_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event);
 static Rect tool_text_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event);
-static Rect tool_selection_on_drag(struct Ctx* ctx, XMotionEvent const* event);
 static Rect tool_drawer_on_press(struct Ctx* ctx, XButtonPressedEvent const* event);
 static Rect tool_drawer_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event);
-static Rect tool_drawer_on_drag(struct Ctx* ctx, XMotionEvent const* event);
+static RectSet tool_drawer_on_drag(struct Ctx* ctx, XMotionEvent const* event, Pt const* pts, u32 pts_len);
 static Rect tool_figure_on_press(struct Ctx* ctx, XButtonPressedEvent const* event);
 static Rect tool_figure_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event);
-static Rect tool_figure_on_drag(struct Ctx* ctx, XMotionEvent const* event);
 static Rect tool_fill_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event);
 static Rect tool_picker_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event);
 
@@ -787,6 +1143,8 @@ struct CanvasLineDrwCtxFloodFill {
 static Rect canvas_line_flood_fill_callback(void* drw_ctx, Pt p);
 
 static struct HistItem history_new_as_damage(XImage* im, Rect rect);
+static struct HistItem history_new_as_damage_rects(XImage* im, RectSet const* rects);
+static struct HistPatch history_patch_new(XImage* im, Rect rect);
 static struct HistItem history_new_as_resize(XImage* im);
 static Bool history_move(struct Ctx* ctx, Bool forward);
 static void history_forward(struct Ctx* ctx, struct HistItem hist);
@@ -794,12 +1152,15 @@ static void history_apply(struct Ctx* ctx, struct HistItem* hist);
 static void history_free(struct HistItem* hist);
 static void historyarr_clear(struct HistItem** hist);
 
-static usize ximage_data_len(XImage const* im);
 static XImage* ximage_apply_xtrans(XImage* im, struct DrawCtx* dc, XTransform xtrans);
 static void ximage_blend(XImage* dest, XImage* overlay, Rect blend_mask);
 static void ximage_clear(XImage* im, Rect mask);
 static Bool ximage_put_checked(XImage* im, i32 x, i32 y, argb col);
 static Rect ximage_flood_fill(XImage* im, argb targ_col, i32 x, i32 y);
+// fills area of `area_im` into `im`, images must have same dimensions
+static Rect ximage_flood_fill_ex(XImage* im, XImage const* area_im, argb targ_col, i32 x, i32 y);
+// returns pages of rows [t, b] to system, only for images from ximage_sparse_new
+static Bool ximage_release_rows(XImage* im, i32 t, i32 b);
 static Rect ximage_calc_damage(XImage* im);
 
 static Rect canvas_text(struct DrawCtx* dc, XImage* im, Pt lt_c, XftFont* font, argb col, char const* text, u32 text_len);
@@ -820,6 +1181,8 @@ static void canvas_free(struct Canvas* cv);
 static void canvas_change_zoom(struct DrawCtx* dc, Pt cursor, i32 delta);
 static void canvas_resize(struct Ctx* ctx, u32 new_width, u32 new_height);
 static void canvas_scroll(struct Canvas* cv, DPt delta);
+// replaces overlay image with empty one of given size
+static void overlay_init(struct DrawCtx* dc, struct InputOverlay* ovr, u32 width, u32 height);
 static void overlay_clear(struct InputOverlay* ovr);
 static void overlay_expand_rect(struct InputOverlay* ovr, Rect rect);
 static struct InputOverlay get_transformed_overlay(struct DrawCtx* dc, struct Input const* inp);
@@ -831,27 +1194,79 @@ static Pt clientarea_size(struct DrawCtx const* dc);
 static Pt canvas_size(struct DrawCtx const* dc);
 static void draw_arc(struct DrawCtx* dc, Pt c, Pt dims, double a1, double a2, argb col);
 static void fill_arc(struct DrawCtx* dc, Pt c, Pt dims, double a1, double a2, argb col);
+// clips screen_gc and draw_string, NULL removes clip
+static void dc_clip_set(struct DrawCtx* dc, RectSet const* clip);
 static u32 draw_string(struct DrawCtx* dc, char const* str, Pt c, enum Schm sc, Bool invert);
-static u32 draw_int(struct DrawCtx* dc, i32 i, Pt c, enum Schm sc, Bool invert);
 static int fill_rect(struct DrawCtx* dc, Pt p, Pt dim, argb col);
 static int draw_line_ex(struct DrawCtx* dc, Pt from, Pt to, u32 w, int line_style, enum Schm sc, Bool invert);
 static int draw_line(struct DrawCtx* dc, Pt from, Pt to, u32 w, enum Schm sc, Bool invert);
 static void draw_dash_line(struct DrawCtx* dc, Pt from, Pt to, u32 w);
-static void draw_dash_rect(struct DrawCtx* dc, Pt pts[4]);
-static void draw_dash_cross(struct DrawCtx* dc, Pt cv_center, i32 radius);
+// draw functions below return window area they cover, nothing is drawn if dry_run
+static Rect draw_dash_rect(struct DrawCtx* dc, Pt pts[4], Bool dry_run);
+static Rect draw_dash_cross(struct DrawCtx* dc, Pt cv_center, i32 radius, Bool dry_run);
+static Rect draw_figure_preview(struct Ctx* ctx, u32 variant, Pt p_static, Pt p_dynamic, Bool dry_run);
 // FIXME merge with get_string_rect?
 static u32 get_string_width(struct DrawCtx const* dc, char const* str, u32 len);
 static Rect get_string_rect(struct DrawCtx const* dc, XftFont* font, char const* str, u32 len, Pt lt_c);
-static void draw_selection_circle(struct Ctx* ctx, struct SelectionCircle const* sc, i32 pointer_x, i32 pointer_y);
+static Rect draw_selection_circle(struct Ctx* ctx, struct SelectionCircle* sc, i32 pointer_x, i32 pointer_y, Bool dry_run);
+// decorations over canvas, selection circle and statusline
+static Rect draw_interface(struct Ctx* ctx, Pt cur_scr, Bool dry_run);
+// schedules redraw, frame is rendered in run
 static void update_screen(struct Ctx* ctx, Pt cur_scr, Bool full_redraw);
-static void update_statusline(struct Ctx* ctx);
+static void frame_render(struct Ctx* ctx);
+// draws status line where frame damage is, dry_run returns its bounds
+static Rect update_statusline(struct Ctx* ctx, Bool dry_run);
+// updates layout and returns changed status line parts
+static Rect statusline_update_cache(struct Ctx* ctx);
+// LEFT_MODULES then RIGHT_MODULES
+static SLModule const* statusline_module(u32 index);
 static void show_message(struct Ctx* ctx, char const* msg);
-static void swap_backbuffer(struct Ctx* ctx);
+static void dc_damage_scr(struct DrawCtx* dc, Rect scr_rect);
+static void dc_damage_cv(struct DrawCtx* dc, Rect cv_rect);
+// copies window area from back buffer
+static void present_backbuffer(struct Ctx* ctx, Rect scr_rect);
 
 static void dc_cache_init(struct Ctx* ctx);
 static void dc_cache_free(struct DrawCtx* dc);
 // update Pixmaps for XRender interactions
 static void dc_cache_update(struct Ctx* ctx, Rect damage);
+// canvas rect of overlay tile with index i
+static Rect dc_overlay_tile_rect(struct DrawCtx const* dc, i32 i);
+// creates tiles that got overlay content, frees empty ones and uploads damage to the rest
+static void dc_cache_update_overlay(struct Ctx* ctx, Rect damage);
+// waits until server stops reading shared memory images
+static void dc_shm_wait(struct DrawCtx* dc);
+// window sized canvas and overlay composite without interface, retained between frames
+static void dc_view_reset(struct DrawCtx* dc);
+static void dc_view_free(struct DrawCtx* dc);
+static Bool dc_view_anchor_fits(struct DrawCtx const* dc);
+// moves retained view content and composites exposed strips
+static void dc_view_scroll(struct Ctx* ctx, Pt delta);
+static void dc_view_compose(struct Ctx* ctx, Rect rect);
+// composites rect of view on client into view.im, False if image can't be created
+static Bool dc_view_compose_client(struct Ctx* ctx, Rect rect);
+// stops client renderer threads
+static void render_pool_free(struct RenderPool* pool);
+static char const* renderer_to_string(enum Renderer renderer);
+// mip level for current zoom, 0 if canvas is not downscaled
+static u32 dc_mip_level(struct DrawCtx const* dc);
+// updates mip levels up to level from their dirty rects, 0 returns cache.pm
+static Pixmap dc_cache_mip(struct DrawCtx* dc, u32 level);
+// same as dc_cache_mip on client side, 0 returns cv.im
+static XImage* dc_client_mip(struct DrawCtx* dc, u32 level);
+
+static void shm_init(struct DrawCtx* dc);
+// returns NULL if MIT-SHM is not available
+static XImage* ximage_shm_new(struct DrawCtx* dc, u32 width, u32 height);
+static int ximage_shm_destroy(XImage* im);
+static Bool ximage_is_shm(XImage const* im);
+// shared memory image from ximage_sparse_new
+static Bool ximage_is_sparse_shm(XImage const* im);
+// moves image content to shared memory if possible, im is freed in this case
+static XImage* ximage_to_shm(struct DrawCtx* dc, XImage* im);
+// zeroed image, memory is allocated by system on first write to each page, in shared memory if possible
+static XImage* ximage_sparse_new(struct DrawCtx* dc, u32 width, u32 height);
+static int ximage_sparse_destroy(XImage* im);
 
 static void brush_cache_free(struct Brush* brush);
 static void brush_cache_update(struct DrawerData const* data, u32 line_w, argb col, struct Brush* brush_in_out);
@@ -862,6 +1277,14 @@ static struct Ctx ctx_init(Display* dp);
 static void xextinit(Display* dp);
 static void setup(Display* dp, struct Ctx* ctx);
 static void run(struct Ctx* ctx);
+static HdlrResult handle_event(struct Ctx* ctx, XEvent* event);
+static u64 monotonic_us(void);
+static void loop_init(struct Loop* loop);
+static void loop_free(struct Loop* loop);
+static void loop_arm_frame_timer(struct Loop* loop, u64 deadline_us);
+// thread-safe, on_done is called on UI thread with data
+static void loop_post(struct Loop* loop, void (*on_done)(struct Ctx* ctx, void* data), void* data);
+static void loop_handle_posted(struct Ctx* ctx);
 static HdlrResult button_press_hdlr(struct Ctx* ctx, XEvent* event);
 static HdlrResult button_release_hdlr(struct Ctx* ctx, XEvent* event);
 static HdlrResult destroy_notify_hdlr(struct Ctx* ctx, XEvent* event);
@@ -869,16 +1292,30 @@ static HdlrResult expose_hdlr(struct Ctx* ctx, XEvent* event);
 static HdlrResult key_press_hdlr(struct Ctx* ctx, XEvent* event);
 static HdlrResult mapping_notify_hdlr(struct Ctx* ctx, XEvent* event);
 static HdlrResult motion_notify_hdlr(struct Ctx* ctx, XEvent* event);
+// drains consecutive queued motion events into e, collects their pointer positions to input.motion_arr
+static void motion_coalesce(struct Ctx* ctx, XMotionEvent* e);
 static HdlrResult configure_notify_hdlr(struct Ctx* ctx, XEvent* event);
 static HdlrResult selection_request_hdlr(struct Ctx* ctx, XEvent* event);
 static HdlrResult selection_notify_hdlr(struct Ctx* ctx, XEvent* event);
+// uses pasted or dropped data
+static void selection_data_apply(struct Ctx* ctx, Atom target, u8* data, usize count);
+// continues INCR transfers
+static HdlrResult property_notify_hdlr(struct Ctx* ctx, XEvent* event);
+// appends next chunk of pasted data, applies it after last one
+static void incr_recv_chunk(struct Ctx* ctx);
 static HdlrResult client_message_hdlr(struct Ctx* ctx, XEvent* event);
 static void cleanup(struct Ctx* ctx);
 // clang-format on
 
 static Bool is_verbose_output = False;
 static Atom atoms[A_Last];
+static Bool shm_attach_failed = False;  // set by shm_attach_error_hdlr
+static Bool incr_send_failed = False;  // set by incr_send_error_hdlr
+static mode_t file_umask = 022;  // read once in main, umask can't be read without changing it for all threads
 static XImage* images[I_Last];
+// temporaries of one event or frame, reset after each of them
+static struct Arena frame_arena;
+static __thread u64 heap_alloc_count = 0;  // by ecalloc and stb_ds, traced for motion events and frames
 
 #include "config.h"
 // include debug.h if exists (for debug functions)
@@ -895,6 +1332,9 @@ static void main_show_help_message(FILE* out);
 // clang-format on
 
 i32 main(i32 argc, char** argv) {
+    file_umask = umask(0);
+    (void)umask(file_umask);
+
     Display* display = XOpenDisplay(NULL);
     if (!display) {
         die("cannot open X display");
@@ -1005,6 +1445,7 @@ void trace(char const* fmt, ...) {
 }
 
 void* ecalloc(u32 n, u32 size) {
+    ++heap_alloc_count;
     void* p = calloc(n, size);
 
     if (!p) {
@@ -1013,6 +1454,16 @@ void* ecalloc(u32 n, u32 size) {
     return p;
 }
 
+void* heap_realloc(void* ptr, size_t size) {
+    ++heap_alloc_count;
+    void* p = realloc(ptr, size);
+
+    if (!p && size) {
+        die("realloc:");
+    }
+    return p;
+}
+
 u32 digit_count(u32 number) {
     return (u32)floor(log10(number)) + 1;
 }
@@ -1202,6 +1653,197 @@ Bool is_valid_rect(Rect rect) {
     return !IS_RNIL(rect) && (rect.l <= rect.r) && (rect.t <= rect.b);
 }
 
+u32 rect_subtract(Rect rect, Rect hole, Rect out[4]) {
+    Rect const common = rect_bound(rect, hole);
+    if (!is_valid_rect(common)) {
+        out[0] = rect;
+        return 1;
+    }
+    u32 len = 0;
+    if (rect.t < common.t) {
+        out[len++] = (Rect) {rect.l, rect.t, rect.r, common.t - 1};
+    }
+    if (common.b < rect.b) {
+        out[len++] = (Rect) {rect.l, common.b + 1, rect.r, rect.b};
+    }
+    if (rect.l < common.l) {
+        out[len++] = (Rect) {rect.l, common.t, common.l - 1, common.b};
+    }
+    if (common.r < rect.r) {
+        out[len++] = (Rect) {common.r + 1, common.t, rect.r, common.b};
+    }
+    return len;
+}
+
+u64 rect_area(Rect a) {
+    if (!is_valid_rect(a)) {
+        return 0;
+    }
+    Pt const dims = rect_dims(a);
+    return (u64)dims.x * (u64)dims.y;
+}
+
+RectSet rectset_from_rect(Rect rect) {
+    RectSet result = {0};
+    rectset_add(&result, rect);
+    return result;
+}
+
+void rectset_add(RectSet* set, Rect rect) {
+    if (!is_valid_rect(rect)) {
+        return;
+    }
+
+    Rect pieces[RECTSET_MAX * 4];
+    u32 pieces_len = 1;
+    pieces[0] = rect;
+    for (u32 i = 0; i < set->len && pieces_len; ++i) {
+        Rect next[LENGTH(pieces)];
+        u32 next_len = 0;
+        for (u32 p = 0; p < pieces_len; ++p) {
+            if (next_len + 4 > LENGTH(next)) {
+                // too fragmented, covered area is joined with rect instead
+                rectset_shrink(set);
+                rectset_add(set, rect);
+                return;
+            }
+            next_len += rect_subtract(pieces[p], set->rects[i], &next[next_len]);
+        }
+        memcpy(pieces, next, next_len * sizeof(Rect));
+        pieces_len = next_len;
+    }
+
+    for (u32 p = 0; p < pieces_len; ++p) {
+        if (set->len == RECTSET_MAX) {
+            rectset_shrink(set);
+            // merged rect may cover remaining pieces
+            for (; p < pieces_len; ++p) {
+                rectset_add(set, pieces[p]);
+            }
+            return;
+        }
+        set->rects[set->len++] = pieces[p];
+    }
+    rectset_coalesce(set);
+}
+
+void rectset_add_set(RectSet* set, RectSet const* other) {
+    for (u32 i = 0; i < other->len; ++i) {
+        rectset_add(set, other->rects[i]);
+    }
+}
+
+void rectset_shrink(RectSet* set) {
+    if (set->len < 2) {
+        return;
+    }
+
+    // every pair is tried, merge can cut or absorb neighbours, so covered area is compared as a whole
+    RectSet best = {0};
+    u64 best_area = UINT64_MAX;
+    for (u32 a = 0; a < set->len; ++a) {
+        for (u32 b = a + 1; b < set->len; ++b) {
+            RectSet const candidate = rectset_merged(set, a, b);
+            u64 area = 0;
+            for (u32 i = 0; i < candidate.len; ++i) {
+                area += rect_area(candidate.rects[i]);
+            }
+            if (area < best_area) {
+                best_area = area;
+                best = candidate;
+            }
+        }
+    }
+    *set = best;
+}
+
+RectSet rectset_merged(RectSet const* set, u32 a, u32 b) {
+    assert(a < b && b < set->len);
+    Rect merged = rect_expand(set->rects[a], set->rects[b]);
+    RectSet rest = *set;
+    // b > a, so removal of b keeps a index
+    rest.rects[b] = rest.rects[--rest.len];
+    rest.rects[a] = rest.rects[--rest.len];
+
+    /* cut intersecting rects by merged one, if it keeps the set smaller */ {
+        RectSet cut = {0};
+        Bool fits = True;
+        for (u32 i = 0; i < rest.len && fits; ++i) {
+            Rect pieces[4];
+            u32 const pieces_len = rect_subtract(rest.rects[i], merged, pieces);
+            fits = cut.len + pieces_len < RECTSET_MAX;
+            for (u32 p = 0; p < pieces_len && fits; ++p) {
+                cut.rects[cut.len++] = pieces[p];
+            }
+        }
+        if (fits && cut.len + 1 < set->len) {
+            cut.rects[cut.len++] = merged;
+            return cut;
+        }
+    }
+
+    // otherwise merged rect absorbs everything it intersects
+    for (Bool changed = True; changed;) {
+        changed = False;
+        for (u32 i = 0; i < rest.len;) {
+            if (is_valid_rect(rect_bound(merged, rest.rects[i]))) {
+                merged = rect_expand(merged, rest.rects[i]);
+                rest.rects[i] = rest.rects[--rest.len];
+                changed = True;
+            } else {
+                ++i;
+            }
+        }
+    }
+    rest.rects[rest.len++] = merged;
+    return rest;
+}
+
+void rectset_coalesce(RectSet* set) {
+    for (Bool changed = True; changed;) {
+        changed = False;
+        for (u32 a = 0; a < set->len && !changed; ++a) {
+            for (u32 b = a + 1; b < set->len && !changed; ++b) {
+                Rect const ra = set->rects[a];
+                Rect const rb = set->rects[b];
+                Bool const same_rows = ra.t == rb.t && ra.b == rb.b && (ra.r + 1 == rb.l || rb.r + 1 == ra.l);
+                Bool const same_cols = ra.l == rb.l && ra.r == rb.r && (ra.b + 1 == rb.t || rb.b + 1 == ra.t);
+                if (same_rows || same_cols) {
+                    set->rects[a] = rect_expand(ra, rb);
+                    set->rects[b] = set->rects[--set->len];
+                    changed = True;
+                }
+            }
+        }
+    }
+}
+
+Rect rectset_bounds(RectSet const* set) {
+    Rect result = RNIL;
+    for (u32 i = 0; i < set->len; ++i) {
+        result = rect_expand(result, set->rects[i]);
+    }
+    return result;
+}
+
+Bool rectset_intersects(RectSet const* set, Rect rect) {
+    for (u32 i = 0; i < set->len; ++i) {
+        if (is_valid_rect(rect_bound(set->rects[i], rect))) {
+            return True;
+        }
+    }
+    return False;
+}
+
+u32 rectset_to_xrects(RectSet const* set, XRectangle out[RECTSET_MAX]) {
+    for (u32 i = 0; i < set->len; ++i) {
+        Rect const r = set->rects[i];
+        Pt const dims = rect_dims(r);
+        out[i] = (XRectangle) {(short)r.l, (short)r.t, (unsigned short)dims.x, (unsigned short)dims.y};
+    }
+    return set->len;
+}
+
 Transform trans_add(Transform a, Transform b) {
     return ((Transform) {.scale.x = a.scale.x * b.scale.x,
                          .scale.y = a.scale.y * b.scale.y,
@@ -1287,6 +1929,20 @@ XTransform xtrans_invert(XTransform a) {
         {XDoubleToFixed(0.0), XDoubleToFixed(0.0), XDoubleToFixed(1.0)}}};
 }
 
+DPt xtrans_apply(XTransform a, DPt p) {
+    double m[3][3] = {0};
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            m[i][j] = XFixedToDouble(a.matrix[i][j]);
+        }
+    }
+    double const w = (m[2][0] * p.x) + (m[2][1] * p.y) + m[2][2];
+    return (DPt) {
+        ((m[0][0] * p.x) + (m[0][1] * p.y) + m[0][2]) / w,
+        ((m[1][0] * p.x) + (m[1][1] * p.y) + m[1][2]) / w,
+    };
+}
+
 void xwindow_set_cardinal(Display* dp, Window window, Atom key, u32 value) {
     XChangeProperty(dp, window, key, atoms[A_Cardinal], 32, PropModeReplace, (unsigned char*)&value, 1);
 }
@@ -1309,6 +1965,64 @@ char* str_new_va(char const* fmt, va_list args) {
     return result;
 }
 
+void* arena_alloc(struct Arena* a, usize n, usize size) {
+    usize const align = 16;
+    usize const len = ((n * size) + align - 1) & ~(align - 1);
+
+    if (!a->head || a->head->cap - a->head->used < len) {
+        struct ArenaBlock* block = ecalloc(1, sizeof(struct ArenaBlock));
+        block->cap = MAX(len, ARENA_BLOCK_MIN);
+        block->data = ecalloc(block->cap, sizeof(u8));
+        block->prev = a->head;
+        a->head = block;
+    }
+    void* result = a->head->data + a->head->used;
+    a->head->used += len;
+    a->used_total += len;
+    return result;
+}
+
+char* arena_str_new(struct Arena* a, char const* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    usize const len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+
+    char* result = arena_alloc(a, len + 1, sizeof(char));
+    va_start(ap, fmt);
+    (void)vsnprintf(result, len + 1, fmt, ap);
+    va_end(ap);
+    return result;
+}
+
+void arena_reset(struct Arena* a) {
+    usize const used_total = a->used_total;
+    a->used_total = 0;
+    if (!a->head) {
+        return;
+    }
+    if (!a->head->prev && a->head->cap <= ARENA_RETAIN_MAX) {
+        a->head->used = 0;
+        return;
+    }
+    arena_free(a);
+    if (used_total <= ARENA_RETAIN_MAX) {
+        (void)arena_alloc(a, used_total, sizeof(u8));
+        a->head->used = 0;
+        a->used_total = 0;
+    }
+}
+
+void arena_free(struct Arena* a) {
+    while (a->head) {
+        struct ArenaBlock* prev = a->head->prev;
+        free(a->head->data);
+        free(a->head);
+        a->head = prev;
+    }
+    a->used_total = 0;
+}
+
 void str_free(char** str_dyn) {
     if (*str_dyn) {
         free(*str_dyn);
@@ -1359,7 +2073,6 @@ void tc_set_tool(struct ToolCtx* tc, enum ToolTag type, union ToolData* td_opt)
             break;
         case Tool_Selection:
             tc->on_release = &tool_selection_on_release;
-            tc->on_drag = &tool_selection_on_drag;
             break;
         case Tool_Drawer:
             tc->on_press = &tool_drawer_on_press;
@@ -1374,7 +2087,6 @@ void tc_set_tool(struct ToolCtx* tc, enum ToolTag type, union ToolData* td_opt)
         case Tool_Figure:
             tc->on_press = &tool_figure_on_press;
             tc->on_release = &tool_figure_on_release;
-            tc->on_drag = &tool_figure_on_drag;
             tc->d.fig = (struct FigureData) {0};
             break;
     }
@@ -1555,6 +2267,10 @@ void ioctx_free(struct IOCtx* ioctx) {
     *ioctx = (struct IOCtx) {0};
 }
 
+Pt dc_scroll_px(struct DrawCtx const* dc) {
+    return (Pt) {(i32)round(dc->cv.scroll.x), (i32)round(dc->cv.scroll.y)};
+}
+
 Pt pt_from_cv_to_scr(struct DrawCtx const* dc, Pt p) {
     return pt_from_cv_to_scr_xy(dc, p.x, p.y);
 }
@@ -1573,6 +2289,23 @@ Pt pt_from_scr_to_cv_xy(struct DrawCtx const* dc, i32 x, i32 y) {
     };
 }
 
+Rect rect_from_cv_to_scr(struct DrawCtx const* dc, Rect cv_rect) {
+    if (IS_RNIL(cv_rect)) {
+        return RNIL;
+    }
+    double const zoom = ZOOM_C(dc);
+    // canvas is composited to rounded scroll in frame_render
+    double const scroll_x = round(dc->cv.scroll.x);
+    double const scroll_y = round(dc->cv.scroll.y);
+    // extra pixel for XRender scaling rounding
+    return (Rect) {
+        .l = (i32)floor((cv_rect.l * zoom) + scroll_x) - 1,
+        .t = (i32)floor((cv_rect.t * zoom) + scroll_y) - 1,
+        .r = (i32)ceil(((cv_rect.r + 1) * zoom) + scroll_x) + 1,
+        .b = (i32)ceil(((cv_rect.b + 1) * zoom) + scroll_y) + 1,
+    };
+}
+
 Pt pt_apply_trans(Pt p, Transform trans) {
     XFixed(*m)[3] = xtrans_from_trans(trans).matrix;
 
@@ -1624,7 +2357,7 @@ double dpt_dist(DPt a, DPt b) {
     return sqrt((dx * dx) + (dy * dy));
 }
 
-enum ImageType file_type(u8 const* data, u32 len) {
+enum ImageType file_type(u8 const* data, usize len) {
     if (!data || !len) {
         return IMT_Unknown;
     }
@@ -1633,6 +2366,22 @@ enum ImageType file_type(u8 const* data, u32 len) {
     if (len >= 2 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) {
         return IMT_Jpg;
     }
+    if (len >= 8 && memcmp(data, XPR_MAGIC, 8) == 0) {
+        return IMT_Xpr;
+    }
+    if (len >= 8 && memcmp(data, "farbfeld", 8) == 0) {
+        return IMT_Ff;
+    }
+    // binary pgm is saved as ppm
+    if (len >= 3 && data[0] == 'P' && (data[1] == '5' || data[1] == '6') && isspace(data[2])) {
+        return IMT_Ppm;
+    }
+    if (len >= 3 && data[0] == 'P' && data[1] == '7' && isspace(data[2])) {
+        return IMT_Pam;
+    }
+    if (len >= 4 && memcmp(data, "qoif", 4) == 0) {
+        return IMT_Qoi;
+    }
     // png header
     if (len >= 8 && data[0] == 0x89 && data[1] == 0x50 && data[2] == 0x4E && data[3] == 0x47 && data[4] == 0x0D
         && data[5] == 0x0A && data[6] == 0x1A && data[7] == 0x0A) {
@@ -1797,3039 +2546,6942 @@ static u32 argb_to_abgr(argb v) {
     return a | blue << (2 * 8) | g | red;
 }
 
-static struct Image read_file_from_memory(struct DrawCtx const* dc, u8 const* data, u32 len, argb bg) {
-    i32 width = NIL;
-    i32 height = NIL;
+argb* image_decode(u8 const* data, usize len, argb bg, Pt* dims_out) {
+    argb* image = xpr_decode(data, len, dims_out);
+    if (image) {
+        return image;
+    }
+    image = stream_decode(data, len, bg, dims_out);
+    if (image) {
+        return image;
+    }
+    // stb handles formats and png variants not supported by png_decode
+    image = png_decode(data, len, bg, dims_out);
+    if (image) {
+        return image;
+    }
+    // stb takes int length
+    if (len > INT32_MAX) {
+        return NULL;
+    }
     i32 comp = NIL;
-    stbi_uc* image_data = stbi_load_from_memory(data, (i32)len, &width, &height, &comp, 4);
+    stbi_uc* image_data = stbi_load_from_memory(data, (i32)len, &dims_out->x, &dims_out->y, &comp, 4);
     if (image_data == NULL) {
-        return (struct Image) {0};
+        return NULL;
     }
     // process image data
-    argb* image = (argb*)image_data;
-    for (i32 i = 0; i < (width * height); ++i) {
+    image = (argb*)image_data;
+    for (i32 i = 0; i < (dims_out->x * dims_out->y); ++i) {
         if (bg) {
             image[i] = argb_blend(image[i], bg, (image[i] >> 24) & 0xFF);
         }
         // https://stackoverflow.com/a/17030897
         image[i] = argb_to_abgr(image[i]);
     }
-    XImage* im = XCreateImage(
+    return image;
+}
+
+XImage* ximage_from_argb(struct DrawCtx const* dc, argb* pixels, Pt dims) {
+    return XCreateImage(
         dc->dp,
         dc->sys.vinfo.visual,
         dc->sys.vinfo.depth,
         ZPixmap,
         0,
-        (char*)image_data,
-        width,
-        height,
+        (char*)pixels,
+        dims.x,
+        dims.y,
         32,  // FIXME what is it? (must be 32)
-        width * 4
+        dims.x * 4
     );
+}
 
-    return (struct Image) {.im = im, .type = file_type(data, len)};
+static struct Image read_file_from_memory(struct DrawCtx const* dc, u8 const* data, usize len, argb bg) {
+    Pt dims = {NIL, NIL};
+    argb* image = image_decode(data, len, bg, &dims);
+    if (image == NULL) {
+        return (struct Image) {0};
+    }
+    return (struct Image) {.im = ximage_from_argb(dc, image, dims), .type = file_type(data, len)};
 }
 
-struct Image read_image_io(struct DrawCtx const* dc, struct IOCtx const* ioctx, argb bg) {
-    switch (ioctx->t) {
-        case IO_None: return (struct Image) {0};
-        case IO_File: {
-            int fd = open(ioctx->d.file.path_dyn, O_RDONLY | O_CLOEXEC, 0644);
-            if (fd == -1) {
-                return (struct Image) {0};
-            }
-            off_t len = lseek(fd, 0, SEEK_END);
-            void* data = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
-            if (!data) {
-                return (struct Image) {0};
-            }
-            struct Image result = read_file_from_memory(dc, data, len, bg);
+usize xpr_header_check(struct XprHeader const* hdr, usize file_len) {
+    if (memcmp(hdr->magic, XPR_MAGIC, 8) != 0 || hdr->byte_order != XPR_BYTE_ORDER) {
+        return 0;
+    }
+    if (!hdr->width || !hdr->height || hdr->width > (1u << 24) || hdr->height > (1u << 24)
+        || (usize)hdr->width * hdr->height > INT32_MAX || hdr->stride != hdr->width * sizeof(argb)
+        || hdr->data_offset != XPR_DATA_OFFSET) {
+        return 0;
+    }
+    usize const size = (usize)hdr->stride * hdr->height;
+    return file_len >= hdr->data_offset && file_len - hdr->data_offset >= size ? size : 0;
+}
 
-            munmap(data, len);
-            close(fd);
-            return result;
+argb* xpr_decode(u8 const* data, usize len, Pt* dims_out) {
+    struct XprHeader hdr;
+    if (len < sizeof(hdr)) {
+        return NULL;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    usize const size = xpr_header_check(&hdr, len);
+    if (!size) {
+        return NULL;
+    }
+    argb* pixels = (argb*)malloc(size);
+    if (pixels) {
+        memcpy(pixels, data + hdr.data_offset, size);
+        *dims_out = (Pt) {(i32)hdr.width, (i32)hdr.height};
+    }
+    return pixels;
+}
+
+XImage* xpr_map(struct DrawCtx const* dc, char const* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct XprHeader hdr;
+    struct stat st;
+    usize size = 0;
+    if (fstat(fd, &st) == 0 && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) {
+        size = xpr_header_check(&hdr, st.st_size);
+    }
+    // private writable mapping, canvas edits never reach file
+    void* data = size ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t)hdr.data_offset) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+
+    XImage* im = XCreateImage(
+        dc->dp,
+        dc->sys.vinfo.visual,
+        dc->sys.vinfo.depth,
+        ZPixmap,
+        0,
+        (char*)data,
+        hdr.width,
+        hdr.height,
+        32,
+        (i32)hdr.stride
+    );
+    if (!im) {
+        munmap(data, size);
+        return NULL;
+    }
+    im->f.destroy_image = &ximage_mapped_destroy;
+    return im;
+}
+
+int ximage_mapped_destroy(XImage* im) {
+    munmap(im->data, (usize)im->bytes_per_line * im->height);
+    XFree(im);
+    return 1;
+}
+
+Bool ximage_is_mapped(XImage const* im) {
+    return im->f.destroy_image == &ximage_mapped_destroy;
+}
+
+// reads until EOF into geometrically grown buffer, NULL on error
+static u8* read_fd_all(i32 fd, usize* len_out) {
+    usize cap = 64 * 1024;
+    usize len = 0;
+    u8* data = ecalloc(cap, sizeof(u8));
+
+    for (;;) {
+        if (len == cap) {
+            cap *= 2;
+            u8* expanded = (u8*)realloc(data, cap);
+            if (!expanded) {
+                die("out of memory");
+            }
+            data = expanded;
         }
-        case IO_Stdio: {
-            u8* data = NULL;
-            u32 len = 0;
-            i32 c = 0;
-            // FIXME read not by 1 char?
-            while ((c = getc(stdin)) != EOF) {
-                len += 1;
-                u8* expanded = (u8*)realloc(data, len);
-                if (!expanded) {
-                    die("out of memory");
-                }
-                data = expanded;
-                data[len - 1] = c;
+        ssize_t const res = read(fd, data + len, cap - len);
+        if (res == 0) {
+            break;
+        }
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            struct Image result = read_file_from_memory(dc, data, len, bg);
-
+            trace("xpaint: failed to read: %s", strerror(errno));
             free(data);
-            return result;
+            return NULL;
         }
+        len += res;
     }
-    return (struct Image) {0};
+
+    *len_out = len;
+    return data;
 }
 
-void ioctx_write_part(void* pctx, void* data, i32 size) {
-    struct IOCtxWriteCtx* ctx = (struct IOCtxWriteCtx*)pctx;
-    ctx->result_out = False;
+Bool io_data_read(struct IOCtx const* ioctx, struct IOData* out) {
+    *out = (struct IOData) {0};
 
-    switch (ctx->ioctx->t) {
-        case IO_None: break;
+    switch (ioctx->t) {
+        case IO_None: return False;
         case IO_File: {
-            FILE* fd = fopen(ctx->ioctx->d.file.path_dyn, "ae");
-            if (!fd) {
-                trace("xpaint: failed to open file");
-                return;
-            }
-
-            if (fwrite(data, sizeof(char), size, fd)) {
-                ctx->result_out = True;
-            } else {
-                trace("xpaint: failed to write to file");
+            int fd = open(ioctx->d.file.path_dyn, O_RDONLY | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                return False;
             }
-
-            if (fclose(fd) == EOF) {
-                trace("xpaint: failed to close file");
+            out->len = lseek(fd, 0, SEEK_END);
+            void* data = mmap(0, out->len, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (data == MAP_FAILED) {
+                return False;
             }
+            out->data = data;
+            out->mapped = True;
         } break;
         case IO_Stdio: {
-            if (fwrite(data, sizeof(char), size, stdout)) {
-                ctx->result_out = True;
-            } else {
-                trace("xpaint: failed to write to stdout");
+            out->data = read_fd_all(STDIN_FILENO, &out->len);
+            if (!out->data) {
+                return False;
             }
         } break;
     }
+
+    return True;
 }
 
-Bool write_io(struct DrawCtx* dc, struct Input const* input, enum ImageType type, struct IOCtx const* ioctx) {
-    if (type == IMT_Unknown) {
-        return False;
+void io_data_free(struct IOData* input) {
+    if (input->mapped) {
+        munmap(input->data, input->len);
+    } else {
+        free(input->data);
     }
-    Bool result = False;
+    *input = (struct IOData) {0};
+}
 
-    i32 w = dc->cv.im->width;
-    i32 h = dc->cv.im->height;
-    u8* rgba_dyn = ximage_to_rgb(dc->cv.im, True);
-    if (!rgba_dyn) {
-        return False;
-    }
+static void trace_image_load(struct IOCtx const* ioctx, Bool loaded, usize len, u64 start_us) {
+    u64 const elapsed_us = MAX(1, monotonic_us() - start_us);
+    trace(
+        "xpaint: %s %zu bytes from '%s' in %llu us (%.1f MiB/s)",
+        loaded ? "loaded" : "failed to load",
+        len,
+        ioctx_as_str(ioctx),
+        (unsigned long long)elapsed_us,
+        ((double)len / (1024.0 * 1024.0)) / ((double)elapsed_us / 1e6)
+    );
+}
 
-    // FIXME ask before delete/override?
-    if (ioctx->t == IO_File) {
-        // no check for file existence
-        (void)remove(ioctx->d.file.path_dyn);
+// xpr files are used in place, other files and stdin are decoded
+static struct Image read_image_mapped(struct DrawCtx const* dc, struct IOCtx const* ioctx, u64 start_us) {
+    XImage* im = ioctx->t == IO_File ? xpr_map(dc, ioctx->d.file.path_dyn) : NULL;
+    if (!im) {
+        return (struct Image) {0};
     }
+    trace_image_load(ioctx, True, (usize)im->bytes_per_line * im->height, start_us);
+    return (struct Image) {.im = im, .type = IMT_Xpr};
+}
 
-    switch (type) {
-        case IMT_Png: {
-            stbi_write_png_compression_level = input->png_compression_level;
-            struct IOCtxWriteCtx ioctx_write_ctx = {.ioctx = ioctx};
-            result = stbi_write_png_to_func(&ioctx_write_part, (void*)&ioctx_write_ctx, w, h, 4, rgba_dyn, 0);
-            result &= ioctx_write_ctx.result_out;
-        } break;
-        case IMT_Jpg: {
-            i32 quality = input->jpg_quality_level;
-            struct IOCtxWriteCtx ioctx_write_ctx = {.ioctx = ioctx};
-            result = stbi_write_jpg_to_func(&ioctx_write_part, (void*)&ioctx_write_ctx, w, h, 4, rgba_dyn, quality);
-            result &= ioctx_write_ctx.result_out;
-        } break;
-        case IMT_Unknown: UNREACHABLE();
+struct Image read_image_io(struct DrawCtx const* dc, struct IOCtx const* ioctx, argb bg) {
+    u64 const start_us = monotonic_us();
+    struct Image mapped = read_image_mapped(dc, ioctx, start_us);
+    if (mapped.im) {
+        return mapped;
     }
-    free(rgba_dyn);
+    struct IOData input = {0};
+    if (!io_data_read(ioctx, &input)) {
+        return (struct Image) {0};
+    }
+    struct Image result = read_file_from_memory(dc, input.data, input.len, bg);
+    trace_image_load(ioctx, result.im != NULL, input.len, start_us);
+    io_data_free(&input);
     return result;
 }
 
-void image_free(struct Image* im) {
-    if (im->im) {
-        XDestroyImage(im->im);
+struct Image read_image_io_scaled(
+    struct DrawCtx const* dc,
+    struct IOCtx const* ioctx,
+    i32 scale_shift,
+    Pt wnd,
+    struct FullResJob** fullres_out
+) {
+    *fullres_out = NULL;
+    u64 const start_us = monotonic_us();
+    struct Image mapped = read_image_mapped(dc, ioctx, start_us);
+    if (mapped.im) {
+        return mapped;
+    }
+    struct IOData input = {0};
+    if (!io_data_read(ioctx, &input)) {
+        return (struct Image) {0};
     }
-    *im = (struct Image) {0};
+
+    Pt src_dims = {0};
+    u32 shift = 0;
+    if (jpg_dims(input.data, input.len, &src_dims)) {
+        shift = scale_shift == NIL ? jpg_preview_shift(src_dims, wnd) : (u32)scale_shift;
+    }
+    Pt dims = {0};
+    argb* preview = shift ? jpg_decode_scaled(input.data, input.len, shift, &dims) : NULL;
+    if (!preview) {
+        struct Image result = read_file_from_memory(dc, input.data, input.len, 0);
+        trace_image_load(ioctx, result.im != NULL, input.len, start_us);
+        io_data_free(&input);
+        return result;
+    }
+    trace(
+        "xpaint: loaded 1/%u preview %dx%d of %dx%d from '%s' in %llu us",
+        1u << shift,
+        dims.x,
+        dims.y,
+        src_dims.x,
+        src_dims.y,
+        ioctx_as_str(ioctx),
+        (unsigned long long)(monotonic_us() - start_us)
+    );
+
+    struct FullResJob* job = ecalloc(1, sizeof(struct FullResJob));
+    *job = (struct FullResJob) {.input = input, .scale_shift = shift};
+    *fullres_out = job;
+    return (struct Image) {.im = ximage_from_argb(dc, preview, dims), .type = IMT_Jpg};
 }
 
-ClCPrcResult cl_cmd_process(struct Ctx* ctx, struct ClCommand const* cl_cmd) {
-    assert(cl_cmd);
-    char* msg_to_show = NULL;  // counts as PCCR_Msg at func end
-    ClCPrcFlags result = 0;
+Bool ioctx_write_begin(struct IOCtxWriteCtx* ctx, struct IOCtx const* ioctx) {
+    *ctx = (struct IOCtxWriteCtx) {.ioctx = ioctx, .result_out = True, .fd = NIL, .start_us = monotonic_us()};
 
-    switch (cl_cmd->t) {
-        case ClC_Set: {
-            switch (cl_cmd->d.set.t) {
-                case ClCDS_LineW: {
-                    CURR_TC(ctx).line_w = cl_cmd->d.set.d.line_w.value;
-                } break;
-                case ClCDS_Col: {
-                    *tc_curr_col(&CURR_TC(ctx)) = cl_cmd->d.set.d.col.v;
-                } break;
-                case ClCDS_UiFont: {
-                    char const* font = cl_cmd->d.set.d.ui_font.name_dyn;
-                    if (!xft_font_set(&ctx->dc, font, &ctx->dc.fnt)) {
-                        msg_to_show = str_new("invalid font name: '%s'", font);
-                    }
-                } break;
-                case ClCDS_TextFont: {
-                    char const* font = cl_cmd->d.set.d.text_font.name_dyn;
-                    if (!xft_font_set(&ctx->dc, font, &CURR_TC(ctx).text_font)) {
-                        msg_to_show = str_new("invalid font name: '%s'", font);
-                    }
-                } break;
-                case ClCDS_Inp: {
-                    char const* path = cl_cmd->d.set.d.inp.path_dyn;
-                    ioctx_set(&ctx->inp, path);
-                    msg_to_show = str_new("inp set to '%s'", ioctx_as_str(&ctx->inp));
-                } break;
-                case ClCDS_Out: {
-                    char const* path = cl_cmd->d.set.d.out.path_dyn;
-                    ioctx_set(&ctx->out, path);
-                    msg_to_show = str_new("out set to '%s'", ioctx_as_str(&ctx->out));
-                } break;
-                case ClCDS_PngCompression: {
-                    ctx->input.png_compression_level = cl_cmd->d.set.d.png_cpr.compression;
-                } break;
-                case ClCDS_JpgQuality: {
-                    ctx->input.jpg_quality_level = cl_cmd->d.set.d.jpg_qlt.quality;
-                } break;
-                case ClCDS_Spacing: {
-                    if (CURR_TC(ctx).t == Tool_Drawer) {
-                        if (cl_cmd->d.set.d.spacing.val >= 0.0) {
-                            CURR_TC(ctx).d.drawer.spacing = cl_cmd->d.set.d.spacing.val;
-                        } else {
-                            msg_to_show = str_new("spacing must be >= 0.0");
-                        }
-                    } else {
-                        msg_to_show = str_new("wrong tool to set spacing");
-                    }
-                } break;
-                case ClCDS_Hardness: {
-                    if (CURR_TC(ctx).t == Tool_Drawer) {
-                        if (BETWEEN(cl_cmd->d.set.d.hardness.val, 0.0, 1.0)) {
-                            CURR_TC(ctx).d.drawer.hardness = cl_cmd->d.set.d.hardness.val;
-                        } else {
-                            msg_to_show = str_new("hardness must be in [0.0 .. 1.0]");
-                        }
-                    } else {
-                        msg_to_show = str_new("wrong tool to set hardness");
-                    }
-                } break;
-                case ClCDSTag_Invalid:
-                case ClCDSTag_Count: assert(!"invalid tag");
+    switch (ioctx->t) {
+        case IO_None: return False;
+        case IO_File: {
+            char const* path = ioctx->d.file.path_dyn;
+            // same directory, so rename is atomic
+            ctx->tmp_path_dyn = str_new("%s.XXXXXX", path);
+            ctx->fd = mkstemp(ctx->tmp_path_dyn);
+            if (ctx->fd == NIL) {
+                trace("xpaint: failed to create temporary file '%s': %s", ctx->tmp_path_dyn, strerror(errno));
+                str_free(&ctx->tmp_path_dyn);
+                return False;
             }
-        } break;
-        case ClC_Echo: {
-            msg_to_show = str_new("%s", cl_cmd->d.echo.msg_dyn);
-        } break;
-        case ClC_Exit: {
-            result |= ClCPrc_Exit;
-        } break;
-        case ClC_W:
-        case ClC_WQ: {
-            if (ctx->out.t != IO_None) {
-                enum ImageType const type = IMT_Png;  // FIXME pass actual filetype
-                if (write_io(&ctx->dc, &ctx->input, type, &ctx->out)) {
-                    if (cl_cmd->t == ClC_WQ) {
-                        result |= ClCPrc_Exit;
-                    } else {
-                        msg_to_show = str_new("image saved to '%s'", ioctx_as_str(&ctx->out));
-                    }
-                } else {
-                    msg_to_show = str_new("failed save image to '%s'", ioctx_as_str(&ctx->out));
-                }
+            // mkstemp creates file with 0600
+            struct stat st;
+            mode_t mode = 0;
+            if (stat(path, &st) == 0) {
+                mode = st.st_mode & 07777;
             } else {
-                msg_to_show =
-                    str_new("can't save: no path provided (use '%s' command to pass path)", cl_cmd_to_string(ClC_Save));
+                mode = 0666 & ~file_umask;
             }
+            (void)fchmod(ctx->fd, mode);
         } break;
-        case ClC_Save: {
-            if (!cl_cmd->d.save.path_dyn && ctx->out.t == IO_None) {
-                msg_to_show = str_new("can't save: no path provided");
-            } else {
-                struct IOCtx ioctx =
-                    cl_cmd->d.save.path_dyn ? ioctx_new(cl_cmd->d.save.path_dyn) : ioctx_copy(&ctx->out);
-                /* relevant for long-running operations, as saving occurs on the main thread */ {
-                    char* save_msg = str_new("saving image to '%s'", ioctx_as_str(&ioctx));
-                    show_message(ctx, save_msg);
-                    str_free(&save_msg);
+        case IO_Stdio: {
+            (void)fflush(stdout);
+            ctx->fd = STDOUT_FILENO;
+        } break;
+    }
+    ctx->buf_dyn = ecalloc(IO_WRITE_BUF, sizeof(u8));
+    return True;
+}
+
+static void ioctx_write_fd(struct IOCtxWriteCtx* ctx, u8 const* data, usize size) {
+    while (size && ctx->result_out) {
+        ssize_t const res = write(ctx->fd, data, size);
+        if (res == -1) {
+            if (errno != EINTR) {
+                trace("xpaint: failed to write: %s", strerror(errno));
+                ctx->result_out = False;
+            }
+            continue;
+        }
+        data += res;
+        size -= res;
+        ctx->written += res;
+    }
+}
+
+void ioctx_write_part(void* pctx, void* data, i32 size) {
+    struct IOCtxWriteCtx* ctx = (struct IOCtxWriteCtx*)pctx;
+    if (!ctx->buf_dyn || size <= 0) {
+        return;
+    }
+
+    if (ctx->buf_len + size > IO_WRITE_BUF) {
+        ioctx_write_fd(ctx, ctx->buf_dyn, ctx->buf_len);
+        ctx->buf_len = 0;
+    }
+    if (size >= IO_WRITE_BUF) {
+        ioctx_write_fd(ctx, data, size);
+    } else {
+        memcpy(ctx->buf_dyn + ctx->buf_len, data, size);
+        ctx->buf_len += size;
+    }
+}
+
+Bool ioctx_write_end(struct IOCtxWriteCtx* ctx, Bool ok) {
+    if (!ctx->buf_dyn) {
+        return False;
+    }
+    ioctx_write_fd(ctx, ctx->buf_dyn, ctx->buf_len);
+    ok &= ctx->result_out;
+    free(ctx->buf_dyn);
+    ctx->buf_dyn = NULL;
+
+    if (ctx->ioctx->t == IO_File) {
+        if (ok && fsync(ctx->fd) == -1) {
+            trace("xpaint: failed to sync '%s': %s", ctx->tmp_path_dyn, strerror(errno));
+            ok = False;
+        }
+        if (close(ctx->fd) == -1) {
+            trace("xpaint: failed to close '%s': %s", ctx->tmp_path_dyn, strerror(errno));
+            ok = False;
+        }
+        if (ok && rename(ctx->tmp_path_dyn, ctx->ioctx->d.file.path_dyn) == -1) {
+            trace("xpaint: failed to rename '%s': %s", ctx->tmp_path_dyn, strerror(errno));
+            ok = False;
+        }
+        if (!ok) {
+            (void)unlink(ctx->tmp_path_dyn);
+        }
+        str_free(&ctx->tmp_path_dyn);
+    }
+
+    u64 const elapsed_us = MAX(1, monotonic_us() - ctx->start_us);
+    trace(
+        "xpaint: %s %zu bytes to '%s' in %llu us (%.1f MiB/s)",
+        ok ? "wrote" : "failed after",
+        ctx->written,
+        ioctx_as_str(ctx->ioctx),
+        (unsigned long long)elapsed_us,
+        ((double)ctx->written / (1024.0 * 1024.0)) / ((double)elapsed_us / 1e6)
+    );
+    return ok;
+}
+
+// part of png zlib stream, compressed independently, see png_write_parallel
+struct PngPart {
+    usize from;  // in filtered data
+    usize len;
+    u8* out_dyn;  // IDAT chunk tag and deflate blocks ending on byte boundary
+    usize out_len;
+    u32 adler;  // of part input
+    u32 crc;  // of out_dyn
+};
+
+struct PngJob {
+    u8 const* pixels;  // rgba
+    Pt dims;
+    u8* filt;  // filter type and filtered row, for each row
+    i32 quality;
+    struct PngPart* parts;
+    u32 parts_len;
+    i64* hash_dyn;  // hash chains of this thread, PNG_ZHASH heads and PNG_WINDOW links
+    i32 thread;
+    i32 threads;
+};
+
+struct PngBits {
+    u8* out;
+    usize len;
+    u32 buf;
+    i32 count;
+};
+
+static void png_bits_put(struct PngBits* b, u32 code, i32 bits) {
+    b->buf |= code << b->count;
+    b->count += bits;
+    while (b->count >= 8) {
+        b->out[b->len++] = b->buf & 0xFF;
+        b->buf >>= 8;
+        b->count -= 8;
+    }
+}
+
+static void png_bits_align(struct PngBits* b) {
+    if (b->count) {
+        png_bits_put(b, 0, 8 - b->count);
+    }
+}
+
+// symbol of fixed huffman literal/length alphabet
+static void png_bits_huff(struct PngBits* b, u32 n) {
+    if (n <= 143) {
+        png_bits_put(b, stbiw__zlib_bitrev((i32)(0x30 + n), 8), 8);
+    } else if (n <= 255) {
+        png_bits_put(b, stbiw__zlib_bitrev((i32)(0x190 + n - 144), 9), 9);
+    } else if (n <= 279) {
+        png_bits_put(b, stbiw__zlib_bitrev((i32)(n - 256), 7), 7);
+    } else {
+        png_bits_put(b, stbiw__zlib_bitrev((i32)(0xC0 + n - 280), 8), 8);
+    }
+}
+
+static u32 png_adler32(u8 const* data, usize len) {
+    u32 s1 = 1;
+    u32 s2 = 0;
+    for (usize i = 0; i < len;) {
+        usize const block_end = MIN(len, i + 5552);  // no overflow before modulo
+        for (; i < block_end; ++i) {
+            s1 += data[i];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return (s2 << 16) | s1;
+}
+
+// adler32 of concatenated data from adler32 of parts, as adler32_combine in zlib
+static u32 png_adler32_combine(u32 a, u32 b, usize b_len) {
+    u32 const base = 65521;
+    u32 const rem = b_len % base;
+    u32 sum1 = a & 0xFFFF;
+    u32 sum2 = (u32)(((u64)rem * sum1) % base);
+    sum1 += (b & 0xFFFF) + base - 1;
+    sum2 += (a >> 16) + (b >> 16) + base - rem;
+    sum1 = sum1 >= base ? sum1 - base : sum1;
+    sum1 = sum1 >= base ? sum1 - base : sum1;
+    sum2 = sum2 >= (base << 1) ? sum2 - (base << 1) : sum2;
+    sum2 = sum2 >= base ? sum2 - base : sum2;
+    return (sum2 << 16) | sum1;
+}
+
+static void png_hash_insert(u8 const* data, usize pos, i64* head, i64* prev) {
+    u32 const h = stbiw__zhash((u8*)data + pos) & (PNG_ZHASH - 1);
+    prev[pos & (PNG_WINDOW - 1)] = head[h];
+    head[h] = (i64)pos;
+}
+
+// deflate length and distance codes, with sentinels for encoder
+// clang-format off
+static u16 const png_lengthc[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258, 259,
+};
+static u8 const png_lengtheb[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static u16 const png_distc[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577, 32768,
+};
+static u8 const png_disteb[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+// clang-format on
+
+// same matcher as stbi_zlib_compress, but primed with previous 32K of data and with chains instead of buckets
+static void png_deflate_part(u8 const* data, struct PngPart* part, i32 quality, Bool first, Bool last, i64* hash) {
+    i64* head = hash;
+    i64* prev = hash + PNG_ZHASH;
+    usize const start = part->from;
+    usize const end = part->from + part->len;
+    u32 const chain_max = 2 * MAX(5, quality);  // stb keeps up to 2 * quality entries in bucket
+
+    struct PngBits b = {.out = part->out_dyn};
+    memcpy(b.out, "IDAT", 4);
+    b.len = 4;
+    if (first) {
+        b.out[b.len++] = 0x78;  // DEFLATE 32K window
+        b.out[b.len++] = 0x5E;  // FLEVEL = 1
+    }
+    usize const blocks_from = b.len;
+    png_bits_put(&b, last, 1);  // BFINAL
+    png_bits_put(&b, 1, 2);  // BTYPE = 1 -- fixed huffman
+
+    for (u32 i = 0; i < PNG_ZHASH; ++i) {
+        head[i] = NIL;
+    }
+    for (usize i = start > PNG_WINDOW ? start - PNG_WINDOW : 0; i < start && i + 3 <= end; ++i) {
+        png_hash_insert(data, i, head, prev);
+    }
+
+    usize i = start;
+    while (i + 3 < end) {
+        u32 best = 3;
+        i64 bestloc = NIL;
+        u32 steps = 0;
+        for (i64 c = head[stbiw__zhash((u8*)data + i) & (PNG_ZHASH - 1)]; c != NIL && steps < chain_max;
+             c = prev[c & (PNG_WINDOW - 1)], ++steps) {
+            if (i - (usize)c > 32767) {
+                break;
+            }
+            u32 const d = stbiw__zlib_countm((u8*)data + c, (u8*)data + i, (i32)MIN(end - i, 258));
+            // chain goes from closest, so equal matches don't replace it
+            if (d > best || (d == best && bestloc == NIL)) {
+                best = d;
+                bestloc = c;
+            }
+        }
+        png_hash_insert(data, i, head, prev);
+
+        if (bestloc != NIL) {
+            // "lazy matching" - check match at *next* byte, and if it's better, do cur byte as literal
+            steps = 0;
+            for (i64 c = head[stbiw__zhash((u8*)data + i + 1) & (PNG_ZHASH - 1)]; c != NIL && steps < chain_max;
+                 c = prev[c & (PNG_WINDOW - 1)], ++steps) {
+                if (i + 1 - (usize)c > 32767) {
+                    break;
+                }
+                u32 const e = stbiw__zlib_countm((u8*)data + c, (u8*)data + i + 1, (i32)MIN(end - i - 1, 258));
+                if (e > best) {
+                    bestloc = NIL;
+                    break;
                 }
-                msg_to_show = str_new(
-                    write_io(&ctx->dc, &ctx->input, cl_save_type_to_image_type(cl_cmd->d.save.im_type), &ioctx)
-                        ? "image saved to '%s'"
-                        : "failed save image to '%s'",
-                    ioctx_as_str(&ioctx)
-                );
-                ioctx_free(&ioctx);
             }
-        } break;
-        case ClC_Load: {
-            struct IOCtx ioctx = cl_cmd->d.load.path_dyn ? ioctx_new(cl_cmd->d.load.path_dyn) : ioctx_copy(&ctx->inp);
-            struct Image im = read_image_io(&ctx->dc, &ioctx, 0);
+        }
 
-            XImage* old_cv = ctx->dc.cv.im;
-            Rect old_cv_rect = (Rect) {0, 0, old_cv->width, old_cv->height};
-            struct HistItem to_push = history_new_as_damage(old_cv, old_cv_rect);
+        if (bestloc != NIL) {
+            u32 const d = i - bestloc;
+            u32 j = 0;
+            for (j = 0; best > png_lengthc[j + 1] - 1u; ++j) {}
+            png_bits_huff(&b, j + 257);
+            if (png_lengtheb[j]) {
+                png_bits_put(&b, best - png_lengthc[j], png_lengtheb[j]);
+            }
+            for (j = 0; d > png_distc[j + 1] - 1u; ++j) {}
+            png_bits_put(&b, stbiw__zlib_bitrev((i32)j, 5), 5);
+            if (png_disteb[j]) {
+                png_bits_put(&b, d - png_distc[j], png_disteb[j]);
+            }
+            i += best;
+        } else {
+            png_bits_huff(&b, data[i]);
+            ++i;
+        }
+    }
+    for (; i < end; ++i) {
+        png_bits_huff(&b, data[i]);
+    }
+    png_bits_huff(&b, 256);  // end of block
+    if (!last) {
+        // empty stored block, so next part starts on byte boundary (zlib's Z_SYNC_FLUSH)
+        png_bits_put(&b, 0, 3);
+        png_bits_align(&b);
+        u8 const empty[] = {0x00, 0x00, 0xFF, 0xFF};
+        memcpy(b.out + b.len, empty, sizeof(empty));
+        b.len += sizeof(empty);
+    }
+    png_bits_align(&b);
+
+    // store uncompressed instead if compression was worse
+    usize const stored_len = part->len + (((part->len + 32766) / 32767) * 5);
+    if (b.len - blocks_from > stored_len) {
+        b.len = blocks_from;
+        for (usize j = 0; j < part->len;) {
+            u32 const block_len = MIN(part->len - j, 32767);
+            Bool const block_last = j + block_len == part->len;
+            u8 const header[] = {
+                last && block_last,  // BFINAL, BTYPE = 0 -- no compression
+                block_len & 0xFF,
+                block_len >> 8,
+                ~block_len & 0xFF,
+                (~block_len >> 8) & 0xFF,
+            };
+            memcpy(b.out + b.len, header, sizeof(header));
+            b.len += sizeof(header);
+            memcpy(b.out + b.len, data + start + j, block_len);
+            b.len += block_len;
+            j += block_len;
+        }
+    }
 
-            if (canvas_load(ctx, &im)) {
-                history_forward(ctx, to_push);
-                msg_to_show = str_new("image_loaded from '%s'", ioctx_as_str(&ioctx));
-            } else {
-                image_free(&im);
-                history_free(&to_push);
-                msg_to_show = str_new("failed load image from '%s'", ioctx_as_str(&ioctx));
+    part->out_len = b.len;
+    part->adler = png_adler32(data + start, part->len);
+    part->crc = stbiw__crc32(part->out_dyn, (i32)part->out_len);
+}
+
+static void* png_filter_rows(void* arg) {
+    struct PngJob const* job = (struct PngJob const*)arg;
+    i32 const w = job->dims.x;
+    i32 const h = job->dims.y;
+    usize const filt_stride = ((usize)w * 4) + 1;
+
+    for (i32 y = h * job->thread / job->threads; y < h * (job->thread + 1) / job->threads; ++y) {
+        u8* const filt_row = job->filt + (filt_stride * y);
+        signed char* const line = (signed char*)filt_row + 1;
+        // same estimation as in stbi_write_png_to_mem, candidates are written in place
+        i32 best_filter = 0;
+        i32 best_filter_val = INT32_MAX;
+        i32 filter_type = 0;
+        for (filter_type = 0; filter_type < 5; ++filter_type) {
+            stbiw__encode_png_line((u8*)job->pixels, w * 4, w, h, y, 4, filter_type, line);
+            i32 est = 0;
+            for (i32 i = 0; i < w * 4; ++i) {
+                est += abs(line[i]);
             }
-            ioctx_free(&ioctx);
-        } break;
-        case ClCTag_Invalid:
-        case ClCTag_Count: assert(!"invalid enum value");
+            if (est < best_filter_val) {
+                best_filter_val = est;
+                best_filter = filter_type;
+            }
+        }
+        if (filter_type - 1 != best_filter) {
+            stbiw__encode_png_line((u8*)job->pixels, w * 4, w, h, y, 4, best_filter, line);
+        }
+        filt_row[0] = (u8)best_filter;
     }
-    result |= msg_to_show ? ClCPrc_Msg : 0;
-    return (ClCPrcResult) {.flags = result, .msg_dyn = msg_to_show};
+    return NULL;
 }
 
-static ClCPrsResult cl_cmd_parse_helper(__attribute__((unused)) struct Ctx* ctx, char* cl) {
-    char const* cmd = strtok(cl, CL_DELIM);
-    if (!cmd) {
-        return cl_prs_noarg(str_new("command"), NULL);
+static void* png_deflate_parts(void* arg) {
+    struct PngJob const* job = (struct PngJob const*)arg;
+    for (u32 i = job->thread; i < job->parts_len; i += job->threads) {
+        png_deflate_part(job->filt, &job->parts[i], job->quality, i == 0, i == job->parts_len - 1, job->hash_dyn);
+    }
+    return NULL;
+}
+
+static void png_run_jobs(void* (*routine)(void*), struct PngJob* jobs, i32 threads) {
+    pthread_t tids[THREADS_MAX];
+    Bool started[THREADS_MAX] = {0};
+    // last part is done on this thread
+    for (i32 t = 0; t < threads - 1; ++t) {
+        started[t] = pthread_create(&tids[t], NULL, routine, &jobs[t]) == 0;
+        if (!started[t]) {
+            routine(&jobs[t]);
+        }
+    }
+    routine(&jobs[threads - 1]);
+    for (i32 t = 0; t < threads - 1; ++t) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
     }
+}
 
-    switch (cl_cmd_from_string(cmd)) {
-        case ClC_Echo: {
-            char const* user_msg = strtok(NULL, "");
-            return (ClCPrsResult
-            ) {.t = ClCPrs_Ok, .d.ok.t = ClC_Echo, .d.ok.d.echo.msg_dyn = str_new("%s", COALESCE(user_msg, ""))};
+static void png_put_be32(u8* out, u32 v) {
+    out[0] = (v >> 24) & 0xFF;
+    out[1] = (v >> 16) & 0xFF;
+    out[2] = (v >> 8) & 0xFF;
+    out[3] = v & 0xFF;
+}
+
+Bool png_write_parallel(
+    void (*write)(void* ctx, void* data, i32 size),
+    void* ctx,
+    u8 const* rgba,
+    Pt dims,
+    i32 quality
+) {
+    if (dims.x <= 0 || dims.y <= 0) {
+        return False;
+    }
+    u64 const start_us = monotonic_us();
+    usize const filt_stride = ((usize)dims.x * 4) + 1;
+    usize const filt_len = filt_stride * dims.y;
+    u8* filt_dyn = ecalloc(dims.y, filt_stride);
+
+    u32 const parts_len = (filt_len + PNG_DEFLATE_PART - 1) / PNG_DEFLATE_PART;
+    struct PngPart* parts_dyn = ecalloc(parts_len, sizeof(struct PngPart));
+    for (u32 i = 0; i < parts_len; ++i) {
+        parts_dyn[i].from = (usize)i * PNG_DEFLATE_PART;
+        parts_dyn[i].len = MIN(filt_len - parts_dyn[i].from, PNG_DEFLATE_PART);
+        // fixed huffman codes take at most 9 bits per byte
+        parts_dyn[i].out_dyn = ecalloc(parts_dyn[i].len + (parts_dyn[i].len / 8) + 64, sizeof(u8));
+    }
+
+    i32 threads = PNG_ENCODE_THREADS ? (i32)PNG_ENCODE_THREADS : (i32)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = CLAMP(threads, 1, MAX(1, MIN(THREADS_MAX, (i32)MIN(parts_len, (u32)dims.y))));
+
+    struct PngJob jobs[THREADS_MAX];
+    for (i32 t = 0; t < threads; ++t) {
+        jobs[t] = (struct PngJob) {
+            .pixels = rgba,
+            .dims = dims,
+            .filt = filt_dyn,
+            .quality = quality,
+            .parts = parts_dyn,
+            .parts_len = parts_len,
+            .hash_dyn = ecalloc(PNG_ZHASH + PNG_WINDOW, sizeof(i64)),
+            .thread = t,
+            .threads = threads,
+        };
+    }
+    // parts are primed with filtered data of previous part, so all rows are filtered first
+    png_run_jobs(&png_filter_rows, jobs, threads);
+    png_run_jobs(&png_deflate_parts, jobs, threads);
+
+    /* header */ {
+        u8 header[8 + 4 + 4 + 13 + 4] = {137, 80, 78, 71, 13, 10, 26, 10};
+        png_put_be32(header + 8, 13);
+        memcpy(header + 12, "IHDR", 4);
+        png_put_be32(header + 16, dims.x);
+        png_put_be32(header + 20, dims.y);
+        u8 const ihdr_rest[] = {8, 6, 0, 0, 0};  // 8-bit RGBA, no interlace
+        memcpy(header + 24, ihdr_rest, sizeof(ihdr_rest));
+        png_put_be32(header + 29, stbiw__crc32(header + 12, 4 + 13));
+        write(ctx, header, sizeof(header));
+    }
+    u32 adler = 1;
+    for (u32 i = 0; i < parts_len; ++i) {
+        struct PngPart const* part = &parts_dyn[i];
+        u8 len_be[4];
+        u8 crc_be[4];
+        png_put_be32(len_be, part->out_len - 4);  // without tag
+        png_put_be32(crc_be, part->crc);
+        write(ctx, len_be, sizeof(len_be));
+        write(ctx, part->out_dyn, (i32)part->out_len);
+        write(ctx, crc_be, sizeof(crc_be));
+        adler = png_adler32_combine(adler, part->adler, part->len);
+    }
+    /* zlib trailer in own IDAT chunk and IEND */ {
+        u8 tail[4 + 4 + 4 + 4 + 4 + 4 + 4] = {0, 0, 0, 4, 'I', 'D', 'A', 'T'};
+        png_put_be32(tail + 8, adler);
+        png_put_be32(tail + 12, stbiw__crc32(tail + 4, 4 + 4));
+        png_put_be32(tail + 16, 0);
+        memcpy(tail + 20, "IEND", 4);
+        png_put_be32(tail + 24, stbiw__crc32(tail + 20, 4));
+        write(ctx, tail, sizeof(tail));
+    }
+
+    for (i32 t = 0; t < threads; ++t) {
+        free(jobs[t].hash_dyn);
+    }
+    for (u32 i = 0; i < parts_len; ++i) {
+        free(parts_dyn[i].out_dyn);
+    }
+    free(parts_dyn);
+    free(filt_dyn);
+    trace("xpaint: png encoded by %d threads in %llu us", threads, (unsigned long long)(monotonic_us() - start_us));
+    return True;
+}
+
+// canonical huffman decoding table, see png_huff_build
+struct PngHuff {
+    u16 fast[1 << PNG_FAST_BITS];  // (length << 9) | symbol, 0 for longer codes
+    u16 firstcode[16];
+    u16 firstsymbol[16];
+    u32 maxcode[17];  // first code of next length, aligned to 16 bits
+    u8 size[288];
+    u16 value[288];  // symbols ordered by code
+};
+
+struct PngInflate {
+    u8 const* in;
+    usize in_len;
+    usize in_pos;
+    u64 bits;
+    u32 count;
+    u8* out;
+    usize out_len;
+    usize out_pos;
+};
+
+static u32 png_bitrev(u32 v, u32 bits) {
+    u32 r = 0;
+    for (u32 i = 0; i < bits; ++i) {
+        r = (r << 1) | ((v >> i) & 1);
+    }
+    return r;
+}
+
+static Bool png_huff_build(struct PngHuff* h, u8 const* sizes, u32 num) {
+    u32 sizes_count[17] = {0};
+    u32 next_code[16] = {0};
+    memset(h->fast, 0, sizeof(h->fast));
+    for (u32 i = 0; i < num; ++i) {
+        ++sizes_count[sizes[i]];
+    }
+    sizes_count[0] = 0;
+    for (u32 i = 1; i < 16; ++i) {
+        if (sizes_count[i] > (1u << i)) {
+            return False;
         }
-        case ClC_Set: {
-            char const* prop = strtok(NULL, CL_DELIM);
-            if (!prop) {
-                return cl_prs_noarg(str_new("prop to set"), NULL);
+    }
+    u32 code = 0;
+    u32 k = 0;
+    for (u32 i = 1; i < 16; ++i) {
+        next_code[i] = code;
+        h->firstcode[i] = code;
+        h->firstsymbol[i] = k;
+        code += sizes_count[i];
+        if (sizes_count[i] && code - 1 >= (1u << i)) {
+            return False;  // oversubscribed
+        }
+        h->maxcode[i] = code << (16 - i);
+        code <<= 1;
+        k += sizes_count[i];
+    }
+    h->maxcode[16] = 0x10000;
+    for (u32 i = 0; i < num; ++i) {
+        u32 const s = sizes[i];
+        if (!s) {
+            continue;
+        }
+        u32 const c = next_code[s] - h->firstcode[s] + h->firstsymbol[s];
+        h->size[c] = s;
+        h->value[c] = i;
+        if (s <= PNG_FAST_BITS) {
+            // every table index with this code as prefix
+            for (u32 j = png_bitrev(next_code[s], s); j < (1u << PNG_FAST_BITS); j += 1u << s) {
+                h->fast[j] = (s << 9) | i;
             }
-            switch (cl_set_prop_from_string(prop)) {
-                case ClCDS_LineW: {
-                    static const u32 MIN_LW = 1;
-                    static const u32 MAX_LW = 5000;  // extremely large values may lag
+        }
+        ++next_code[s];
+    }
+    return True;
+}
 
-                    char const* arg = strtok(NULL, "");
-                    if (!arg) {
-                        return cl_prs_noarg(str_new("line width"), NULL);
-                    }
-                    u32 const line_w = strtol(arg, NULL, 0);
-                    if (!BETWEEN(line_w, MIN_LW, MAX_LW)) {
-                        return cl_prs_invarg(
-                            str_new("%s", arg),
-                            str_new("value must be in [%d .. %d]", MIN_LW, MAX_LW),
-                            NULL
-                        );
-                    }
-                    return (ClCPrsResult) {
-                        .t = ClCPrs_Ok,
-                        .d.ok.t = ClC_Set,
-                        .d.ok.d.set.t = ClCDS_LineW,
-                        .d.ok.d.set.d.line_w.value = line_w,
-                    };
-                }
-                case ClCDS_Col: {
-                    char* arg = strtok(NULL, CL_DELIM);
-                    argb value = 0;
-                    if (!arg) {
-                        return cl_prs_noarg(str_new("hex color"), str_new("%s", cl_set_prop_to_string(ClCDS_Col)));
-                    }
-                    if (!argb_from_hex_col(arg, &value)) {
-                        return cl_prs_invarg(
-                            str_new("%s", arg),
-                            str_new("failed to parse hex color"),
-                            str_new("%s", cl_set_prop_to_string(ClCDS_Col))
-                        );
-                    }
-                    return (ClCPrsResult
-                    ) {.t = ClCPrs_Ok, .d.ok.t = ClC_Set, .d.ok.d.set.t = ClCDS_Col, .d.ok.d.set.d.col.v = value};
-                }
-                case ClCDS_UiFont: {
-                    char const* font = strtok(NULL, "");  // font with spaces
-                    if (!font) {
-                        return cl_prs_noarg(str_new("ui font"), NULL);
-                    }
-                    return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                           .d.ok.t = ClC_Set,
-                                           .d.ok.d.set.t = ClCDS_UiFont,
-                                           .d.ok.d.set.d.ui_font.name_dyn = font ? str_new("%s", font) : NULL};
-                }
-                case ClCDS_TextFont: {
-                    char const* font = strtok(NULL, "");  // font with spaces
-                    if (!font) {
-                        return cl_prs_noarg(str_new("text tool font"), NULL);
-                    }
-                    return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                           .d.ok.t = ClC_Set,
-                                           .d.ok.d.set.t = ClCDS_TextFont,
-                                           .d.ok.d.set.d.text_font.name_dyn = font ? str_new("%s", font) : NULL};
-                }
-                case ClCDS_Inp: {
-                    char const* path = strtok(NULL, "");  // user can load NULL
-                    return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                           .d.ok.t = ClC_Set,
-                                           .d.ok.d.set.t = ClCDS_Inp,
-                                           .d.ok.d.set.d.inp.path_dyn = path ? str_new("%s", path) : NULL};
-                }
-                case ClCDS_Out: {
-                    char const* path = strtok(NULL, "");  // user can load NULL
-                    return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                           .d.ok.t = ClC_Set,
-                                           .d.ok.d.set.t = ClCDS_Out,
-                                           .d.ok.d.set.d.out.path_dyn = path ? str_new("%s", path) : NULL};
-                }
-                case ClCDS_PngCompression: {
-                    char const* compression = strtok(NULL, "");
-                    if (!compression) {
-                        return cl_prs_noarg(str_new("compression value"), NULL);
-                    }
-                    return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                           .d.ok.t = ClC_Set,
-                                           .d.ok.d.set.t = ClCDS_PngCompression,
-                                           .d.ok.d.set.d.png_cpr.compression = (i32)strtol(compression, NULL, 0)};
-                }
-                case ClCDS_JpgQuality: {
-                    char const* quality = strtok(NULL, "");
-                    if (!quality) {
-                        return cl_prs_noarg(str_new("image quality"), NULL);
-                    }
-                    return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                           .d.ok.t = ClC_Set,
-                                           .d.ok.d.set.t = ClCDS_JpgQuality,
-                                           .d.ok.d.set.d.jpg_qlt.quality = (i32)strtol(quality, NULL, 0)};
-                }
-                case ClCDS_Spacing: {
-                    char const* spacing = strtok(NULL, "");
-                    if (!spacing) {
-                        return cl_prs_noarg(str_new("spacing"), NULL);
-                    }
-                    return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                           .d.ok.t = ClC_Set,
-                                           .d.ok.d.set.t = ClCDS_Spacing,
-                                           .d.ok.d.set.d.spacing.val = strtof(spacing, NULL)};
-                }
-                case ClCDS_Hardness: {
-                    char const* hardness = strtok(NULL, "");
-                    if (!hardness) {
-                        return cl_prs_noarg(str_new("hardness"), NULL);
-                    }
-                    return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                           .d.ok.t = ClC_Set,
-                                           .d.ok.d.set.t = ClCDS_Hardness,
-                                           .d.ok.d.set.d.hardness.val = strtof(hardness, NULL)};
-                }
-                case ClCDSTag_Invalid:
-                case ClCDSTag_Count:
-                    return cl_prs_invarg(
-                        str_new("%s", prop),
-                        str_new("unknown prop"),
-                        str_new("%s", cl_cmd_to_string(ClC_Set))
-                    );
+// guarantees at least 56 bits, zeros are shifted in after input end
+static void png_inflate_refill(struct PngInflate* z) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (z->in_pos + 8 <= z->in_len) {
+        u64 word = 0;
+        memcpy(&word, z->in + z->in_pos, 8);
+        z->bits |= word << z->count;
+        z->in_pos += (63 - z->count) >> 3;
+        z->count |= 56;
+        return;
+    }
+#endif
+    while (z->count <= 56) {
+        u64 const byte = z->in_pos < z->in_len ? z->in[z->in_pos] : 0;
+        ++z->in_pos;  // counted past end to detect overrun
+        z->bits |= byte << z->count;
+        z->count += 8;
+    }
+}
+
+static u32 png_inflate_take(struct PngInflate* z, u32 n) {
+    if (z->count < n) {
+        png_inflate_refill(z);
+    }
+    u32 const v = (u32)(z->bits & ((1ull << n) - 1));
+    z->bits >>= n;
+    z->count -= n;
+    return v;
+}
+
+// NIL on invalid code
+static i32 png_inflate_symbol(struct PngInflate* z, struct PngHuff const* h) {
+    if (z->count < 16) {
+        png_inflate_refill(z);
+    }
+    u32 const fast = h->fast[z->bits & ((1 << PNG_FAST_BITS) - 1)];
+    if (fast) {
+        u32 const s = fast >> 9;
+        z->bits >>= s;
+        z->count -= s;
+        return (i32)(fast & 0x1FF);
+    }
+    u32 const k = png_bitrev((u32)(z->bits & 0xFFFF), 16);
+    u32 s = PNG_FAST_BITS + 1;
+    while (k >= h->maxcode[s]) {
+        ++s;
+    }
+    if (s >= 16) {
+        return NIL;
+    }
+    u32 const b = (k >> (16 - s)) - h->firstcode[s] + h->firstsymbol[s];
+    if (b >= 288 || h->size[b] != s) {
+        return NIL;
+    }
+    z->bits >>= s;
+    z->count -= s;
+    return h->value[b];
+}
+
+static Bool png_inflate_codes(struct PngInflate* z, struct PngHuff const* lit, struct PngHuff const* dist) {
+    for (;;) {
+        i32 sym = png_inflate_symbol(z, lit);
+        if (sym < 256) {
+            if (sym < 0 || z->out_pos >= z->out_len) {
+                return False;
             }
-            UNREACHABLE();
+            z->out[z->out_pos++] = (u8)sym;
+            continue;
         }
-        case ClC_Exit: {
-            return (ClCPrsResult) {.t = ClCPrs_Ok, .d.ok.t = ClC_Exit};
+        if (sym == 256) {
+            return True;
         }
-        case ClC_Save: {
-            char const* type_str = strtok(NULL, CL_DELIM);
-            if (!type_str) {
-                return cl_prs_noarg(str_new("file type"), NULL);
+        sym -= 257;
+        if (sym >= 29) {
+            return False;
+        }
+        usize const len = png_lengthc[sym] + png_inflate_take(z, png_lengtheb[sym]);
+        i32 const dsym = png_inflate_symbol(z, dist);
+        if (dsym < 0 || dsym >= 30) {
+            return False;
+        }
+        usize const d = png_distc[dsym] + png_inflate_take(z, png_disteb[dsym]);
+        if (d > z->out_pos || len > z->out_len - z->out_pos) {
+            return False;
+        }
+
+        u8* dst = z->out + z->out_pos;
+        u8 const* src = dst - d;
+        if (d >= 8 && z->out_len - z->out_pos >= len + 8) {
+            // may write up to 7 bytes after match, they are overwritten later
+            for (usize i = 0; i < len; i += 8) {
+                memcpy(dst + i, src + i, 8);
             }
-            enum ClCDSv type = cl_save_type_from_string(type_str);
-            if (type == ClCDSv_Invalid || type == ClCDSv_Count) {
-                return cl_prs_invarg(str_new("%s", type_str), str_new("unknown type"), NULL);
+        } else if (d == 1) {
+            memset(dst, *src, len);
+        } else {
+            for (usize i = 0; i < len; ++i) {
+                dst[i] = src[i];
             }
-            char const* path = strtok(NULL, "");  // path with spaces
-            return (ClCPrsResult) {.t = ClCPrs_Ok,
-                                   .d.ok.t = ClC_Save,
-                                   .d.ok.d.save.im_type = type,
-                                   .d.ok.d.save.path_dyn = path ? str_new("%s", path) : NULL};
         }
-        case ClC_W: {
-            return (ClCPrsResult) {.t = ClCPrs_Ok, .d.ok.t = ClC_W};
+        z->out_pos += len;
+    }
+}
+
+static Bool png_inflate_dynamic(struct PngInflate* z, struct PngHuff* lit, struct PngHuff* dist) {
+    static u8 const clen_order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    u32 const hlit = png_inflate_take(z, 5) + 257;
+    u32 const hdist = png_inflate_take(z, 5) + 1;
+    u32 const hclen = png_inflate_take(z, 4) + 4;
+
+    u8 clen_sizes[19] = {0};
+    for (u32 i = 0; i < hclen; ++i) {
+        clen_sizes[clen_order[i]] = png_inflate_take(z, 3);
+    }
+    struct PngHuff clen;
+    if (!png_huff_build(&clen, clen_sizes, 19)) {
+        return False;
+    }
+
+    u8 sizes[288 + 32] = {0};
+    u32 n = 0;
+    while (n < hlit + hdist) {
+        i32 const c = png_inflate_symbol(z, &clen);
+        u32 repeat = 0;
+        u8 fill = 0;
+        if (c < 0 || c > 18) {
+            return False;
         }
-        case ClC_WQ: {
-            return (ClCPrsResult) {.t = ClCPrs_Ok, .d.ok.t = ClC_WQ};
+        if (c < 16) {
+            sizes[n++] = (u8)c;
+            continue;
         }
-        case ClC_Load: {
-            char const* path = strtok(NULL, "");  // path with spaces
-            return (ClCPrsResult
-            ) {.t = ClCPrs_Ok, .d.ok.t = ClC_Load, .d.ok.d.load.path_dyn = path ? str_new("%s", path) : NULL};
+        if (c == 16) {
+            if (n == 0) {
+                return False;
+            }
+            repeat = png_inflate_take(z, 2) + 3;
+            fill = sizes[n - 1];
+        } else if (c == 17) {
+            repeat = png_inflate_take(z, 3) + 3;
+        } else {
+            repeat = png_inflate_take(z, 7) + 11;
         }
-        case ClCTag_Invalid:
-        case ClCTag_Count: return cl_prs_invarg(str_new("%s", cmd), str_new("unknown command"), NULL);
+        if (n + repeat > hlit + hdist) {
+            return False;
+        }
+        memset(sizes + n, fill, repeat);
+        n += repeat;
+    }
+    return png_huff_build(lit, sizes, hlit) && png_huff_build(dist, sizes + hlit, hdist);
+}
+
+// zlib stream to exactly out_len bytes
+static Bool png_inflate(u8 const* in, usize in_len, u8* out, usize out_len) {
+    if (in_len < 2 || (in[0] & 0x0F) != 8 || ((in[0] << 8) | in[1]) % 31 || (in[1] & 0x20)) {
+        return False;  // not deflate or preset dictionary
+    }
+    struct PngInflate z = {.in = in, .in_len = in_len, .in_pos = 2, .out = out, .out_len = out_len};
+    struct PngHuff* lit = ecalloc(2, sizeof(struct PngHuff));
+    struct PngHuff* dist = lit + 1;
+    Bool ok = True;
+
+    Bool final = False;
+    while (ok && !final) {
+        final = png_inflate_take(&z, 1);
+        u32 const type = png_inflate_take(&z, 2);
+        switch (type) {
+            case 0: {
+                // stored, drop bits to byte boundary and return whole unread bytes to input
+                png_inflate_take(&z, z.count & 7);
+                z.in_pos -= z.count / 8;
+                z.bits = 0;
+                z.count = 0;
+                if (z.in_len - MIN(z.in_pos, z.in_len) < 4) {
+                    ok = False;
+                    break;
+                }
+                u32 const len = z.in[z.in_pos] | (z.in[z.in_pos + 1] << 8);
+                u32 const nlen = z.in[z.in_pos + 2] | (z.in[z.in_pos + 3] << 8);
+                z.in_pos += 4;
+                if (len != (~nlen & 0xFFFF) || len > z.in_len - z.in_pos || len > z.out_len - z.out_pos) {
+                    ok = False;
+                    break;
+                }
+                memcpy(z.out + z.out_pos, z.in + z.in_pos, len);
+                z.in_pos += len;
+                z.out_pos += len;
+            } break;
+            case 1: {
+                u8 sizes[288 + 32];
+                memset(sizes, 8, 144);
+                memset(sizes + 144, 9, 256 - 144);
+                memset(sizes + 256, 7, 280 - 256);
+                memset(sizes + 280, 8, 288 - 280);
+                memset(sizes + 288, 5, 32);
+                ok = png_huff_build(lit, sizes, 288) && png_huff_build(dist, sizes + 288, 32)
+                    && png_inflate_codes(&z, lit, dist);
+            } break;
+            case 2: ok = png_inflate_dynamic(&z, lit, dist) && png_inflate_codes(&z, lit, dist); break;
+            default: ok = False; break;
+        }
+        // zeros after input end are not data
+        ok &= z.in_pos <= z.in_len + z.count / 8;
     }
 
-    UNREACHABLE();
+    free(lit);
+    return ok && z.out_pos == out_len;
 }
 
-ClCPrsResult cl_cmd_parse(struct Ctx* ctx, char const* cl) {
-    assert(cl);
-    char* cl_bufdyn = str_new("%s", cl);
-    ClCPrsResult result = cl_cmd_parse_helper(ctx, cl_bufdyn);
-    str_free(&cl_bufdyn);
-    return result;
+static u8 png_paeth(u8 a, u8 b, u8 c) {
+    i32 const pa = abs((i32)b - c);
+    i32 const pb = abs((i32)a - c);
+    i32 const pc = abs((i32)a + b - 2 * c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
 }
 
-ClCPrsResult cl_prs_noarg(char* arg_desc_dyn, char* context_optdyn) {
-    return (ClCPrsResult
-    ) {.t = ClCPrs_ENoArg, .d.noarg.arg_desc_dyn = arg_desc_dyn, .d.noarg.context_optdyn = context_optdyn};
+#ifdef __SSE2__
+static __m128i png_load_px(u8 const* p, u32 bpp) {
+    // composed in register, partial memcpy through stack stalls store forwarding
+    u32 v = p[0] | (p[1] << 8) | (p[2] << 16);
+    if (bpp == 4) {
+        memcpy(&v, p, 4);
+    }
+    return _mm_cvtsi32_si128((i32)v);
 }
 
-ClCPrsResult cl_prs_invarg(char* arg_dyn, char* error_dyn, char* context_optdyn) {
-    return (ClCPrsResult) {.t = ClCPrs_EInvArg,
-                           .d.invarg.arg_dyn = arg_dyn,
-                           .d.invarg.error_dyn = error_dyn,
-                           .d.invarg.context_optdyn = context_optdyn};
+static void png_store_px(u8* p, __m128i v, u32 bpp) {
+    u32 const s = (u32)_mm_cvtsi128_si32(v);
+    if (bpp == 4) {
+        memcpy(p, &s, 4);
+    } else {
+        p[0] = s;
+        p[1] = s >> 8;
+        p[2] = s >> 16;
+    }
 }
 
-void cl_cmd_parse_res_free(ClCPrsResult* res) {
-    switch (res->t) {
-        case ClCPrs_Ok: {
-            struct ClCommand* cl_cmd = &res->d.ok;
-            switch (cl_cmd->t) {
-                case ClC_Set:
-                    switch (cl_cmd->d.set.t) {
-                        case ClCDS_UiFont: free(cl_cmd->d.set.d.ui_font.name_dyn); break;
-                        case ClCDS_TextFont: free(cl_cmd->d.set.d.text_font.name_dyn); break;
-                        case ClCDS_Inp: free(cl_cmd->d.set.d.inp.path_dyn); break;
-                        case ClCDS_Out: free(cl_cmd->d.set.d.out.path_dyn); break;
-                        case ClCDS_LineW:
-                        case ClCDS_Col:
-                        case ClCDS_PngCompression:
-                        case ClCDS_JpgQuality:
-                        case ClCDS_Spacing:
-                        case ClCDS_Hardness:
-                        case ClCDSTag_Invalid:
-                        case ClCDSTag_Count: break;  // no default branch to enable warnings
-                    }
-                    break;
-                case ClC_Save: free(cl_cmd->d.save.path_dyn); break;
-                case ClC_Load: free(cl_cmd->d.load.path_dyn); break;
-                case ClC_Echo: free(cl_cmd->d.echo.msg_dyn); break;
-                case ClC_W:
-                case ClC_WQ:
-                case ClC_Exit: break;
-                case ClCTag_Invalid:
-                case ClCTag_Count: assert(!"invalid enum value");  // no default branch to enable warnings
+static __m128i png_select(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static __m128i png_abs16(__m128i v) {
+    return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+#endif
+
+// in place, `prior` is previous unfiltered row
+static Bool png_unfilter_row(u8 filter, u8* row, u8 const* prior, u32 stride, u32 bpp) {
+    switch (filter) {
+        case 0: return True;
+        case 2: {
+            u32 i = 0;
+#ifdef __SSE2__
+            for (; i + 16 <= stride; i += 16) {
+                __m128i const x = _mm_loadu_si128((__m128i const*)(row + i));
+                __m128i const b = _mm_loadu_si128((__m128i const*)(prior + i));
+                _mm_storeu_si128((__m128i*)(row + i), _mm_add_epi8(x, b));
             }
-        } break;
-        case ClCPrs_EInvArg: {
-            str_free(&res->d.invarg.arg_dyn);
-            str_free(&res->d.invarg.error_dyn);
-            str_free(&res->d.invarg.context_optdyn);
-        } break;
-        case ClCPrs_ENoArg: {
-            str_free(&res->d.noarg.arg_desc_dyn);
-            str_free(&res->d.noarg.context_optdyn);
-        } break;
+#endif
+            for (; i < stride; ++i) {
+                row[i] += prior[i];
+            }
+            return True;
+        }
+        case 1:
+        case 3:
+        case 4: break;
+        default: return False;
+    }
+
+#ifdef __SSE2__
+    if (bpp == 3 || bpp == 4) {
+        __m128i const zero = _mm_setzero_si128();
+        __m128i a = zero;
+        if (filter == 1) {
+            for (u32 i = 0; i < stride; i += bpp) {
+                a = _mm_add_epi8(png_load_px(row + i, bpp), a);
+                png_store_px(row + i, a, bpp);
+            }
+        } else if (filter == 3) {
+            __m128i const one = _mm_set1_epi8(1);
+            for (u32 i = 0; i < stride; i += bpp) {
+                __m128i const b = png_load_px(prior + i, bpp);
+                // avg_epu8 rounds up, floor((a + b) / 2) is needed
+                __m128i const avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+                a = _mm_add_epi8(png_load_px(row + i, bpp), avg);
+                png_store_px(row + i, a, bpp);
+            }
+        } else {
+            // in 16-bit lanes, only `a` depends on previous pixel
+            __m128i const low = _mm_set1_epi16(0xFF);
+            __m128i c = zero;
+            for (u32 i = 0; i < stride; i += bpp) {
+                __m128i const x = _mm_unpacklo_epi8(png_load_px(row + i, bpp), zero);
+                __m128i const b = _mm_unpacklo_epi8(png_load_px(prior + i, bpp), zero);
+                __m128i const pa = png_abs16(_mm_sub_epi16(b, c));
+                __m128i const b_2c = _mm_sub_epi16(b, _mm_add_epi16(c, c));
+                __m128i const pb = png_abs16(_mm_sub_epi16(a, c));
+                __m128i const pc = png_abs16(_mm_add_epi16(a, b_2c));
+                __m128i const smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+                // ties favor a over b over c
+                __m128i nearest = png_select(_mm_cmpeq_epi16(smallest, pb), b, c);
+                nearest = png_select(_mm_cmpeq_epi16(smallest, pa), a, nearest);
+                a = _mm_and_si128(_mm_add_epi16(x, nearest), low);
+                png_store_px(row + i, _mm_packus_epi16(a, a), bpp);
+                c = b;
+            }
+        }
+        return True;
+    }
+#endif
+
+    for (u32 i = 0; i < stride; ++i) {
+        u8 const a = i >= bpp ? row[i - bpp] : 0;
+        u8 const c = i >= bpp ? prior[i - bpp] : 0;
+        switch (filter) {
+            case 1: row[i] += a; break;
+            case 3: row[i] += (a + prior[i]) >> 1; break;
+            default: row[i] += png_paeth(a, prior[i], c); break;
+        }
+    }
+    return True;
+}
+
+// RGB(A) bytes to argb
+static void png_convert_row(argb* dst, u8 const* src, u32 width, u32 bpp, argb bg) {
+    u32 x = 0;
+    if (bpp == 3) {
+        for (; x < width; ++x, src += 3) {
+            dst[x] = 0xFF000000 | (src[0] << 16) | (src[1] << 8) | src[2];
+        }
+        return;
+    }
+    if (bg) {
+        // swap of color channels commutes with per-channel blend
+        argb const bg_swapped = argb_to_abgr(bg);
+        for (; x < width; ++x, src += 4) {
+            argb const px = ((u32)src[3] << 24) | (src[0] << 16) | (src[1] << 8) | src[2];
+            dst[x] = argb_blend(px, bg_swapped, src[3]);
+        }
+        return;
+    }
+#if defined(__SSE2__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    __m128i const ag_mask = _mm_set1_epi32((i32)0xFF00FF00);
+    __m128i const b_mask = _mm_set1_epi32(0x000000FF);
+    for (; x + 4 <= width; x += 4, src += 16) {
+        __m128i const v = _mm_loadu_si128((__m128i const*)src);
+        __m128i const r = _mm_slli_epi32(_mm_and_si128(v, b_mask), 16);
+        __m128i const b = _mm_and_si128(_mm_srli_epi32(v, 16), b_mask);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(_mm_and_si128(v, ag_mask), _mm_or_si128(r, b)));
+    }
+#endif
+    for (; x < width; ++x, src += 4) {
+        dst[x] = ((u32)src[3] << 24) | (src[0] << 16) | (src[1] << 8) | src[2];
+    }
+}
+
+static u32 png_get_be32(u8 const* p) {
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+argb* png_decode(u8 const* data, usize len, argb bg, Pt* dims_out) {
+    static u8 const signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    if (len < 8 + 25 || memcmp(data, signature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0) {
+        return NULL;
+    }
+    u8 const* ihdr = data + 16;
+    u32 const width = png_get_be32(ihdr);
+    u32 const height = png_get_be32(ihdr + 4);
+    u8 const color_type = ihdr[9];
+    if (png_get_be32(data + 8) != 13 || ihdr[8] != 8 || (color_type != 2 && color_type != 6) || ihdr[10] || ihdr[11]
+        || ihdr[12]) {
+        return NULL;
+    }
+    u32 const bpp = color_type == 6 ? 4 : 3;
+    if (!width || !height || width > (1u << 24) || height > (1u << 24)
+        || (usize)height * (1 + (usize)width * bpp) > INT32_MAX) {
+        return NULL;
+    }
+    u32 const stride = width * bpp;
+
+    // collect IDAT, copy only if split between chunks
+    u8 const* idat = NULL;
+    usize idat_len = 0;
+    u8* idat_dyn = NULL;
+    Bool ended = False;
+    for (usize pos = 8 + 25; !ended && pos + 12 <= len;) {
+        usize const chunk_len = png_get_be32(data + pos);
+        u8 const* type = data + pos + 4;
+        u8 const* chunk = data + pos + 8;
+        if (chunk_len > len - pos - 12) {
+            break;
+        }
+        pos += 12 + chunk_len;
+        if (memcmp(type, "IDAT", 4) == 0) {
+            if (!idat) {
+                idat = chunk;
+            } else {
+                u8* expanded = (u8*)realloc(idat_dyn, idat_len + chunk_len);
+                if (!expanded) {
+                    break;
+                }
+                if (!idat_dyn) {
+                    memcpy(expanded, idat, idat_len);
+                }
+                memcpy(expanded + idat_len, chunk, chunk_len);
+                idat = idat_dyn = expanded;
+            }
+            idat_len += chunk_len;
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            break;  // color key is left to stb
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            ended = True;
+        }
+    }
+
+    usize const raw_len = (usize)height * (1 + stride);
+    u8* raw = ended && idat ? (u8*)malloc(raw_len) : NULL;
+    u8* zero_row = raw ? (u8*)calloc(stride, 1) : NULL;
+    argb* image = zero_row ? (argb*)malloc((usize)width * height * sizeof(argb)) : NULL;
+    Bool ok = image && png_inflate(idat, idat_len, raw, raw_len);
+
+    for (u32 y = 0; ok && y < height; ++y) {
+        u8* row = raw + (usize)y * (1 + stride);
+        u8 const* prior = y ? row - stride : zero_row;
+        ok = png_unfilter_row(row[0], row + 1, prior, stride, bpp);
+        if (ok) {
+            png_convert_row(image + (usize)y * width, row + 1, width, bpp, bg);
+        }
+    }
+
+    free(idat_dyn);
+    free(raw);
+    free(zero_row);
+    if (!ok) {
+        free(image);
+        return NULL;
+    }
+    *dims_out = (Pt) {(i32)width, (i32)height};
+    return image;
+}
+
+// canonical huffman table, same layout as in stb_image
+struct JpgHuff {
+    u8 fast[1 << JPG_FAST_BITS];  // index of code, 0xFF for longer codes
+    u8 size[257];
+    u8 values[256];
+    u32 maxcode[18];  // first code of next length, aligned to 16 bits
+    i32 delta[17];  // symbol index minus code
+    // for ac tables, codes with value bits fitting in fast lookup:
+    // (value << 8) | (run << 4) | (code length + value bits), 0 for others
+    i16 fast_ac[1 << JPG_FAST_BITS];
+};
+
+struct JpgComp {
+    u8 id;
+    u8 h;
+    u8 v;
+    u8 tq;
+    u8 td;
+    u8 ta;
+    i32 dc_pred;
+    u32 bw;  // blocks per line, padded to whole MCUs
+    u32 bh;
+    u8* plane;  // bw * bh blocks of n * n samples
+};
+
+struct JpgDec {
+    u8 const* data;
+    usize len;
+    usize pos;
+    u64 bits;  // msb first
+    i32 count;
+    Bool marker_hit;
+    u16 quant[4][64];  // zigzag order
+    struct JpgHuff* huff;  // 4 dc then 4 ac tables
+    Bool huff_ok[8];
+    struct JpgComp comps[3];
+    u32 comps_len;
+    u32 width;
+    u32 height;
+    u32 hmax;
+    u32 vmax;
+    u32 restart_interval;
+    Bool rgb;  // adobe transform 0, components are not YCbCr
+    u32 n;  // output samples per block side
+    u32 span;  // side of coefficient square contributing to output
+    float basis[8][8];  // [u][x], zero for x >= n, see jpg_decode_scaled
+};
+
+// clang-format off
+static u8 const jpg_dezigzag[64] = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+// clang-format on
+
+static i32 jpg_extend(u32 v, u32 s) {
+    return s && v < (1u << (s - 1)) ? (i32)v - (i32)((1u << s) - 1) : (i32)v;
+}
+
+static Bool jpg_huff_build(struct JpgHuff* h, u8 const* counts) {
+    u32 k = 0;
+    for (u32 i = 0; i < 16; ++i) {
+        for (u32 j = 0; j < counts[i]; ++j) {
+            h->size[k++] = i + 1;
+        }
+    }
+    h->size[k] = 0;
+
+    u16 codes[256];
+    u32 code = 0;
+    k = 0;
+    for (u32 s = 1; s <= 16; ++s) {
+        h->delta[s] = (i32)k - (i32)code;
+        if (h->size[k] == s) {
+            while (h->size[k] == s) {
+                codes[k++] = code++;
+            }
+            if (code - 1 >= (1u << s)) {
+                return False;  // oversubscribed
+            }
+        }
+        h->maxcode[s] = code << (16 - s);
+        code <<= 1;
+    }
+    h->maxcode[17] = 0xFFFFFFFF;
+
+    memset(h->fast, 0xFF, sizeof(h->fast));
+    for (u32 i = 0; i < k; ++i) {
+        u32 const s = h->size[i];
+        if (s <= JPG_FAST_BITS) {
+            u32 const first = codes[i] << (JPG_FAST_BITS - s);
+            memset(h->fast + first, (i32)i, 1u << (JPG_FAST_BITS - s));
+        }
+    }
+    return True;
+}
+
+static void jpg_huff_build_fast_ac(struct JpgHuff* h) {
+    for (u32 i = 0; i < (1 << JPG_FAST_BITS); ++i) {
+        u32 const fast = h->fast[i];
+        h->fast_ac[i] = 0;
+        if (fast == 0xFF) {
+            continue;
+        }
+        u32 const rs = h->values[fast];
+        u32 const run = rs >> 4;
+        u32 const mag_bits = rs & 15;
+        u32 const len = h->size[fast];
+        if (mag_bits && len + mag_bits <= JPG_FAST_BITS) {
+            u32 const v = (i >> (JPG_FAST_BITS - len - mag_bits)) & ((1u << mag_bits) - 1);
+            i32 const k = jpg_extend(v, mag_bits);
+            h->fast_ac[i] = (i16)(k * 256 + run * 16 + len + mag_bits);
+        }
+    }
+}
+
+// stops before markers, then zeros are shifted in
+static void jpg_refill(struct JpgDec* j) {
+    if (!j->marker_hit && j->pos + 8 <= j->len) {
+        u64 v = 0;
+        for (u32 i = 0; i < 8; ++i) {
+            v = (v << 8) | j->data[j->pos + i];
+        }
+        // without 0xFF bytes there are no stuffed zeros and markers, bits after count are also valid
+        if (!((~v - 0x0101010101010101ull) & v & 0x8080808080808080ull)) {
+            j->bits |= v >> j->count;
+            j->pos += (63 - j->count) >> 3;
+            j->count |= 56;
+            return;
+        }
+    }
+    while (j->count <= 56) {
+        u64 byte = 0;
+        if (!j->marker_hit && j->pos < j->len) {
+            byte = j->data[j->pos];
+            if (byte == 0xFF) {
+                if (j->pos + 1 < j->len && j->data[j->pos + 1] == 0x00) {
+                    ++j->pos;  // stuffed zero
+                } else {
+                    j->marker_hit = True;
+                    byte = 0;
+                    --j->pos;
+                }
+            }
+            ++j->pos;
+        }
+        j->bits |= byte << (56 - j->count);
+        j->count += 8;
+    }
+}
+
+static u32 jpg_take(struct JpgDec* j, u32 n) {
+    if (!n) {
+        return 0;
+    }
+    if (j->count < (i32)n) {
+        jpg_refill(j);
+    }
+    u32 const v = (u32)(j->bits >> (64 - n));
+    j->bits <<= n;
+    j->count -= (i32)n;
+    return v;
+}
+
+// NIL on invalid code
+static i32 jpg_decode_symbol(struct JpgDec* j, struct JpgHuff const* h) {
+    if (j->count < 16) {
+        jpg_refill(j);
+    }
+    u32 const fast = h->fast[j->bits >> (64 - JPG_FAST_BITS)];
+    if (fast != 0xFF) {
+        u32 const s = h->size[fast];
+        j->bits <<= s;
+        j->count -= (i32)s;
+        return h->values[fast];
+    }
+    u32 const peek = (u32)(j->bits >> 48);
+    u32 s = JPG_FAST_BITS + 1;
+    while (peek >= h->maxcode[s]) {
+        ++s;
+    }
+    if (s == 17) {
+        return NIL;
+    }
+    i32 const c = (i32)(peek >> (16 - s)) + h->delta[s];
+    if (c < 0 || c > 255 || h->size[c] != s) {
+        return NIL;
+    }
+    j->bits <<= s;
+    j->count -= (i32)s;
+    return h->values[c];
+}
+
+// writes n * n box filtered samples
+static Bool jpg_decode_block(struct JpgDec* j, struct JpgComp* c, u8* out, u32 out_stride) {
+    struct JpgHuff const* dc = &j->huff[c->td];
+    struct JpgHuff const* ac = &j->huff[4 + c->ta];
+    u16 const* q = j->quant[c->tq];
+    u32 const n = j->n;
+    float coef[8][8] = {{0}};
+    u32 rows = 1;  // rows and columns with nonzero coefficients
+    u32 cols = 1;
+
+    i32 const t = jpg_decode_symbol(j, dc);
+    if (t < 0 || t > 15) {
+        return False;
+    }
+    c->dc_pred += jpg_extend(jpg_take(j, t), t);
+    coef[0][0] = (float)c->dc_pred * q[0];
+
+    for (u32 k = 1; k < 64;) {
+        if (j->count < 16) {
+            jpg_refill(j);
+        }
+        i32 const fast = ac->fast_ac[j->bits >> (64 - JPG_FAST_BITS)];
+        if (fast) {
+            u32 const len = fast & 15;
+            k += (fast >> 4) & 15;
+            j->bits <<= len;
+            j->count -= (i32)len;
+            if (k > 63) {
+                return False;
+            }
+            u32 const zz = jpg_dezigzag[k];
+            if (zz / 8 < j->span && zz % 8 < j->span) {
+                coef[zz / 8][zz % 8] = (float)(fast >> 8) * q[k];
+                rows = MAX(rows, zz / 8 + 1);
+                cols = MAX(cols, zz % 8 + 1);
+            }
+            ++k;
+            continue;
+        }
+        i32 const rs = jpg_decode_symbol(j, ac);
+        if (rs < 0) {
+            return False;
+        }
+        u32 const r = rs >> 4;
+        u32 const s = rs & 15;
+        if (!s) {
+            if (r != 15) {
+                break;  // end of block
+            }
+            k += 16;
+            continue;
+        }
+        k += r;
+        if (k > 63) {
+            return False;
+        }
+        i32 const v = jpg_extend(jpg_take(j, s), s);
+        u32 const zz = jpg_dezigzag[k];
+        if (zz / 8 < j->span && zz % 8 < j->span) {
+            coef[zz / 8][zz % 8] = (float)v * q[k];
+            rows = MAX(rows, zz / 8 + 1);
+            cols = MAX(cols, zz % 8 + 1);
+        }
+        ++k;
+    }
+
+    // separable, rows then columns, 8 lanes of x are vectorized
+    float tmp[8][8];
+    for (u32 v = 0; v < rows; ++v) {
+        float acc[8] = {0};
+        for (u32 u = 0; u < cols; ++u) {
+            for (u32 x = 0; x < 8; ++x) {
+                acc[x] += j->basis[u][x] * coef[v][u];
+            }
+        }
+        memcpy(tmp[v], acc, sizeof(acc));
+    }
+    for (u32 y = 0; y < n; ++y) {
+        float acc[8] = {128.5f, 128.5f, 128.5f, 128.5f, 128.5f, 128.5f, 128.5f, 128.5f};
+        for (u32 v = 0; v < rows; ++v) {
+            for (u32 x = 0; x < 8; ++x) {
+                acc[x] += j->basis[v][y] * tmp[v][x];
+            }
+        }
+        for (u32 x = 0; x < n; ++x) {
+            out[y * out_stride + x] = (u8)CLAMP(acc[x], 0.0f, 255.0f);
+        }
+    }
+    return True;
+}
+
+// restart marker must follow
+static Bool jpg_restart(struct JpgDec* j) {
+    j->bits = 0;
+    j->count = 0;
+    j->marker_hit = False;
+    while (j->pos + 1 < j->len && !(j->data[j->pos] == 0xFF && j->data[j->pos + 1] != 0xFF)) {
+        ++j->pos;  // fill bytes
+    }
+    if (j->pos + 1 >= j->len || j->data[j->pos + 1] < 0xD0 || j->data[j->pos + 1] > 0xD7) {
+        return False;
+    }
+    j->pos += 2;
+    for (u32 i = 0; i < j->comps_len; ++i) {
+        j->comps[i].dc_pred = 0;
+    }
+    return True;
+}
+
+static Bool jpg_decode_scan(struct JpgDec* j, struct JpgComp** scan, u32 scan_len) {
+    u32 const n = j->n;
+    u32 mcu_w = scan[0]->bw / scan[0]->h;
+    u32 mcu_h = scan[0]->bh / scan[0]->v;
+    if (scan_len == 1) {
+        // not interleaved, blocks cover only component area
+        u32 const comp_w = (j->width * scan[0]->h + j->hmax - 1) / j->hmax;
+        u32 const comp_h = (j->height * scan[0]->v + j->vmax - 1) / j->vmax;
+        mcu_w = (comp_w + 7) / 8;
+        mcu_h = (comp_h + 7) / 8;
+    }
+    u32 until_restart = j->restart_interval;
+    j->bits = 0;
+    j->count = 0;
+    j->marker_hit = False;
+
+    for (u32 my = 0; my < mcu_h; ++my) {
+        for (u32 mx = 0; mx < mcu_w; ++mx) {
+            if (j->restart_interval && !until_restart--) {
+                if (!jpg_restart(j)) {
+                    return False;
+                }
+                until_restart = j->restart_interval - 1;
+            }
+            for (u32 i = 0; i < scan_len; ++i) {
+                struct JpgComp* c = scan[i];
+                u32 const bh = scan_len == 1 ? 1 : c->h;
+                u32 const bv = scan_len == 1 ? 1 : c->v;
+                for (u32 by = 0; by < bv; ++by) {
+                    for (u32 bx = 0; bx < bh; ++bx) {
+                        usize const row = (usize)(my * bv + by) * n;
+                        usize const col = (usize)(mx * bh + bx) * n;
+                        u8* out = c->plane + row * c->bw * n + col;
+                        if (!jpg_decode_block(j, c, out, c->bw * n)) {
+                            return False;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // refill never reads past marker, so next one is found by scanning from j->pos
+    return True;
+}
+
+static u32 jpg_be16(u8 const* p) {
+    return (p[0] << 8) | p[1];
+}
+
+// converts planes to argb, chroma is upsampled by nearest sample
+static void jpg_convert(struct JpgDec const* j, argb* image, Pt dims) {
+    u32 const n = j->n;
+    for (i32 y = 0; y < dims.y; ++y) {
+        u8 const* rows[3];
+        u32 xs[3];
+        for (u32 i = 0; i < j->comps_len; ++i) {
+            struct JpgComp const* c = &j->comps[i];
+            rows[i] = c->plane + (usize)(y * c->v / j->vmax) * c->bw * n;
+            xs[i] = c->h * 0x10000 / j->hmax;  // 16.16 step
+        }
+        argb* out = image + (usize)y * dims.x;
+        for (i32 x = 0; x < dims.x; ++x) {
+            if (j->comps_len == 1) {
+                u32 const l = rows[0][x];
+                out[x] = 0xFF000000 | (l << 16) | (l << 8) | l;
+                continue;
+            }
+            i32 const c0 = rows[0][(x * xs[0]) >> 16];
+            i32 const c1 = rows[1][(x * xs[1]) >> 16];
+            i32 const c2 = rows[2][(x * xs[2]) >> 16];
+            if (j->rgb) {
+                out[x] = 0xFF000000 | (c0 << 16) | (c1 << 8) | c2;
+                continue;
+            }
+            // JFIF YCbCr, 16.16 fixed point
+            i32 const cb = c1 - 128;
+            i32 const cr = c2 - 128;
+            i32 const yy = (c0 << 16) + (1 << 15);
+            i32 const r = (yy + 91881 * cr) >> 16;
+            i32 const g = (yy - 22554 * cb - 46802 * cr) >> 16;
+            i32 const b = (yy + 116130 * cb) >> 16;
+            out[x] = 0xFF000000 | (CLAMP(r, 0, 255) << 16) | (CLAMP(g, 0, 255) << 8) | CLAMP(b, 0, 255);
+        }
+    }
+}
+
+Bool jpg_dims(u8 const* data, usize len, Pt* dims_out) {
+    if (len < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+        return False;
+    }
+    for (usize pos = 2; pos + 4 <= len;) {
+        if (data[pos] != 0xFF) {
+            return False;
+        }
+        u8 const marker = data[pos + 1];
+        if (marker == 0xFF) {
+            ++pos;  // fill byte
+            continue;
+        }
+        usize const seg_len = jpg_be16(data + pos + 2);
+        if (marker == 0xC0 || marker == 0xC1) {
+            if (seg_len < 8 || pos + 2 + seg_len > len) {
+                return False;
+            }
+            *dims_out = (Pt) {(i32)jpg_be16(data + pos + 7), (i32)jpg_be16(data + pos + 5)};
+            return dims_out->x > 0 && dims_out->y > 0;
+        }
+        if ((marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) || marker == 0xDA) {
+            return False;  // other frame types or scan before frame
+        }
+        pos += 2 + seg_len;
+    }
+    return False;
+}
+
+argb* jpg_decode_scaled(u8 const* data, usize len, u32 scale_shift, Pt* dims_out) {
+    Pt src_dims = {0};
+    if (scale_shift > 3 || !jpg_dims(data, len, &src_dims)) {
+        return NULL;
+    }
+    struct JpgDec* j = ecalloc(1, sizeof(struct JpgDec));
+    j->data = data;
+    j->len = len;
+    j->n = 8 >> scale_shift;
+    j->huff = ecalloc(8, sizeof(struct JpgHuff));
+    // 8-point idct averaged over groups of m = 8 / n samples, which is n-point idct basis
+    // attenuated by sin(m * a) / (m * sin(a)) with a = u * pi / 16
+    // only an approximation of averaging the full decode: subsampled chroma is filtered on its own grid
+    // and replicated, and samples are clamped after averaging, a few levels off per channel at 1/8
+    u32 const m = 1u << scale_shift;
+    j->span = j->n == 1 ? 1 : 8;  // block average is dc alone
+    for (u32 x = 0; x < j->n; ++x) {
+        for (u32 u = 0; u < 8; ++u) {
+            double const a = u * M_PI / 16.0;
+            double const cu = u ? 1.0 : 1.0 / sqrt(2.0);
+            double const box = u ? sin(m * a) / (m * sin(a)) : 1.0;
+            j->basis[u][x] = (float)(cu / 2.0 * cos((2.0 * x + 1.0) * u * M_PI / (2.0 * j->n)) * box);
+        }
+    }
+
+    Bool ok = True;
+    Bool frame = False;
+    Bool scanned = False;
+    Bool done = False;
+    usize pos = 2;
+    while (ok && !done) {
+        // markers may be preceded by fill bytes or, after scan, by entropy data
+        while (pos + 1 < len && !(data[pos] == 0xFF && data[pos + 1] != 0x00 && data[pos + 1] != 0xFF)) {
+            ++pos;
+        }
+        if (pos + 1 >= len) {
+            break;
+        }
+        u8 const marker = data[pos + 1];
+        pos += 2;
+        if (marker == 0xD9) {
+            done = True;
+            break;
+        }
+        if (marker >= 0xD0 && marker <= 0xD7) {
+            continue;  // stray restart marker
+        }
+        if (pos + 2 > len || jpg_be16(data + pos) < 2 || pos + jpg_be16(data + pos) > len) {
+            ok = False;
+            break;
+        }
+        u8 const* seg = data + pos + 2;
+        usize const seg_len = jpg_be16(data + pos) - 2;
+        pos += 2 + seg_len;
+
+        switch (marker) {
+            case 0xDB: {  // quantization tables
+                for (usize p = 0; ok && p < seg_len;) {
+                    u32 const precision = seg[p] >> 4;
+                    u32 const id = seg[p] & 15;
+                    usize const table_len = precision ? 128 : 64;
+                    ok = precision <= 1 && id < 4 && p + 1 + table_len <= seg_len;
+                    for (u32 k = 0; ok && k < 64; ++k) {
+                        j->quant[id][k] = precision ? jpg_be16(seg + p + 1 + 2 * k) : seg[p + 1 + k];
+                    }
+                    p += 1 + table_len;
+                }
+            } break;
+            case 0xC4: {  // huffman tables
+                for (usize p = 0; ok && p < seg_len;) {
+                    if (p + 17 > seg_len) {
+                        ok = False;
+                        break;
+                    }
+                    u32 const class = seg[p] >> 4;
+                    u32 const id = seg[p] & 15;
+                    u32 total = 0;
+                    for (u32 i = 0; i < 16; ++i) {
+                        total += seg[p + 1 + i];
+                    }
+                    ok = class <= 1 && id < 4 && total <= 256 && p + 17 + total <= seg_len;
+                    if (ok) {
+                        struct JpgHuff* h = &j->huff[class * 4 + id];
+                        ok = jpg_huff_build(h, seg + p + 1);
+                        memcpy(h->values, seg + p + 17, total);
+                        if (class) {
+                            jpg_huff_build_fast_ac(h);
+                        }
+                        j->huff_ok[class * 4 + id] = ok;
+                    }
+                    p += 17 + total;
+                }
+            } break;
+            case 0xDD: {  // restart interval
+                ok = seg_len >= 2;
+                j->restart_interval = ok ? jpg_be16(seg) : 0;
+            } break;
+            case 0xEE: {  // adobe, transform flag tells if components are YCbCr
+                if (seg_len >= 12 && memcmp(seg, "Adobe", 5) == 0) {
+                    j->rgb = seg[11] == 0;
+                }
+            } break;
+            case 0xC0:
+            case 0xC1: {  // baseline and extended sequential, huffman coded
+                u32 const comps_len = seg_len >= 6 ? seg[5] : 0;
+                ok = !frame && (comps_len == 1 || comps_len == 3) && seg_len >= 6 + 3 * comps_len && seg[0] == 8;
+                if (!ok) {
+                    break;
+                }
+                j->comps_len = comps_len;
+                j->height = jpg_be16(seg + 1);
+                j->width = jpg_be16(seg + 3);
+                ok = j->width && j->height;
+                for (u32 i = 0; ok && i < j->comps_len; ++i) {
+                    struct JpgComp* c = &j->comps[i];
+                    c->id = seg[6 + 3 * i];
+                    c->h = seg[7 + 3 * i] >> 4;
+                    c->v = seg[7 + 3 * i] & 15;
+                    c->tq = seg[8 + 3 * i];
+                    ok = c->h >= 1 && c->h <= 4 && c->v >= 1 && c->v <= 4 && c->tq < 4;
+                    j->hmax = MAX(j->hmax, c->h);
+                    j->vmax = MAX(j->vmax, c->v);
+                }
+                u32 const mcu_x = ok ? (j->width + 8 * j->hmax - 1) / (8 * j->hmax) : 0;
+                u32 const mcu_y = ok ? (j->height + 8 * j->vmax - 1) / (8 * j->vmax) : 0;
+                for (u32 i = 0; ok && i < j->comps_len; ++i) {
+                    struct JpgComp* c = &j->comps[i];
+                    c->bw = mcu_x * c->h;
+                    c->bh = mcu_y * c->v;
+                    // gray for components missing in stream
+                    usize const plane_len = (usize)c->bw * c->bh * j->n * j->n;
+                    c->plane = (u8*)malloc(plane_len);
+                    ok = c->plane != NULL;
+                    if (ok) {
+                        memset(c->plane, 0x80, plane_len);
+                    }
+                }
+                frame = ok;
+            } break;
+            case 0xDA: {  // scan
+                u32 const scan_len = seg_len ? seg[0] : 0;
+                struct JpgComp* scan[3] = {0};
+                ok = frame && scan_len >= 1 && scan_len <= j->comps_len && seg_len >= 4 + 2 * scan_len;
+                for (u32 i = 0; ok && i < scan_len; ++i) {
+                    for (u32 k = 0; k < j->comps_len; ++k) {
+                        if (j->comps[k].id == seg[1 + 2 * i]) {
+                            scan[i] = &j->comps[k];
+                        }
+                    }
+                    ok = scan[i] != NULL;
+                    if (ok) {
+                        scan[i]->td = seg[2 + 2 * i] >> 4;
+                        scan[i]->ta = seg[2 + 2 * i] & 15;
+                        scan[i]->dc_pred = 0;
+                        ok = scan[i]->td < 4 && scan[i]->ta < 4 && j->huff_ok[scan[i]->td] && j->huff_ok[4 + scan[i]->ta];
+                    }
+                }
+                if (!ok) {
+                    break;
+                }
+                j->pos = pos;
+                ok = jpg_decode_scan(j, scan, scan_len);
+                scanned = True;
+                pos = j->pos;
+            } break;
+            default: {
+                // progressive, lossless and arithmetic coded frames
+                ok = !(marker >= 0xC2 && marker <= 0xCF);
+            } break;
+        }
+    }
+
+    argb* image = NULL;
+    if (ok && scanned) {
+        // ceil of scaled size, as in libjpeg
+        Pt const dims = {
+            (i32)((j->width + (1u << scale_shift) - 1) >> scale_shift),
+            (i32)((j->height + (1u << scale_shift) - 1) >> scale_shift),
+        };
+        image = (argb*)malloc((usize)dims.x * dims.y * sizeof(argb));
+        if (image) {
+            jpg_convert(j, image, dims);
+            *dims_out = dims;
+        }
+    }
+
+    for (u32 i = 0; i < j->comps_len; ++i) {
+        free(j->comps[i].plane);
+    }
+    free(j->huff);
+    free(j);
+    return image;
+}
+
+u32 jpg_preview_shift(Pt dims, Pt wnd) {
+    u32 shift = 0;
+    while (shift < 3 && (dims.x >> (shift + 1)) >= wnd.x && (dims.y >> (shift + 1)) >= wnd.y) {
+        ++shift;
+    }
+    return JPG_PREVIEW_MIN_SCALE && (1u << shift) >= JPG_PREVIEW_MIN_SCALE ? shift : 0;
+}
+
+// same limits as png_decode
+static Bool stream_dims_valid(u32 width, u32 height) {
+    return width && height && width <= (1u << 24) && height <= (1u << 24)
+        && (usize)width * height <= INT32_MAX / sizeof(argb);
+}
+
+// converts row of `depth` channels, 1 or 2 bytes each, to 8-bit rgba
+static void raw_row_to_rgba(u8* rgba, u8 const* src, u32 width, u32 depth, u32 maxval) {
+    u32 const bytes = maxval > 255 ? 2 : 1;
+    for (u32 x = 0; x < width; ++x, rgba += 4) {
+        u8 ch[4] = {0, 0, 0, 255};
+        for (u32 c = 0; c < depth; ++c, src += bytes) {
+            u32 const v = MIN(bytes == 2 ? jpg_be16(src) : *src, maxval);
+            ch[c] = maxval == 255 ? (u8)v : (u8)((v * 255 + maxval / 2) / maxval);
+        }
+        if (depth <= 2) {
+            // gray with optional alpha
+            rgba[0] = rgba[1] = rgba[2] = ch[0];
+            rgba[3] = depth == 2 ? ch[1] : 255;
+        } else {
+            memcpy(rgba, ch, 4);
+        }
+    }
+}
+
+// rows of uncompressed samples after header
+static argb* raw_decode(u8 const* data, usize len, Pt dims, u32 depth, u32 maxval, argb bg) {
+    usize const stride = (usize)dims.x * depth * (maxval > 255 ? 2 : 1);
+    if (!depth || depth > 4 || !maxval || maxval > 65535 || len / stride < (usize)dims.y) {
+        return NULL;
+    }
+    argb* image = (argb*)malloc((usize)dims.x * dims.y * sizeof(argb));
+    if (!image) {
+        return NULL;
+    }
+    Bool const direct = maxval == 255 && depth >= 3;
+    u8* row_dyn = direct ? NULL : ecalloc(dims.x, 4);
+    for (i32 y = 0; y < dims.y; ++y) {
+        u8 const* src = data + (y * stride);
+        if (direct) {
+            png_convert_row(image + ((usize)y * dims.x), src, dims.x, depth, bg);
+        } else {
+            raw_row_to_rgba(row_dyn, src, dims.x, depth, maxval);
+            png_convert_row(image + ((usize)y * dims.x), row_dyn, dims.x, 4, bg);
+        }
+    }
+    free(row_dyn);
+    return image;
+}
+
+// next header token, skips whitespace and comments, NULL at end of data
+static char const* pnm_token(u8 const* data, usize len, usize* pos, usize* tok_len) {
+    while (*pos < len && (isspace(data[*pos]) || data[*pos] == '#')) {
+        if (data[*pos] == '#') {
+            while (*pos < len && data[*pos] != '\n') {
+                ++*pos;
+            }
+        } else {
+            ++*pos;
+        }
+    }
+    usize const start = *pos;
+    while (*pos < len && !isspace(data[*pos])) {
+        ++*pos;
+    }
+    *tok_len = *pos - start;
+    return *tok_len ? (char const*)data + start : NULL;
+}
+
+static Bool pnm_number(u8 const* data, usize len, usize* pos, u32* out) {
+    usize tok_len = 0;
+    char const* tok = pnm_token(data, len, pos, &tok_len);
+    if (!tok || tok_len > 9) {
+        return False;
+    }
+    *out = 0;
+    for (usize i = 0; i < tok_len; ++i) {
+        if (!isdigit((u8)tok[i])) {
+            return False;
+        }
+        *out = *out * 10 + (tok[i] - '0');
+    }
+    return True;
+}
+
+static argb* pnm_decode(u8 const* data, usize len, argb bg, Pt* dims_out) {
+    u32 width = 0;
+    u32 height = 0;
+    u32 depth = 0;
+    u32 maxval = 0;
+    usize pos = 2;
+    if (data[1] == '5' || data[1] == '6') {
+        depth = data[1] == '5' ? 1 : 3;
+        if (!pnm_number(data, len, &pos, &width) || !pnm_number(data, len, &pos, &height)
+            || !pnm_number(data, len, &pos, &maxval)) {
+            return NULL;
+        }
+    } else {
+        // P7 header lines up to ENDHDR, TUPLTYPE is implied by DEPTH
+        for (;;) {
+            usize tok_len = 0;
+            char const* tok = pnm_token(data, len, &pos, &tok_len);
+            if (!tok) {
+                return NULL;
+            }
+            Bool ok = True;
+            if (tok_len == 6 && memcmp(tok, "ENDHDR", 6) == 0) {
+                break;
+            } else if (tok_len == 5 && memcmp(tok, "WIDTH", 5) == 0) {
+                ok = pnm_number(data, len, &pos, &width);
+            } else if (tok_len == 6 && memcmp(tok, "HEIGHT", 6) == 0) {
+                ok = pnm_number(data, len, &pos, &height);
+            } else if (tok_len == 5 && memcmp(tok, "DEPTH", 5) == 0) {
+                ok = pnm_number(data, len, &pos, &depth);
+            } else if (tok_len == 6 && memcmp(tok, "MAXVAL", 6) == 0) {
+                ok = pnm_number(data, len, &pos, &maxval);
+            } else if (tok_len == 8 && memcmp(tok, "TUPLTYPE", 8) == 0) {
+                pnm_token(data, len, &pos, &tok_len);
+            } else {
+                ok = False;
+            }
+            if (!ok) {
+                return NULL;
+            }
+        }
+    }
+    // single whitespace separates header from samples
+    if (pos >= len || !isspace(data[pos]) || !stream_dims_valid(width, height)) {
+        return NULL;
+    }
+    ++pos;
+    Pt const dims = {(i32)width, (i32)height};
+    argb* image = raw_decode(data + pos, len - pos, dims, depth, maxval, bg);
+    if (image) {
+        *dims_out = dims;
+    }
+    return image;
+}
+
+static argb* qoi_decode(u8 const* data, usize len, argb bg, Pt* dims_out) {
+    u32 const width = png_get_be32(data + 4);
+    u32 const height = png_get_be32(data + 8);
+    if (!stream_dims_valid(width, height) || (data[12] != 3 && data[12] != 4)) {
+        return NULL;
+    }
+    argb* image = (argb*)malloc((usize)width * height * sizeof(argb));
+    if (!image) {
+        return NULL;
+    }
+    u8* row_dyn = ecalloc(width, 4);
+    u8 index[64][4] = {{0}};
+    u8 px[4] = {0, 0, 0, 255};
+    u32 run = 0;
+    usize pos = 14;
+    Bool ok = True;
+    for (u32 y = 0; ok && y < height; ++y) {
+        for (u32 x = 0; x < width; ++x) {
+            if (run) {
+                --run;
+            } else if (pos >= len) {
+                ok = False;
+                break;
+            } else {
+                u8 const op = data[pos++];
+                if (op == 0xFE || op == 0xFF) {
+                    u32 const n = op == 0xFE ? 3 : 4;
+                    if (pos + n > len) {
+                        ok = False;
+                        break;
+                    }
+                    memcpy(px, data + pos, n);
+                    pos += n;
+                } else if ((op >> 6) == 0) {
+                    memcpy(px, index[op], 4);
+                } else if ((op >> 6) == 1) {
+                    px[0] += ((op >> 4) & 3) - 2;
+                    px[1] += ((op >> 2) & 3) - 2;
+                    px[2] += (op & 3) - 2;
+                } else if ((op >> 6) == 2) {
+                    if (pos >= len) {
+                        ok = False;
+                        break;
+                    }
+                    i32 const dg = (op & 0x3F) - 32;
+                    u8 const rb = data[pos++];
+                    px[0] += dg - 8 + (rb >> 4);
+                    px[1] += dg;
+                    px[2] += dg - 8 + (rb & 15);
+                } else {
+                    run = op & 0x3F;
+                }
+            }
+            memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+            memcpy(row_dyn + ((usize)x * 4), px, 4);
+        }
+        png_convert_row(image + ((usize)y * width), row_dyn, width, 4, bg);
+    }
+    free(row_dyn);
+    if (!ok) {
+        free(image);
+        return NULL;
+    }
+    *dims_out = (Pt) {(i32)width, (i32)height};
+    return image;
+}
+
+argb* stream_decode(u8 const* data, usize len, argb bg, Pt* dims_out) {
+    if (len >= 16 && memcmp(data, "farbfeld", 8) == 0) {
+        u32 const width = png_get_be32(data + 8);
+        u32 const height = png_get_be32(data + 12);
+        if (!stream_dims_valid(width, height)) {
+            return NULL;
+        }
+        Pt const dims = {(i32)width, (i32)height};
+        argb* image = raw_decode(data + 16, len - 16, dims, 4, 65535, bg);
+        if (image) {
+            *dims_out = dims;
+        }
+        return image;
+    }
+    if (len >= 3 && data[0] == 'P' && data[1] >= '5' && data[1] <= '7' && isspace(data[2])) {
+        return pnm_decode(data, len, bg, dims_out);
+    }
+    if (len >= 14 && memcmp(data, "qoif", 4) == 0) {
+        return qoi_decode(data, len, bg, dims_out);
+    }
+    return NULL;
+}
+
+// qoi encoder state, persists across rows
+struct QoiEnc {
+    argb index[64];
+    argb prev;
+    u32 run;
+};
+
+static u32 qoi_hash(argb px) {
+    return (((px >> 16) & 0xFF) * 3 + ((px >> 8) & 0xFF) * 5 + (px & 0xFF) * 7 + (px >> 24) * 11) % 64;
+}
+
+// returns bytes written to out, at most 5 per pixel
+static u32 qoi_encode_row(struct QoiEnc* enc, argb const* row, u32 width, u8* out) {
+    u8* const start = out;
+    for (u32 x = 0; x < width; ++x) {
+        argb const px = row[x];
+        if (px == enc->prev) {
+            if (++enc->run == 62) {
+                *out++ = 0xC0 | (enc->run - 1);
+                enc->run = 0;
+            }
+            continue;
+        }
+        if (enc->run) {
+            *out++ = 0xC0 | (enc->run - 1);
+            enc->run = 0;
+        }
+        u32 const hash = qoi_hash(px);
+        if (enc->index[hash] == px) {
+            *out++ = hash;
+        } else if ((px >> 24) == (enc->prev >> 24)) {
+            i8 const dr = (i8)(((px >> 16) & 0xFF) - ((enc->prev >> 16) & 0xFF));
+            i8 const dg = (i8)(((px >> 8) & 0xFF) - ((enc->prev >> 8) & 0xFF));
+            i8 const db = (i8)((px & 0xFF) - (enc->prev & 0xFF));
+            i8 const dr_dg = (i8)(dr - dg);
+            i8 const db_dg = (i8)(db - dg);
+            if (BETWEEN(dr, -2, 1) && BETWEEN(dg, -2, 1) && BETWEEN(db, -2, 1)) {
+                *out++ = 0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+            } else if (BETWEEN(dg, -32, 31) && BETWEEN(dr_dg, -8, 7) && BETWEEN(db_dg, -8, 7)) {
+                *out++ = 0x80 | (dg + 32);
+                *out++ = ((dr_dg + 8) << 4) | (db_dg + 8);
+            } else {
+                *out++ = 0xFE;
+                *out++ = (px >> 16) & 0xFF;
+                *out++ = (px >> 8) & 0xFF;
+                *out++ = px & 0xFF;
+            }
+        } else {
+            *out++ = 0xFF;
+            *out++ = (px >> 16) & 0xFF;
+            *out++ = (px >> 8) & 0xFF;
+            *out++ = px & 0xFF;
+            *out++ = px >> 24;
+        }
+        enc->index[hash] = px;
+        enc->prev = px;
+    }
+    return out - start;
+}
+
+Bool stream_write(XImage const* im, enum ImageType type, struct IOCtx const* ioctx) {
+    assert(im->bits_per_pixel == 32);
+    struct IOCtxWriteCtx ioctx_write_ctx;
+    if (!ioctx_write_begin(&ioctx_write_ctx, ioctx)) {
+        return False;
+    }
+    u32 const w = im->width;
+    u32 const h = im->height;
+
+    u8 header[128];
+    i32 header_len = 0;
+    switch (type) {
+        case IMT_Ff: {
+            memcpy(header, "farbfeld", 8);
+            png_put_be32(header + 8, w);
+            png_put_be32(header + 12, h);
+            header_len = 16;
+        } break;
+        case IMT_Ppm: header_len = snprintf((char*)header, sizeof(header), "P6\n%u %u\n255\n", w, h); break;
+        case IMT_Pam: {
+            header_len = snprintf(
+                (char*)header,
+                sizeof(header),
+                "P7\nWIDTH %u\nHEIGHT %u\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                w,
+                h
+            );
+        } break;
+        case IMT_Qoi: {
+            memcpy(header, "qoif", 4);
+            png_put_be32(header + 4, w);
+            png_put_be32(header + 8, h);
+            header[12] = 4;  // rgba
+            header[13] = 0;  // srgb with linear alpha
+            header_len = 14;
+        } break;
+        default: UNREACHABLE();
+    }
+    ioctx_write_part(&ioctx_write_ctx, header, header_len);
+
+    // encoded row, qoi needs at most 5 bytes per pixel
+    u8* row_dyn = ecalloc(w, 8);
+    struct QoiEnc qoi = {.prev = ARGB_ALPHA};
+    for (u32 y = 0; y < h; ++y) {
+        argb const* px = (argb const*)(im->data + ((usize)y * im->bytes_per_line));
+        u8* out = row_dyn;
+        switch (type) {
+            case IMT_Ff: {
+                for (u32 x = 0; x < w; ++x, out += 8) {
+                    // 8 bit value v is 16 bit v * 257
+                    out[0] = out[1] = (px[x] >> 16) & 0xFF;
+                    out[2] = out[3] = (px[x] >> 8) & 0xFF;
+                    out[4] = out[5] = px[x] & 0xFF;
+                    out[6] = out[7] = px[x] >> 24;
+                }
+            } break;
+            case IMT_Ppm: {
+                for (u32 x = 0; x < w; ++x, out += 3) {
+                    out[0] = (px[x] >> 16) & 0xFF;
+                    out[1] = (px[x] >> 8) & 0xFF;
+                    out[2] = px[x] & 0xFF;
+                }
+            } break;
+            case IMT_Pam: {
+                for (u32 x = 0; x < w; ++x, out += 4) {
+                    out[0] = (px[x] >> 16) & 0xFF;
+                    out[1] = (px[x] >> 8) & 0xFF;
+                    out[2] = px[x] & 0xFF;
+                    out[3] = px[x] >> 24;
+                }
+            } break;
+            case IMT_Qoi: out += qoi_encode_row(&qoi, px, w, out); break;
+            default: UNREACHABLE();
+        }
+        ioctx_write_part(&ioctx_write_ctx, row_dyn, (i32)(out - row_dyn));
+    }
+    free(row_dyn);
+
+    if (type == IMT_Qoi) {
+        u8 tail[9] = {0, 0, 0, 0, 0, 0, 0, 1};
+        u32 tail_len = 8;
+        if (qoi.run) {
+            memmove(tail + 1, tail, 8);
+            tail[0] = 0xC0 | (qoi.run - 1);
+            tail_len = 9;
+        }
+        ioctx_write_part(&ioctx_write_ctx, tail, (i32)tail_len);
+    }
+    return ioctx_write_end(&ioctx_write_ctx, True);
+}
+
+Bool xpr_write(XImage const* im, struct IOCtx const* ioctx) {
+    assert(im->bits_per_pixel == 32);
+    struct IOCtxWriteCtx ioctx_write_ctx;
+    if (!ioctx_write_begin(&ioctx_write_ctx, ioctx)) {
+        return False;
+    }
+    struct XprHeader hdr = {
+        .byte_order = XPR_BYTE_ORDER,
+        .width = im->width,
+        .height = im->height,
+        .stride = im->width * sizeof(argb),
+        .data_offset = XPR_DATA_OFFSET,
+    };
+    memcpy(hdr.magic, XPR_MAGIC, sizeof(hdr.magic));
+    // header padded to data offset
+    u8* head_dyn = ecalloc(XPR_DATA_OFFSET, sizeof(u8));
+    memcpy(head_dyn, &hdr, sizeof(hdr));
+    ioctx_write_part(&ioctx_write_ctx, head_dyn, XPR_DATA_OFFSET);
+    free(head_dyn);
+
+    for (i32 y = 0; y < im->height; ++y) {
+        ioctx_write_part(&ioctx_write_ctx, im->data + ((usize)y * im->bytes_per_line), (i32)hdr.stride);
+    }
+    return ioctx_write_end(&ioctx_write_ctx, True);
+}
+
+Bool write_io(XImage const* im, enum ImageType type, i32 png_level, i32 jpg_quality, struct IOCtx const* ioctx) {
+    if (type == IMT_Unknown) {
+        return False;
+    }
+    switch (type) {
+        case IMT_Xpr: return xpr_write(im, ioctx);  // no conversion needed
+        case IMT_Ff:
+        case IMT_Ppm:
+        case IMT_Pam:
+        case IMT_Qoi: return stream_write(im, type, ioctx);
+        default: break;
+    }
+    Bool result = False;
+
+    i32 w = im->width;
+    i32 h = im->height;
+    u8* rgba_dyn = ximage_to_rgb(im, True);
+    if (!rgba_dyn) {
+        return False;
+    }
+
+    // FIXME ask before override?
+    struct IOCtxWriteCtx ioctx_write_ctx;
+    if (!ioctx_write_begin(&ioctx_write_ctx, ioctx)) {
+        free(rgba_dyn);
+        return False;
+    }
+
+    switch (type) {
+        case IMT_Png: {
+            result = png_write_parallel(
+                &ioctx_write_part,
+                (void*)&ioctx_write_ctx,
+                rgba_dyn,
+                (Pt) {w, h},
+                png_level
+            );
+        } break;
+        case IMT_Jpg: {
+            result = stbi_write_jpg_to_func(&ioctx_write_part, (void*)&ioctx_write_ctx, w, h, 4, rgba_dyn, jpg_quality);
+        } break;
+        default: UNREACHABLE();
+    }
+    free(rgba_dyn);
+    return ioctx_write_end(&ioctx_write_ctx, result);
+}
+
+Bool save_start(struct Ctx* ctx, struct IOCtx const* ioctx, enum ImageType type) {
+    if (ctx->fullres.pending || ctx->fullres.ready) {
+        // preview would overwrite full image
+        show_message(ctx, "can't save: full resolution image is still loading");
+        return False;
+    }
+    XImage const* cv = ctx->dc.cv.im;
+    struct SaveJob* job = ecalloc(1, sizeof(struct SaveJob));
+    *job = (struct SaveJob) {
+        .loop = &ctx->loop,
+        .snapshot = *cv,
+        .type = type,
+        .png_compression_level = ctx->input.png_compression_level,
+        .jpg_quality_level = ctx->input.jpg_quality_level,
+        .ioctx = ioctx_copy(ioctx),
+    };
+    // XGetPixel only needs image format, so copied struct with own data works without X server
+    job->snapshot.data = ecalloc(cv->height, cv->bytes_per_line);
+    memcpy(job->snapshot.data, cv->data, (usize)cv->bytes_per_line * cv->height);
+
+    arrpush(ctx->saves.queue_arr, job);
+    if (arrlen(ctx->saves.queue_arr) == 1) {
+        save_run(job);
+    }
+
+    char* save_msg = str_new("saving image to '%s'", ioctx_as_str(ioctx));
+    show_message(ctx, save_msg);
+    str_free(&save_msg);
+    return True;
+}
+
+void save_run(struct SaveJob* job) {
+    pthread_t tid = 0;
+    if (pthread_create(&tid, NULL, &save_worker, job) == 0) {
+        pthread_detach(tid);
+    } else {
+        save_worker(job);  // completion is still posted
+    }
+}
+
+void* save_worker(void* arg) {
+    struct SaveJob* job = (struct SaveJob*)arg;
+    job->result =
+        write_io(&job->snapshot, job->type, job->png_compression_level, job->jpg_quality_level, &job->ioctx);
+    loop_post(job->loop, &save_done, job);
+    return NULL;
+}
+
+void save_done(struct Ctx* ctx, void* data) {
+    struct Saves* saves = &ctx->saves;
+    struct SaveJob* job = (struct SaveJob*)data;
+    assert(arrlen(saves->queue_arr) && saves->queue_arr[0] == job);
+
+    char* msg = str_new(job->result ? "image saved to '%s'" : "failed save image to '%s'", ioctx_as_str(&job->ioctx));
+    if (saves->exiting) {
+        trace("xpaint: %s", msg);
+    } else {
+        show_message(ctx, msg);
+    }
+    str_free(&msg);
+    saves->exit_when_done &= job->result;
+
+    arrdel(saves->queue_arr, 0);
+    free(job->snapshot.data);
+    ioctx_free(&job->ioctx);
+    free(job);
+
+    if (arrlen(saves->queue_arr)) {
+        save_run(saves->queue_arr[0]);
+    }
+}
+
+void fullres_start(struct Ctx* ctx, struct FullResJob* job) {
+    if (!job) {
+        return;
+    }
+    job->loop = &ctx->loop;
+    job->hist_version = ctx->hist_version;
+    ctx->fullres.pending = job;
+    ++ctx->fullres.running;
+
+    pthread_t tid = 0;
+    if (pthread_create(&tid, NULL, &fullres_worker, job) == 0) {
+        pthread_detach(tid);
+    } else {
+        fullres_worker(job);  // completion is still posted
+    }
+}
+
+void* fullres_worker(void* arg) {
+    struct FullResJob* job = (struct FullResJob*)arg;
+    job->pixels_dyn = image_decode(job->input.data, job->input.len, 0, &job->dims);
+    loop_post(job->loop, &fullres_done, job);
+    return NULL;
+}
+
+void fullres_done(struct Ctx* ctx, void* data) {
+    struct FullResJob* job = (struct FullResJob*)data;
+    assert(ctx->fullres.running);
+    --ctx->fullres.running;
+
+    if (job != ctx->fullres.pending) {
+        fullres_free(job);
+        return;
+    }
+    ctx->fullres.pending = NULL;
+    if (!job->pixels_dyn) {
+        show_message(ctx, "failed to load full resolution image, preview kept");
+        fullres_free(job);
+        return;
+    }
+    ctx->fullres.ready = job;
+    fullres_apply_ready(ctx);
+}
+
+void fullres_apply_ready(struct Ctx* ctx) {
+    struct FullResJob* job = ctx->fullres.ready;
+    struct Input const* inp = &ctx->input;
+    // overlay and pointer positions of unfinished action belong to preview
+    if (!job || inp->c.state != CS_None || inp->mode.t == InputT_Transform || inp->mode.t == InputT_Text) {
+        return;
+    }
+    ctx->fullres.ready = NULL;
+
+    if (job->hist_version != ctx->hist_version) {
+        show_message(ctx, "preview was edited, full resolution image dropped");
+    } else {
+        struct Image image = {
+            .im = ximage_from_argb(&ctx->dc, job->pixels_dyn, job->dims),
+            .type = IMT_Jpg,
+        };
+        job->pixels_dyn = NULL;  // owned by image
+        canvas_load(ctx, &image);
+        // keep size on screen
+        struct DrawCtx* dc = &ctx->dc;
+        i32 const zoom_delta = -(i32)lround(job->scale_shift * log(2.0) / log(CANVAS_ZOOM_SPEED));
+        canvas_change_zoom(dc, (Pt) {(i32)dc->cv.scroll.x, (i32)dc->cv.scroll.y}, zoom_delta);
+        update_screen(ctx, PNIL, True);
+        show_message(ctx, "full resolution image loaded");
+    }
+    fullres_free(job);
+}
+
+void fullres_free(struct FullResJob* job) {
+    io_data_free(&job->input);
+    free(job->pixels_dyn);
+    free(job);
+}
+
+void workers_wait(struct Ctx* ctx) {
+    ctx->saves.exiting = True;
+    ctx->fullres.pending = NULL;
+    if (ctx->fullres.ready) {
+        fullres_free(ctx->fullres.ready);
+        ctx->fullres.ready = NULL;
+    }
+    if (arrlen(ctx->saves.queue_arr)) {
+        trace("xpaint: waiting for %u pending saves", (u32)arrlen(ctx->saves.queue_arr));
+    }
+    while (arrlen(ctx->saves.queue_arr) || ctx->fullres.running || ctx->sel_buf.encoding) {
+        struct pollfd wake = {.fd = ctx->loop.wake_fd, .events = POLLIN};
+        if (poll(&wake, 1, -1) == -1 && errno != EINTR) {
+            die("poll failed: %s", strerror(errno));
+        }
+        u64 count = 0;
+        ssize_t const read_res = read(ctx->loop.wake_fd, &count, sizeof(count));
+        (void)read_res;
+        loop_handle_posted(ctx);
+    }
+}
+
+void image_free(struct Image* im) {
+    if (im->im) {
+        XDestroyImage(im->im);
+    }
+    *im = (struct Image) {0};
+}
+
+ClCPrcResult cl_cmd_process(struct Ctx* ctx, struct ClCommand const* cl_cmd) {
+    assert(cl_cmd);
+    char* msg_to_show = NULL;  // counts as PCCR_Msg at func end
+    ClCPrcFlags result = 0;
+
+    switch (cl_cmd->t) {
+        case ClC_Set: {
+            switch (cl_cmd->d.set.t) {
+                case ClCDS_LineW: {
+                    CURR_TC(ctx).line_w = cl_cmd->d.set.d.line_w.value;
+                } break;
+                case ClCDS_Col: {
+                    *tc_curr_col(&CURR_TC(ctx)) = cl_cmd->d.set.d.col.v;
+                } break;
+                case ClCDS_UiFont: {
+                    char const* font = cl_cmd->d.set.d.ui_font.name_dyn;
+                    if (!xft_font_set(&ctx->dc, font, &ctx->dc.fnt)) {
+                        msg_to_show = str_new("invalid font name: '%s'", font);
+                    }
+                } break;
+                case ClCDS_TextFont: {
+                    char const* font = cl_cmd->d.set.d.text_font.name_dyn;
+                    if (!xft_font_set(&ctx->dc, font, &CURR_TC(ctx).text_font)) {
+                        msg_to_show = str_new("invalid font name: '%s'", font);
+                    }
+                } break;
+                case ClCDS_Inp: {
+                    char const* path = cl_cmd->d.set.d.inp.path_dyn;
+                    ioctx_set(&ctx->inp, path);
+                    msg_to_show = str_new("inp set to '%s'", ioctx_as_str(&ctx->inp));
+                } break;
+                case ClCDS_Out: {
+                    char const* path = cl_cmd->d.set.d.out.path_dyn;
+                    ioctx_set(&ctx->out, path);
+                    msg_to_show = str_new("out set to '%s'", ioctx_as_str(&ctx->out));
+                } break;
+                case ClCDS_PngCompression: {
+                    ctx->input.png_compression_level = cl_cmd->d.set.d.png_cpr.compression;
+                } break;
+                case ClCDS_JpgQuality: {
+                    ctx->input.jpg_quality_level = cl_cmd->d.set.d.jpg_qlt.quality;
+                } break;
+                case ClCDS_Spacing: {
+                    if (CURR_TC(ctx).t == Tool_Drawer) {
+                        if (cl_cmd->d.set.d.spacing.val >= 0.0) {
+                            CURR_TC(ctx).d.drawer.spacing = cl_cmd->d.set.d.spacing.val;
+                        } else {
+                            msg_to_show = str_new("spacing must be >= 0.0");
+                        }
+                    } else {
+                        msg_to_show = str_new("wrong tool to set spacing");
+                    }
+                } break;
+                case ClCDS_Hardness: {
+                    if (CURR_TC(ctx).t == Tool_Drawer) {
+                        if (BETWEEN(cl_cmd->d.set.d.hardness.val, 0.0, 1.0)) {
+                            CURR_TC(ctx).d.drawer.hardness = cl_cmd->d.set.d.hardness.val;
+                        } else {
+                            msg_to_show = str_new("hardness must be in [0.0 .. 1.0]");
+                        }
+                    } else {
+                        msg_to_show = str_new("wrong tool to set hardness");
+                    }
+                } break;
+                case ClCDS_Renderer: {
+                    ctx->dc.renderer = cl_cmd->d.set.d.renderer.val;
+                    update_screen(ctx, PNIL, True);
+                    msg_to_show = str_new("renderer set to '%s'", renderer_to_string(ctx->dc.renderer));
+                } break;
+                case ClCDSTag_Invalid:
+                case ClCDSTag_Count: assert(!"invalid tag");
+            }
+        } break;
+        case ClC_Echo: {
+            msg_to_show = str_new("%s", cl_cmd->d.echo.msg_dyn);
+        } break;
+        case ClC_Exit: {
+            result |= ClCPrc_Exit;
+        } break;
+        case ClC_W:
+        case ClC_WQ: {
+            if (ctx->out.t != IO_None) {
+                // same as loaded file, so working files stay xpr
+                enum ImageType const type = ctx->dc.cv.type == IMT_Unknown ? IMT_Png : ctx->dc.cv.type;
+                // exits after all pending saves are done
+                if (save_start(ctx, &ctx->out, type)) {
+                    ctx->saves.exit_when_done |= cl_cmd->t == ClC_WQ;
+                }
+            } else {
+                msg_to_show =
+                    str_new("can't save: no path provided (use '%s' command to pass path)", cl_cmd_to_string(ClC_Save));
+            }
+        } break;
+        case ClC_Save: {
+            if (!cl_cmd->d.save.path_dyn && ctx->out.t == IO_None) {
+                msg_to_show = str_new("can't save: no path provided");
+            } else {
+                struct IOCtx ioctx =
+                    cl_cmd->d.save.path_dyn ? ioctx_new(cl_cmd->d.save.path_dyn) : ioctx_copy(&ctx->out);
+                save_start(ctx, &ioctx, cl_save_type_to_image_type(cl_cmd->d.save.im_type));
+                ioctx_free(&ioctx);
+            }
+        } break;
+        case ClC_Load: {
+            struct IOCtx ioctx = cl_cmd->d.load.path_dyn ? ioctx_new(cl_cmd->d.load.path_dyn) : ioctx_copy(&ctx->inp);
+            struct FullResJob* fullres = NULL;
+            Pt const wnd = {(i32)ctx->dc.width, (i32)ctx->dc.height};
+            struct Image im = read_image_io_scaled(&ctx->dc, &ioctx, cl_cmd->d.load.scale_shift, wnd, &fullres);
+
+            XImage* old_cv = ctx->dc.cv.im;
+            Rect old_cv_rect = (Rect) {0, 0, old_cv->width, old_cv->height};
+            struct HistItem to_push = history_new_as_damage(old_cv, old_cv_rect);
+
+            if (canvas_load(ctx, &im)) {
+                history_forward(ctx, to_push);
+                fullres_start(ctx, fullres);
+                msg_to_show = fullres
+                    ? str_new("preview loaded from '%s', decoding full image", ioctx_as_str(&ioctx))
+                    : str_new("image_loaded from '%s'", ioctx_as_str(&ioctx));
+            } else {
+                image_free(&im);
+                history_free(&to_push);
+                if (fullres) {
+                    fullres_free(fullres);
+                }
+                msg_to_show = str_new("failed load image from '%s'", ioctx_as_str(&ioctx));
+            }
+            ioctx_free(&ioctx);
+        } break;
+        case ClCTag_Invalid:
+        case ClCTag_Count: assert(!"invalid enum value");
+    }
+    result |= msg_to_show ? ClCPrc_Msg : 0;
+    return (ClCPrcResult) {.flags = result, .msg_dyn = msg_to_show};
+}
+
+static ClCPrsResult cl_cmd_parse_helper(__attribute__((unused)) struct Ctx* ctx, char* cl) {
+    char const* cmd = strtok(cl, CL_DELIM);
+    if (!cmd) {
+        return cl_prs_noarg(str_new("command"), NULL);
+    }
+
+    switch (cl_cmd_from_string(cmd)) {
+        case ClC_Echo: {
+            char const* user_msg = strtok(NULL, "");
+            return (ClCPrsResult
+            ) {.t = ClCPrs_Ok, .d.ok.t = ClC_Echo, .d.ok.d.echo.msg_dyn = str_new("%s", COALESCE(user_msg, ""))};
+        }
+        case ClC_Set: {
+            char const* prop = strtok(NULL, CL_DELIM);
+            if (!prop) {
+                return cl_prs_noarg(str_new("prop to set"), NULL);
+            }
+            switch (cl_set_prop_from_string(prop)) {
+                case ClCDS_LineW: {
+                    static const u32 MIN_LW = 1;
+                    static const u32 MAX_LW = 5000;  // extremely large values may lag
+
+                    char const* arg = strtok(NULL, "");
+                    if (!arg) {
+                        return cl_prs_noarg(str_new("line width"), NULL);
+                    }
+                    u32 const line_w = strtol(arg, NULL, 0);
+                    if (!BETWEEN(line_w, MIN_LW, MAX_LW)) {
+                        return cl_prs_invarg(
+                            str_new("%s", arg),
+                            str_new("value must be in [%d .. %d]", MIN_LW, MAX_LW),
+                            NULL
+                        );
+                    }
+                    return (ClCPrsResult) {
+                        .t = ClCPrs_Ok,
+                        .d.ok.t = ClC_Set,
+                        .d.ok.d.set.t = ClCDS_LineW,
+                        .d.ok.d.set.d.line_w.value = line_w,
+                    };
+                }
+                case ClCDS_Col: {
+                    char* arg = strtok(NULL, CL_DELIM);
+                    argb value = 0;
+                    if (!arg) {
+                        return cl_prs_noarg(str_new("hex color"), str_new("%s", cl_set_prop_to_string(ClCDS_Col)));
+                    }
+                    if (!argb_from_hex_col(arg, &value)) {
+                        return cl_prs_invarg(
+                            str_new("%s", arg),
+                            str_new("failed to parse hex color"),
+                            str_new("%s", cl_set_prop_to_string(ClCDS_Col))
+                        );
+                    }
+                    return (ClCPrsResult
+                    ) {.t = ClCPrs_Ok, .d.ok.t = ClC_Set, .d.ok.d.set.t = ClCDS_Col, .d.ok.d.set.d.col.v = value};
+                }
+                case ClCDS_UiFont: {
+                    char const* font = strtok(NULL, "");  // font with spaces
+                    if (!font) {
+                        return cl_prs_noarg(str_new("ui font"), NULL);
+                    }
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_UiFont,
+                                           .d.ok.d.set.d.ui_font.name_dyn = font ? str_new("%s", font) : NULL};
+                }
+                case ClCDS_TextFont: {
+                    char const* font = strtok(NULL, "");  // font with spaces
+                    if (!font) {
+                        return cl_prs_noarg(str_new("text tool font"), NULL);
+                    }
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_TextFont,
+                                           .d.ok.d.set.d.text_font.name_dyn = font ? str_new("%s", font) : NULL};
+                }
+                case ClCDS_Inp: {
+                    char const* path = strtok(NULL, "");  // user can load NULL
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_Inp,
+                                           .d.ok.d.set.d.inp.path_dyn = path ? str_new("%s", path) : NULL};
+                }
+                case ClCDS_Out: {
+                    char const* path = strtok(NULL, "");  // user can load NULL
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_Out,
+                                           .d.ok.d.set.d.out.path_dyn = path ? str_new("%s", path) : NULL};
+                }
+                case ClCDS_PngCompression: {
+                    char const* compression = strtok(NULL, "");
+                    if (!compression) {
+                        return cl_prs_noarg(str_new("compression value"), NULL);
+                    }
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_PngCompression,
+                                           .d.ok.d.set.d.png_cpr.compression = (i32)strtol(compression, NULL, 0)};
+                }
+                case ClCDS_JpgQuality: {
+                    char const* quality = strtok(NULL, "");
+                    if (!quality) {
+                        return cl_prs_noarg(str_new("image quality"), NULL);
+                    }
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_JpgQuality,
+                                           .d.ok.d.set.d.jpg_qlt.quality = (i32)strtol(quality, NULL, 0)};
+                }
+                case ClCDS_Spacing: {
+                    char const* spacing = strtok(NULL, "");
+                    if (!spacing) {
+                        return cl_prs_noarg(str_new("spacing"), NULL);
+                    }
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_Spacing,
+                                           .d.ok.d.set.d.spacing.val = strtof(spacing, NULL)};
+                }
+                case ClCDS_Hardness: {
+                    char const* hardness = strtok(NULL, "");
+                    if (!hardness) {
+                        return cl_prs_noarg(str_new("hardness"), NULL);
+                    }
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_Hardness,
+                                           .d.ok.d.set.d.hardness.val = strtof(hardness, NULL)};
+                }
+                case ClCDS_Renderer: {
+                    char const* renderer = strtok(NULL, "");
+                    if (!renderer) {
+                        return cl_prs_noarg(str_new("renderer name"), NULL);
+                    }
+                    enum Renderer val = Renderer_XRender;
+                    if (strcmp(renderer, renderer_to_string(Renderer_Client)) == 0) {
+                        val = Renderer_Client;
+                    } else if (strcmp(renderer, renderer_to_string(Renderer_XRender)) != 0) {
+                        return cl_prs_invarg(
+                            str_new("%s", renderer),
+                            str_new("unknown renderer"),
+                            str_new("%s", cl_set_prop_to_string(ClCDS_Renderer))
+                        );
+                    }
+                    return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                           .d.ok.t = ClC_Set,
+                                           .d.ok.d.set.t = ClCDS_Renderer,
+                                           .d.ok.d.set.d.renderer.val = val};
+                }
+                case ClCDSTag_Invalid:
+                case ClCDSTag_Count:
+                    return cl_prs_invarg(
+                        str_new("%s", prop),
+                        str_new("unknown prop"),
+                        str_new("%s", cl_cmd_to_string(ClC_Set))
+                    );
+            }
+            UNREACHABLE();
+        }
+        case ClC_Exit: {
+            return (ClCPrsResult) {.t = ClCPrs_Ok, .d.ok.t = ClC_Exit};
+        }
+        case ClC_Save: {
+            char const* type_str = strtok(NULL, CL_DELIM);
+            if (!type_str) {
+                return cl_prs_noarg(str_new("file type"), NULL);
+            }
+            enum ClCDSv type = cl_save_type_from_string(type_str);
+            if (type == ClCDSv_Invalid || type == ClCDSv_Count) {
+                return cl_prs_invarg(str_new("%s", type_str), str_new("unknown type"), NULL);
+            }
+            char const* path = strtok(NULL, "");  // path with spaces
+            return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                   .d.ok.t = ClC_Save,
+                                   .d.ok.d.save.im_type = type,
+                                   .d.ok.d.save.path_dyn = path ? str_new("%s", path) : NULL};
+        }
+        case ClC_W: {
+            return (ClCPrsResult) {.t = ClCPrs_Ok, .d.ok.t = ClC_W};
+        }
+        case ClC_WQ: {
+            return (ClCPrsResult) {.t = ClCPrs_Ok, .d.ok.t = ClC_WQ};
+        }
+        case ClC_Load: {
+            char* path = strtok(NULL, "");  // path with spaces
+            i32 scale_shift = NIL;
+            if (path && strncmp(path, "--scale", 7) == 0 && (path[7] == '\0' || path[7] == ' ')) {
+                strtok(path, CL_DELIM);  // option itself
+                char const* scale = strtok(NULL, CL_DELIM);
+                if (!scale) {
+                    return cl_prs_noarg(str_new("scale"), str_new("%s", cl_cmd_to_string(ClC_Load)));
+                }
+                u32 denom = 0;
+                char tail = '\0';
+                if (sscanf(scale, "1/%u%c", &denom, &tail) != 1 || denom == 0 || denom > 8 || (denom & (denom - 1))) {
+                    return cl_prs_invarg(
+                        str_new("%s", scale),
+                        str_new("expected 1/1, 1/2, 1/4 or 1/8"),
+                        str_new("%s", cl_cmd_to_string(ClC_Load))
+                    );
+                }
+                for (scale_shift = 0; (1u << scale_shift) < denom; ++scale_shift) {}
+                path = strtok(NULL, "");
+            }
+            return (ClCPrsResult) {.t = ClCPrs_Ok,
+                                   .d.ok.t = ClC_Load,
+                                   .d.ok.d.load.path_dyn = path ? str_new("%s", path) : NULL,
+                                   .d.ok.d.load.scale_shift = scale_shift};
+        }
+        case ClCTag_Invalid:
+        case ClCTag_Count: return cl_prs_invarg(str_new("%s", cmd), str_new("unknown command"), NULL);
+    }
+
+    UNREACHABLE();
+}
+
+ClCPrsResult cl_cmd_parse(struct Ctx* ctx, char const* cl) {
+    assert(cl);
+    char* cl_bufdyn = str_new("%s", cl);
+    ClCPrsResult result = cl_cmd_parse_helper(ctx, cl_bufdyn);
+    str_free(&cl_bufdyn);
+    return result;
+}
+
+ClCPrsResult cl_prs_noarg(char* arg_desc_dyn, char* context_optdyn) {
+    return (ClCPrsResult
+    ) {.t = ClCPrs_ENoArg, .d.noarg.arg_desc_dyn = arg_desc_dyn, .d.noarg.context_optdyn = context_optdyn};
+}
+
+ClCPrsResult cl_prs_invarg(char* arg_dyn, char* error_dyn, char* context_optdyn) {
+    return (ClCPrsResult) {.t = ClCPrs_EInvArg,
+                           .d.invarg.arg_dyn = arg_dyn,
+                           .d.invarg.error_dyn = error_dyn,
+                           .d.invarg.context_optdyn = context_optdyn};
+}
+
+void cl_cmd_parse_res_free(ClCPrsResult* res) {
+    switch (res->t) {
+        case ClCPrs_Ok: {
+            struct ClCommand* cl_cmd = &res->d.ok;
+            switch (cl_cmd->t) {
+                case ClC_Set:
+                    switch (cl_cmd->d.set.t) {
+                        case ClCDS_UiFont: free(cl_cmd->d.set.d.ui_font.name_dyn); break;
+                        case ClCDS_TextFont: free(cl_cmd->d.set.d.text_font.name_dyn); break;
+                        case ClCDS_Inp: free(cl_cmd->d.set.d.inp.path_dyn); break;
+                        case ClCDS_Out: free(cl_cmd->d.set.d.out.path_dyn); break;
+                        case ClCDS_LineW:
+                        case ClCDS_Col:
+                        case ClCDS_PngCompression:
+                        case ClCDS_JpgQuality:
+                        case ClCDS_Spacing:
+                        case ClCDS_Hardness:
+                        case ClCDS_Renderer:
+                        case ClCDSTag_Invalid:
+                        case ClCDSTag_Count: break;  // no default branch to enable warnings
+                    }
+                    break;
+                case ClC_Save: free(cl_cmd->d.save.path_dyn); break;
+                case ClC_Load: free(cl_cmd->d.load.path_dyn); break;
+                case ClC_Echo: free(cl_cmd->d.echo.msg_dyn); break;
+                case ClC_W:
+                case ClC_WQ:
+                case ClC_Exit: break;
+                case ClCTag_Invalid:
+                case ClCTag_Count: assert(!"invalid enum value");  // no default branch to enable warnings
+            }
+        } break;
+        case ClCPrs_EInvArg: {
+            str_free(&res->d.invarg.arg_dyn);
+            str_free(&res->d.invarg.error_dyn);
+            str_free(&res->d.invarg.context_optdyn);
+        } break;
+        case ClCPrs_ENoArg: {
+            str_free(&res->d.noarg.arg_desc_dyn);
+            str_free(&res->d.noarg.context_optdyn);
+        } break;
+    }
+}
+
+char* cl_cmd_get_str_dyn(struct InputConsoleData const* d_cl) {
+    usize const cmd_len = arrlen(d_cl->cmdarr);
+    char* cmd_dyn = ecalloc(cmd_len + 1, sizeof(char));
+    memcpy(cmd_dyn, d_cl->cmdarr, cmd_len);
+    cmd_dyn[cmd_len] = '\0';
+    return cmd_dyn;
+}
+
+char const* cl_cmd_descr(enum ClCTag t) {
+    switch (t) {
+        case ClC_Echo: return "print message";
+        case ClC_Set: return "set property value";
+        case ClC_Exit: return "exit program";
+        case ClC_Save: return "save changes to provided file";
+        case ClC_W: return "save changes";
+        case ClC_WQ: return "save changes and exit program";
+        case ClC_Load: return "load file to canvas";
+        case ClCTag_Invalid:
+        case ClCTag_Count: break;
+    }
+    UNREACHABLE();
+}
+
+char const* cl_set_prop_descr(enum ClCDSTag t) {
+    switch (t) {
+        case ClCDS_LineW: return "line width";
+        case ClCDS_Col: return "tool color";
+        case ClCDS_UiFont: return "interface font";
+        case ClCDS_TextFont: return "text tool font";
+        case ClCDS_Inp: return "input file";
+        case ClCDS_Out: return "output file";
+        case ClCDS_PngCompression: return "png file compression level";
+        case ClCDS_JpgQuality: return "jpeg quality level";
+        case ClCDS_Spacing: return "brush tool spacing";  //   FIXME change brush to something?
+        case ClCDS_Hardness: return "brush tool hardness";  // because all drawers use this properties
+        case ClCDS_Renderer: return "canvas renderer (xrender or client)";
+        case ClCDSTag_Invalid:
+        case ClCDSTag_Count: break;
+    }
+    UNREACHABLE();
+}
+
+enum ImageType cl_save_type_to_image_type(enum ClCDSv t) {
+    switch (t) {
+        case ClCDSv_Png: return IMT_Png;
+        case ClCDSv_Jpg: return IMT_Jpg;
+        case ClCDSv_Xpr: return IMT_Xpr;
+        case ClCDSv_Ff: return IMT_Ff;
+        case ClCDSv_Ppm: return IMT_Ppm;
+        case ClCDSv_Pam: return IMT_Pam;
+        case ClCDSv_Qoi: return IMT_Qoi;
+        case ClCDSv_Invalid:
+        case ClCDSv_Count: UNREACHABLE();
+    }
+    UNREACHABLE();
+}
+
+static void for_each_enum(
+    i32 enum_last,
+    char const* (*enum_to_str)(i32),
+    void (*callback)(i32 tag, char const* enum_str, void* data_in_out),
+    void* data_in_out
+) {
+    for (i32 e = 0; e < enum_last; ++e) {
+        char const* enum_str = enum_to_str(e);
+        callback(e, enum_str, data_in_out);
+    }
+}
+
+struct CompletionCallbackData {
+    struct ComplsItem** result;
+    char const* token;
+    Bool add_delim;
+    char const* (*get_descr_opt)(i32 tag);
+};
+
+static void completion_callback(i32 tag, char const* enum_str, void* user_data) {
+    struct CompletionCallbackData* ctx = user_data;
+    usize const token_len = strlen(ctx->token);
+    usize const offset = first_dismatch(enum_str, ctx->token);
+    if (offset == token_len && (offset <= strlen(enum_str))) {
+        char const* prefix = ctx->add_delim && (token_len == 0) ? CL_DELIM : "";
+        struct ComplsItem complt = {
+            .val_dyn = str_new("%s%s", prefix, enum_str + offset),
+            .descr_optdyn = ctx->get_descr_opt ? str_new("%s", ctx->get_descr_opt(tag)) : NULL,
+        };
+        arrpush(*ctx->result, complt);
+    }
+}
+
+static void cl_compls_update_helper(
+    struct ComplsItem** result_out,
+    char const* token,
+    char const* (*enum_to_str)(i32),
+    char const* (*get_descr)(i32),
+    i32 enum_last,
+    Bool add_delim
+) {
+    if (!token || !enum_to_str || !result_out) {
+        return;
+    }
+
+    struct CompletionCallbackData ctx = {result_out, token, add_delim, get_descr};
+    for_each_enum(enum_last, enum_to_str, completion_callback, &ctx);
+}
+
+struct TokenCheckCallbackData {
+    char const* token;
+    Bool found;
+};
+
+static void check_token_callback(__attribute__((unused)) i32 tag, char const* enum_str, void* user_data) {
+    struct TokenCheckCallbackData* ctx = user_data;
+    if (!strcmp(ctx->token, enum_str)) {
+        ctx->found = True;
+    }
+}
+
+static Bool is_valid_token(char const* token, char const* (*enum_to_str)(i32), i32 enum_last) {
+    struct TokenCheckCallbackData ctx = {token, False};
+    for_each_enum(enum_last, enum_to_str, check_token_callback, &ctx);
+    return ctx.found;
+}
+
+static char* get_dir_part(char const* path) {
+    if (!path) {
+        return NULL;
+    }
+
+    char* last_slash = strrchr(path, '/');
+    if (!last_slash) {
+        return str_new(".");
+    }
+
+    if (last_slash == path) {
+        return str_new("/");
+    }
+
+    size_t dir_len = last_slash - path;
+    char* dir = ecalloc(dir_len + 1, sizeof(char));
+    strncpy(dir, path, dir_len);
+    return dir;
+}
+
+static char const* get_base_part(char const* path) {
+    if (!path) {
+        return "";
+    }
+
+    char const* last_slash = strrchr(path, '/');
+    if (!last_slash) {
+        return path;
+    }
+
+    return last_slash + 1;
+}
+
+static void cl_compls_update_dirs(struct ComplsItem** result, char const* token, Bool only_dirs, Bool add_delim) {
+    if (!token || !result) {
+        return;
+    }
+
+    // Get directory to search in and base name to match against
+    char* dir_part_dyn = get_dir_part(token);
+    char* search_dir_dyn = path_expand_home(dir_part_dyn);
+    free(dir_part_dyn);
+    char const* base_name = get_base_part(token);
+
+    DIR* dir = opendir(search_dir_dyn);
+    if (!dir) {
+        str_free(&search_dir_dyn);
+        return;
+    }
+
+    struct dirent* entry = NULL;
+    while ((entry = readdir(dir))) {
+        struct stat st;
+        char* full_path_dyn = str_new("%s/%s", search_dir_dyn, entry->d_name);
+        if (stat(full_path_dyn, &st) == 0) {
+            if (!only_dirs || S_ISDIR(st.st_mode)) {
+                char const* filename = entry->d_name;
+                if (filename[0] == '.' && (filename[1] == '\0' || (filename[1] == '.' && filename[2] == '\0'))) {
+                    str_free(&full_path_dyn);
+                    continue;  // Skip . and ..
+                }
+
+                usize const base_len = strlen(base_name);
+                usize const offset = first_dismatch(filename, base_name);
+                if (offset == base_len && (offset < strlen(filename))) {
+                    // Only add space prefix if we're starting fresh
+                    char const* prefix = (add_delim && !*token) ? CL_DELIM : "";
+                    char const* suffix = S_ISDIR(st.st_mode) ? "/" : "";
+                    struct ComplsItem complt = {
+                        .val_dyn = str_new("%s%s%s", prefix, filename + offset, suffix),
+                        .descr_optdyn = NULL,
+                    };
+                    arrpush(*result, complt);
+                }
+            }
+        }
+        str_free(&full_path_dyn);
+    }
+    closedir(dir);
+    str_free(&search_dir_dyn);
+}
+
+static void cl_compls_update_fonts(struct ComplsItem** result, char const* token, Bool add_delim) {
+    char** fonts = xft_get_fonts_arr();
+
+    for (i32 i = 0; i < arrlen(fonts); ++i) {
+        usize const offset = first_dismatch(token, fonts[i]);
+        if (offset == strlen(token) && offset < strlen(fonts[i])) {
+            // Only add space prefix if we're starting fresh
+            char const* prefix = (add_delim && !*token) ? CL_DELIM : "";
+            struct ComplsItem complt = {
+                .val_dyn = str_new("%s%s", prefix, fonts[i] + offset),
+                .descr_optdyn = NULL,
+            };
+            arrpush(*result, complt);
+        }
+
+        free(fonts[i]);
+    }
+    arrfree(fonts);
+}
+
+usize cl_compls_new(struct InputConsoleData* cl) {
+    char* cl_buf_dyn = cl_cmd_get_str_dyn(cl);
+    struct ComplsItem* result = NULL;
+
+    usize const cl_buf_len = strlen(cl_buf_dyn);
+    Bool const last_char_is_space = cl_buf_len != 0 && cl_buf_dyn[cl_buf_len - 1] == CL_DELIM[0];
+    // prepend delim to completions if not provided
+    Bool const add_delim = cl_buf_len != 0 && !last_char_is_space;
+
+    // FIXME strtok in if-chain
+    char const* tok1 = strtok(cl_buf_dyn, CL_DELIM);
+    char const* tok2 = strtok(NULL, CL_DELIM);
+    char const* tok3 = strtok(NULL, "");
+    tok1 = COALESCE(tok1, "");  // don't do strtok in macro
+    tok2 = COALESCE(tok2, "");
+    tok3 = COALESCE(tok3, "");
+
+    cl_compls_free(cl);
+
+    typedef char const* (*itos_f)(i32);
+    // subcommands with own completions
+    if (!strcmp(tok1, cl_cmd_to_string(ClC_Set))) {
+        if (!strcmp(tok2, cl_set_prop_to_string(ClCDS_TextFont))
+            || !strcmp(tok2, cl_set_prop_to_string(ClCDS_UiFont))) {
+            cl_compls_update_fonts(&result, tok3, add_delim);
+        } else if (!strcmp(tok3, "")) {
+            cl_compls_update_helper(
+                &result,
+                tok2,
+                (itos_f)&cl_set_prop_to_string,
+                (itos_f)&cl_set_prop_descr,
+                ClCDSTag_Count,
+                add_delim
+            );
+        }
+    } else if (!strcmp(tok1, cl_cmd_to_string(ClC_Save))) {
+        // Check if tok2 is a valid save type
+        if (is_valid_token(tok2, (itos_f)&cl_save_type_to_string, ClCDSv_Count)) {
+            // If we have a valid type, suggest directories
+            cl_compls_update_dirs(&result, tok3, False, add_delim);
+            cl->dont_append_delimeter_after_apply = True;
+        } else {
+            // If tok2 is empty or not a valid type, suggest types
+            cl_compls_update_helper(&result, tok2, (itos_f)&cl_save_type_to_string, NULL, ClCDSv_Count, add_delim);
+        }
+    } else if (!strcmp(tok1, cl_cmd_to_string(ClC_Load))) {
+        // Suggest directories to load
+        cl_compls_update_dirs(&result, tok2, False, add_delim);
+        cl->dont_append_delimeter_after_apply = True;
+    } else if (strlen(tok2) == 0 && !last_char_is_space) {  // first token completion
+        cl_compls_update_helper(
+            &result,
+            tok1,
+            (itos_f)&cl_cmd_to_string,
+            (itos_f)&cl_cmd_descr,
+            ClCTag_Count,
+            add_delim
+        );
+    } else {
+        free(cl_buf_dyn);
+        return 0;
+    }
+
+    free(cl_buf_dyn);
+
+    cl->compls_arr = result;
+
+    return arrlen(cl->compls_arr);
+}
+
+void cl_free(struct InputConsoleData* cl) {
+    arrfree(cl->cmdarr);
+    cl_compls_free(cl);
+}
+
+void cl_compls_free(struct InputConsoleData* cl) {
+    if (cl->compls_arr) {
+        for (u32 i = 0; i < arrlen(cl->compls_arr); ++i) {
+            str_free(&cl->compls_arr[i].val_dyn);
+            str_free(&cl->compls_arr[i].descr_optdyn);
+        }
+        arrfree(cl->compls_arr);
+        cl->compls_arr = NULL;
+        cl->compls_curr = 0;
+    }
+}
+
+void cl_push(struct InputConsoleData* cl, char c) {
+    arrpush(cl->cmdarr, c);
+    cl_compls_free(cl);
+    if (CONSOLE_AUTO_COMPLETIONS) {
+        cl_compls_new(cl);
+    }
+}
+
+Bool cl_pop(struct InputConsoleData* cl, Bool force_no_compls) {
+    if (!cl->cmdarr) {
+        return False;
+    }
+    usize const size = arrlen(cl->cmdarr);
+    if (size) {
+        arrpoputf8(cl->cmdarr);
+    }
+
+    cl_compls_free(cl);
+    if (CONSOLE_AUTO_COMPLETIONS && !force_no_compls) {
+        cl_compls_new(cl);
+    }
+
+    return size != 0;
+}
+
+void input_set_damage(struct Input* inp, Rect damage) {
+    RectSet const set = rectset_from_rect(damage);
+    input_set_damage_rects(inp, &set);
+}
+
+void input_set_damage_rects(struct Input* inp, RectSet const* damage) {
+    if (damage->len) {
+        if (inp->redraw_track[0].len) {
+            inp->redraw_track[1] = inp->redraw_track[0];
+        }
+        inp->redraw_track[0] = *damage;
+    }
+    inp->damage = *damage;
+}
+
+void input_add_damage(struct Input* inp, Rect damage) {
+    RectSet const set = rectset_from_rect(damage);
+    input_add_damage_rects(inp, &set);
+}
+
+void input_add_damage_rects(struct Input* inp, RectSet const* damage) {
+    if (!damage->len) {
+        return;
+    }
+    rectset_add_set(&inp->damage, damage);
+    if (inp->redraw_track[0].len) {
+        inp->redraw_track[1] = inp->redraw_track[0];
+    }
+    inp->redraw_track[0] = *damage;
+}
+
+void input_mode_set(struct Ctx* ctx, enum InputTag const mode_tag) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct Input* inp = &ctx->input;
+    struct ToolCtx* tc = &CURR_TC(ctx);
+
+    switch (inp->mode.t) {
+        case InputT_Transform: {
+            struct InputOverlay transformed = get_transformed_overlay(dc, inp);
+
+            if (!IS_RNIL(transformed.rect)) {
+                input_set_damage(inp, transformed.rect);
+                history_forward(ctx, history_new_as_damage(dc->cv.im, transformed.rect));
+                ximage_blend(dc->cv.im, transformed.im, transformed.rect);
+            }
+            overlay_free(&transformed);
+
+            input_set_damage(inp, inp->ovr.rect);
+            overlay_clear(&inp->ovr);
+            update_screen(ctx, PNIL, False);
+        } break;
+        default: break;
+    }
+
+    input_mode_free(&inp->mode);
+    inp->mode.t = mode_tag;
+
+    switch (inp->mode.t) {
+        case InputT_Color: inp->mode.d.col = (struct InputColorData) {.current_digit = 0}; break;
+        case InputT_Console: {
+            inp->mode.d.cl = (struct InputConsoleData) {0};
+            if (CONSOLE_AUTO_COMPLETIONS) {
+                cl_compls_new(&inp->mode.d.cl);
+            }
+        } break;
+        case InputT_Interact: break;
+        case InputT_Transform:
+            inp->mode.d.trans = (struct InputTransformData) {
+                .acc = TRANSFORM_DEFAULT,
+                .curr = TRANSFORM_DEFAULT,
+            };
+            break;
+        case InputT_Text:
+            if (tc->t == Tool_Text) {
+                inp->mode.d.text = (struct InputTextData) {.tool_data = tc->d.text};
+            } else {
+                inp->mode.d.text = (struct InputTextData) {0};
+            }
+            break;
+    }
+}
+
+void input_mode_free(struct InputMode* input_mode) {
+    switch (input_mode->t) {
+        case InputT_Console: cl_free(&input_mode->d.cl); break;
+        case InputT_Text: arrfree(input_mode->d.text.textarr); break;
+        default: break;
+    }
+}
+
+char const* input_mode_as_str(enum InputTag mode_tag) {
+    switch (mode_tag) {
+        case InputT_Interact: return "INT";
+        case InputT_Color: return "COL";
+        case InputT_Console: return "CMD";
+        case InputT_Transform: return "TFM";
+        case InputT_Text: return "TXT";
+    }
+    return "???";
+}
+
+void input_free(struct Input* input) {
+    input_mode_free(&input->mode);
+    overlay_free(&input->ovr);
+    arrfree(input->motion_arr);
+}
+
+InputModeFlags input_mode_to_flag(enum InputTag mode) {
+    switch (mode) {
+        case InputT_Interact: return MF_Int;
+        case InputT_Color: return MF_Color;
+        case InputT_Transform: return MF_Trans;
+        // managed manually, don't have mode flag
+        case InputT_Console:
+        case InputT_Text: return 0;
+    }
+    UNREACHABLE();
+    return 0;
+}
+
+void text_mode_push(struct Ctx* ctx, char c) {
+    if (ctx->input.mode.t != InputT_Text) {
+        return;
+    }
+
+    struct InputTextData* td = &ctx->input.mode.d.text;
+    arrpush(td->textarr, c);
+
+    text_mode_rerender(ctx);
+}
+
+Bool text_mode_pop(struct Ctx* ctx) {
+    if (ctx->input.mode.t != InputT_Text) {
+        return False;
+    }
+
+    struct InputTextData* td = &ctx->input.mode.d.text;
+    if (!td->textarr) {
+        return False;
+    }
+
+    usize const size = arrlen(td->textarr);
+    if (size == 0) {
+        return False;
+    }
+    arrpoputf8(td->textarr);
+
+    text_mode_rerender(ctx);
+    return True;
+}
+
+void text_mode_rerender(struct Ctx* ctx) {
+    struct Input* inp = &ctx->input;
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    if (inp->mode.t != InputT_Text) {
+        return;
+    }
+    struct InputTextData* td = &inp->mode.d.text;
+
+    input_set_damage(inp, RNIL);
+    overlay_clear(&inp->ovr);
+    Rect const damage = canvas_text(
+        &ctx->dc,
+        inp->ovr.im,
+        td->tool_data.lb_corner,
+        tc->text_font,
+        *tc_curr_col(tc),
+        td->textarr,
+        arrlen(td->textarr)
+    );
+    inp->ovr.rect = damage;
+    input_set_damage(inp, damage);
+}
+
+void sel_circ_on_select_tool(struct Ctx* ctx, union SCI_Arg tool) {
+    tc_set_tool(&CURR_TC(ctx), tool.tool, NULL);
+}
+
+void sel_circ_on_select_drawer(struct Ctx* ctx, union SCI_Arg tool) {
+    tc_set_tool(
+        &CURR_TC(ctx),
+        Tool_Drawer,
+        &(union ToolData) {
+            .drawer =
+                (struct DrawerData) {
+                    .shape = tool.drawer,
+                    .spacing = tool.drawer == DS_Square ? 0.0 : TOOLS_BRUSH_DEFAULT_SPACING,
+                    .hardness = TOOLS_BRUSH_DEFAULT_HARDNESS,
+                },
+        }
+    );
+}
+
+void sel_circ_on_select_figure_toggle_fill(struct Ctx* ctx, __attribute__((unused)) union SCI_Arg arg) {
+    struct ToolCtx* tc = &CURR_TC(ctx);
+
+    if (tc->t == Tool_Figure) {
+        tc->d.fig.fill ^= 1;
+    }
+}
+
+void sel_circ_on_select_figure(struct Ctx* ctx, union SCI_Arg figure) {
+    struct ToolCtx* tc = &CURR_TC(ctx);
+
+    if (tc->t == Tool_Figure) {
+        tc->d.fig.curr = figure.figure;
+    }
+}
+
+void sel_circ_on_select_col(struct Ctx* ctx, union SCI_Arg col) {
+    *tc_curr_col(&CURR_TC(ctx)) = col.col;
+}
+
+void sel_circ_on_select_set_linew(struct Ctx* ctx, union SCI_Arg num) {
+    CURR_TC(ctx).line_w = num.num;
+}
+
+void sel_circ_init_and_show(struct Ctx* ctx, Button button, i32 x, i32 y) {
+    sel_circ_free_and_hide(&ctx->dc, &ctx->sc);
+
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    struct SelectionCircle* sc = &ctx->sc;
+
+    sc->x = x;
+    sc->y = y;
+
+    switch (ctx->input.mode.t) {
+        case InputT_Text:
+        case InputT_Transform:
+        case InputT_Console: break;
+        case InputT_Color: {
+            sc->draw_separators = False;
+
+            if (BTN_EQ(button, BTN_SEL_CIRC)) {
+                if (sc->hue_items_arr == NULL) {
+                    for (u32 hue_int = 0; hue_int < SEL_CIRC_COLOR_ITEMS; ++hue_int) {
+                        double hue = (double)hue_int / SEL_CIRC_COLOR_ITEMS;
+                        argb col = argb_from_hsl(hue, 1.0, 0.5);
+                        struct Item item = {
+                            .arg.col = col,
+                            .on_select = &sel_circ_on_select_col,
+                            .col_outer = col,
+                            .col_inner = COL_BG(&ctx->dc, SchmNorm),
+                        };
+                        arrpush(sc->hue_items_arr, item);
+                    }
+                }
+                arraddnptr(sc->items_arr, arrlen(sc->hue_items_arr));
+                memcpy(sc->items_arr, sc->hue_items_arr, arrlen(sc->hue_items_arr) * sizeof(struct Item));
+                sc->is_hue_wheel = True;
+                sc->wheel_pm = sc->hue_pm;
+            } else {
+                argb base_col = *tc_curr_col(tc);
+                for (u32 i = 0; i < SEL_CIRC_COLOR_ITEMS; ++i) {
+                    double t = (double)i / SEL_CIRC_COLOR_ITEMS;
+                    argb col = 0xFF000000;
+
+                    double const span_grey = 0.15;
+                    double const span_white = 0.2;
+                    double const span_bright = 0.5;
+                    double const span_dark = 0.75;
+                    double const span_black = 1.0;
+
+                    if (t < span_grey) {
+                        t = t / span_grey;
+                        u8 const grey = (u8)(t * 255.0);
+                        col = 0xFF000000 | (grey << 16) | (grey << 8) | grey;
+                    } else if (t < span_white) {
+                        t = (t - span_grey) / (span_white - span_grey);
+                        col = argb_blend(0xFFFFFFFF, base_col | 0x00FFFFFF, (u8)((1.0 - t) * 255.0));
+                    } else if (t < span_bright) {
+                        t = (t - span_white) / (span_bright - span_white);
+                        col = argb_blend(base_col | 0x00FFFFFF, base_col, (u8)((1.0 - t) * 255.0));
+                    } else if (t < span_dark) {
+                        t = (t - span_bright) / (span_dark - span_bright);
+                        col = argb_blend(base_col, base_col & 0xFF7F7F7F, (u8)((1.0 - t) * 255.0));
+                    } else {
+                        t = (t - span_dark) / (span_black - span_dark);
+                        col = argb_blend(base_col & 0xFF7F7F7F, 0xFF000000, (u8)((1.0 - t) * 255.0));
+                    }
+
+                    struct Item item = {
+                        .arg.col = col,
+                        .on_select = &sel_circ_on_select_col,
+                        .col_outer = col,
+                        .col_inner = COL_BG(&ctx->dc, SchmNorm),
+                    };
+                    arrpush(sc->items_arr, item);
+                }
+            }
+        } break;
+        case InputT_Interact: {
+            sc->draw_separators = True;
+
+            if (BTN_EQ(button, BTN_SEL_CIRC)) {
+                switch (tc->t) {
+                    case Tool_Text:
+                    case Tool_Selection:
+                    case Tool_Drawer:
+                    case Tool_Fill:
+                    case Tool_Picker: {
+                        struct Item items[] = {
+                            {.arg.tool = Tool_Text, .on_select = &sel_circ_on_select_tool, .icon = I_Text},
+                            {.arg.tool = Tool_Selection, .on_select = &sel_circ_on_select_tool, .icon = I_Select},
+                            {.arg.drawer = DS_Square, .on_select = &sel_circ_on_select_drawer, .icon = I_Pencil},
+                            {.arg.tool = Tool_Fill, .on_select = &sel_circ_on_select_tool, .icon = I_Fill},
+                            {.arg.tool = Tool_Picker, .on_select = &sel_circ_on_select_tool, .icon = I_Picker},
+                            {.arg.drawer = DS_Brush, .on_select = &sel_circ_on_select_drawer, .icon = I_Brush},
+                            {.arg.drawer = DS_CircleRandom, .on_select = &sel_circ_on_select_drawer, .icon = I_Spray},
+                            {.arg.tool = Tool_Figure, .on_select = &sel_circ_on_select_tool, .icon = I_Figure},
+                        };
+                        for (u32 i = 0; i < LENGTH(items); ++i) {
+                            arrpush(sc->items_arr, items[i]);
+                        }
+                    } break;
+                    case Tool_Figure: {
+                        struct Item items[] = {
+                            {.arg.figure = Figure_Circle, .on_select = &sel_circ_on_select_figure, .icon = I_FigCirc},
+                            {.arg.figure = Figure_Rectangle, .on_select = &sel_circ_on_select_figure, .icon = I_FigRect
+                            },
+                            {.arg.figure = Figure_Triangle, .on_select = &sel_circ_on_select_figure, .icon = I_FigTri},
+                            {.on_select = &sel_circ_on_select_figure_toggle_fill,
+                             .icon = tc->d.fig.fill ? I_FigFillOff : I_FigFillOn},
+                            {.arg.drawer = DS_Square, .on_select = &sel_circ_on_select_drawer, .icon = I_Pencil},
+                        };
+                        for (u32 i = 0; i < LENGTH(items); ++i) {
+                            arrpush(sc->items_arr, items[i]);
+                        }
+                    } break;
+                }
+            } else {
+                for (u32 i = 0; i < LENGTH(ALTERNATIVE_SEL_CIRC_ITEMS); ++i) {
+                    arrpush(sc->items_arr, ALTERNATIVE_SEL_CIRC_ITEMS[i]);
+                }
+            }
+        } break;
+    }
+
+    if (sc->items_arr) {
+        dc_damage_scr(&ctx->dc, sel_circ_rect(sc));
+    }
+}
+
+void sel_circ_free_and_hide(struct DrawCtx* dc, struct SelectionCircle* sel_circ) {
+    if (sel_circ->items_arr) {
+        dc_damage_scr(dc, sel_circ_rect(sel_circ));
+        arrfree(sel_circ->items_arr);
+        sel_circ->items_arr = NULL;
+    }
+    if (sel_circ->is_hue_wheel) {
+        sel_circ->hue_pm = sel_circ->wheel_pm;
+    } else if (sel_circ->wheel_pm) {
+        XFreePixmap(dc->dp, sel_circ->wheel_pm);
+    }
+    sel_circ->wheel_pm = 0;
+    sel_circ->is_hue_wheel = False;
+}
+
+Rect sel_circ_rect(struct SelectionCircle const* sc) {
+    i32 const outer_r = (i32)SEL_CIRC_OUTER_R_PX;
+    i32 const margin = (i32)SEL_CIRC_LINE_W + 1;
+    return (Rect) {
+        sc->x - outer_r - margin,
+        sc->y - outer_r - margin,
+        sc->x + outer_r + margin,
+        sc->y + outer_r + margin,
+    };
+}
+
+Rect sel_circ_item_rect(struct SelectionCircle const* sc, i32 item) {
+    if (item == NIL || sc->items_arr == NULL) {
+        return RNIL;
+    }
+    double const segment_rad = PI * 2 / MAX(1, arrlen(sc->items_arr));
+    double const radii[] = {SEL_CIRC_INNER_R_PX, SEL_CIRC_OUTER_R_PX};
+    i32 const steps = 8;  // outer arc is sampled, sagitta is covered by margin
+    i32 const margin = (i32)SEL_CIRC_LINE_W + 2 + (i32)(SEL_CIRC_OUTER_R_PX * (1.0 - cos(segment_rad / steps / 2)));
+    Rect result = RNIL;
+    for (u32 r = 0; r < LENGTH(radii); ++r) {
+        for (i32 step = 0; step <= steps; ++step) {
+            // same angles as fill_arc in draw_selection_circle
+            double const a = -segment_rad * (item + ((double)step / steps));
+            Pt const p = {sc->x + (i32)(cos(a) * radii[r]), sc->y + (i32)(sin(a) * radii[r])};
+            result = rect_expand(result, (Rect) {p.x, p.y, p.x, p.y});
+        }
+    }
+    return (Rect) {result.l - margin, result.t - margin, result.r + margin, result.b + margin};
+}
+
+i32 sel_circ_curr_item(struct SelectionCircle const* sc, i32 x, i32 y) {
+    if (sc == NULL || sc->items_arr == NULL) {
+        return NIL;
+    }
+
+    i32 const pointer_x_rel = x - sc->x;
+    i32 const pointer_y_rel = y - sc->y;
+    if (pointer_x_rel == 0 && pointer_y_rel == 0) {
+        return NIL;  // prevent 0.0 / 0.0 division
+    }
+
+    i32 const items_len = MAX(1, arrlen(sc->items_arr));
+    double const segment_rad = PI * 2.0 / (double)items_len;
+    double const segment_deg = segment_rad / PI * 180;
+    double const pointer_r = sqrt((pointer_x_rel * pointer_x_rel) + (pointer_y_rel * pointer_y_rel));
+
+    if (pointer_r > SEL_CIRC_OUTER_R_PX || pointer_r < SEL_CIRC_INNER_R_PX) {
+        return NIL;
+    }
+    // FIXME do it right
+    double angle = -atan(pointer_y_rel * 1.0 / pointer_x_rel) / PI * 180;
+    if (pointer_x_rel < 0) {
+        angle += 180;
+    } else if (pointer_y_rel >= 0) {
+        angle += 360;
+    }
+
+    i32 const result = (i32)floor(angle / segment_deg);
+
+    // on 360 degrees result is equal to items_len
+    return CLAMP(result, 0, items_len - 1);
+}
+
+Rect tool_selection_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
+    if (!BTN_EQ(get_btn(event), BTN_MAIN) && !BTN_EQ(get_btn(event), BTN_COPY_SELECTION)) {
+        return RNIL;
+    }
+
+    struct DrawCtx* dc = &ctx->dc;
+    struct Input* inp = &ctx->input;
+
+    Pt const pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
+    i32 const begin_x = CLAMP(inp->c.pos.x, 0, dc->cv.im->width);
+    i32 const begin_y = CLAMP(inp->c.pos.y, 0, dc->cv.im->height);
+    i32 const end_x = CLAMP(pointer.x, 0, dc->cv.im->width);
+    i32 const end_y = CLAMP(pointer.y, 0, dc->cv.im->height);
+
+    Pt p = {MIN(begin_x, end_x), MIN(begin_y, end_y)};
+    Pt dims = (Pt) {MAX(begin_x, end_x) - p.x, MAX(begin_y, end_y) - p.y};
+
+    input_set_damage(inp, RNIL);
+    overlay_clear(&inp->ovr);
+
+    Rect damage = canvas_copy_region(inp->ovr.im, dc->cv.im, p, dims, p);
+    overlay_expand_rect(&inp->ovr, damage);
+
+    if (!IS_RNIL(damage)) {
+        // move on BTN_MAIN, copy on BTN_COPY_SELECTION
+        if (!BTN_EQ(get_btn(event), BTN_COPY_SELECTION)) {
+            history_forward(ctx, history_new_as_damage(dc->cv.im, damage));
+
+            argb bg_col = CANVAS_BACKGROUND;  // FIXME set in runtime?
+            canvas_fill_rect(dc->cv.im, p, dims, bg_col);
+        }
+
+        input_mode_set(ctx, InputT_Transform);
     }
-}
 
-char* cl_cmd_get_str_dyn(struct InputConsoleData const* d_cl) {
-    usize const cmd_len = arrlen(d_cl->cmdarr);
-    char* cmd_dyn = ecalloc(cmd_len + 1, sizeof(char));
-    memcpy(cmd_dyn, d_cl->cmdarr, cmd_len);
-    cmd_dyn[cmd_len] = '\0';
-    return cmd_dyn;
+    // all actions already done above
+    return RNIL;
 }
 
-char const* cl_cmd_descr(enum ClCTag t) {
-    switch (t) {
-        case ClC_Echo: return "print message";
-        case ClC_Set: return "set property value";
-        case ClC_Exit: return "exit program";
-        case ClC_Save: return "save changes to provided file";
-        case ClC_W: return "save changes";
-        case ClC_WQ: return "save changes and exit program";
-        case ClC_Load: return "load file to canvas";
-        case ClCTag_Invalid:
-        case ClCTag_Count: break;
+Rect tool_text_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
+    if (!BTN_EQ(get_btn(event), BTN_MAIN)) {
+        return RNIL;
     }
-    UNREACHABLE();
+
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    assert(tc->t == Tool_Text);
+
+    tc->d.text.lb_corner = pt_from_scr_to_cv_xy(&ctx->dc, event->x, event->y);
+    input_mode_set(ctx, InputT_Text);
+
+    return RNIL;
 }
 
-char const* cl_set_prop_descr(enum ClCDSTag t) {
-    switch (t) {
-        case ClCDS_LineW: return "line width";
-        case ClCDS_Col: return "tool color";
-        case ClCDS_UiFont: return "interface font";
-        case ClCDS_TextFont: return "text tool font";
-        case ClCDS_Inp: return "input file";
-        case ClCDS_Out: return "output file";
-        case ClCDS_PngCompression: return "png file compression level";
-        case ClCDS_JpgQuality: return "jpeg quality level";
-        case ClCDS_Spacing: return "brush tool spacing";  //   FIXME change brush to something?
-        case ClCDS_Hardness: return "brush tool hardness";  // because all drawers use this properties
-        case ClCDSTag_Invalid:
-        case ClCDSTag_Count: break;
+Rect tool_drawer_on_press(struct Ctx* ctx, XButtonPressedEvent const* event) {
+    if (!BTN_EQ(get_btn(event), BTN_MAIN)) {
+        return RNIL;
     }
-    UNREACHABLE();
-}
 
-enum ImageType cl_save_type_to_image_type(enum ClCDSv t) {
-    switch (t) {
-        case ClCDSv_Png: return IMT_Png;
-        case ClCDSv_Jpg: return IMT_Jpg;
-        case ClCDSv_Invalid:
-        case ClCDSv_Count: UNREACHABLE();
+    struct DrawCtx* dc = &ctx->dc;
+    struct ToolCtx* tc = &CURR_TC(ctx);
+
+    if (!state_match(event->state, ShiftMask)) {
+        ctx->input.anchor = pt_from_scr_to_cv_xy(dc, event->x, event->y);
+        return canvas_apply_drawer(
+            ctx->input.ovr.im,
+            tc->d.drawer,
+            tc->line_w,
+            *tc_curr_col(tc),
+            pt_from_scr_to_cv_xy(dc, event->x, event->y),
+            &tc->brush_cache
+        );
     }
-    UNREACHABLE();
+
+    return RNIL;
 }
 
-static void for_each_enum(
-    i32 enum_last,
-    char const* (*enum_to_str)(i32),
-    void (*callback)(i32 tag, char const* enum_str, void* data_in_out),
-    void* data_in_out
-) {
-    for (i32 e = 0; e < enum_last; ++e) {
-        char const* enum_str = enum_to_str(e);
-        callback(e, enum_str, data_in_out);
+Rect tool_drawer_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
+    if (!BTN_EQ(get_btn(event), BTN_MAIN)) {
+        return RNIL;
     }
-}
 
-struct CompletionCallbackData {
-    struct ComplsItem** result;
-    char const* token;
-    Bool add_delim;
-    char const* (*get_descr_opt)(i32 tag);
-};
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    struct DrawCtx* dc = &ctx->dc;
+    assert(tc->t == Tool_Drawer);
+    struct DrawerData* drawer = &tc->d.drawer;
 
-static void completion_callback(i32 tag, char const* enum_str, void* user_data) {
-    struct CompletionCallbackData* ctx = user_data;
-    usize const token_len = strlen(ctx->token);
-    usize const offset = first_dismatch(enum_str, ctx->token);
-    if (offset == token_len && (offset <= strlen(enum_str))) {
-        char const* prefix = ctx->add_delim && (token_len == 0) ? CL_DELIM : "";
-        struct ComplsItem complt = {
-            .val_dyn = str_new("%s%s", prefix, enum_str + offset),
-            .descr_optdyn = ctx->get_descr_opt ? str_new("%s", ctx->get_descr_opt(tag)) : NULL,
-        };
-        arrpush(*ctx->result, complt);
+    Pt begin = ctx->input.anchor;
+    Pt end = pt_from_scr_to_cv_xy(dc, event->x, event->y);
+    XImage* const im = ctx->input.ovr.im;
+
+    ctx->input.anchor = end;
+
+    // all points with drag motion drawn in on_drag
+    if (ctx->input.c.state != CS_Drag && state_match(event->state, ShiftMask)) {
+        return canvas_line(
+            &canvas_line_drawer_callback,
+            &(struct CanvasLineDrwCtxDrawer) {
+                .im = im,
+                .brush_in_out = &tc->brush_cache,
+                .data = *drawer,
+                .line_w = tc->line_w,
+                .col = *tc_curr_col(tc),
+            },
+            begin,
+            end,
+            tc->line_w,
+            drawer->spacing,
+            False
+        );
     }
+
+    return RNIL;
 }
 
-static void cl_compls_update_helper(
-    struct ComplsItem** result_out,
-    char const* token,
-    char const* (*enum_to_str)(i32),
-    char const* (*get_descr)(i32),
-    i32 enum_last,
-    Bool add_delim
+RectSet tool_drawer_on_drag(
+    struct Ctx* ctx,
+    __attribute__((unused)) XMotionEvent const* event,
+    Pt const* pts,
+    u32 pts_len
 ) {
-    if (!token || !enum_to_str || !result_out) {
-        return;
+    RectSet damage = {0};
+    if (!BTN_EQ(ctx->input.c.btn, BTN_MAIN)) {
+        return damage;
     }
 
-    struct CompletionCallbackData ctx = {result_out, token, add_delim, get_descr};
-    for_each_enum(enum_last, enum_to_str, completion_callback, &ctx);
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    struct DrawCtx* dc = &ctx->dc;
+    assert(tc->t == Tool_Drawer);
+    struct DrawerData const* drawer = &tc->d.drawer;
+    XImage* const im = ctx->input.ovr.im;
+
+    // stroke goes through every reported pointer position, segments are damaged separately
+    for (u32 i = 0; i < pts_len; ++i) {
+        Pt const pointer = pt_from_scr_to_cv_xy(dc, pts[i].x, pts[i].y);
+        Rect const segment_damage = canvas_line(
+            &canvas_line_drawer_callback,
+            &(struct CanvasLineDrwCtxDrawer) {
+                .im = im,
+                .brush_in_out = &tc->brush_cache,
+                .data = *drawer,
+                .col = *tc_curr_col(tc),
+                .line_w = tc->line_w,
+            },
+            ctx->input.anchor,
+            pointer,
+            tc->line_w,
+            drawer->spacing,
+            False
+        );
+
+        if (!IS_RNIL(segment_damage)) {
+            ctx->input.anchor = pointer;
+        }
+        rectset_add(&damage, segment_damage);
+    }
+
+    return damage;
 }
 
-struct TokenCheckCallbackData {
-    char const* token;
-    Bool found;
-};
+Rect tool_figure_on_press(struct Ctx* ctx, XButtonPressedEvent const* event) {
+    if (!BTN_EQ(get_btn(event), BTN_MAIN)) {
+        return RNIL;
+    }
 
-static void check_token_callback(__attribute__((unused)) i32 tag, char const* enum_str, void* user_data) {
-    struct TokenCheckCallbackData* ctx = user_data;
-    if (!strcmp(ctx->token, enum_str)) {
-        ctx->found = True;
+    struct DrawCtx* dc = &ctx->dc;
+
+    if (!state_match(event->state, ShiftMask)) {
+        ctx->input.anchor = pt_from_scr_to_cv_xy(dc, event->x, event->y);
     }
+
+    return RNIL;
 }
 
-static Bool is_valid_token(char const* token, char const* (*enum_to_str)(i32), i32 enum_last) {
-    struct TokenCheckCallbackData ctx = {token, False};
-    for_each_enum(enum_last, enum_to_str, check_token_callback, &ctx);
-    return ctx.found;
+Rect tool_figure_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
+    Button const btn = ctx->input.c.btn;
+    if ((!BTN_EQ(btn, BTN_MAIN) && !BTN_EQ(btn, BTN_MAIN_ALTERNATIVE))
+        || (ctx->input.c.state != CS_Drag && !(state_match(event->state, ShiftMask)))) {
+        return RNIL;
+    }
+
+    struct DrawCtx* dc = &ctx->dc;
+    Pt pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
+    Pt anchor = ctx->input.anchor;
+    u32 const fig_variant = BTN_EQ(btn, BTN_MAIN_ALTERNATIVE) ? 1 : 0;
+
+    overlay_clear(&ctx->input.ovr);
+    return canvas_figure(ctx, ctx->input.ovr.im, fig_variant, anchor, pointer);
 }
 
-static char* get_dir_part(char const* path) {
-    if (!path) {
-        return NULL;
+Rect tool_fill_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
+    if (!BTN_EQ(ctx->input.c.btn, BTN_MAIN)) {
+        return RNIL;
     }
 
-    char* last_slash = strrchr(path, '/');
-    if (!last_slash) {
-        return str_new(".");
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    struct DrawCtx* dc = &ctx->dc;
+    struct Input* inp = &ctx->input;
+
+    Pt const cur = pt_from_scr_to_cv_xy(dc, event->x, event->y);
+
+    // area is searched on canvas, only filled pixels are written to overlay
+    return ximage_flood_fill_ex(inp->ovr.im, dc->cv.im, *tc_curr_col(tc), cur.x, cur.y);
+}
+
+Rect tool_picker_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    struct DrawCtx* dc = &ctx->dc;
+    Pt const pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
+    XImage* im = dc->cv.im;
+
+    if (!ximage_is_valid_pt(im, pointer.x, pointer.y)) {
+        return RNIL;
     }
 
-    if (last_slash == path) {
-        return str_new("/");
-    }
+    *tc_curr_col(tc) = XGetPixel(im, pointer.x, pointer.y);
+    return RNIL;
+}
+
+Rect canvas_line_drawer_callback(void* drw_ctx, Pt p) {
+    struct CanvasLineDrwCtxDrawer* ctx = (struct CanvasLineDrwCtxDrawer*)drw_ctx;
+    return canvas_apply_drawer(ctx->im, ctx->data, ctx->line_w, ctx->col, p, ctx->brush_in_out);
+}
+
+Rect canvas_line_flood_fill_callback(void* drw_ctx, Pt p) {
+    struct CanvasLineDrwCtxFloodFill* ctx = (struct CanvasLineDrwCtxFloodFill*)drw_ctx;
+    return ximage_flood_fill(ctx->im, ctx->col, p.x, p.y);
+}
+
+struct HistItem history_new_as_damage(XImage* im, Rect rect) {
+    assert(is_valid_rect(rect));
 
-    size_t dir_len = last_slash - path;
-    char* dir = ecalloc(dir_len + 1, sizeof(char));
-    strncpy(dir, path, dir_len);
-    return dir;
+    struct HistItem result = {.t = HT_Damage, .d.damage.patches_arr = NULL};
+    arrpush(result.d.damage.patches_arr, history_patch_new(im, rect));
+    return result;
 }
 
-static char const* get_base_part(char const* path) {
-    if (!path) {
-        return "";
-    }
+struct HistItem history_new_as_damage_rects(XImage* im, RectSet const* rects) {
+    assert(rects->len);
 
-    char const* last_slash = strrchr(path, '/');
-    if (!last_slash) {
-        return path;
+    struct HistItem result = {.t = HT_Damage, .d.damage.patches_arr = NULL};
+    for (u32 i = 0; i < rects->len; ++i) {
+        arrpush(result.d.damage.patches_arr, history_patch_new(im, rects->rects[i]));
     }
+    return result;
+}
 
-    return last_slash + 1;
+struct HistPatch history_patch_new(XImage* im, Rect rect) {
+    return (struct HistPatch) {
+        .pivot = (Pt) {rect.l, rect.t},
+        .patch = XSubImage(
+            im,
+            rect.l,
+            rect.t,
+            // inclusive
+            rect.r - rect.l + 1,
+            rect.b - rect.t + 1
+        ),
+    };
 }
 
-static void cl_compls_update_dirs(struct ComplsItem** result, char const* token, Bool only_dirs, Bool add_delim) {
-    if (!token || !result) {
-        return;
-    }
+struct HistItem history_new_as_resize(XImage* im) {
+    return (struct HistItem) {
+        .t = HT_Resize,
+        .d.resize = (struct HistResize) {.cv = XSubImage(im, 0, 0, im->width, im->height)},
+    };
+}
 
-    // Get directory to search in and base name to match against
-    char* dir_part_dyn = get_dir_part(token);
-    char* search_dir_dyn = path_expand_home(dir_part_dyn);
-    free(dir_part_dyn);
-    char const* base_name = get_base_part(token);
+Bool history_move(struct Ctx* ctx, Bool forward) {
+    struct HistItem** hist_pop = forward ? &ctx->hist_nextarr : &ctx->hist_prevarr;
+    struct HistItem** hist_save = forward ? &ctx->hist_prevarr : &ctx->hist_nextarr;
 
-    DIR* dir = opendir(search_dir_dyn);
-    if (!dir) {
-        str_free(&search_dir_dyn);
-        return;
+    if (!arrlenu(*hist_pop)) {
+        return False;
     }
 
-    struct dirent* entry = NULL;
-    while ((entry = readdir(dir))) {
-        struct stat st;
-        char* full_path_dyn = str_new("%s/%s", search_dir_dyn, entry->d_name);
-        if (stat(full_path_dyn, &st) == 0) {
-            if (!only_dirs || S_ISDIR(st.st_mode)) {
-                char const* filename = entry->d_name;
-                if (filename[0] == '.' && (filename[1] == '\0' || (filename[1] == '.' && filename[2] == '\0'))) {
-                    str_free(&full_path_dyn);
-                    continue;  // Skip . and ..
-                }
-
-                usize const base_len = strlen(base_name);
-                usize const offset = first_dismatch(filename, base_name);
-                if (offset == base_len && (offset < strlen(filename))) {
-                    // Only add space prefix if we're starting fresh
-                    char const* prefix = (add_delim && !*token) ? CL_DELIM : "";
-                    char const* suffix = S_ISDIR(st.st_mode) ? "/" : "";
-                    struct ComplsItem complt = {
-                        .val_dyn = str_new("%s%s%s", prefix, filename + offset, suffix),
-                        .descr_optdyn = NULL,
-                    };
-                    arrpush(*result, complt);
-                }
+    struct HistItem curr = arrpop(*hist_pop);
+    switch (curr.t) {
+        case HT_Damage: {
+            struct HistItem saved = {.t = HT_Damage, .d.damage.patches_arr = NULL};
+            for (u32 i = 0; i < arrlen(curr.d.damage.patches_arr); ++i) {
+                struct HistPatch const* p = &curr.d.damage.patches_arr[i];
+                Rect curr_rect =
+                    (Rect) {p->pivot.x, p->pivot.y, p->pivot.x + p->patch->width, p->pivot.y + p->patch->height};
+                arrpush(saved.d.damage.patches_arr, history_patch_new(ctx->dc.cv.im, curr_rect));
             }
-        }
-        str_free(&full_path_dyn);
+            arrpush(*hist_save, saved);
+        } break;
+        case HT_Resize: {
+            arrpush(*hist_save, history_new_as_resize(ctx->dc.cv.im));
+        } break;
     }
-    closedir(dir);
-    str_free(&search_dir_dyn);
+    history_apply(ctx, &curr);
+    history_free(&curr);
+    ++ctx->hist_version;
+
+    return True;
 }
 
-static void cl_compls_update_fonts(struct ComplsItem** result, char const* token, Bool add_delim) {
-    char** fonts = xft_get_fonts_arr();
+void history_forward(struct Ctx* ctx, struct HistItem hist) {
+    trace("xpaint: history forward");
+    // next history invalidated after user action
+    historyarr_clear(&ctx->hist_nextarr);
+    arrpush(ctx->hist_prevarr, hist);
+    ++ctx->hist_version;
+}
 
-    for (i32 i = 0; i < arrlen(fonts); ++i) {
-        usize const offset = first_dismatch(token, fonts[i]);
-        if (offset == strlen(token) && offset < strlen(fonts[i])) {
-            // Only add space prefix if we're starting fresh
-            char const* prefix = (add_delim && !*token) ? CL_DELIM : "";
-            struct ComplsItem complt = {
-                .val_dyn = str_new("%s%s", prefix, fonts[i] + offset),
-                .descr_optdyn = NULL,
-            };
-            arrpush(*result, complt);
-        }
+void history_apply(struct Ctx* ctx, struct HistItem* hist) {
+    RectSet damage = {0};
+    switch (hist->t) {
+        case HT_Damage: {
+            for (u32 i = 0; i < arrlen(hist->d.damage.patches_arr); ++i) {
+                struct HistPatch const* p = &hist->d.damage.patches_arr[i];
+                rectset_add(
+                    &damage,
+                    canvas_copy_region(
+                        ctx->dc.cv.im,
+                        p->patch,
+                        (Pt) {0, 0},
+                        (Pt) {p->patch->width, p->patch->height},
+                        p->pivot
+                    )
+                );
+            }
+        } break;
+        case HT_Resize: {
+            u32 w = hist->d.resize.cv->width;
+            u32 h = hist->d.resize.cv->height;
+            canvas_resize(ctx, w, h);
+            damage = rectset_from_rect(
+                canvas_copy_region(ctx->dc.cv.im, hist->d.resize.cv, (Pt) {0, 0}, (Pt) {(i32)w, (i32)h}, (Pt) {0, 0})
+            );
+        } break;
+    }
+    input_set_damage_rects(&ctx->input, &damage);
+}
 
-        free(fonts[i]);
+void history_free(struct HistItem* hist) {
+    switch (hist->t) {
+        case HT_Damage: {
+            for (u32 i = 0; i < arrlen(hist->d.damage.patches_arr); ++i) {
+                XDestroyImage(hist->d.damage.patches_arr[i].patch);
+            }
+            arrfree(hist->d.damage.patches_arr);
+        } break;
+        case HT_Resize: XDestroyImage(hist->d.resize.cv); break;
     }
-    arrfree(fonts);
 }
 
-usize cl_compls_new(struct InputConsoleData* cl) {
-    char* cl_buf_dyn = cl_cmd_get_str_dyn(cl);
-    struct ComplsItem* result = NULL;
+void historyarr_clear(struct HistItem** histarr) {
+    for (u32 i = 0; i < arrlenu(*histarr); ++i) {
+        history_free(&(*histarr)[i]);
+    }
+    arrfree(*histarr);
+}
 
-    usize const cl_buf_len = strlen(cl_buf_dyn);
-    Bool const last_char_is_space = cl_buf_len != 0 && cl_buf_dyn[cl_buf_len - 1] == CL_DELIM[0];
-    // prepend delim to completions if not provided
-    Bool const add_delim = cl_buf_len != 0 && !last_char_is_space;
+XImage* ximage_apply_xtrans(XImage* im, struct DrawCtx* dc, XTransform xtrans) {
+    u32 const w = im->width;
+    u32 const h = im->height;
 
-    // FIXME strtok in if-chain
-    char const* tok1 = strtok(cl_buf_dyn, CL_DELIM);
-    char const* tok2 = strtok(NULL, CL_DELIM);
-    char const* tok3 = strtok(NULL, "");
-    tok1 = COALESCE(tok1, "");  // don't do strtok in macro
-    tok2 = COALESCE(tok2, "");
-    tok3 = COALESCE(tok3, "");
+    Pixmap src_pm = XCreatePixmap(dc->dp, dc->window, w, h, dc->sys.vinfo.depth);
+    XPutImage(dc->dp, src_pm, dc->screen_gc, im, 0, 0, 0, 0, w, h);
+    Pixmap dst_pm = XCreatePixmap(dc->dp, dc->window, w, h, dc->sys.vinfo.depth);
 
-    cl_compls_free(cl);
+    Picture src = XRenderCreatePicture(dc->dp, src_pm, dc->sys.xrnd_pic_format, 0, NULL);
+    Picture dst = XRenderCreatePicture(dc->dp, dst_pm, dc->sys.xrnd_pic_format, 0, NULL);
 
-    typedef char const* (*itos_f)(i32);
-    // subcommands with own completions
-    if (!strcmp(tok1, cl_cmd_to_string(ClC_Set))) {
-        if (!strcmp(tok2, cl_set_prop_to_string(ClCDS_TextFont))
-            || !strcmp(tok2, cl_set_prop_to_string(ClCDS_UiFont))) {
-            cl_compls_update_fonts(&result, tok3, add_delim);
-        } else if (!strcmp(tok3, "")) {
-            cl_compls_update_helper(
-                &result,
-                tok2,
-                (itos_f)&cl_set_prop_to_string,
-                (itos_f)&cl_set_prop_descr,
-                ClCDSTag_Count,
-                add_delim
-            );
-        }
-    } else if (!strcmp(tok1, cl_cmd_to_string(ClC_Save))) {
-        // Check if tok2 is a valid save type
-        if (is_valid_token(tok2, (itos_f)&cl_save_type_to_string, ClCDSv_Count)) {
-            // If we have a valid type, suggest directories
-            cl_compls_update_dirs(&result, tok3, False, add_delim);
-            cl->dont_append_delimeter_after_apply = True;
-        } else {
-            // If tok2 is empty or not a valid type, suggest types
-            cl_compls_update_helper(&result, tok2, (itos_f)&cl_save_type_to_string, NULL, ClCDSv_Count, add_delim);
-        }
-    } else if (!strcmp(tok1, cl_cmd_to_string(ClC_Load))) {
-        // Suggest directories to load
-        cl_compls_update_dirs(&result, tok2, False, add_delim);
-        cl->dont_append_delimeter_after_apply = True;
-    } else if (strlen(tok2) == 0 && !last_char_is_space) {  // first token completion
-        cl_compls_update_helper(
-            &result,
-            tok1,
-            (itos_f)&cl_cmd_to_string,
-            (itos_f)&cl_cmd_descr,
-            ClCTag_Count,
-            add_delim
-        );
-    } else {
-        free(cl_buf_dyn);
-        return 0;
-    }
+    // HACK xtrans_invert, because XRENDER missinterprets XTransform values
+    XTransform xtrans_pict = xtrans_invert(xtrans);
+    XRenderSetPictureTransform(dc->dp, src, &xtrans_pict);
+    XRenderComposite(dc->dp, PictOpSrc, src, None, dst, 0, 0, 0, 0, 0, 0, w, h);
 
-    free(cl_buf_dyn);
+    XImage* result = XGetImage(dc->dp, dst_pm, 0, 0, w, h, AllPlanes, ZPixmap);
 
-    cl->compls_arr = result;
+    XRenderFreePicture(dc->dp, src);
+    XRenderFreePicture(dc->dp, dst);
+    XFreePixmap(dc->dp, src_pm);
+    XFreePixmap(dc->dp, dst_pm);
 
-    return arrlen(cl->compls_arr);
+    return result;
 }
 
-void cl_free(struct InputConsoleData* cl) {
-    arrfree(cl->cmdarr);
-    cl_compls_free(cl);
-}
+void ximage_blend(XImage* dest, XImage* overlay, Rect blend_mask) {
+    if (IS_RNIL(blend_mask)) {
+        blend_mask = ximage_rect(overlay);
+    }
+    assert(is_valid_rect(blend_mask));
+    assert(is_subrect(ximage_rect(dest), ximage_rect(overlay)));
+    assert(is_subrect(ximage_rect(overlay), blend_mask));
 
-void cl_compls_free(struct InputConsoleData* cl) {
-    if (cl->compls_arr) {
-        for (u32 i = 0; i < arrlen(cl->compls_arr); ++i) {
-            str_free(&cl->compls_arr[i].val_dyn);
-            str_free(&cl->compls_arr[i].descr_optdyn);
+    for (i32 x = blend_mask.l; x <= blend_mask.r; ++x) {
+        for (i32 y = blend_mask.t; y <= blend_mask.b; ++y) {
+            argb ovr = XGetPixel(overlay, x, y);
+            if (ovr & ARGB_ALPHA) {
+                argb bg = XGetPixel(dest, x, y);
+                // make first argument opaque and use its opacity as third argument.
+                argb result = argb_blend(argb_normalize(ovr), bg, (ovr >> 0x18) & 0xFF);
+                XPutPixel(dest, x, y, result);
+            }
         }
-        arrfree(cl->compls_arr);
-        cl->compls_arr = NULL;
-        cl->compls_curr = 0;
     }
 }
 
-void cl_push(struct InputConsoleData* cl, char c) {
-    arrpush(cl->cmdarr, c);
-    cl_compls_free(cl);
-    if (CONSOLE_AUTO_COMPLETIONS) {
-        cl_compls_new(cl);
+void ximage_clear(XImage* im, Rect mask) {
+    if (IS_RNIL(mask)) {
+        return;
+    }
+    assert(is_subrect(ximage_rect(im), mask));
+    assert(im->format == ZPixmap);
+    assert(im->bits_per_pixel % 8 == 0);
+
+    u32 const bpp = (im->bits_per_pixel + 7) / 8;
+    u8* base = (u8*)im->data;
+
+    for (i32 y = mask.t; y <= mask.b; y++) {
+        u8* row_start = base + (size_t)(y * im->bytes_per_line) + (size_t)(mask.l * bpp);
+        u32 bytes = (mask.r - mask.l + 1) * bpp;
+        memset(row_start, 0, bytes);
+    }
+}
+
+Bool ximage_release_rows(XImage* im, i32 t, i32 b) {
+    i32 advice = 0;
+    if (im->f.destroy_image == &ximage_sparse_destroy) {
+        advice = MADV_DONTNEED;
+    } else if (ximage_is_sparse_shm(im)) {
+        advice = MADV_REMOVE;  // shared pages stay in segment otherwise
+    } else {
+        return False;
     }
+    assert(BETWEEN(t, 0, b) && b < im->height);
+
+    // image data is page aligned, page parts outside of rows must be already zero
+    uintptr_t const page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t const from = ((uintptr_t)im->data + ((usize)t * im->bytes_per_line)) & ~(page - 1);
+    uintptr_t const to = ((uintptr_t)im->data + ((usize)(b + 1) * im->bytes_per_line) + page - 1) & ~(page - 1);
+    return madvise((void*)from, to - from, advice) == 0;
 }
 
-Bool cl_pop(struct InputConsoleData* cl, Bool force_no_compls) {
-    if (!cl->cmdarr) {
+Bool ximage_put_checked(XImage* im, i32 x, i32 y, argb col) {
+    if (!ximage_is_valid_pt(im, x, y)) {
         return False;
     }
-    usize const size = arrlen(cl->cmdarr);
-    if (size) {
-        arrpoputf8(cl->cmdarr);
-    }
-
-    cl_compls_free(cl);
-    if (CONSOLE_AUTO_COMPLETIONS && !force_no_compls) {
-        cl_compls_new(cl);
-    }
+    XPutPixel(im, x, y, col);
+    return True;
+}
 
-    return size != 0;
+Rect ximage_flood_fill(XImage* im, argb targ_col, i32 x, i32 y) {
+    return ximage_flood_fill_ex(im, im, targ_col, x, y);
 }
 
-void input_set_damage(struct Input* inp, Rect damage) {
-    if (!IS_RNIL(damage)) {
-        if (!IS_RNIL(inp->redraw_track[0])) {
-            inp->redraw_track[1] = inp->redraw_track[0];
-        }
-        inp->redraw_track[0] = damage;
+Rect ximage_flood_fill_ex(XImage* im, XImage const* area_im, argb targ_col, i32 x, i32 y) {
+    assert(im && area_im);
+    assert(im->width == area_im->width && im->height == area_im->height);
+    if (!ximage_is_valid_pt(im, x, y)) {
+        return RNIL;
     }
-    inp->damage = damage;
-}
 
-void input_mode_set(struct Ctx* ctx, enum InputTag const mode_tag) {
-    struct DrawCtx* dc = &ctx->dc;
-    struct Input* inp = &ctx->input;
-    struct ToolCtx* tc = &CURR_TC(ctx);
+    static i32 const d_rows[] = {1, 0, 0, -1};
+    static i32 const d_cols[] = {0, 1, -1, 0};
 
-    switch (inp->mode.t) {
-        case InputT_Transform: {
-            struct InputOverlay transformed = get_transformed_overlay(dc, inp);
+    argb const area_col = XGetPixel((XImage*)area_im, x, y);
+    if (area_col == targ_col) {
+        return RNIL;
+    }
 
-            if (!IS_RNIL(transformed.rect)) {
-                input_set_damage(inp, transformed.rect);
-                history_forward(ctx, history_new_as_damage(dc->cv.im, transformed.rect));
-                ximage_blend(dc->cv.im, transformed.im, transformed.rect);
-            }
-            overlay_free(&transformed);
+    Rect damage = RNIL;
+    Pt* queue_arr = NULL;
+    Pt first = {x, y};
+    arrpush(queue_arr, first);
 
-            input_set_damage(inp, inp->ovr.rect);
-            overlay_clear(&inp->ovr);
-            update_screen(ctx, PNIL, False);
-        } break;
-        default: break;
-    }
+    while (arrlen(queue_arr)) {
+        Pt curr = arrpop(queue_arr);
 
-    input_mode_free(&inp->mode);
-    inp->mode.t = mode_tag;
+        for (i32 dir = 0; dir < 4; ++dir) {
+            Pt d_curr = {curr.x + d_rows[dir], curr.y + d_cols[dir]};
 
-    switch (inp->mode.t) {
-        case InputT_Color: inp->mode.d.col = (struct InputColorData) {.current_digit = 0}; break;
-        case InputT_Console: {
-            inp->mode.d.cl = (struct InputConsoleData) {0};
-            if (CONSOLE_AUTO_COMPLETIONS) {
-                cl_compls_new(&inp->mode.d.cl);
-            }
-        } break;
-        case InputT_Interact: break;
-        case InputT_Transform:
-            inp->mode.d.trans = (struct InputTransformData) {
-                .acc = TRANSFORM_DEFAULT,
-                .curr = TRANSFORM_DEFAULT,
-            };
-            break;
-        case InputT_Text:
-            if (tc->t == Tool_Text) {
-                inp->mode.d.text = (struct InputTextData) {.tool_data = tc->d.text};
-            } else {
-                inp->mode.d.text = (struct InputTextData) {0};
+            if (!ximage_is_valid_pt(im, d_curr.x, d_curr.y)) {
+                continue;
             }
-            break;
-    }
-}
 
-void input_mode_free(struct InputMode* input_mode) {
-    switch (input_mode->t) {
-        case InputT_Console: cl_free(&input_mode->d.cl); break;
-        case InputT_Text: arrfree(input_mode->d.text.textarr); break;
-        default: break;
-    }
-}
+            // filled pixels are skipped, area_im may be the same image
+            if (XGetPixel((XImage*)area_im, d_curr.x, d_curr.y) == area_col
+                && XGetPixel(im, d_curr.x, d_curr.y) != targ_col) {
+                XPutPixel(im, d_curr.x, d_curr.y, targ_col);
+                damage = rect_expand(damage, (Rect) {d_curr.x, d_curr.y, d_curr.x, d_curr.y});
 
-char const* input_mode_as_str(enum InputTag mode_tag) {
-    switch (mode_tag) {
-        case InputT_Interact: return "INT";
-        case InputT_Color: return "COL";
-        case InputT_Console: return "CMD";
-        case InputT_Transform: return "TFM";
-        case InputT_Text: return "TXT";
+                arrpush(queue_arr, d_curr);
+            }
+        }
     }
-    return "???";
-}
 
-void input_free(struct Input* input) {
-    input_mode_free(&input->mode);
-    overlay_free(&input->ovr);
-}
+    arrfree(queue_arr);
 
-InputModeFlags input_mode_to_flag(enum InputTag mode) {
-    switch (mode) {
-        case InputT_Interact: return MF_Int;
-        case InputT_Color: return MF_Color;
-        case InputT_Transform: return MF_Trans;
-        // managed manually, don't have mode flag
-        case InputT_Console:
-        case InputT_Text: return 0;
-    }
-    UNREACHABLE();
-    return 0;
+    return damage;
 }
 
-void text_mode_push(struct Ctx* ctx, char c) {
-    if (ctx->input.mode.t != InputT_Text) {
-        return;
+Rect ximage_calc_damage(XImage* im) {
+    Rect damage = RNIL;
+    for (i32 i = 0; i < im->width; ++i) {
+        for (i32 j = 0; j < im->height; ++j) {
+            if (XGetPixel(im, i, j) != 0) {
+                damage = rect_expand(damage, (Rect) {i, j, i, j});
+            }
+        }
     }
-
-    struct InputTextData* td = &ctx->input.mode.d.text;
-    arrpush(td->textarr, c);
-
-    text_mode_rerender(ctx);
+    return damage;
 }
 
-Bool text_mode_pop(struct Ctx* ctx) {
-    if (ctx->input.mode.t != InputT_Text) {
-        return False;
+Rect canvas_text(struct DrawCtx* dc, XImage* im, Pt lt_c, XftFont* font, argb col, char const* text, u32 text_len) {
+    Rect damage = RNIL;
+    if (text == NULL || im == NULL || dc == NULL) {
+        return damage;
     }
 
-    struct InputTextData* td = &ctx->input.mode.d.text;
-    if (!td->textarr) {
-        return False;
+    XRenderColor xrendercol = argb_to_xrender_color(col);
+    XRenderColor transp_xrendercol = argb_to_xrender_color(0x00000000);
+    XftColor color;
+    XftColor transp;
+    if (!XftColorAllocValue(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &xrendercol, &color)) {
+        trace("xpaint: canvas_text: failed to create xft color");
+        return damage;
+    }
+    if (!XftColorAllocValue(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &transp_xrendercol, &transp)) {
+        XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &color);
+        trace("xpaint: canvas_text: failed to create xft color");
+        return damage;
     }
 
-    usize const size = arrlen(td->textarr);
-    if (size == 0) {
-        return False;
+    Rect const text_rect = get_string_rect(dc, font, text, text_len, lt_c);
+    Pt const text_dims = rect_dims(text_rect);
+
+    Pixmap pm = XCreatePixmap(dc->dp, dc->window, text_dims.x, text_dims.y, dc->sys.vinfo.depth);
+    XftDraw* d = XftDrawCreate(dc->dp, pm, dc->sys.vinfo.visual, dc->sys.colmap);
+    if (!d) {
+        XFreePixmap(dc->dp, pm);
+        XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &transp);
+        XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &color);
+        trace("xpaint: canvas_text: failed to create xft draw");
+        return damage;
     }
-    arrpoputf8(td->textarr);
 
-    text_mode_rerender(ctx);
-    return True;
-}
+    // initial contents of Pixmap are undefined
+    XftDrawRect(d, &transp, 0, 0, text_dims.x, text_dims.y);
+    // x, y == left-baseline
+    XftDrawStringUtf8(d, &color, font, 0, font->height - font->descent, (FcChar8*)text, (i32)text_len);
+    damage = rect_expand(damage, text_rect);
 
-void text_mode_rerender(struct Ctx* ctx) {
-    struct Input* inp = &ctx->input;
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    if (inp->mode.t != InputT_Text) {
-        return;
+    /* apply pixmap with text on input image */ {
+        XImage* image = XGetImage(dc->dp, pm, 0, 0, text_dims.x, text_dims.y, AllPlanes, ZPixmap);
+        canvas_copy_region(im, image, (Pt) {0, 0}, text_dims, (Pt) {text_rect.l, text_rect.t});
+        XDestroyImage(image);
     }
-    struct InputTextData* td = &inp->mode.d.text;
 
-    input_set_damage(inp, RNIL);
-    overlay_clear(&inp->ovr);
-    Rect const damage = canvas_text(
-        &ctx->dc,
-        inp->ovr.im,
-        td->tool_data.lb_corner,
-        tc->text_font,
-        *tc_curr_col(tc),
-        td->textarr,
-        arrlen(td->textarr)
-    );
-    inp->ovr.rect = damage;
-    input_set_damage(inp, damage);
-}
+    XftDrawDestroy(d);
+    XFreePixmap(dc->dp, pm);
+    XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &transp);
+    XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &color);
 
-void sel_circ_on_select_tool(struct Ctx* ctx, union SCI_Arg tool) {
-    tc_set_tool(&CURR_TC(ctx), tool.tool, NULL);
+    return damage;
 }
 
-void sel_circ_on_select_drawer(struct Ctx* ctx, union SCI_Arg tool) {
-    tc_set_tool(
-        &CURR_TC(ctx),
-        Tool_Drawer,
-        &(union ToolData) {
-            .drawer =
-                (struct DrawerData) {
-                    .shape = tool.drawer,
-                    .spacing = tool.drawer == DS_Square ? 0.0 : TOOLS_BRUSH_DEFAULT_SPACING,
-                    .hardness = TOOLS_BRUSH_DEFAULT_HARDNESS,
-                },
-        }
-    );
-}
+Rect canvas_dash_rect(XImage* im, Pt c, Pt dims, u32 w, u32 dash_w, argb col1, argb col2) {
+    Rect damage = RNIL;
 
-void sel_circ_on_select_figure_toggle_fill(struct Ctx* ctx, __attribute__((unused)) union SCI_Arg arg) {
-    struct ToolCtx* tc = &CURR_TC(ctx);
+    Rect const rect = rect_bound((Rect) {c.x, c.y, c.x + dims.x, c.y + dims.y}, ximage_rect(im));
+    Pt corners[4] = {0};
+    rect_corners(rect, corners);
+
+    for (u32 i = 0; i < LENGTH(corners); ++i) {
+        Pt curr = corners[i];
+        Pt const to = corners[(i + 1) % LENGTH(corners)];
+        Pt const delta = {to.x - curr.x, to.y - curr.y};
+        assert(delta.x == 0 || delta.y == 0);
+        Pt const delta_sign = {delta.x == 0 ? 0 : delta.x > 0 ? 1 : -1, delta.y == 0 ? 0 : delta.y > 0 ? 1 : -1};
+
+        u32 iterations = 0;
+        while (!PT_EQ(curr, to) && iterations < 10000000) {
+            Pt const lt = (Pt) {curr.x - ((i32)w / 2), curr.y - ((i32)w / 2)};
+            argb col = !dash_w ? col1 : iterations / dash_w % 2 ? col1 : col2;
+            Rect d = canvas_fill_rect(im, lt, (Pt) {(i32)w, (i32)w}, col);
+            damage = rect_expand(damage, d);
 
-    if (tc->t == Tool_Figure) {
-        tc->d.fig.fill ^= 1;
+            curr.x += delta_sign.x;
+            curr.y += delta_sign.y;
+            iterations += 1;
+        }
     }
+
+    return damage;
 }
 
-void sel_circ_on_select_figure(struct Ctx* ctx, union SCI_Arg figure) {
-    struct ToolCtx* tc = &CURR_TC(ctx);
+Rect canvas_fill_rect(XImage* im, Pt c, Pt dims, argb col) {
+    Rect damage = RNIL;
 
-    if (tc->t == Tool_Figure) {
-        tc->d.fig.curr = figure.figure;
+    Bool const nx = dims.x < 0;
+    Bool const ny = dims.y < 0;
+    for (i32 x = c.x + (nx ? dims.x : 0); x < c.x + (nx ? 0 : dims.x); ++x) {
+        for (i32 y = c.y + (ny ? dims.y : 0); y < c.y + (ny ? 0 : dims.y); ++y) {
+            if (ximage_put_checked(im, x, y, col)) {
+                damage = rect_expand(damage, (Rect) {x, y, x, y});
+            }
+        }
     }
-}
 
-void sel_circ_on_select_col(struct Ctx* ctx, union SCI_Arg col) {
-    *tc_curr_col(&CURR_TC(ctx)) = col.col;
+    return damage;
 }
 
-void sel_circ_on_select_set_linew(struct Ctx* ctx, union SCI_Arg num) {
-    CURR_TC(ctx).line_w = num.num;
+Rect canvas_rect(XImage* im, Pt c, Pt dims, u32 line_w, argb col) {
+    return canvas_dash_rect(im, c, dims, line_w, 0, col, col);
 }
 
-void sel_circ_init_and_show(struct Ctx* ctx, Button button, i32 x, i32 y) {
-    sel_circ_free_and_hide(&ctx->sc);
+// FIXME only used for Figure_Rectangle, rest handled in canvas_regular_poly
+static Pt canvas_figure_fill_pt_helper(enum FigureType type, Pt a, Pt b, Pt im_dims) {
+    switch (type) {
+        case Figure_Circle:
+        case Figure_Rectangle:
+        case Figure_Triangle:
+            return (Pt) {
+                CLAMP((a.x + b.x) / 2, 0, im_dims.x - 1),
+                CLAMP((a.y + b.y) / 2, 0, im_dims.y - 1),
+            };
+    }
+    return (Pt) {-1, -1};  // will not fill anything
+}
 
+Rect canvas_figure(struct Ctx* ctx, XImage* im, u32 variant, Pt p_static, Pt p_dynamic) {
+    if (IS_PNIL(p_static) || IS_PNIL(p_dynamic)) {
+        return RNIL;
+    }
     struct ToolCtx* tc = &CURR_TC(ctx);
-    struct SelectionCircle* sc = &ctx->sc;
-
-    sc->x = x;
-    sc->y = y;
-
-    switch (ctx->input.mode.t) {
-        case InputT_Text:
-        case InputT_Transform:
-        case InputT_Console: break;
-        case InputT_Color: {
-            sc->draw_separators = False;
-
-            if (BTN_EQ(button, BTN_SEL_CIRC)) {
-                for (u32 hue_int = 0; hue_int < SEL_CIRC_COLOR_ITEMS; ++hue_int) {
-                    double hue = (double)hue_int / SEL_CIRC_COLOR_ITEMS;
-                    argb col = argb_from_hsl(hue, 1.0, 0.5);
-                    struct Item item = {
-                        .arg.col = col,
-                        .on_select = &sel_circ_on_select_col,
-                        .col_outer = col,
-                        .col_inner = COL_BG(&ctx->dc, SchmNorm),
-                    };
-                    arrpush(sc->items_arr, item);
-                }
-            } else {
-                argb base_col = *tc_curr_col(tc);
-                for (u32 i = 0; i < SEL_CIRC_COLOR_ITEMS; ++i) {
-                    double t = (double)i / SEL_CIRC_COLOR_ITEMS;
-                    argb col = 0xFF000000;
-
-                    double const span_grey = 0.15;
-                    double const span_white = 0.2;
-                    double const span_bright = 0.5;
-                    double const span_dark = 0.75;
-                    double const span_black = 1.0;
-
-                    if (t < span_grey) {
-                        t = t / span_grey;
-                        u8 const grey = (u8)(t * 255.0);
-                        col = 0xFF000000 | (grey << 16) | (grey << 8) | grey;
-                    } else if (t < span_white) {
-                        t = (t - span_grey) / (span_white - span_grey);
-                        col = argb_blend(0xFFFFFFFF, base_col | 0x00FFFFFF, (u8)((1.0 - t) * 255.0));
-                    } else if (t < span_bright) {
-                        t = (t - span_white) / (span_bright - span_white);
-                        col = argb_blend(base_col | 0x00FFFFFF, base_col, (u8)((1.0 - t) * 255.0));
-                    } else if (t < span_dark) {
-                        t = (t - span_bright) / (span_dark - span_bright);
-                        col = argb_blend(base_col, base_col & 0xFF7F7F7F, (u8)((1.0 - t) * 255.0));
-                    } else {
-                        t = (t - span_dark) / (span_black - span_dark);
-                        col = argb_blend(base_col & 0xFF7F7F7F, 0xFF000000, (u8)((1.0 - t) * 255.0));
-                    }
+    if (tc->t != Tool_Figure) {
+        return RNIL;
+    }
+    struct FigureData const* fig = &tc->d.fig;
+    argb const col = *tc_curr_col(tc);
 
-                    struct Item item = {
-                        .arg.col = col,
-                        .on_select = &sel_circ_on_select_col,
-                        .col_outer = col,
-                        .col_inner = COL_BG(&ctx->dc, SchmNorm),
-                    };
-                    arrpush(sc->items_arr, item);
+    if (variant == 1) {
+        switch (fig->curr) {
+            case Figure_Rectangle: {
+                Rect const damage = canvas_rect(
+                    im,
+                    p_static,
+                    (Pt) {p_dynamic.x - p_static.x, p_dynamic.y - p_static.y},
+                    tc->line_w,
+                    col
+                );
+                if (fig->fill) {
+                    Pt const im_dims = {im->width, im->height};
+                    Pt const fill_pt = canvas_figure_fill_pt_helper(fig->curr, p_dynamic, p_static, im_dims);
+                    ximage_flood_fill(im, col, fill_pt.x, fill_pt.y);
                 }
+                return damage;
             }
-        } break;
-        case InputT_Interact: {
-            sc->draw_separators = True;
+            case Figure_Circle:
+            case Figure_Triangle: {
+                // d_static at figure center
+                Pt const diff = {p_dynamic.x - p_static.x, p_dynamic.y - p_static.y};
+                Pt const p_opposite = {p_static.x - diff.x, p_static.y - diff.y};
 
-            if (BTN_EQ(button, BTN_SEL_CIRC)) {
-                switch (tc->t) {
-                    case Tool_Text:
-                    case Tool_Selection:
-                    case Tool_Drawer:
-                    case Tool_Fill:
-                    case Tool_Picker: {
-                        struct Item items[] = {
-                            {.arg.tool = Tool_Text, .on_select = &sel_circ_on_select_tool, .icon = I_Text},
-                            {.arg.tool = Tool_Selection, .on_select = &sel_circ_on_select_tool, .icon = I_Select},
-                            {.arg.drawer = DS_Square, .on_select = &sel_circ_on_select_drawer, .icon = I_Pencil},
-                            {.arg.tool = Tool_Fill, .on_select = &sel_circ_on_select_tool, .icon = I_Fill},
-                            {.arg.tool = Tool_Picker, .on_select = &sel_circ_on_select_tool, .icon = I_Picker},
-                            {.arg.drawer = DS_Brush, .on_select = &sel_circ_on_select_drawer, .icon = I_Brush},
-                            {.arg.drawer = DS_CircleRandom, .on_select = &sel_circ_on_select_drawer, .icon = I_Spray},
-                            {.arg.tool = Tool_Figure, .on_select = &sel_circ_on_select_tool, .icon = I_Figure},
-                        };
-                        for (u32 i = 0; i < LENGTH(items); ++i) {
-                            arrpush(sc->items_arr, items[i]);
-                        }
-                    } break;
-                    case Tool_Figure: {
-                        struct Item items[] = {
-                            {.arg.figure = Figure_Circle, .on_select = &sel_circ_on_select_figure, .icon = I_FigCirc},
-                            {.arg.figure = Figure_Rectangle, .on_select = &sel_circ_on_select_figure, .icon = I_FigRect
-                            },
-                            {.arg.figure = Figure_Triangle, .on_select = &sel_circ_on_select_figure, .icon = I_FigTri},
-                            {.on_select = &sel_circ_on_select_figure_toggle_fill,
-                             .icon = tc->d.fig.fill ? I_FigFillOff : I_FigFillOn},
-                            {.arg.drawer = DS_Square, .on_select = &sel_circ_on_select_drawer, .icon = I_Pencil},
-                        };
-                        for (u32 i = 0; i < LENGTH(items); ++i) {
-                            arrpush(sc->items_arr, items[i]);
-                        }
-                    } break;
-                }
-            } else {
-                for (u32 i = 0; i < LENGTH(ALTERNATIVE_SEL_CIRC_ITEMS); ++i) {
-                    arrpush(sc->items_arr, ALTERNATIVE_SEL_CIRC_ITEMS[i]);
-                }
+                Rect damage =
+                    canvas_regular_poly(im, tc, figure_side_count(fig->curr), p_dynamic, p_opposite, fig->fill);
+                return damage;
             }
-        } break;
+        }
+    } else {
+        switch (fig->curr) {
+            case Figure_Circle:
+            case Figure_Rectangle:
+            case Figure_Triangle: {
+                Rect damage = canvas_regular_poly(im, tc, figure_side_count(fig->curr), p_dynamic, p_static, fig->fill);
+                return damage;
+            }
+        }
     }
-}
 
-void sel_circ_free_and_hide(struct SelectionCircle* sel_circ) {
-    if (sel_circ->items_arr) {
-        arrfree(sel_circ->items_arr);
-        sel_circ->items_arr = NULL;
-    }
+    return RNIL;
 }
 
-i32 sel_circ_curr_item(struct SelectionCircle const* sc, i32 x, i32 y) {
-    if (sc == NULL || sc->items_arr == NULL) {
-        return NIL;
+// FIXME runs in runtime
+static DPt get_inr_circmr_cfs(u32 n) {
+    // from https://math.stackexchange.com/a/3504360
+    if (n % 2 == 0) {
+        return (DPt) {0.5, 0.5};
     }
+    double const h = 1;
+    double const side = 2.0 * h * sin(PI / n) / (1 + cos(PI / n));
+    double const inradius = side / 2.0 / tan(PI / n);
+    double const circumradius = side / 2.0 / sin(PI / n);
+    return (DPt) {inradius, circumradius};
+}
 
-    i32 const pointer_x_rel = x - sc->x;
-    i32 const pointer_y_rel = y - sc->y;
-    if (pointer_x_rel == 0 && pointer_y_rel == 0) {
-        return NIL;  // prevent 0.0 / 0.0 division
+// n vertices of regular polygon from side middle (or vertex) a to opposite vertex (or side middle) b
+static void regular_poly_vertices(u32 n, Pt a, Pt b, DPt* out) {
+    DPt const inr_circmr = get_inr_circmr_cfs(n);
+    DPt const c = {
+        a.x + ((b.x - a.x) * inr_circmr.x),
+        a.y + ((b.y - a.y) * inr_circmr.x),
+    };
+    DPt curr = {
+        (b.x - a.x) * inr_circmr.y,
+        (b.y - a.y) * inr_circmr.y,
+    };
+    for (u32 i = 0; i < n; ++i) {
+        curr = dpt_rotate(curr, 360.0 / n);
+        out[i] = dpt_add(c, curr);
     }
+}
 
-    i32 const items_len = MAX(1, arrlen(sc->items_arr));
-    double const segment_rad = PI * 2.0 / (double)items_len;
-    double const segment_deg = segment_rad / PI * 180;
-    double const pointer_r = sqrt((pointer_x_rel * pointer_x_rel) + (pointer_y_rel * pointer_y_rel));
-
-    if (pointer_r > SEL_CIRC_OUTER_R_PX || pointer_r < SEL_CIRC_INNER_R_PX) {
-        return NIL;
-    }
-    // FIXME do it right
-    double angle = -atan(pointer_y_rel * 1.0 / pointer_x_rel) / PI * 180;
-    if (pointer_x_rel < 0) {
-        angle += 180;
-    } else if (pointer_y_rel >= 0) {
-        angle += 360;
+Rect canvas_regular_poly_frame_helper(
+    XImage* im,
+    u32 n,
+    Pt a,
+    Pt b,
+    struct DrawerData data,
+    u32 line_w,
+    argb col,
+    DPt* edges_optout  // n items
+) {
+    struct Brush brush_cache = {0};
+    Rect damage = RNIL;
+    DPt* edges = edges_optout ? edges_optout : arena_alloc(&frame_arena, n, sizeof(DPt));
+    regular_poly_vertices(n, a, b, edges);
+    for (u32 i = 0; i < n; ++i) {
+        // only hard lines, no spacing needed
+        Rect line_damage = canvas_line_no_spacing(
+            &canvas_line_drawer_callback,
+            &(struct CanvasLineDrwCtxDrawer) {
+                .im = im,
+                .brush_in_out = &brush_cache,
+                .data = data,
+                .line_w = line_w,
+                .col = col,
+            },
+            dpt_to_pt(edges[(i + n - 1) % n]),
+            dpt_to_pt(edges[i])
+        );
+        damage = rect_expand(damage, line_damage);
     }
 
-    i32 const result = (i32)floor(angle / segment_deg);
-
-    // on 360 degrees result is equal to items_len
-    return CLAMP(result, 0, items_len - 1);
+    brush_cache_free(&brush_cache);
+    return damage;
 }
 
-Rect tool_selection_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
-    if (!BTN_EQ(get_btn(event), BTN_MAIN) && !BTN_EQ(get_btn(event), BTN_COPY_SELECTION)) {
-        return RNIL;
-    }
-
-    struct DrawCtx* dc = &ctx->dc;
-    struct Input* inp = &ctx->input;
-
-    Pt const pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-    i32 const begin_x = CLAMP(inp->c.pos.x, 0, dc->cv.im->width);
-    i32 const begin_y = CLAMP(inp->c.pos.y, 0, dc->cv.im->height);
-    i32 const end_x = CLAMP(pointer.x, 0, dc->cv.im->width);
-    i32 const end_y = CLAMP(pointer.y, 0, dc->cv.im->height);
+// moves `a` to `b` by `distance` and stores to `c`. and `d` = `b` --> `a`
+static void canvas_regular_poly_point_helper(DPt a, DPt b, u32 distance, DPt* c, DPt* d) {
+    DPt const delta = {b.x - a.x, b.y - a.y};
+    double const dist = sqrt((delta.x * delta.x) + (delta.y * delta.y));
 
-    Pt p = {MIN(begin_x, end_x), MIN(begin_y, end_y)};
-    Pt dims = (Pt) {MAX(begin_x, end_x) - p.x, MAX(begin_y, end_y) - p.y};
+    if (dist <= distance) {
+        return;
+    }
 
-    input_set_damage(inp, RNIL);
-    overlay_clear(&inp->ovr);
+    DPt const unit = {delta.x / dist, delta.y / dist};  // unit vector from a to b
 
-    Rect damage = canvas_copy_region(inp->ovr.im, dc->cv.im, p, dims, p);
-    overlay_expand_rect(&inp->ovr, damage);
+    double const t = dist - distance;  // move-in amount for each point
+    if (c) {
+        *c = (DPt) {b.x - (unit.x * t), b.y - (unit.y * t)};
+    }
+    if (d) {
+        *d = (DPt) {a.x + (unit.x * t), a.y + (unit.y * t)};
+    }
+}
 
-    if (!IS_RNIL(damage)) {
-        // move on BTN_MAIN, copy on BTN_COPY_SELECTION
-        if (!BTN_EQ(get_btn(event), BTN_COPY_SELECTION)) {
-            history_forward(ctx, history_new_as_damage(dc->cv.im, damage));
+static DPt circumcenter_from_height(unsigned N, DPt V, DPt H) {
+    DPt O = DPNIL;
+    if (N < 3) {
+        return O;
+    }
 
-            argb bg_col = CANVAS_BACKGROUND;  // FIXME set in runtime?
-            canvas_fill_rect(dc->cv.im, p, dims, bg_col);
-        }
+    double dx = H.x - V.x;
+    double dy = H.y - V.y;
+    double d = sqrt((dx * dx) + (dy * dy));
+    double angle = PI / N;
+    double c = cos(angle);
 
-        input_mode_set(ctx, InputT_Transform);
+    if (N & 1) {
+        double R = d / (1.0 + c);
+        double t = R / d;
+        O.x = V.x + dx * t;
+        O.y = V.y + dy * t;
+    } else {
+        // Center is midpoint between V and the midpoint of the opposite side (H)
+        O.x = (V.x + H.x) * 0.5;
+        O.y = (V.y + H.y) * 0.5;
     }
-
-    // all actions already done above
-    return RNIL;
+    return O;
 }
 
-Rect tool_text_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
-    if (!BTN_EQ(get_btn(event), BTN_MAIN)) {
-        return RNIL;
+// find valid fill points within image and figure and use flood fill at them
+static void canvas_regular_poly_fill_helper(
+    XImage* im,
+    DPt const* edges,
+    u32 edges_len,
+    DPt center,
+    double indent,
+    argb col
+) {
+    if (edges_len < 3) {
+        return;
+    }
+    // too small, so just fill inside
+    if (dpt_dist(edges[0], center) < indent) {
+        ximage_flood_fill(im, col, (i32)center.x, (i32)center.y);
+        return;
     }
 
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    assert(tc->t == Tool_Text);
-
-    tc->d.text.lb_corner = pt_from_scr_to_cv_xy(&ctx->dc, event->x, event->y);
-    input_mode_set(ctx, InputT_Text);
+    for (u32 i = 0; i < edges_len; ++i) {
+        u32 const prev_index = MIN(i - 1, edges_len - 1);
+        DPt prev = DPNIL;
+        DPt curr = DPNIL;
+        canvas_regular_poly_point_helper(edges[prev_index], center, (u32)indent, &prev, NULL);
+        canvas_regular_poly_point_helper(edges[i], center, (u32)indent, &curr, NULL);
+        // flood fill optimized for spam
+        canvas_line_no_spacing(
+            &canvas_line_flood_fill_callback,
+            &(struct CanvasLineDrwCtxFloodFill) {.im = im, .col = col},
+            dpt_to_pt(prev),
+            dpt_to_pt(curr)
+        );
+    }
+}
 
-    return RNIL;
+// calculate distance between edges from distance between sides
+static double canvas_regular_poly_line_w_helper(u32 n, u32 line_w) {
+    // angle of regular polygon
+    double const angle = (((180.0 * n) - 360.0) / 2.0) * PI / 180.0;
+    // length of hypotenuse
+    return line_w / sin(angle / n);
 }
 
-Rect tool_selection_on_drag(struct Ctx* ctx, XMotionEvent const* event) {
-    if (!BTN_EQ(ctx->input.c.btn, BTN_MAIN) && !BTN_EQ(ctx->input.c.btn, BTN_COPY_SELECTION)) {
-        return RNIL;
+Rect canvas_regular_poly(XImage* im, struct ToolCtx* tc, u32 n, Pt a, Pt b, Bool fill) {
+    DPt const a_dpt = {a.x, a.y};
+    DPt const b_dpt = {b.x, b.y};
+    u32 const line_w = tc->line_w;
+    argb const col = *tc_curr_col(tc);
+    static struct DrawerData const circle_data = {.shape = DS_Circle, .spacing = 0.0, .hardness = 1.0};
+    static struct DrawerData const point_data = {.shape = DS_Point, .spacing = 0.0, .hardness = 1.0};
+
+    // fill strategy will not work for small line_w
+    if (!fill && tc->line_w < 10) {
+        DPt c = DPNIL;
+        DPt d = DPNIL;
+        canvas_regular_poly_point_helper(a_dpt, b_dpt, tc->line_w / 2, &c, &d);
+        if (!IS_PNIL(c) && !IS_PNIL(d)) {
+            return canvas_regular_poly_frame_helper(im, n, dpt_to_pt(c), dpt_to_pt(d), circle_data, line_w, col, NULL);
+        }
+        return canvas_regular_poly_frame_helper(im, n, a, b, circle_data, line_w, col, NULL);
     }
 
-    struct Input* inp = &ctx->input;
-    struct DrawCtx* dc = &ctx->dc;
-    Pt pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-    i32 const begin_x = MIN(pointer.x, inp->c.pos.x);
-    i32 const begin_y = MIN(pointer.y, inp->c.pos.y);
-    i32 const end_x = MAX(pointer.x, inp->c.pos.x);
-    i32 const end_y = MAX(pointer.y, inp->c.pos.y);
-    i32 const w = end_x - begin_x;
-    i32 const h = end_y - begin_y;
+    // draw outer frame
+    DPt* edges = arena_alloc(&frame_arena, n, sizeof(DPt));
+    DPt const center = circumcenter_from_height(n, (DPt) {b.x, b.y}, (DPt) {a.x, a.y});
+    double const indent = canvas_regular_poly_line_w_helper(n, tc->line_w);
+    Rect const damage = canvas_regular_poly_frame_helper(im, n, a, b, point_data, line_w, col, edges);
 
-    input_set_damage(inp, RNIL);
-    overlay_clear(&inp->ovr);
+    // draw inner frame to restrict fill
+    if (!fill && n > 1) {
+        // canvas_regular_poly_frame_helper on moved a and b will draw Figure_Triangle badly
+        for (u32 i = 0; i < n; ++i) {
+            u32 const prev_index = MIN(i - 1, n - 1);
+            DPt prev = DPNIL;
+            DPt curr = DPNIL;
+            canvas_regular_poly_point_helper(edges[prev_index], center, (u32)indent, &prev, NULL);
+            canvas_regular_poly_point_helper(edges[i], center, (u32)indent, &curr, NULL);
+            // point_data will not work with spacing
+            canvas_line_no_spacing(
+                &canvas_line_drawer_callback,
+                &(struct CanvasLineDrwCtxDrawer) {
+                    .im = im,
+                    .brush_in_out = &tc->brush_cache,
+                    .line_w = line_w,
+                    .data = point_data,
+                    .col = col,
+                },
+                dpt_to_pt(prev),
+                dpt_to_pt(curr)
+            );
+        }
+    }
 
-    u32 const line_w = (u32)MAX(1, ceil(1.5 / ZOOM_C(dc)));
+    // fill between outer and inner frame
+    // without inner flame this will fill whole figure
+    double const fill_indent = (indent * 0.1) + 2.5;  // static part for indent == 1
+    canvas_regular_poly_fill_helper(im, edges, n, center, fill_indent, *tc_curr_col(tc));
 
-    Rect damage = canvas_dash_rect(
-        inp->ovr.im,
-        (Pt) {begin_x, begin_y},
-        (Pt) {w - 1, h - 1},  // inclusive
-        line_w,
-        line_w * 2,
-        COL_BG(dc, SchmNorm),
-        COL_FG(dc, SchmNorm)
-    );
     return damage;
 }
 
-Rect tool_drawer_on_press(struct Ctx* ctx, XButtonPressedEvent const* event) {
-    if (!BTN_EQ(get_btn(event), BTN_MAIN)) {
-        return RNIL;
-    }
-
-    struct DrawCtx* dc = &ctx->dc;
-    struct ToolCtx* tc = &CURR_TC(ctx);
-
-    if (!state_match(event->state, ShiftMask)) {
-        ctx->input.anchor = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-        return canvas_apply_drawer(
-            ctx->input.ovr.im,
-            tc->d.drawer,
-            tc->line_w,
-            *tc_curr_col(tc),
-            pt_from_scr_to_cv_xy(dc, event->x, event->y),
-            &tc->brush_cache
-        );
-    }
+Rect canvas_line(
+    Rect (*drawer)(void* drw_ctx, Pt p),
+    void* drw_ctx,
+    Pt from,
+    Pt const to,
+    u32 line_w,
+    double spacing,
+    Bool draw_first_pt
+) {
+    // XXX tc may be NULL
+    u32 const CANVAS_LINE_MAX_STEPS = 1000000;
 
-    return RNIL;
-}
+    Rect damage = RNIL;
 
-Rect tool_drawer_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
-    if (!BTN_EQ(get_btn(event), BTN_MAIN)) {
+    if (IS_PNIL(from) || IS_PNIL(to)) {
         return RNIL;
     }
 
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    struct DrawCtx* dc = &ctx->dc;
-    assert(tc->t == Tool_Drawer);
-    struct DrawerData* drawer = &tc->d.drawer;
-
-    Pt begin = ctx->input.anchor;
-    Pt end = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-    XImage* const im = ctx->input.ovr.im;
-
-    ctx->input.anchor = end;
+    i32 dx = abs(to.x - from.x);
+    i32 sx = from.x < to.x ? 1 : -1;
+    i32 dy = -abs(to.y - from.y);
+    i32 sy = from.y < to.y ? 1 : -1;
+    i32 error = dx + dy;
+    i32 spacing_cnt = 0;
+    i32 spacing_max = (i32)(line_w * spacing);
 
-    // all points with drag motion drawn in on_drag
-    if (ctx->input.c.state != CS_Drag && state_match(event->state, ShiftMask)) {
-        return canvas_line(
-            &canvas_line_drawer_callback,
-            &(struct CanvasLineDrwCtxDrawer) {
-                .im = im,
-                .brush_in_out = &tc->brush_cache,
-                .data = *drawer,
-                .line_w = tc->line_w,
-                .col = *tc_curr_col(tc),
-            },
-            begin,
-            end,
-            tc->line_w,
-            drawer->spacing,
-            False
-        );
+    u32 steps = 0;  // prevent infinite loops
+    while (++steps < CANVAS_LINE_MAX_STEPS) {
+        if (draw_first_pt && spacing_cnt == 0) {
+            Rect pt_damage = drawer(drw_ctx, from);
+            damage = rect_expand(damage, pt_damage);
+        }
+        if (PT_EQ(from, to)) {
+            break;
+        }
+        i32 e2 = 2 * error;
+        if (e2 >= dy) {
+            if (from.x == to.x) {
+                break;
+            }
+            error += dy;
+            from.x += sx;
+        }
+        if (e2 <= dx) {
+            if (from.y == to.y) {
+                break;
+            }
+            error += dx;
+            from.y += sy;
+        }
+        if (spacing_max) {
+            spacing_cnt = (spacing_cnt + 1) % spacing_max;
+        }
+        draw_first_pt = True;
     }
 
-    return RNIL;
+    return damage;
 }
 
-Rect tool_drawer_on_drag(struct Ctx* ctx, XMotionEvent const* event) {
-    if (!BTN_EQ(ctx->input.c.btn, BTN_MAIN)) {
-        return RNIL;
-    }
+Rect canvas_line_no_spacing(Rect (*drawer)(void* drw_ctx, Pt p), void* drw_ctx, Pt from, Pt to) {
+    return canvas_line(drawer, drw_ctx, from, to, 1, 0.0, True);
+}
 
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    struct DrawCtx* dc = &ctx->dc;
-    assert(tc->t == Tool_Drawer);
-    struct DrawerData const* drawer = &tc->d.drawer;
-    XImage* const im = ctx->input.ovr.im;
+// writes d * d pixels to `result`
+static void fill_circle_brush(argb* result, argb col, double hardness, u32 d, Bool random) {
+    if (d == 0) {
+        return;
+    }
+    if (d == 1) {
+        result[0] = col;
+        return;
+    }
+    memset(result, 0, (usize)d * d * sizeof(argb));
 
-    Pt const pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-    Pt const anchor = ctx->input.anchor;
-
-    Rect damage = canvas_line(
-        &canvas_line_drawer_callback,
-        &(struct CanvasLineDrwCtxDrawer) {
-            .im = im,
-            .brush_in_out = &tc->brush_cache,
-            .data = *drawer,
-            .col = *tc_curr_col(tc),
-            .line_w = tc->line_w,
-        },
-        anchor,
-        pointer,
-        tc->line_w,
-        drawer->spacing,
-        False
-    );
+    double const c = (d - 1) / 2.0;
+    double const r = d / 2.0;
+    double const r_sq = r * r;
 
-    if (!IS_RNIL(damage)) {
-        ctx->input.anchor = pointer;
+    for (i32 y = 0; y < (i32)d; ++y) {
+        double dy = (y - c);
+        for (i32 x = 0; x < (i32)d; ++x) {
+            double dx = (x - c);
+            double const dist_sq = (dx * dx) + (dy * dy);
+            if (dist_sq < r_sq) {
+                if (random) {
+                    double const curr_r = (double)rand() / (double)RAND_MAX;  // NOLINT(cert-msc30-c, cert-msc50-cpp)
+                    double const threshold = ease_in_expo(hardness + 0.1);
+                    result[(y * d) + x] = curr_r < threshold ? col : 0;
+                } else {
+                    u8 const alpha = (u8)((1.0 - ease_out_cubic_hardness(hardness, dist_sq / r_sq)) * 0xFF);
+                    argb const curr_col = (col & 0x00FFFFFF) | ((u32)alpha << (8 * 3));
+                    result[(y * d) + x] = curr_col;
+                }
+            }
+        }
     }
-
-    return damage;
 }
 
-Rect tool_figure_on_press(struct Ctx* ctx, XButtonPressedEvent const* event) {
-    if (!BTN_EQ(get_btn(event), BTN_MAIN)) {
-        return RNIL;
+// copy `brush_arr` to `im` at `lt` corner
+static Pt canvas_apply_brush(XImage* im, argb const* brush_arr, Pt brush_dims, Pt lt) {
+    // XXX this implementation assumes XImage::data is flattened 2D array of `argb` values
+    if (!im || !brush_arr || IS_PNIL(brush_dims)) {
+        return PNIL;
     }
+    Pt dims = {
+        .x = MAX(0, MIN(brush_dims.x, im->width - lt.x)),
+        .y = MAX(0, MIN(brush_dims.y, im->height - lt.y)),
+    };
 
-    struct DrawCtx* dc = &ctx->dc;
+    // all messy logic is needed to crop brush_arr to im dimentions
+    for (i32 row = 0; row < dims.y; ++row) {
+        if (dims.y < -lt.x || row < -lt.y) {
+            continue;  // code below assumes what at least one row/column will be affected
+        }
+        argb const* const brush_row = brush_arr + (ptrdiff_t)(brush_dims.x * row);
+        argb* const im_row_offseted = (argb*)im->data + (ptrdiff_t)(((MAX(0, row + lt.y) * im->width) + MAX(0, lt.x)));
 
-    if (!state_match(event->state, ShiftMask)) {
-        ctx->input.anchor = pt_from_scr_to_cv_xy(dc, event->x, event->y);
+        for (i32 col = 0; col < (dims.x - (lt.x < 0 ? -lt.x : 0)); ++col) {
+            argb const bg = im_row_offseted[col];
+            argb const fg = brush_row[col];
+            // use brush pixel transparency as blending alpha value
+            im_row_offseted[col] = argb_blend(fg | ARGB_ALPHA, bg, (fg >> 0x18) & 0xFF);
+        }
     }
 
-    return RNIL;
+    return dims;
 }
 
-Rect tool_figure_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
-    Button const btn = ctx->input.c.btn;
-    if ((!BTN_EQ(btn, BTN_MAIN) && !BTN_EQ(btn, BTN_MAIN_ALTERNATIVE))
-        || (ctx->input.c.state != CS_Drag && !(state_match(event->state, ShiftMask)))) {
-        return RNIL;
-    }
+Rect canvas_apply_drawer(XImage* im, struct DrawerData data, u32 line_w, argb col, Pt c, struct Brush* brush_in_out) {
+    brush_cache_update(&data, line_w, col, brush_in_out);
+    Pt const brush_dims = brush_in_out->dims;
 
-    struct DrawCtx* dc = &ctx->dc;
-    Pt pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-    Pt anchor = ctx->input.anchor;
-    u32 const fig_variant = BTN_EQ(btn, BTN_MAIN_ALTERNATIVE) ? 1 : 0;
+    Pt lt = (Pt) {c.x - (brush_dims.x / 2), c.y - (brush_dims.y / 2)};
+    canvas_apply_brush(im, brush_in_out->data, brush_dims, lt);
 
-    overlay_clear(&ctx->input.ovr);
-    return canvas_figure(ctx, ctx->input.ovr.im, fig_variant, anchor, pointer);
+    // inclusive
+    return (Rect) {
+        CLAMP(lt.x, 0, im->width - 1),
+        CLAMP(lt.y, 0, im->height - 1),
+        CLAMP(lt.x + brush_dims.x, 0, im->width - 1),
+        CLAMP(lt.y + brush_dims.y, 0, im->height - 1),
+    };
 }
 
-Rect tool_figure_on_drag(struct Ctx* ctx, XMotionEvent const* event) {
-    Button const btn = ctx->input.c.btn;
-    if (!BTN_EQ(btn, BTN_MAIN) && !BTN_EQ(btn, BTN_MAIN_ALTERNATIVE)) {
+Rect canvas_copy_region(XImage* dest, XImage* src, Pt from, Pt dims, Pt to) {
+    assert(from.x >= 0 && from.y >= 0);
+    assert(from.x + dims.x <= src->width && from.y + dims.y <= src->height);
+
+    if (dims.x == 0 || dims.y == 0) {
         return RNIL;
     }
 
-    struct DrawCtx* dc = &ctx->dc;
-    Pt pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-    Pt anchor = ctx->input.anchor;
-    u32 const fig_variant = BTN_EQ(btn, BTN_MAIN_ALTERNATIVE) ? 1 : 0;
-
-    input_set_damage(&ctx->input, RNIL);  // also undo damage
-    overlay_clear(&ctx->input.ovr);
+    // src and dest may be the same image
+    u32* region = arena_alloc(&frame_arena, (usize)dims.x * dims.y, sizeof(u32));
+    for (i32 get_or_set = 1; get_or_set >= 0; --get_or_set) {
+        for (i32 y = 0; y < dims.y; ++y) {
+            for (i32 x = 0; x < dims.x; ++x) {
+                if (get_or_set) {
+                    region[(y * dims.x) + x] = XGetPixel(src, from.x + x, from.y + y);
+                } else {
+                    ximage_put_checked(dest, to.x + x, to.y + y, region[(y * dims.x) + x]);
+                }
+            }
+        }
+    }
 
-    return canvas_figure(ctx, ctx->input.ovr.im, fig_variant, anchor, pointer);
+    return (Rect) {
+        MAX(0, to.x),
+        MAX(0, to.y),
+        MIN(dest->width - 1, to.x + dims.x - 1),
+        MIN(dest->height - 1, to.y + dims.y - 1),
+    };
 }
 
-Rect tool_fill_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
-    if (!BTN_EQ(ctx->input.c.btn, BTN_MAIN)) {
-        return RNIL;
+void canvas_fill(XImage* im, argb col) {
+    for (i32 i = 0; i < im->width; ++i) {
+        for (i32 j = 0; j < im->height; ++j) {
+            XPutPixel(im, i, j, col);
+        }
     }
-
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    struct DrawCtx* dc = &ctx->dc;
-    struct Input* inp = &ctx->input;
-
-    // copy whole canvas to overlay (flood_fill must know surround pixels)
-    usize data_len = ximage_data_len(dc->cv.im);
-    // XXX is XImage::data public member?
-    memcpy(inp->ovr.im->data, dc->cv.im->data, data_len);
-
-    Pt const cur = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-
-    return ximage_flood_fill(inp->ovr.im, *tc_curr_col(tc), cur.x, cur.y);
 }
 
-Rect tool_picker_on_release(struct Ctx* ctx, XButtonReleasedEvent const* event) {
-    struct ToolCtx* tc = &CURR_TC(ctx);
+static Bool canvas_load(struct Ctx* ctx, struct Image* image) {
+    if (!image->im) {
+        return False;
+    }
     struct DrawCtx* dc = &ctx->dc;
-    Pt const pointer = pt_from_scr_to_cv_xy(dc, event->x, event->y);
-    XImage* im = dc->cv.im;
 
-    if (!ximage_is_valid_pt(im, pointer.x, pointer.y)) {
-        return RNIL;
+    overlay_free(&ctx->input.ovr);
+    canvas_free(&dc->cv);
+    // copying mapped file to shared memory would read all of it, damage is uploaded with XPutImage instead
+    dc->cv.im = ximage_is_mapped(image->im) ? image->im : ximage_to_shm(dc, image->im);
+    dc->cv.type = image->type;
+    ctx->fullres.pending = NULL;  // running job is dropped on completion
+    if (ctx->fullres.ready) {
+        fullres_free(ctx->fullres.ready);
+        ctx->fullres.ready = NULL;
     }
 
-    *tc_curr_col(tc) = XGetPixel(im, pointer.x, pointer.y);
-    return RNIL;
-}
-
-Rect canvas_line_drawer_callback(void* drw_ctx, Pt p) {
-    struct CanvasLineDrwCtxDrawer* ctx = (struct CanvasLineDrwCtxDrawer*)drw_ctx;
-    return canvas_apply_drawer(ctx->im, ctx->data, ctx->line_w, ctx->col, p, ctx->brush_in_out);
-}
+    overlay_init(dc, &ctx->input.ovr, dc->cv.im->width, dc->cv.im->height);
 
-Rect canvas_line_flood_fill_callback(void* drw_ctx, Pt p) {
-    struct CanvasLineDrwCtxFloodFill* ctx = (struct CanvasLineDrwCtxFloodFill*)drw_ctx;
-    return ximage_flood_fill(ctx->im, ctx->col, p.x, p.y);
+    return True;
 }
 
-struct HistItem history_new_as_damage(XImage* im, Rect rect) {
-    assert(is_valid_rect(rect));
-
-    return (struct HistItem) {
-        .t = HT_Damage,
-        .d.damage =
-            (struct HistDamage) {
-                .pivot = (Pt) {rect.l, rect.t},
-                .patch = XSubImage(
-                    im,
-                    rect.l,
-                    rect.t,
-                    // inclusive
-                    rect.r - rect.l + 1,
-                    rect.b - rect.t + 1
-                ),
-            },
-    };
+void canvas_free(struct Canvas* cv) {
+    if (cv->im) {
+        XDestroyImage(cv->im);
+        cv->im = NULL;
+    }
 }
 
-struct HistItem history_new_as_resize(XImage* im) {
-    return (struct HistItem) {
-        .t = HT_Resize,
-        .d.resize = (struct HistResize) {.cv = XSubImage(im, 0, 0, im->width, im->height)},
-    };
+void canvas_change_zoom(struct DrawCtx* dc, Pt cursor, i32 delta) {
+    double old_zoom = ZOOM_C(dc);
+    dc->cv.zoom = CLAMP(dc->cv.zoom + delta, CANVAS_MIN_ZOOM, CANVAS_MAX_ZOOM);
+    // keep cursor at same position
+    canvas_scroll(
+        &dc->cv,
+        (DPt) {
+            (dc->cv.scroll.x - cursor.x) * (ZOOM_C(dc) / old_zoom - 1.0),
+            (dc->cv.scroll.y - cursor.y) * (ZOOM_C(dc) / old_zoom - 1.0),
+        }
+    );
 }
 
-Bool history_move(struct Ctx* ctx, Bool forward) {
-    struct HistItem** hist_pop = forward ? &ctx->hist_nextarr : &ctx->hist_prevarr;
-    struct HistItem** hist_save = forward ? &ctx->hist_prevarr : &ctx->hist_nextarr;
-
-    if (!arrlenu(*hist_pop)) {
-        return False;
+void canvas_resize(struct Ctx* ctx, u32 new_width, u32 new_height) {
+    if (new_width <= 0 || new_height <= 0) {
+        trace("resize_canvas: invalid canvas size");
+        return;
     }
+    struct DrawCtx* dc = &ctx->dc;
+    struct Input* inp = &ctx->input;
+    u32 const old_width = dc->cv.im->width;
+    u32 const old_height = dc->cv.im->height;
 
-    struct HistItem curr = arrpop(*hist_pop);
-    switch (curr.t) {
-        case HT_Damage: {
-            struct HistDamage const* d = &curr.d.damage;
-            Rect curr_rect =
-                (Rect) {d->pivot.x, d->pivot.y, d->pivot.x + d->patch->width, d->pivot.y + d->patch->height};
-
-            arrpush(*hist_save, history_new_as_damage(ctx->dc.cv.im, curr_rect));
-        } break;
-        case HT_Resize: {
-            arrpush(*hist_save, history_new_as_resize(ctx->dc.cv.im));
-        } break;
-    }
-    history_apply(ctx, &curr);
-    history_free(&curr);
+    // resize overlay too
+    overlay_init(dc, &inp->ovr, new_width, new_height);
 
-    return True;
-}
+    // FIXME can fill color be changed?
+    XImage* new_cv_im = ximage_to_shm(dc, XSubImage(dc->cv.im, 0, 0, new_width, new_height));
+    XDestroyImage(dc->cv.im);
+    dc->cv.im = new_cv_im;
 
-void history_forward(struct Ctx* ctx, struct HistItem hist) {
-    trace("xpaint: history forward");
-    // next history invalidated after user action
-    historyarr_clear(&ctx->hist_nextarr);
-    arrpush(ctx->hist_prevarr, hist);
+    // fill new area if needed
+    if (old_width < new_width) {
+        canvas_fill_rect(
+            dc->cv.im,
+            (Pt) {(i32)old_width, 0},
+            (Pt) {(i32)(new_width - old_width), (i32)new_height},
+            CANVAS_BACKGROUND
+        );
+    }
+    if (old_height < new_height) {
+        canvas_fill_rect(
+            dc->cv.im,
+            (Pt) {0, (i32)old_height},
+            (Pt) {(i32)new_width, (i32)(new_height - old_height)},
+            CANVAS_BACKGROUND
+        );
+    }
 }
 
-void history_apply(struct Ctx* ctx, struct HistItem* hist) {
-    Rect damage = RNIL;
-    switch (hist->t) {
-        case HT_Damage: {
-            damage = canvas_copy_region(
-                ctx->dc.cv.im,
-                hist->d.damage.patch,
-                (Pt) {0, 0},
-                (Pt) {hist->d.damage.patch->width, hist->d.damage.patch->height},
-                hist->d.damage.pivot
-            );
-        } break;
-        case HT_Resize: {
-            u32 w = hist->d.resize.cv->width;
-            u32 h = hist->d.resize.cv->height;
-            canvas_resize(ctx, w, h);
-            damage =
-                canvas_copy_region(ctx->dc.cv.im, hist->d.resize.cv, (Pt) {0, 0}, (Pt) {(i32)w, (i32)h}, (Pt) {0, 0});
-        } break;
-    }
-    input_set_damage(&ctx->input, damage);
+void canvas_scroll(struct Canvas* cv, DPt delta) {
+    cv->scroll.x += delta.x;
+    cv->scroll.y += delta.y;
 }
 
-void history_free(struct HistItem* hist) {
-    switch (hist->t) {
-        case HT_Damage: XDestroyImage(hist->d.damage.patch); break;
-        case HT_Resize: XDestroyImage(hist->d.resize.cv); break;
-    }
+void overlay_init(struct DrawCtx* dc, struct InputOverlay* ovr, u32 width, u32 height) {
+    overlay_free(ovr);
+    ovr->im = ximage_sparse_new(dc, width, height);
+    ovr->rect = RNIL;
 }
 
-void historyarr_clear(struct HistItem** histarr) {
-    for (u32 i = 0; i < arrlenu(*histarr); ++i) {
-        history_free(&(*histarr)[i]);
+void overlay_clear(struct InputOverlay* ovr) {
+    // written pages are released, so overlay memory is proportional to its content
+    if (!IS_RNIL(ovr->rect) && !ximage_release_rows(ovr->im, ovr->rect.t, ovr->rect.b)) {
+        ximage_clear(ovr->im, ovr->rect);
     }
-    arrfree(*histarr);
+    ovr->rect = RNIL;
 }
 
-usize ximage_data_len(XImage const* im) {
-    // FIXME is it correct?
-    return (usize)im->width * im->height * (im->depth / 8);
+void overlay_expand_rect(struct InputOverlay* ovr, Rect rect) {
+    ovr->rect = rect_expand(ovr->rect, rect);
 }
 
-XImage* ximage_apply_xtrans(XImage* im, struct DrawCtx* dc, XTransform xtrans) {
-    u32 const w = im->width;
-    u32 const h = im->height;
-
-    Pixmap src_pm = XCreatePixmap(dc->dp, dc->window, w, h, dc->sys.vinfo.depth);
-    XPutImage(dc->dp, src_pm, dc->screen_gc, im, 0, 0, 0, 0, w, h);
-    Pixmap dst_pm = XCreatePixmap(dc->dp, dc->window, w, h, dc->sys.vinfo.depth);
-
-    Picture src = XRenderCreatePicture(dc->dp, src_pm, dc->sys.xrnd_pic_format, 0, NULL);
-    Picture dst = XRenderCreatePicture(dc->dp, dst_pm, dc->sys.xrnd_pic_format, 0, NULL);
-
-    // HACK xtrans_invert, because XRENDER missinterprets XTransform values
-    XTransform xtrans_pict = xtrans_invert(xtrans);
-    XRenderSetPictureTransform(dc->dp, src, &xtrans_pict);
-    XRenderComposite(dc->dp, PictOpSrc, src, None, dst, 0, 0, 0, 0, 0, 0, w, h);
-
-    XImage* result = XGetImage(dc->dp, dst_pm, 0, 0, w, h, AllPlanes, ZPixmap);
-
-    XRenderFreePicture(dc->dp, src);
-    XRenderFreePicture(dc->dp, dst);
-    XFreePixmap(dc->dp, src_pm);
-    XFreePixmap(dc->dp, dst_pm);
-
-    return result;
+static struct InputOverlay get_transformed_overlay(struct DrawCtx* dc, struct Input const* inp) {
+    XTransform const xtrans = xtrans_overlay_transform_mode(inp);
+    XImage* im = ximage_apply_xtrans(inp->ovr.im, dc, xtrans);
+    Rect const rect = ximage_calc_damage(im);
+    return (struct InputOverlay) {.im = im, .rect = rect};
 }
 
-void ximage_blend(XImage* dest, XImage* overlay, Rect blend_mask) {
-    if (IS_RNIL(blend_mask)) {
-        blend_mask = ximage_rect(overlay);
+void overlay_free(struct InputOverlay* ovr) {
+    if (ovr->im) {
+        XDestroyImage(ovr->im);
+        ovr->im = NULL;
     }
-    assert(is_valid_rect(blend_mask));
-    assert(is_subrect(ximage_rect(dest), ximage_rect(overlay)));
-    assert(is_subrect(ximage_rect(overlay), blend_mask));
+    ovr->rect = RNIL;
+}
 
-    for (i32 x = blend_mask.l; x <= blend_mask.r; ++x) {
-        for (i32 y = blend_mask.t; y <= blend_mask.b; ++y) {
-            argb ovr = XGetPixel(overlay, x, y);
-            if (ovr & ARGB_ALPHA) {
-                argb bg = XGetPixel(dest, x, y);
-                // make first argument opaque and use its opacity as third argument.
-                argb result = argb_blend(argb_normalize(ovr), bg, (ovr >> 0x18) & 0xFF);
-                XPutPixel(dest, x, y, result);
-            }
-        }
-    }
+u32 statusline_height(struct DrawCtx const* dc) {
+    return dc->fnt->ascent + STATUSLINE_PADDING_BOTTOM;
 }
 
-void ximage_clear(XImage* im, Rect mask) {
-    if (IS_RNIL(mask)) {
-        return;
-    }
-    assert(is_subrect(ximage_rect(im), mask));
-    assert(im->format == ZPixmap);
-    assert(im->bits_per_pixel % 8 == 0);
+Pt clientarea_size(struct DrawCtx const* dc) {
+    return (Pt) {
+        .x = (i32)(dc->width),
+        .y = (i32)(dc->height - statusline_height(dc)),
+    };
+}
 
-    u32 const bpp = (im->bits_per_pixel + 7) / 8;
-    u8* base = (u8*)im->data;
+Pt canvas_size(struct DrawCtx const* dc) {
+    return (Pt) {
+        .x = (i32)(dc->cv.im->width * ZOOM_C(dc)),
+        .y = (i32)(dc->cv.im->height * ZOOM_C(dc)),
+    };
+}
 
-    for (i32 y = mask.t; y <= mask.b; y++) {
-        u8* row_start = base + (size_t)(y * im->bytes_per_line) + (size_t)(mask.l * bpp);
-        u32 bytes = (mask.r - mask.l + 1) * bpp;
-        memset(row_start, 0, bytes);
-    }
+void draw_arc(struct DrawCtx* dc, Pt c, Pt dims, double a1, double a2, argb col) {
+    XSetForeground(dc->dp, dc->screen_gc, col);
+    XDrawArc(dc->dp, dc->back_buffer, dc->screen_gc, c.x, c.y, dims.x, dims.y, (i32)(a1 * 64), (i32)(a2 * 64));
 }
 
-Bool ximage_put_checked(XImage* im, i32 x, i32 y, argb col) {
-    if (!ximage_is_valid_pt(im, x, y)) {
-        return False;
-    }
-    XPutPixel(im, x, y, col);
-    return True;
+void fill_arc(struct DrawCtx* dc, Pt c, Pt dims, double a1, double a2, argb col) {
+    XSetForeground(dc->dp, dc->screen_gc, col);
+    XFillArc(dc->dp, dc->back_buffer, dc->screen_gc, c.x, c.y, dims.x, dims.y, (i32)(a1 * 64), (i32)(a2 * 64));
 }
 
-Rect ximage_flood_fill(XImage* im, argb targ_col, i32 x, i32 y) {
-    assert(im);
-    if (!ximage_is_valid_pt(im, x, y)) {
-        return RNIL;
+void dc_clip_set(struct DrawCtx* dc, RectSet const* clip) {
+    dc->clip = clip;
+    if (!clip) {
+        XSetClipMask(dc->dp, dc->screen_gc, None);
+        return;
     }
+    XRectangle rects[RECTSET_MAX];
+    u32 const rects_len = rectset_to_xrects(clip, rects);
+    XSetClipRectangles(dc->dp, dc->screen_gc, 0, 0, rects, (i32)rects_len, Unsorted);
+}
 
-    static i32 const d_rows[] = {1, 0, 0, -1};
-    static i32 const d_cols[] = {0, 1, -1, 0};
-
-    argb const area_col = XGetPixel(im, x, y);
-    if (area_col == targ_col) {
-        return RNIL;
+u32 draw_string(struct DrawCtx* dc, char const* str, Pt c, enum Schm sc, Bool invert) {
+    XftDraw* d = XftDrawCreate(dc->dp, dc->back_buffer, dc->sys.vinfo.visual, dc->sys.colmap);
+    // antialiased glyphs outside of damage would be blended over previous frame ones
+    if (dc->clip) {
+        XRectangle rects[RECTSET_MAX];
+        u32 const rects_len = rectset_to_xrects(dc->clip, rects);
+        XftDrawSetClipRectangles(d, 0, 0, rects, (i32)rects_len);
     }
+    u32 str_len = strlen(str);
+    u32 const width = get_string_width(dc, str, str_len);
+    XftDrawStringUtf8(
+        d,
+        invert ? &dc->schemes_dyn[sc].bg : &dc->schemes_dyn[sc].fg,
+        dc->fnt,
+        c.x,
+        c.y,
+        (FcChar8 const*)str,
+        (i32)str_len
+    );
+    XftDrawDestroy(d);
+    return width;
+}
 
-    Rect damage = RNIL;
-    Pt* queue_arr = NULL;
-    Pt first = {x, y};
-    arrpush(queue_arr, first);
-
-    while (arrlen(queue_arr)) {
-        Pt curr = arrpop(queue_arr);
-
-        for (i32 dir = 0; dir < 4; ++dir) {
-            Pt d_curr = {curr.x + d_rows[dir], curr.y + d_cols[dir]};
-
-            if (!ximage_is_valid_pt(im, d_curr.x, d_curr.y)) {
-                continue;
-            }
-
-            if (XGetPixel(im, d_curr.x, d_curr.y) == area_col) {
-                XPutPixel(im, d_curr.x, d_curr.y, targ_col);
-                damage = rect_expand(damage, (Rect) {d_curr.x, d_curr.y, d_curr.x, d_curr.y});
+// XXX always opaque
+int fill_rect(struct DrawCtx* dc, Pt p, Pt dim, argb col) {
+    XSetForeground(dc->dp, dc->screen_gc, col | 0xFF000000);
+    return XFillRectangle(dc->dp, dc->back_buffer, dc->screen_gc, p.x, p.y, dim.x, dim.y);
+}
 
-                arrpush(queue_arr, d_curr);
-            }
-        }
-    }
+int draw_line_ex(struct DrawCtx* dc, Pt from, Pt to, u32 w, int line_style, enum Schm sc, Bool invert) {
+    GC gc = dc->screen_gc;
+    XSetForeground(dc->dp, gc, invert ? COL_BG(dc, sc) : COL_FG(dc, sc));
+    XSetLineAttributes(dc->dp, gc, w, line_style, CapButt, JoinMiter);
+    return XDrawLine(dc->dp, dc->back_buffer, gc, from.x, from.y, to.x, to.y);
+}
 
-    arrfree(queue_arr);
+int draw_line(struct DrawCtx* dc, Pt from, Pt to, u32 w, enum Schm sc, Bool invert) {
+    return draw_line_ex(dc, from, to, w, LineSolid, sc, invert);
+}
 
-    return damage;
+void draw_dash_line(struct DrawCtx* dc, Pt from, Pt to, u32 w) {
+    draw_line(dc, from, to, w, SchmNorm, True);
+    draw_line_ex(dc, from, to, w, LineOnOffDash, SchmNorm, False);
 }
 
-Rect ximage_calc_damage(XImage* im) {
-    Rect damage = RNIL;
-    for (i32 i = 0; i < im->width; ++i) {
-        for (i32 j = 0; j < im->height; ++j) {
-            if (XGetPixel(im, i, j) != 0) {
-                damage = rect_expand(damage, (Rect) {i, j, i, j});
-            }
+Rect draw_dash_rect(struct DrawCtx* dc, Pt pts[4], Bool dry_run) {
+    i32 const line_w = 2;
+    Rect result = RNIL;
+    for (u32 i = 0; i < 4; ++i) {
+        Pt const from = pt_from_cv_to_scr(dc, pts[i]);
+        Pt const to = pt_from_cv_to_scr(dc, pts[(i + 1) % 4]);
+        if (!dry_run) {
+            draw_dash_line(dc, from, to, line_w);
         }
+        result = rect_expand(result, (Rect) {from.x, from.y, from.x, from.y});
     }
-    return damage;
+    return (Rect) {result.l - line_w, result.t - line_w, result.r + line_w, result.b + line_w};
 }
 
-Rect canvas_text(struct DrawCtx* dc, XImage* im, Pt lt_c, XftFont* font, argb col, char const* text, u32 text_len) {
-    Rect damage = RNIL;
-    if (text == NULL || im == NULL || dc == NULL) {
-        return damage;
-    }
+Rect draw_dash_cross(struct DrawCtx* dc, Pt cv_center, i32 radius, Bool dry_run) {
+    Pt lt = pt_from_cv_to_scr(dc, cv_center);
+    Pt rb = pt_from_cv_to_scr(dc, (Pt) {cv_center.x + 1, cv_center.y + 1});
+    Pt scr_center = (Pt) {(lt.x + rb.x) / 2, (lt.y + rb.y) / 2};
+    Rect const rect = {
+        scr_center.x - radius,
+        scr_center.y - radius,
+        scr_center.x + radius,
+        scr_center.y + radius,
+    };
 
-    XRenderColor xrendercol = argb_to_xrender_color(col);
-    XRenderColor transp_xrendercol = argb_to_xrender_color(0x00000000);
-    XftColor color;
-    XftColor transp;
-    if (!XftColorAllocValue(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &xrendercol, &color)) {
-        trace("xpaint: canvas_text: failed to create xft color");
-        return damage;
-    }
-    if (!XftColorAllocValue(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &transp_xrendercol, &transp)) {
-        XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &color);
-        trace("xpaint: canvas_text: failed to create xft color");
-        return damage;
+    if (!dry_run) {
+        draw_dash_line(dc, (Pt) {rect.l, rect.b}, (Pt) {rect.r, rect.t}, 1);
+        draw_dash_line(dc, (Pt) {rect.l, rect.t}, (Pt) {rect.r, rect.b}, 1);
     }
+    return (Rect) {rect.l - 1, rect.t - 1, rect.r + 1, rect.b + 1};
+}
 
-    Rect const text_rect = get_string_rect(dc, font, text, text_len, lt_c);
-    Pt const text_dims = rect_dims(text_rect);
-
-    Pixmap pm = XCreatePixmap(dc->dp, dc->window, text_dims.x, text_dims.y, dc->sys.vinfo.depth);
-    XftDraw* d = XftDrawCreate(dc->dp, pm, dc->sys.vinfo.visual, dc->sys.colmap);
-    if (!d) {
-        XFreePixmap(dc->dp, pm);
-        XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &transp);
-        XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &color);
-        trace("xpaint: canvas_text: failed to create xft draw");
-        return damage;
+// outline of the figure canvas_figure would rasterize, drawn in screen space while dragging
+Rect draw_figure_preview(struct Ctx* ctx, u32 variant, Pt p_static, Pt p_dynamic, Bool dry_run) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    if (tc->t != Tool_Figure || IS_PNIL(p_static) || IS_PNIL(p_dynamic)) {
+        return RNIL;
+    }
+    struct FigureData const* fig = &tc->d.fig;
+    double const zoom = ZOOM_C(dc);
+
+    DPt cv_pts[256];
+    u32 n = 0;
+    if (variant == 1 && fig->curr == Figure_Rectangle) {
+        cv_pts[n++] = (DPt) {p_static.x, p_static.y};
+        cv_pts[n++] = (DPt) {p_dynamic.x, p_static.y};
+        cv_pts[n++] = (DPt) {p_dynamic.x, p_dynamic.y};
+        cv_pts[n++] = (DPt) {p_static.x, p_dynamic.y};
+    } else {
+        Pt const b = variant == 1 ? (Pt) {(2 * p_static.x) - p_dynamic.x, (2 * p_static.y) - p_dynamic.y} : p_static;
+        n = figure_side_count(fig->curr);
+        assert(n <= LENGTH(cv_pts));
+        regular_poly_vertices(n, p_dynamic, b, cv_pts);
     }
 
-    // initial contents of Pixmap are undefined
-    XftDrawRect(d, &transp, 0, 0, text_dims.x, text_dims.y);
-    // x, y == left-baseline
-    XftDrawStringUtf8(d, &color, font, 0, font->height - font->descent, (FcChar8*)text, (i32)text_len);
-    damage = rect_expand(damage, text_rect);
-
-    /* apply pixmap with text on input image */ {
-        XImage* image = XGetImage(dc->dp, pm, 0, 0, text_dims.x, text_dims.y, AllPlanes, ZPixmap);
-        canvas_copy_region(im, image, (Pt) {0, 0}, text_dims, (Pt) {text_rect.l, text_rect.t});
-        XDestroyImage(image);
+    i32 const line_w = MAX(1, (i32)round(tc->line_w * zoom));
+    // same whole pixel scroll as composited canvas, otherwise preview shakes against it
+    Pt const scroll = dc_scroll_px(dc);
+    XPoint scr_pts[LENGTH(cv_pts) + 1];
+    Rect bounds = RNIL;
+    for (u32 i = 0; i < n; ++i) {
+        // canvas_figure strokes through pixel centers
+        double const x = ((cv_pts[i].x + 0.5) * zoom) + scroll.x;
+        double const y = ((cv_pts[i].y + 0.5) * zoom) + scroll.y;
+        scr_pts[i] = (XPoint) {(short)CLAMP(x, SHRT_MIN, SHRT_MAX), (short)CLAMP(y, SHRT_MIN, SHRT_MAX)};
+        bounds = rect_expand(bounds, (Rect) {scr_pts[i].x, scr_pts[i].y, scr_pts[i].x, scr_pts[i].y});
+    }
+    scr_pts[n] = scr_pts[0];
+
+    if (!dry_run) {
+        GC gc = dc->screen_gc;
+        // XXX always opaque, alpha is applied on release
+        XSetForeground(dc->dp, gc, *tc_curr_col(tc) | 0xFF000000);
+        XSetLineAttributes(dc->dp, gc, line_w, LineSolid, CapRound, JoinRound);
+        if (fig->fill) {
+            XFillPolygon(dc->dp, dc->back_buffer, gc, scr_pts, (i32)n, Convex, CoordModeOrigin);
+        }
+        XDrawLines(dc->dp, dc->back_buffer, gc, scr_pts, (i32)n + 1, CoordModeOrigin);
     }
 
-    XftDrawDestroy(d);
-    XFreePixmap(dc->dp, pm);
-    XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &transp);
-    XftColorFree(dc->dp, dc->sys.vinfo.visual, dc->sys.colmap, &color);
+    i32 const margin = (line_w / 2) + 1;
+    return (Rect) {bounds.l - margin, bounds.t - margin, bounds.r + margin, bounds.b + margin};
+}
 
-    return damage;
+u32 get_string_width(struct DrawCtx const* dc, char const* str, u32 len) {
+    XGlyphInfo ext;
+    XftTextExtentsUtf8(dc->dp, dc->fnt, (XftChar8*)str, (i32)len, &ext);
+    return ext.xOff;
 }
 
-Rect canvas_dash_rect(XImage* im, Pt c, Pt dims, u32 w, u32 dash_w, argb col1, argb col2) {
-    Rect damage = RNIL;
+Rect get_string_rect(struct DrawCtx const* dc, XftFont* font, char const* str, u32 len, Pt lt) {
+    XGlyphInfo ext = {0};
+    XftTextExtentsUtf8(dc->dp, font, (FcChar8 const*)str, (i32)len, &ext);
+    // XftDrawStringUtf8 seems like to accept left-baseline point
+    return (Rect) {
+        .l = lt.x,
+        .t = lt.y + font->descent - font->height,
+        .r = lt.x + ext.xOff,
+        .b = lt.y + font->descent,
+    };
+}
 
-    Rect const rect = rect_bound((Rect) {c.x, c.y, c.x + dims.x, c.y + dims.y}, ximage_rect(im));
-    Pt corners[4] = {0};
-    rect_corners(rect, corners);
+static void sel_circ_draw_wheel(struct Ctx* ctx, struct SelectionCircle const* sc, Pt c) {
+    struct DrawCtx* dc = &ctx->dc;
+    double const segment_icon_location = 0.58;  // 0.5 for center
+    i32 const outer_r = (i32)SEL_CIRC_OUTER_R_PX;
+    i32 const inner_r = (i32)SEL_CIRC_INNER_R_PX;
+    Pt const outer_c = {c.x - outer_r, c.y - outer_r};
+    Pt const outer_dims = {outer_r * 2, outer_r * 2};
+    Pt const inner_c = {c.x - inner_r, c.y - inner_r};
+    Pt const inner_dims = {inner_r * 2, inner_r * 2};
 
-    for (u32 i = 0; i < LENGTH(corners); ++i) {
-        Pt curr = corners[i];
-        Pt const to = corners[(i + 1) % LENGTH(corners)];
-        Pt const delta = {to.x - curr.x, to.y - curr.y};
-        assert(delta.x == 0 || delta.y == 0);
-        Pt const delta_sign = {delta.x == 0 ? 0 : delta.x > 0 ? 1 : -1, delta.y == 0 ? 0 : delta.y > 0 ? 1 : -1};
+    fill_arc(dc, outer_c, outer_dims, 0.0, 360.0, COL_BG(dc, SchmNorm));
 
-        u32 iterations = 0;
-        while (!PT_EQ(curr, to) && iterations < 10000000) {
-            Pt const lt = (Pt) {curr.x - ((i32)w / 2), curr.y - ((i32)w / 2)};
-            argb col = !dash_w ? col1 : iterations / dash_w % 2 ? col1 : col2;
-            Rect d = canvas_fill_rect(im, lt, (Pt) {(i32)w, (i32)w}, col);
-            damage = rect_expand(damage, d);
+    double const segment_rad = PI * 2 / MAX(1, arrlen(sc->items_arr));
+    double const segment_deg = segment_rad / PI * 180;
 
-            curr.x += delta_sign.x;
-            curr.y += delta_sign.y;
-            iterations += 1;
+    // item's properties
+    for (u32 item_num = 0; item_num < arrlen(sc->items_arr); ++item_num) {
+        struct Item const* item = &sc->items_arr[item_num];
+        XImage* icon = images[item->icon];
+        Pt center = {
+            (i32)(c.x + (cos(-segment_rad * (item_num + 0.5)) * ((outer_r + inner_r) * segment_icon_location))),
+            (i32)(c.y + (sin(-segment_rad * (item_num + 0.5)) * ((outer_r + inner_r) * segment_icon_location))),
+        };
+
+        if (item->col_outer) {
+            fill_arc(dc, outer_c, outer_dims, item_num * segment_deg, segment_deg + (1.0 / 64.0), item->col_outer);
         }
-    }
 
-    return damage;
-}
+        if (item->col_inner) {
+            fill_arc(dc, inner_c, inner_dims, item_num * segment_deg, segment_deg + (1.0 / 64.0), item->col_inner);
+        }
 
-Rect canvas_fill_rect(XImage* im, Pt c, Pt dims, argb col) {
-    Rect damage = RNIL;
+        if (icon) {
+            XPutImage(
+                dc->dp,
+                dc->back_buffer,
+                dc->screen_gc,
+                icon,
+                0,
+                0,
+                center.x - (icon->width / 2),
+                center.y - (icon->height / 2),
+                icon->width,
+                icon->height
+            );
+        }
 
-    Bool const nx = dims.x < 0;
-    Bool const ny = dims.y < 0;
-    for (i32 x = c.x + (nx ? dims.x : 0); x < c.x + (nx ? 0 : dims.x); ++x) {
-        for (i32 y = c.y + (ny ? dims.y : 0); y < c.y + (ny ? 0 : dims.y); ++y) {
-            if (ximage_put_checked(im, x, y, col)) {
-                damage = rect_expand(damage, (Rect) {x, y, x, y});
+        if (item->desc) {
+            Rect const desc_rect = get_string_rect(dc, dc->fnt, item->desc, strlen(item->desc), (Pt) {0, 0});
+            Pt const desc_dims = rect_dims(desc_rect);
+            Pt text_center = {
+                center.x - (desc_dims.x / 2),
+                center.y + (desc_dims.y / 2) + (i32)SEL_CIRC_ITEM_ICON_MARGIN_PX + (icon ? icon->height / 2 : 0),
+            };
+
+            draw_string(dc, item->desc, text_center, SchmNorm, False);
+        }
+    }
+}
+
+// separators and circle lines, drawn over wheel and highlight
+static void sel_circ_draw_lines(struct DrawCtx* dc, struct SelectionCircle const* sc, Pt c, i32 only_item) {
+    i32 const outer_r = (i32)SEL_CIRC_OUTER_R_PX;
+    i32 const inner_r = (i32)SEL_CIRC_INNER_R_PX;
+    i32 const items_len = (i32)arrlen(sc->items_arr);
+    double const segment_rad = PI * 2 / MAX(1, items_len);
+
+    if (sc->draw_separators && items_len >= 2) {
+        XSetForeground(dc->dp, dc->screen_gc, COL_FG(dc, SchmNorm));
+        for (i32 line_num = 0; line_num < items_len; ++line_num) {
+            // separators are at -angle, item n is between separators -n and -(n + 1)
+            i32 const mirrored = (items_len - line_num) % items_len;
+            if (only_item != NIL && mirrored != only_item && mirrored != (only_item + 1) % items_len) {
+                continue;
             }
+            XDrawLine(
+                dc->dp,
+                dc->back_buffer,
+                dc->screen_gc,
+                c.x + (i32)(cos(segment_rad * line_num) * inner_r),
+                c.y + (i32)(sin(segment_rad * line_num) * inner_r),
+                c.x + (i32)(cos(segment_rad * line_num) * outer_r),
+                c.y + (i32)(sin(segment_rad * line_num) * outer_r)
+            );
         }
     }
 
-    return damage;
+    argb const col = COL_FG(dc, SchmNorm);
+    draw_arc(dc, (Pt) {c.x - inner_r, c.y - inner_r}, (Pt) {inner_r * 2, inner_r * 2}, 0.0, 360.0, col);
+    draw_arc(dc, (Pt) {c.x - outer_r, c.y - outer_r}, (Pt) {outer_r * 2, outer_r * 2}, 0.0, 360.0, col);
 }
 
-Rect canvas_rect(XImage* im, Pt c, Pt dims, u32 line_w, argb col) {
-    return canvas_dash_rect(im, c, dims, line_w, 0, col, col);
-}
+static Pixmap sel_circ_render_wheel(struct Ctx* ctx, struct SelectionCircle const* sc) {
+    struct DrawCtx* dc = &ctx->dc;
+    Rect const rect = sel_circ_rect(sc);
+    Pt const dims = rect_dims(rect);
+    Pixmap const pm = XCreatePixmap(dc->dp, dc->window, dims.x, dims.y, dc->sys.vinfo.depth);
+    // frame damage clip is in window coordinates, whole pixmap is rendered
+    RectSet const* clip = dc->clip;
+    dc_clip_set(dc, NULL);
+
+    // transparent outside of circle
+    XSetForeground(dc->dp, dc->screen_gc, 0);
+    XFillRectangle(dc->dp, pm, dc->screen_gc, 0, 0, dims.x, dims.y);
+
+    // HACK draw_* functions draw to back buffer
+    XdbeBackBuffer const back_buffer = dc->back_buffer;
+    dc->back_buffer = pm;
+    XSetLineAttributes(dc->dp, dc->screen_gc, SEL_CIRC_LINE_W, SEL_CIRC_LINE_STYLE, CapNotLast, JoinMiter);
+    Pt const c = {sc->x - rect.l, sc->y - rect.t};
+    sel_circ_draw_wheel(ctx, sc, c);
+    sel_circ_draw_lines(dc, sc, c, NIL);
+    dc->back_buffer = back_buffer;
+    dc_clip_set(dc, clip);
 
-// FIXME only used for Figure_Rectangle, rest handled in canvas_regular_poly
-static Pt canvas_figure_fill_pt_helper(enum FigureType type, Pt a, Pt b, Pt im_dims) {
-    switch (type) {
-        case Figure_Circle:
-        case Figure_Rectangle:
-        case Figure_Triangle:
-            return (Pt) {
-                CLAMP((a.x + b.x) / 2, 0, im_dims.x - 1),
-                CLAMP((a.y + b.y) / 2, 0, im_dims.y - 1),
-            };
-    }
-    return (Pt) {-1, -1};  // will not fill anything
+    return pm;
 }
 
-Rect canvas_figure(struct Ctx* ctx, XImage* im, u32 variant, Pt p_static, Pt p_dynamic) {
-    if (IS_PNIL(p_static) || IS_PNIL(p_dynamic)) {
-        return RNIL;
-    }
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    if (tc->t != Tool_Figure) {
+Rect draw_selection_circle(
+    struct Ctx* ctx,
+    struct SelectionCircle* sc,
+    i32 const pointer_x,
+    i32 const pointer_y,
+    Bool dry_run
+) {
+    struct DrawCtx* dc = &ctx->dc;
+    if (sc->items_arr == NULL || arrlen(sc->items_arr) == 0) {
         return RNIL;
     }
-    struct FigureData const* fig = &tc->d.fig;
-    argb const col = *tc_curr_col(tc);
-
-    if (variant == 1) {
-        switch (fig->curr) {
-            case Figure_Rectangle: {
-                Rect const damage = canvas_rect(
-                    im,
-                    p_static,
-                    (Pt) {p_dynamic.x - p_static.x, p_dynamic.y - p_static.y},
-                    tc->line_w,
-                    col
-                );
-                if (fig->fill) {
-                    Pt const im_dims = {im->width, im->height};
-                    Pt const fill_pt = canvas_figure_fill_pt_helper(fig->curr, p_dynamic, p_static, im_dims);
-                    ximage_flood_fill(im, col, fill_pt.x, fill_pt.y);
-                }
-                return damage;
-            }
-            case Figure_Circle:
-            case Figure_Triangle: {
-                // d_static at figure center
-                Pt const diff = {p_dynamic.x - p_static.x, p_dynamic.y - p_static.y};
-                Pt const p_opposite = {p_static.x - diff.x, p_static.y - diff.y};
 
-                Rect damage =
-                    canvas_regular_poly(im, tc, figure_side_count(fig->curr), p_dynamic, p_opposite, fig->fill);
-                return damage;
-            }
-        }
-    } else {
-        switch (fig->curr) {
-            case Figure_Circle:
-            case Figure_Rectangle:
-            case Figure_Triangle: {
-                Rect damage = canvas_regular_poly(im, tc, figure_side_count(fig->curr), p_dynamic, p_static, fig->fill);
-                return damage;
-            }
-        }
+    Rect const result = sel_circ_rect(sc);
+    if (dry_run) {
+        return result;
     }
 
-    return RNIL;
-}
-
-// FIXME runs in runtime
-static DPt get_inr_circmr_cfs(u32 n) {
-    // from https://math.stackexchange.com/a/3504360
-    if (n % 2 == 0) {
-        return (DPt) {0.5, 0.5};
+    if (!sc->wheel_pm) {
+        sc->wheel_pm = sel_circ_render_wheel(ctx, sc);
+    }
+
+    /* wheel */ {
+        Pt const dims = rect_dims(result);
+        Picture wheel_pict = XRenderCreatePicture(dc->dp, sc->wheel_pm, dc->sys.xrnd_pic_format, 0, NULL);
+        Picture bb_pict = XRenderCreatePicture(dc->dp, dc->back_buffer, dc->sys.xrnd_pic_format, 0, NULL);
+        // same clip as screen_gc
+        XRectangle clip[RECTSET_MAX];
+        u32 const clip_len = rectset_to_xrects(&dc->scr_damage.drawn, clip);
+        XRenderSetPictureClipRectangles(dc->dp, bb_pict, 0, 0, clip, (i32)clip_len);
+        // clang-format off
+        XRenderComposite(
+            dc->dp, PictOpOver,
+            wheel_pict, None,
+            bb_pict,
+            0, 0,
+            0, 0,
+            result.l, result.t,
+            dims.x, dims.y
+        );
+        // clang-format on
+        XRenderFreePicture(dc->dp, wheel_pict);
+        XRenderFreePicture(dc->dp, bb_pict);
     }
-    double const h = 1;
-    double const side = 2.0 * h * sin(PI / n) / (1 + cos(PI / n));
-    double const inradius = side / 2.0 / tan(PI / n);
-    double const circumradius = side / 2.0 / sin(PI / n);
-    return (DPt) {inradius, circumradius};
-}
 
-Rect canvas_regular_poly_frame_helper(
-    XImage* im,
-    u32 n,
-    Pt a,
-    Pt b,
-    struct DrawerData data,
-    u32 line_w,
-    argb col,
-    DPt** edges_optout
-) {
-    struct Brush brush_cache = {0};
-    Rect damage = RNIL;
-    DPt const inr_circmr = get_inr_circmr_cfs(n);
-    DPt c = {
-        a.x + ((b.x - a.x) * inr_circmr.x),
-        a.y + ((b.y - a.y) * inr_circmr.x),
-    };
-    DPt curr = {
-        (b.x - a.x) * inr_circmr.y,
-        (b.y - a.y) * inr_circmr.y,
-    };
-    DPt prev = curr;
-    for (u32 i = 0; i < n; ++i) {
-        curr = dpt_rotate(curr, 360.0 / n);
+    // selected item fill
+    i32 const current_item = sel_circ_curr_item(sc, pointer_x, pointer_y);
+    if (current_item != NIL) {
+        i32 const outer_r = (i32)SEL_CIRC_OUTER_R_PX;
+        i32 const inner_r = (i32)SEL_CIRC_INNER_R_PX;
+        double const segment_deg = 360.0 / MAX(1, arrlen(sc->items_arr));
+        Pt const c = {sc->x, sc->y};
 
-        DPt const curr_adjusted = dpt_add(c, curr);
-        if (edges_optout) {
-            arrpush(*edges_optout, curr_adjusted);
-        }
-        // only hard lines, no spacing needed
-        Rect line_damage = canvas_line_no_spacing(
-            &canvas_line_drawer_callback,
-            &(struct CanvasLineDrwCtxDrawer) {
-                .im = im,
-                .brush_in_out = &brush_cache,
-                .data = data,
-                .line_w = line_w,
-                .col = col,
-            },
-            dpt_to_pt(dpt_add(c, prev)),
-            dpt_to_pt(curr_adjusted)
+        XSetLineAttributes(dc->dp, dc->screen_gc, SEL_CIRC_LINE_W, SEL_CIRC_LINE_STYLE, CapNotLast, JoinMiter);
+        fill_arc(
+            dc,
+            (Pt) {c.x - outer_r, c.y - outer_r},
+            (Pt) {outer_r * 2, outer_r * 2},
+            current_item * segment_deg,
+            segment_deg,
+            COL_BG(dc, SchmFocus)
         );
-        damage = rect_expand(damage, line_damage);
-        prev = curr;
+        fill_arc(
+            dc,
+            (Pt) {c.x - inner_r, c.y - inner_r},
+            (Pt) {inner_r * 2, inner_r * 2},
+            current_item * segment_deg,
+            segment_deg,
+            COL_BG(dc, SchmNorm)
+        );
+        sel_circ_draw_lines(dc, sc, c, current_item);
     }
 
-    brush_cache_free(&brush_cache);
-    return damage;
+    return result;
 }
 
-// moves `a` to `b` by `distance` and stores to `c`. and `d` = `b` --> `a`
-static void canvas_regular_poly_point_helper(DPt a, DPt b, u32 distance, DPt* c, DPt* d) {
-    DPt const delta = {b.x - a.x, b.y - a.y};
-    double const dist = sqrt((delta.x * delta.x) + (delta.y * delta.y));
+void update_screen(struct Ctx* ctx, Pt cur_scr, Bool full_redraw) {
+    struct Frame* fr = &ctx->frame;
+    struct Input* inp = &ctx->input;
 
-    if (dist <= distance) {
-        return;
+    if (fr->message_shown) {
+        str_free(&fr->message_dyn);
+        fr->message_shown = False;
+    }
+    fr->dirty = True;
+    fr->full_redraw = fr->full_redraw || full_redraw;
+    if (!IS_PNIL(cur_scr)) {
+        fr->cur_scr = cur_scr;
     }
+    rectset_add_set(&fr->cv_damage, &inp->redraw_track[0]);
+    rectset_add_set(&fr->cv_damage, &inp->redraw_track[1]);
+}
 
-    DPt const unit = {delta.x / dist, delta.y / dist};  // unit vector from a to b
+void frame_render(struct Ctx* ctx) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct Frame* fr = &ctx->frame;
+    struct ScreenDamage* sd = &dc->scr_damage;
+    Rect const wnd_rect = {0, 0, (i32)dc->width - 1, (i32)dc->height - 1};
+    Bool const full_redraw = fr->full_redraw;
+    Pt const cur_scr = fr->cur_scr;
+    u64 const start_us = monotonic_us();
+    u64 const allocs_before = heap_alloc_count;
+
+    fr->dirty = False;
+    fr->full_redraw = False;
+    fr->message_shown = fr->message_dyn != NULL;
+
+    /* update cache */ {
+        RectSet const cv_damage = full_redraw ? rectset_from_rect(ximage_rect(dc->cv.im)) : fr->cv_damage;
+        fr->cv_damage = (RectSet) {0};
+        if (!cv_damage.len) {
+            dc_cache_update(ctx, RNIL);  // validates cache dimensions
+        }
+        for (u32 i = 0; i < cv_damage.len; ++i) {
+            dc_cache_update(ctx, cv_damage.rects[i]);
+            dc_damage_cv(dc, cv_damage.rects[i]);
+        }
+    }
 
-    double const t = dist - distance;  // move-in amount for each point
-    if (c) {
-        *c = (DPt) {b.x - (unit.x * t), b.y - (unit.y * t)};
+    Rect present = RNIL;  // window area changed apart from damage
+    /* update view */ {
+        Pt const scroll = dc_scroll_px(dc);
+        Pt const wnd_dims = {(i32)dc->width, (i32)dc->height};
+        Pt const cv_dims = {dc->cv.im->width, dc->cv.im->height};
+        Pt const delta = {scroll.x - sd->scroll.x, scroll.y - sd->scroll.y};
+        sd->scroll = scroll;
+        if (full_redraw || sd->zoom != dc->cv.zoom || !PT_EQ(sd->wnd_dims, wnd_dims) || !PT_EQ(sd->cv_dims, cv_dims)
+            || abs(delta.x) >= wnd_dims.x || abs(delta.y) >= wnd_dims.y || !dc_view_anchor_fits(dc)) {
+            dc_view_reset(dc);
+            dc_damage_scr(dc, wnd_rect);
+        } else if (delta.x != 0 || delta.y != 0) {
+            dc_view_scroll(ctx, delta);
+            present = wnd_rect;
+        }
+        sd->zoom = dc->cv.zoom;
+        sd->wnd_dims = wnd_dims;
+        sd->cv_dims = cv_dims;
     }
-    if (d) {
-        *d = (DPt) {a.x + (unit.x * t), a.y + (unit.y * t)};
+
+    for (u32 i = 0; i < sd->rects.len; ++i) {
+        Rect const view_damage = rect_bound(sd->rects.rects[i], wnd_rect);
+        if (is_valid_rect(view_damage)) {
+            dc_view_compose(ctx, view_damage);
+        }
     }
-}
 
-static DPt circumcenter_from_height(unsigned N, DPt V, DPt H) {
-    DPt O = DPNIL;
-    if (N < 3) {
-        return O;
+    // interface is redrawn where it was and where it will be
+    Rect const ui = draw_interface(ctx, cur_scr, True);
+    Rect sel_circ_damage = RNIL;
+    /* selection circle highlight */ {
+        i32 const item = sel_circ_curr_item(&ctx->sc, cur_scr.x, cur_scr.y);
+        if (item != sd->sel_circ_item) {
+            sel_circ_damage =
+                rect_expand(sel_circ_item_rect(&ctx->sc, sd->sel_circ_item), sel_circ_item_rect(&ctx->sc, item));
+        }
+        sd->sel_circ_item = item;
     }
+    Rect const statusline_damage = statusline_update_cache(ctx);
 
-    double dx = H.x - V.x;
-    double dy = H.y - V.y;
-    double d = sqrt((dx * dx) + (dy * dy));
-    double angle = PI / N;
-    double c = cos(angle);
+    RectSet damage = {0};
+    /* collect damage */ {
+        Rect const parts[] = {present, sd->ui, ui, sel_circ_damage, statusline_damage};
+        rectset_add_set(&damage, &sd->rects);
+        for (u32 i = 0; i < LENGTH(parts); ++i) {
+            rectset_add(&damage, parts[i]);
+        }
+        for (u32 i = 0; i < damage.len; ++i) {
+            damage.rects[i] = rect_bound(damage.rects[i], wnd_rect);
+            if (!is_valid_rect(damage.rects[i])) {
+                damage.rects[i--] = damage.rects[--damage.len];
+            }
+        }
+    }
+    sd->rects = (RectSet) {0};
+    sd->ui = ui;
+    sd->drawn = damage;
+    if (!damage.len) {
+        dc_shm_wait(dc);
+        return;
+    }
 
-    if (N & 1) {
-        double R = d / (1.0 + c);
-        double t = R / d;
-        O.x = V.x + dx * t;
-        O.y = V.y + dy * t;
-    } else {
-        // Center is midpoint between V and the midpoint of the opposite side (H)
-        O.x = (V.x + H.x) * 0.5;
-        O.y = (V.y + H.y) * 0.5;
+    // interface is drawn over view copy
+    for (u32 i = 0; i < damage.len; ++i) {
+        Rect const r = damage.rects[i];
+        Pt const dims = rect_dims(r);
+        XCopyArea(dc->dp, dc->view.pm, dc->back_buffer, dc->screen_gc, r.l, r.t, dims.x, dims.y, r.l, r.t);
     }
-    return O;
+    dc_clip_set(dc, &sd->drawn);
+
+    draw_interface(ctx, cur_scr, False);
+
+    dc_clip_set(dc, NULL);
+    // back buffer is valid outside of damage too, so bounds are presented at once
+    present_backbuffer(ctx, rectset_bounds(&damage));
+    // canvas and overlay may be changed after return
+    dc_shm_wait(dc);
+    trace(
+        "xpaint: frame rendered by %s in %llu us, %llu heap allocations",
+        renderer_to_string(dc->renderer),
+        (unsigned long long)(monotonic_us() - start_us),
+        (unsigned long long)(heap_alloc_count - allocs_before)
+    );
 }
 
-// find valid fill points within image and figure and use flood fill at them
-static void canvas_regular_poly_fill_helper(XImage* im, DPt const* edges, DPt center, double indent, argb col) {
-    if (arrlen(edges) < 3) {
-        return;
-    }
-    // too small, so just fill inside
-    if (dpt_dist(edges[0], center) < indent) {
-        ximage_flood_fill(im, col, (i32)center.x, (i32)center.y);
-        return;
+Rect draw_interface(struct Ctx* ctx, Pt cur_scr, Bool dry_run) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct Input* inp = &ctx->input;
+    struct InputMode* mode = &inp->mode;
+    struct ToolCtx* tc = &CURR_TC(ctx);
+
+    Pt const cur = pt_from_scr_to_cv_xy(dc, cur_scr.x, cur_scr.y);
+    Rect result = RNIL;
+
+    // transform mode rectangle
+    if (ctx->input.mode.t == InputT_Transform) {
+        Transform const trans = OVERLAY_TRANSFORM(&ctx->input.mode);
+        Rect const rect = inp->ovr.rect;
+        Pt const pivot = {rect.l, rect.t};
+        Rect const bounds = draw_dash_rect(
+            dc,
+            (Pt[4]) {pt_apply_trans_pivot((Pt) {rect.l, rect.t}, trans, pivot),
+                     pt_apply_trans_pivot((Pt) {rect.r + 1, rect.t}, trans, pivot),
+                     pt_apply_trans_pivot((Pt) {rect.r + 1, rect.b + 1}, trans, pivot),
+                     pt_apply_trans_pivot((Pt) {rect.l, rect.b + 1}, trans, pivot)},
+            dry_run
+        );
+        result = rect_expand(result, bounds);
     }
 
-    for (u32 i = 0; i < arrlen(edges); ++i) {
-        u32 const prev_index = MIN(i - 1, arrlen(edges) - 1);
-        DPt prev = DPNIL;
-        DPt curr = DPNIL;
-        canvas_regular_poly_point_helper(edges[prev_index], center, (u32)indent, &prev, NULL);
-        canvas_regular_poly_point_helper(edges[i], center, (u32)indent, &curr, NULL);
-        // flood fill optimized for spam
-        canvas_line_no_spacing(
-            &canvas_line_flood_fill_callback,
-            &(struct CanvasLineDrwCtxFloodFill) {.im = im, .col = col},
-            dpt_to_pt(prev),
-            dpt_to_pt(curr)
+    // rectangle around text
+    if (mode->t == InputT_Text) {
+        Rect const text_rect = get_string_rect(
+            dc,
+            tc->text_font,
+            mode->d.text.textarr,
+            arrlen(mode->d.text.textarr),
+            mode->d.text.tool_data.lb_corner
+        );
+        Rect const bounds = draw_dash_rect(
+            dc,
+            // +1 to match Transform rect (idk why it was added)
+            (Pt[4]) {(Pt) {text_rect.l, text_rect.t},
+                     (Pt) {text_rect.r + 1, text_rect.t},
+                     (Pt) {text_rect.r + 1, text_rect.b + 1},
+                     (Pt) {text_rect.l, text_rect.b + 1}},
+            dry_run
         );
+        result = rect_expand(result, bounds);
     }
-}
 
-// calculate distance between edges from distance between sides
-static double canvas_regular_poly_line_w_helper(u32 n, u32 line_w) {
-    // angle of regular polygon
-    double const angle = (((180.0 * n) - 360.0) / 2.0) * PI / 180.0;
-    // length of hypotenuse
-    return line_w / sin(angle / n);
-}
+    // anchor cross
+    if (WND_ANCHOR_CROSS_SIZE && ctx->input.mode.t == InputT_Interact && !IS_PNIL(inp->anchor)
+        && inp->c.state == CS_None) {
+        result = rect_expand(result, draw_dash_cross(dc, inp->anchor, WND_ANCHOR_CROSS_SIZE, dry_run));
+    }
 
-Rect canvas_regular_poly(XImage* im, struct ToolCtx* tc, u32 n, Pt a, Pt b, Bool fill) {
-    DPt const a_dpt = {a.x, a.y};
-    DPt const b_dpt = {b.x, b.y};
-    u32 const line_w = tc->line_w;
-    argb const col = *tc_curr_col(tc);
-    static struct DrawerData const circle_data = {.shape = DS_Circle, .spacing = 0.0, .hardness = 1.0};
-    static struct DrawerData const point_data = {.shape = DS_Point, .spacing = 0.0, .hardness = 1.0};
+    // drawer preview
+    if (ctx->input.mode.t == InputT_Interact && tc->t == Tool_Drawer) {
+        brush_cache_update(&tc->d.drawer, tc->line_w, *tc_curr_col(tc), &tc->brush_cache);
+        Pt brush_dims = tc->brush_cache.dims;
+        Pt lt = {cur.x - (brush_dims.x / 2), cur.y - (brush_dims.y / 2)};
+        Rect const bounds = draw_dash_rect(
+            dc,
+            (Pt[4]) {
+                (Pt) {lt.x, lt.y},
+                (Pt) {lt.x + brush_dims.x, lt.y},
+                (Pt) {lt.x + brush_dims.x, lt.y + brush_dims.y},
+                (Pt) {lt.x, lt.y + brush_dims.y},
+            },
+            dry_run
+        );
+        result = rect_expand(result, bounds);
+    }
 
-    // fill strategy will not work for small line_w
-    if (!fill && tc->line_w < 10) {
-        DPt c = DPNIL;
-        DPt d = DPNIL;
-        canvas_regular_poly_point_helper(a_dpt, b_dpt, tc->line_w / 2, &c, &d);
-        if (!IS_PNIL(c) && !IS_PNIL(d)) {
-            return canvas_regular_poly_frame_helper(im, n, dpt_to_pt(c), dpt_to_pt(d), circle_data, line_w, col, NULL);
-        }
-        return canvas_regular_poly_frame_helper(im, n, a, b, circle_data, line_w, col, NULL);
+    // brush line resize pivot
+    if (inp->mode.t == InputT_Interact && inp->c.state == CS_Drag && BTN_EQ(inp->c.btn, BTN_LINE_RESIZE)) {
+        result = rect_expand(result, draw_dash_cross(dc, inp->c.pos, WND_ANCHOR_CROSS_SIZE, dry_run));
     }
 
-    // draw outer frame
-    DPt* edges = NULL;
-    DPt const center = circumcenter_from_height(n, (DPt) {b.x, b.y}, (DPt) {a.x, a.y});
-    double const indent = canvas_regular_poly_line_w_helper(n, tc->line_w);
-    Rect const damage = canvas_regular_poly_frame_helper(im, n, a, b, point_data, line_w, col, &edges);
+    // selection rectangle, canvas is copied only on release
+    if (inp->mode.t == InputT_Interact && inp->c.state == CS_Drag && tc->t == Tool_Selection
+        && (BTN_EQ(inp->c.btn, BTN_MAIN) || BTN_EQ(inp->c.btn, BTN_COPY_SELECTION))) {
+        Pt const lt = {MIN(inp->c.pos.x, cur.x), MIN(inp->c.pos.y, cur.y)};
+        Pt const rb = {MAX(inp->c.pos.x, cur.x), MAX(inp->c.pos.y, cur.y)};
+        Rect const bounds = draw_dash_rect(
+            dc,
+            (Pt[4]) {
+                (Pt) {lt.x, lt.y},
+                (Pt) {rb.x, lt.y},
+                (Pt) {rb.x, rb.y},
+                (Pt) {lt.x, rb.y},
+            },
+            dry_run
+        );
+        result = rect_expand(result, bounds);
+    }
 
-    // draw inner frame to restrict fill
-    if (!fill && arrlen(edges) > 1) {
-        // canvas_regular_poly_frame_helper on moved a and b will draw Figure_Triangle badly
-        for (u32 i = 0; i < arrlen(edges); ++i) {
-            u32 const prev_index = MIN(i - 1, arrlen(edges) - 1);
-            DPt prev = DPNIL;
-            DPt curr = DPNIL;
-            canvas_regular_poly_point_helper(edges[prev_index], center, (u32)indent, &prev, NULL);
-            canvas_regular_poly_point_helper(edges[i], center, (u32)indent, &curr, NULL);
-            // point_data will not work with spacing
-            canvas_line_no_spacing(
-                &canvas_line_drawer_callback,
-                &(struct CanvasLineDrwCtxDrawer) {
-                    .im = im,
-                    .brush_in_out = &tc->brush_cache,
-                    .line_w = line_w,
-                    .data = point_data,
-                    .col = col,
-                },
-                dpt_to_pt(prev),
-                dpt_to_pt(curr)
-            );
-        }
+    // figure preview, rasterized to canvas only on release
+    if (inp->mode.t == InputT_Interact && inp->c.state == CS_Drag && tc->t == Tool_Figure
+        && (BTN_EQ(inp->c.btn, BTN_MAIN) || BTN_EQ(inp->c.btn, BTN_MAIN_ALTERNATIVE))) {
+        u32 const fig_variant = BTN_EQ(inp->c.btn, BTN_MAIN_ALTERNATIVE) ? 1 : 0;
+        result = rect_expand(result, draw_figure_preview(ctx, fig_variant, inp->anchor, cur, dry_run));
     }
 
-    // fill between outer and inner frame
-    // without inner flame this will fill whole figure
-    double const fill_indent = (indent * 0.1) + 2.5;  // static part for indent == 1
-    canvas_regular_poly_fill_helper(im, edges, center, fill_indent, *tc_curr_col(tc));
+    // canvas resize graphics
+    if (inp->c.state == CS_Drag && BTN_EQ(ctx->input.c.btn, BTN_CANVAS_RESIZE) && inp->mode.t == InputT_Interact) {
+        Rect const bounds = draw_dash_rect(
+            dc,
+            (Pt[4]) {
+                (Pt) {0, 0},
+                (Pt) {cur.x, 0},
+                (Pt) {cur.x, cur.y},
+                (Pt) {0, cur.y},
+            },
+            dry_run
+        );
+        result = rect_expand(result, bounds);
+    }
 
-    arrfree(edges);
+    // damaged on open and close, highlight damage is tracked in frame_render
+    draw_selection_circle(ctx, &ctx->sc, cur_scr.x, cur_scr.y, dry_run);
+    // damaged in statusline_update_cache
+    update_statusline(ctx, dry_run);
 
-    return damage;
+    return result;
 }
 
-Rect canvas_line(
-    Rect (*drawer)(void* drw_ctx, Pt p),
-    void* drw_ctx,
-    Pt from,
-    Pt const to,
-    u32 line_w,
-    double spacing,
-    Bool draw_first_pt
-) {
-    // XXX tc may be NULL
-    u32 const CANVAS_LINE_MAX_STEPS = 1000000;
+static u32 draw_module_string(struct DrawCtx* dc, char const* str, Pt c, enum Schm sc, Bool dry_run) {
+    return dry_run ? get_string_width(dc, str, strlen(str)) : draw_string(dc, str, c, sc, False);
+}
 
-    Rect damage = RNIL;
+// returns module width
+static u32 draw_module(struct Ctx* ctx, SLModule const* module, Pt c, Bool dry_run) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    struct InputMode* mode = &ctx->input.mode;
 
-    if (IS_PNIL(from) || IS_PNIL(to)) {
-        return RNIL;
-    }
+    switch (module->t) {
+        case SLM_Spacer: return module->d.spacer;
+        case SLM_Text: {
+            char const* str = module->d.text;
+            return draw_module_string(dc, str, c, SchmNorm, dry_run);
+        } break;
+        case SLM_ToolCtx: {
+            u32 x = c.x;
+            for (u32 tc_name = 1; tc_name <= TCS_NUM; ++tc_name) {
+                enum Schm const schm = ctx->curr_tc == (tc_name - 1) ? SchmFocus : SchmNorm;
+                char const* name = arena_str_new(&frame_arena, "%u", tc_name);
+                x += draw_module_string(dc, name, (Pt) {(i32)x, c.y}, schm, dry_run);
+                x += STATUSLINE_MODULE_SPACING_SMALL_PX;
+            }
+            return x - c.x - STATUSLINE_MODULE_SPACING_SMALL_PX;
+        } break;
+        case SLM_Mode: {
+            char const* name = input_mode_as_str(mode->t);
+            enum Schm const schm = mode->t == InputT_Interact ? SchmNorm : SchmFocus;
+            return draw_module_string(dc, name, c, schm, dry_run);
+        } break;
+        case SLM_Tool: {
+            char const* name = tc_get_tool_name(tc);
+            return draw_module_string(dc, name, c, SchmNorm, dry_run);
+        } break;
+        case SLM_ToolSettings: {
+            switch (mode->t) {
+                case InputT_Color:
+                case InputT_Console:
+                case InputT_Transform: return 0;
+                case InputT_Interact:
+                    switch (tc->t) {
+                        case Tool_Selection:
+                        case Tool_Fill:
+                        case Tool_Picker:
+                        case Tool_Figure:
+                        case Tool_Text: return 0;
+                        case Tool_Drawer: {
+                            // XXX shows spacing for pencil
+                            char const* fmt = "line_w: %d spacing: %.1f hardness: %.1f";
+                            u32 str_size =
+                                snprintf(NULL, 0, fmt, tc->line_w, tc->d.drawer.spacing, tc->d.drawer.hardness);
+                            char str[str_size + 1];  // +1 for null-terminator
+                            (void
+                            )snprintf(str, sizeof(str), fmt, tc->line_w, tc->d.drawer.spacing, tc->d.drawer.hardness);
 
-    i32 dx = abs(to.x - from.x);
-    i32 sx = from.x < to.x ? 1 : -1;
-    i32 dy = -abs(to.y - from.y);
-    i32 sy = from.y < to.y ? 1 : -1;
-    i32 error = dx + dy;
-    i32 spacing_cnt = 0;
-    i32 spacing_max = (i32)(line_w * spacing);
+                            u32 const width = draw_module_string(dc, str, c, SchmNorm, dry_run);
+                            return width;
+                        }
+                    }
+                    UNREACHABLE();
+                case InputT_Text: {
+                    char const* const separator = " ";
+                    char const* const font_name = xft_font_name(tc->text_font);
+                    char const* const str = arena_str_new(
+                        &frame_arena,
+                        "%s\"%s\"%s%s%.*s",
+                        TEXT_FONT_PROMPT,
+                        font_name,
+                        separator,
+                        TEXT_MODE_PROMPT,
+                        (u32)arrlen(mode->d.text.textarr),
+                        mode->d.text.textarr
+                    );
 
-    u32 steps = 0;  // prevent infinite loops
-    while (++steps < CANVAS_LINE_MAX_STEPS) {
-        if (draw_first_pt && spacing_cnt == 0) {
-            Rect pt_damage = drawer(drw_ctx, from);
-            damage = rect_expand(damage, pt_damage);
-        }
-        if (PT_EQ(from, to)) {
-            break;
+                    return draw_module_string(dc, str, c, SchmNorm, dry_run);
+                }
+            }
+            UNREACHABLE();
         }
-        i32 e2 = 2 * error;
-        if (e2 >= dy) {
-            if (from.x == to.x) {
-                break;
+        case SLM_ColorBox: {
+            if (!dry_run) {
+                fill_rect(
+                    dc,
+                    (Pt) {c.x, clientarea_size(dc).y},
+                    (Pt) {(i32)module->d.color_box_w, (i32)statusline_height(dc)},
+                    *tc_curr_col(tc)
+                );
             }
-            error += dy;
-            from.x += sx;
+            return module->d.color_box_w;
         }
-        if (e2 <= dx) {
-            if (from.y == to.y) {
-                break;
+        case SLM_ColorName: {
+            static u32 const col_value_size = 1 + 6;
+
+            char col_value[col_value_size + 1];
+            (void)sprintf(col_value, "#%06X", *tc_curr_col(tc) & 0xFFFFFF);
+            u32 width = draw_module_string(dc, col_value, c, SchmNorm, dry_run);
+            // draw focused digit
+            if (!dry_run && mode->t == InputT_Color) {
+                static u32 const hash_w = 1;
+                u32 const curr_dig = mode->d.col.current_digit;
+                char const col_digit_value[] = {[0] = col_value[curr_dig + hash_w], [1] = '\0'};
+                u32 focus_offset = get_string_width(dc, col_value, curr_dig + hash_w);
+                draw_string(dc, col_digit_value, (Pt) {c.x + (i32)focus_offset, c.y}, SchmFocus, False);
             }
-            error += dx;
-            from.y += sy;
+            return width;
         }
-        if (spacing_max) {
-            spacing_cnt = (spacing_cnt + 1) % spacing_max;
+        case SLM_ColorList: {
+            // FIXME why it compiles
+            char col_count[(digit_count(MAX_COLORS) * 2) + 1 + 1];
+            (void)sprintf(col_count, "%d/%td", tc->curr_col + 1, arrlen(tc->colarr));
+            return draw_module_string(dc, col_count, c, SchmNorm, dry_run);
         }
-        draw_first_pt = True;
     }
 
-    return damage;
-}
-
-Rect canvas_line_no_spacing(Rect (*drawer)(void* drw_ctx, Pt p), void* drw_ctx, Pt from, Pt to) {
-    return canvas_line(drawer, drw_ctx, from, to, 1, 0.0, True);
+    UNREACHABLE();
 }
 
-static argb* new_circle_brush(argb col, double hardness, u32 d, Bool random) {
-    if (d == 0) {
-        return NULL;
-    }
-    argb* result = ecalloc((usize)d * d, sizeof(argb));
-
-    if (d == 1) {
-        result[0] = col;
-        return result;
-    }
-
-    double const c = (d - 1) / 2.0;
-    double const r = d / 2.0;
-    double const r_sq = r * r;
+Rect update_statusline(struct Ctx* ctx, Bool dry_run) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct InputMode* mode = &ctx->input.mode;
+    u32 const statusline_h = statusline_height(dc);
+    Pt const clientarea = clientarea_size(dc);
+    Pt const line_dims = {(i32)dc->width, (i32)(statusline_h)};
 
-    for (i32 y = 0; y < (i32)d; ++y) {
-        double dy = (y - c);
-        for (i32 x = 0; x < (i32)d; ++x) {
-            double dx = (x - c);
-            double const dist_sq = (dx * dx) + (dy * dy);
-            if (dist_sq < r_sq) {
-                if (random) {
-                    double const curr_r = (double)rand() / (double)RAND_MAX;  // NOLINT(cert-msc30-c, cert-msc50-cpp)
-                    double const threshold = ease_in_expo(hardness + 0.1);
-                    result[(y * d) + x] = curr_r < threshold ? col : 0;
-                } else {
-                    u8 const alpha = (u8)((1.0 - ease_out_cubic_hardness(hardness, dist_sq / r_sq)) * 0xFF);
-                    argb const curr_col = (col & 0x00FFFFFF) | ((u32)alpha << (8 * 3));
-                    result[(y * d) + x] = curr_col;
-                }
-            }
+    if (dry_run) {
+        u32 compls_rows = 0;
+        if (mode->t == InputT_Console && mode->d.cl.compls_arr) {
+            compls_rows = MIN(arrlen(mode->d.cl.compls_arr), STATUSLINE_COMPLS_LIST_MAX);
         }
+        return (Rect) {0, clientarea.y - (i32)(statusline_h * compls_rows), (i32)dc->width - 1, (i32)dc->height - 1};
     }
 
-    return result;
-}
+    fill_rect(dc, (Pt) {0, clientarea.y}, line_dims, COL_BG(dc, SchmNorm));
 
-// copy `brush_arr` to `im` at `lt` corner
-static Pt canvas_apply_brush(XImage* im, argb const* brush_arr, Pt brush_dims, Pt lt) {
-    // XXX this implementation assumes XImage::data is flattened 2D array of `argb` values
-    if (!im || !brush_arr || IS_PNIL(brush_dims)) {
-        return PNIL;
-    }
-    Pt dims = {
-        .x = MAX(0, MIN(brush_dims.x, im->width - lt.x)),
-        .y = MAX(0, MIN(brush_dims.y, im->height - lt.y)),
-    };
+    if (ctx->frame.message_dyn) {
+        draw_string(dc, ctx->frame.message_dyn, (Pt) {0, (i32)(dc->height - STATUSLINE_PADDING_BOTTOM)}, SchmNorm, False);
+    } else if (mode->t == InputT_Console) {
+        struct InputConsoleData* cl = &mode->d.cl;
+        i32 const cmd_y = (i32)(dc->height - STATUSLINE_PADDING_BOTTOM);
 
-    // all messy logic is needed to crop brush_arr to im dimentions
-    for (i32 row = 0; row < dims.y; ++row) {
-        if (dims.y < -lt.x || row < -lt.y) {
-            continue;  // code below assumes what at least one row/column will be affected
+        i32 user_cmd_w = NIL;
+        /* draw command */ {
+            char const* command = cl->cmdarr;
+            u32 const command_len = arrlen(command);
+            char const* cl_str = arena_str_new(&frame_arena, "%s%.*s", CL_CMD_PROMPT, command_len, command);
+
+            user_cmd_w = (i32)draw_string(dc, cl_str, (Pt) {0, cmd_y}, SchmNorm, False);
         }
-        argb const* const brush_row = brush_arr + (ptrdiff_t)(brush_dims.x * row);
-        argb* const im_row_offseted = (argb*)im->data + (ptrdiff_t)(((MAX(0, row + lt.y) * im->width) + MAX(0, lt.x)));
 
-        for (i32 col = 0; col < (dims.x - (lt.x < 0 ? -lt.x : 0)); ++col) {
-            argb const bg = im_row_offseted[col];
-            argb const fg = brush_row[col];
-            // use brush pixel transparency as blending alpha value
-            im_row_offseted[col] = argb_blend(fg | ARGB_ALPHA, bg, (fg >> 0x18) & 0xFF);
+        /* draw cursor */ {
+            i32 const indent = 2;
+            i32 const cursor_w = 1;
+
+            i32 const cursor_width = (i32)get_string_width(dc, "_", 1);
+            Pt const c = {user_cmd_w, cmd_y + indent};
+            draw_line(dc, c, (Pt) {c.x + cursor_width, c.y}, cursor_w, SchmNorm, False);
         }
-    }
 
-    return dims;
-}
+        if (cl->compls_arr) {
+            draw_string(dc, cl->compls_arr[cl->compls_curr].val_dyn, (Pt) {user_cmd_w, cmd_y}, SchmFocus, False);
 
-Rect canvas_apply_drawer(XImage* im, struct DrawerData data, u32 line_w, argb col, Pt c, struct Brush* brush_in_out) {
-    brush_cache_update(&data, line_w, col, brush_in_out);
-    Pt const brush_dims = brush_in_out->dims;
+            /* draw compls array */ {
+                u32 const list_pre_half = (STATUSLINE_COMPLS_LIST_MAX + 1) / 2;
+                u32 const len = arrlen(cl->compls_arr);
 
-    Pt lt = (Pt) {c.x - (brush_dims.x / 2), c.y - (brush_dims.y / 2)};
-    canvas_apply_brush(im, brush_in_out->data, brush_dims, lt);
+                i32 const begin =
+                    MAX(0, MIN((i32)cl->compls_curr - (i32)list_pre_half, (i32)len - (i32)STATUSLINE_COMPLS_LIST_MAX));
+                i32 const end = MIN(len, begin + STATUSLINE_COMPLS_LIST_MAX);
 
-    // inclusive
-    return (Rect) {
-        CLAMP(lt.x, 0, im->width - 1),
-        CLAMP(lt.y, 0, im->height - 1),
-        CLAMP(lt.x + brush_dims.x, 0, im->width - 1),
-        CLAMP(lt.y + brush_dims.y, 0, im->height - 1),
-    };
-}
+                for (i32 i = begin; i < end; ++i) {
+                    char const* const compl_val = cl->compls_arr[i].val_dyn;
+                    char const* const compl_descr = cl->compls_arr[i].descr_optdyn;
 
-Rect canvas_copy_region(XImage* dest, XImage* src, Pt from, Pt dims, Pt to) {
-    i32 const w = src->width;
-    i32 const h = src->height;
-    assert(from.x >= 0 && from.y >= 0);
-    assert(from.x + dims.x <= w && from.y + dims.y <= h);
+                    u32 const row_num = end - i;
+                    i32 const y = (i32)(clientarea.y - (statusline_h * row_num));
+                    i32 const stry = (i32)(y + statusline_h - STATUSLINE_PADDING_BOTTOM);
+                    argb const bg_col = i != (i32)cl->compls_curr ? COL_BG(dc, SchmNorm) : COL_FG(dc, SchmNorm);
+                    Bool const invert = i == (i32)cl->compls_curr;
 
-    if (dims.x == 0 || dims.y == 0) {
-        return RNIL;
-    }
+                    fill_rect(dc, (Pt) {0, y}, line_dims, bg_col);
+                    draw_string(dc, compl_val, (Pt) {0, stry}, SchmNorm, invert);
 
-    // FIXME alloc only dims.x * dims.y
-    u32* region_dyn = (u32*)ecalloc(w * h, sizeof(u32));
-    for (i32 get_or_set = 1; get_or_set >= 0; --get_or_set) {
-        for (i32 y = 0; y < dims.y; ++y) {
-            for (i32 x = 0; x < dims.x; ++x) {
-                if (get_or_set) {
-                    region_dyn[(y * w) + x] = XGetPixel(src, from.x + x, from.y + y);
-                } else {
-                    ximage_put_checked(dest, to.x + x, to.y + y, region_dyn[(y * w) + x]);
+                    if (compl_descr) {
+                        i32 const padding = (i32)STATUSLINE_COMPLS_DESRCIPTION_PADDING_PX;
+                        i32 const val_w = (i32)get_string_width(dc, compl_val, strlen(compl_val));
+                        i32 const descr_w = (i32)get_string_width(dc, compl_descr, strlen(compl_descr));
+                        i32 const strx =
+                            val_w + descr_w + padding < clientarea.x ? clientarea.x - descr_w : val_w + padding;
+                        draw_string(dc, compl_descr, (Pt) {strx, stry}, SchmNorm, invert);
+                    }
                 }
             }
         }
-    }
-
-    free(region_dyn);
-    return (Rect) {
-        MAX(0, to.x),
-        MAX(0, to.y),
-        MIN(dest->width - 1, to.x + dims.x - 1),
-        MIN(dest->height - 1, to.y + dims.y - 1),
-    };
-}
-
-void canvas_fill(XImage* im, argb col) {
-    for (i32 i = 0; i < im->width; ++i) {
-        for (i32 j = 0; j < im->height; ++j) {
-            XPutPixel(im, i, j, col);
+    } else {
+        // laid out in statusline_update_cache, only damaged modules are drawn
+        i32 const y = (i32)(dc->height - STATUSLINE_PADDING_BOTTOM);
+        for (u32 i = 0; i < arrlen(ctx->statusline.modules_arr); ++i) {
+            Rect const rect = ctx->statusline.modules_arr[i].rect;
+            if (rectset_intersects(&dc->scr_damage.drawn, rect)) {
+                draw_module(ctx, statusline_module(i), (Pt) {rect.l, y}, False);
+            }
         }
     }
-}
-
-static Bool canvas_load(struct Ctx* ctx, struct Image* image) {
-    if (!image->im) {
-        return False;
-    }
-    struct DrawCtx* dc = &ctx->dc;
-
-    overlay_free(&ctx->input.ovr);
-    canvas_free(&dc->cv);
-    dc->cv.im = image->im;
-    dc->cv.type = image->type;
 
-    struct InputOverlay* ovr = &ctx->input.ovr;
-    ovr->im = XSubImage(dc->cv.im, 0, 0, dc->cv.im->width, dc->cv.im->height);
-    ovr->rect = ximage_rect(ovr->im);
-    overlay_clear(ovr);
+    return update_statusline(ctx, True);
+}
 
-    return True;
+SLModule const* statusline_module(u32 index) {
+    return index < LENGTH(LEFT_MODULES) ? &LEFT_MODULES[index] : &RIGHT_MODULES[index - LENGTH(LEFT_MODULES)];
 }
 
-void canvas_free(struct Canvas* cv) {
-    if (cv->im) {
-        XDestroyImage(cv->im);
-        cv->im = NULL;
+// FNV-1a
+static u64 hash_bytes(u64 hash, void const* data, usize len) {
+    u8 const* bytes = data;
+    for (usize i = 0; i < len; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
     }
+    return hash;
 }
 
-void canvas_change_zoom(struct DrawCtx* dc, Pt cursor, i32 delta) {
-    double old_zoom = ZOOM_C(dc);
-    dc->cv.zoom = CLAMP(dc->cv.zoom + delta, CANVAS_MIN_ZOOM, CANVAS_MAX_ZOOM);
-    // keep cursor at same position
-    canvas_scroll(
-        &dc->cv,
-        (DPt) {
-            (dc->cv.scroll.x - cursor.x) * (ZOOM_C(dc) / old_zoom - 1.0),
-            (dc->cv.scroll.y - cursor.y) * (ZOOM_C(dc) / old_zoom - 1.0),
-        }
-    );
+static u64 hash_str(u64 hash, char const* str) {
+    return str ? hash_bytes(hash, str, strlen(str) + 1) : hash_bytes(hash, "", 1);
 }
 
-void canvas_resize(struct Ctx* ctx, u32 new_width, u32 new_height) {
-    if (new_width <= 0 || new_height <= 0) {
-        trace("resize_canvas: invalid canvas size");
-        return;
-    }
-    struct DrawCtx* dc = &ctx->dc;
-    struct Input* inp = &ctx->input;
-    u32 const old_width = dc->cv.im->width;
-    u32 const old_height = dc->cv.im->height;
-
-    // resize overlay too
-    XImage* old_overlay = inp->ovr.im;
-    inp->ovr.im = XSubImage(inp->ovr.im, 0, 0, new_width, new_height);
-    inp->ovr.rect = ximage_rect(inp->ovr.im);
-    overlay_clear(&inp->ovr);
-    XDestroyImage(old_overlay);
-
-    // FIXME can fill color be changed?
-    XImage* new_cv_im = XSubImage(dc->cv.im, 0, 0, new_width, new_height);
-    XDestroyImage(dc->cv.im);
-    dc->cv.im = new_cv_im;
+static u64 statusline_module_key(struct Ctx* ctx, SLModule const* module) {
+    struct ToolCtx* tc = &CURR_TC(ctx);
+    struct InputMode* mode = &ctx->input.mode;
+    u64 key = hash_bytes(0xCBF29CE484222325ULL, &module->t, sizeof(module->t));
 
-    // fill new area if needed
-    if (old_width < new_width) {
-        canvas_fill_rect(
-            dc->cv.im,
-            (Pt) {(i32)old_width, 0},
-            (Pt) {(i32)(new_width - old_width), (i32)new_height},
-            CANVAS_BACKGROUND
-        );
-    }
-    if (old_height < new_height) {
-        canvas_fill_rect(
-            dc->cv.im,
-            (Pt) {0, (i32)old_height},
-            (Pt) {(i32)new_width, (i32)(new_height - old_height)},
-            CANVAS_BACKGROUND
-        );
+    switch (module->t) {
+        case SLM_Spacer:
+        case SLM_Text: break;  // static
+        case SLM_ToolCtx: key = hash_bytes(key, &ctx->curr_tc, sizeof(ctx->curr_tc)); break;
+        case SLM_Mode: key = hash_bytes(key, &mode->t, sizeof(mode->t)); break;
+        case SLM_Tool: key = hash_str(key, tc_get_tool_name(tc)); break;
+        case SLM_ToolSettings: {
+            key = hash_bytes(key, &mode->t, sizeof(mode->t));
+            key = hash_bytes(key, &tc->t, sizeof(tc->t));
+            if (mode->t == InputT_Interact && tc->t == Tool_Drawer) {
+                key = hash_bytes(key, &tc->line_w, sizeof(tc->line_w));
+                key = hash_bytes(key, &tc->d.drawer.spacing, sizeof(tc->d.drawer.spacing));
+                key = hash_bytes(key, &tc->d.drawer.hardness, sizeof(tc->d.drawer.hardness));
+            } else if (mode->t == InputT_Text) {
+                key = hash_str(key, xft_font_name(tc->text_font));
+                key = hash_bytes(key, mode->d.text.textarr, arrlen(mode->d.text.textarr));
+            }
+        } break;
+        case SLM_ColorBox: key = hash_bytes(key, tc_curr_col(tc), sizeof(argb)); break;
+        case SLM_ColorName: {
+            key = hash_bytes(key, tc_curr_col(tc), sizeof(argb));
+            key = hash_bytes(key, &mode->t, sizeof(mode->t));
+            if (mode->t == InputT_Color) {
+                key = hash_bytes(key, &mode->d.col.current_digit, sizeof(mode->d.col.current_digit));
+            }
+        } break;
+        case SLM_ColorList: {
+            usize const len = arrlen(tc->colarr);
+            key = hash_bytes(key, &tc->curr_col, sizeof(tc->curr_col));
+            key = hash_bytes(key, &len, sizeof(len));
+        } break;
     }
+    return key;
 }
 
-void canvas_scroll(struct Canvas* cv, DPt delta) {
-    cv->scroll.x += delta.x;
-    cv->scroll.y += delta.y;
-}
-
-void overlay_clear(struct InputOverlay* ovr) {
-    ximage_clear(ovr->im, ovr->rect);
-    ovr->rect = RNIL;
-}
-
-void overlay_expand_rect(struct InputOverlay* ovr, Rect rect) {
-    ovr->rect = rect_expand(ovr->rect, rect);
-}
+Rect statusline_update_cache(struct Ctx* ctx) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct InputMode* mode = &ctx->input.mode;
+    struct Statusline* sl = &ctx->statusline;
+    Rect const rect = update_statusline(ctx, True);
+    Rect damage = RNIL;
 
-static struct InputOverlay get_transformed_overlay(struct DrawCtx* dc, struct Input const* inp) {
-    XTransform const xtrans = xtrans_overlay_transform_mode(inp);
-    XImage* im = ximage_apply_xtrans(inp->ovr.im, dc, xtrans);
-    Rect const rect = ximage_calc_damage(im);
-    return (struct InputOverlay) {.im = im, .rect = rect};
-}
+    /* line */ {
+        enum { K_Message, K_Console, K_Modules } kind = K_Modules;
+        if (ctx->frame.message_dyn) {
+            kind = K_Message;
+        } else if (mode->t == InputT_Console) {
+            kind = K_Console;
+        }
+        u64 key = hash_bytes(0xCBF29CE484222325ULL, &kind, sizeof(kind));
+        key = hash_bytes(key, &rect, sizeof(rect));
+        key = hash_bytes(key, &dc->fnt, sizeof(dc->fnt));
+        if (kind == K_Message) {
+            key = hash_str(key, ctx->frame.message_dyn);
+        } else if (kind == K_Console) {
+            struct InputConsoleData const* cl = &mode->d.cl;
+            key = hash_bytes(key, cl->cmdarr, arrlen(cl->cmdarr));
+            key = hash_bytes(key, &cl->compls_curr, sizeof(cl->compls_curr));
+            for (u32 i = 0; i < arrlen(cl->compls_arr); ++i) {
+                key = hash_str(key, cl->compls_arr[i].val_dyn);
+                key = hash_str(key, cl->compls_arr[i].descr_optdyn);
+            }
+        }
 
-void overlay_free(struct InputOverlay* ovr) {
-    if (ovr->im) {
-        XDestroyImage(ovr->im);
-        ovr->im = NULL;
+        if (key != sl->key) {
+            damage = rect_expand(sl->rect, rect);
+            sl->key = key;
+            sl->rect = rect;
+            // modules are laid out again
+            for (u32 i = 0; i < arrlen(sl->modules_arr); ++i) {
+                sl->modules_arr[i].rect = RNIL;
+            }
+        }
+        if (kind != K_Modules) {
+            return damage;
+        }
     }
-    ovr->rect = RNIL;
-}
 
-u32 statusline_height(struct DrawCtx const* dc) {
-    return dc->fnt->ascent + STATUSLINE_PADDING_BOTTOM;
-}
+    if (sl->modules_arr == NULL) {
+        for (u32 i = 0; i < LENGTH(LEFT_MODULES) + LENGTH(RIGHT_MODULES); ++i) {
+            arrpush(sl->modules_arr, ((struct SLModuleCache) {.key = 0, .rect = RNIL}));
+        }
+    }
 
-Pt clientarea_size(struct DrawCtx const* dc) {
-    return (Pt) {
-        .x = (i32)(dc->width),
-        .y = (i32)(dc->height - statusline_height(dc)),
-    };
+    i32 const top = clientarea_size(dc).y;
+    i32 const bottom = (i32)dc->height - 1;
+    i32 left_x = 0;
+    i32 right_x = (i32)dc->width;
+    for (u32 n = 0; n < arrlen(sl->modules_arr); ++n) {
+        // right modules are laid out from right to left
+        Bool const is_left = n < LENGTH(LEFT_MODULES);
+        u32 const i = is_left ? n : arrlen(sl->modules_arr) - 1 - (n - LENGTH(LEFT_MODULES));
+        struct SLModuleCache* cache = &sl->modules_arr[i];
+        SLModule const* module = statusline_module(i);
+
+        u64 const key = statusline_module_key(ctx, module);
+        i32 const width = key == cache->key && !IS_RNIL(cache->rect)
+            ? rect_dims(cache->rect).x
+            : (i32)draw_module(ctx, module, (Pt) {0, 0}, True);
+        i32 const x = is_left ? left_x : right_x - width;
+        Rect const module_rect = {x, top, x + width - 1, bottom};
+
+        if (key != cache->key || !RECT_EQ(module_rect, cache->rect)) {
+            damage = rect_expand(damage, rect_expand(cache->rect, module_rect));
+            cache->key = key;
+            cache->rect = module_rect;
+        }
+        if (is_left) {
+            left_x += width + (i32)STATUSLINE_MODULE_SPACING_PX;
+        } else {
+            right_x -= width + (i32)STATUSLINE_MODULE_SPACING_PX;
+        }
+    }
+
+    return damage;
 }
 
-Pt canvas_size(struct DrawCtx const* dc) {
-    return (Pt) {
-        .x = (i32)(dc->cv.im->width * ZOOM_C(dc)),
-        .y = (i32)(dc->cv.im->height * ZOOM_C(dc)),
-    };
+void show_message(struct Ctx* ctx, char const* msg) {
+    struct Frame* fr = &ctx->frame;
+    str_free(&fr->message_dyn);
+    fr->message_dyn = str_new("%s", msg);
+    fr->message_shown = False;
+    fr->dirty = True;
+
+    // draw now, caller may block before next frame
+    Rect const rect = rect_expand(statusline_update_cache(ctx), update_statusline(ctx, True));
+    update_statusline(ctx, False);
+    present_backbuffer(ctx, rect);
+    XFlush(ctx->dc.dp);
 }
 
-void draw_arc(struct DrawCtx* dc, Pt c, Pt dims, double a1, double a2, argb col) {
-    XSetForeground(dc->dp, dc->screen_gc, col);
-    XDrawArc(dc->dp, dc->back_buffer, dc->screen_gc, c.x, c.y, dims.x, dims.y, (i32)(a1 * 64), (i32)(a2 * 64));
+void dc_damage_scr(struct DrawCtx* dc, Rect scr_rect) {
+    rectset_add(&dc->scr_damage.rects, scr_rect);
 }
 
-void fill_arc(struct DrawCtx* dc, Pt c, Pt dims, double a1, double a2, argb col) {
-    XSetForeground(dc->dp, dc->screen_gc, col);
-    XFillArc(dc->dp, dc->back_buffer, dc->screen_gc, c.x, c.y, dims.x, dims.y, (i32)(a1 * 64), (i32)(a2 * 64));
+void dc_damage_cv(struct DrawCtx* dc, Rect cv_rect) {
+    dc_damage_scr(dc, rect_from_cv_to_scr(dc, cv_rect));
 }
 
-u32 draw_string(struct DrawCtx* dc, char const* str, Pt c, enum Schm sc, Bool invert) {
-    XftDraw* d = XftDrawCreate(dc->dp, dc->back_buffer, dc->sys.vinfo.visual, dc->sys.colmap);
-    u32 str_len = strlen(str);
-    u32 const width = get_string_width(dc, str, str_len);
-    XftDrawStringUtf8(
-        d,
-        invert ? &dc->schemes_dyn[sc].bg : &dc->schemes_dyn[sc].fg,
-        dc->fnt,
-        c.x,
-        c.y,
-        (FcChar8 const*)str,
-        (i32)str_len
+void present_backbuffer(struct Ctx* ctx, Rect scr_rect) {
+    // back buffer is never swapped, so it keeps last frame outside of damage
+    Pt const dims = rect_dims(scr_rect);
+    XCopyArea(
+        ctx->dc.dp,
+        ctx->dc.back_buffer,
+        ctx->dc.window,
+        ctx->dc.screen_gc,
+        scr_rect.l,
+        scr_rect.t,
+        dims.x,
+        dims.y,
+        scr_rect.l,
+        scr_rect.t
     );
-    XftDrawDestroy(d);
-    return width;
-}
 
-u32 draw_int(struct DrawCtx* dc, i32 i, Pt c, enum Schm sc, Bool invert) {
-    char* msg = str_new("%d", i);
-    u32 result = draw_string(dc, msg, c, sc, invert);
-    str_free(&msg);
-    return result;
+    XSyncSetCounter(ctx->dc.dp, ctx->xsync.counter, ctx->xsync.last_request_value);
 }
 
-// XXX always opaque
-int fill_rect(struct DrawCtx* dc, Pt p, Pt dim, argb col) {
-    XSetForeground(dc->dp, dc->screen_gc, col | 0xFF000000);
-    return XFillRectangle(dc->dp, dc->back_buffer, dc->screen_gc, p.x, p.y, dim.x, dim.y);
+// pm_lt is image point at pixmap origin
+static void dc_cache_update_pm_at(struct DrawCtx* dc, Pixmap pm, Pt pm_lt, XImage* im, Rect damage) {
+    assert(im);
+    damage = rect_bound(damage, ximage_rect(im));
+    if (!is_valid_rect(damage)) {
+        return;
+    }
+    Pt const dims = rect_dims(damage);
+    Pt const dst = {damage.l - pm_lt.x, damage.t - pm_lt.y};
+    if (ximage_is_shm(im)) {
+        // server reads image memory directly, completion is awaited in dc_shm_wait
+        XShmPutImage(dc->dp, pm, dc->screen_gc, im, damage.l, damage.t, dst.x, dst.y, dims.x, dims.y, True);
+        ++dc->shm.pending;
+    } else {
+        XPutImage(dc->dp, pm, dc->screen_gc, im, damage.l, damage.t, dst.x, dst.y, dims.x, dims.y);
+    }
 }
 
-int draw_line_ex(struct DrawCtx* dc, Pt from, Pt to, u32 w, int line_style, enum Schm sc, Bool invert) {
-    GC gc = dc->screen_gc;
-    XSetForeground(dc->dp, gc, invert ? COL_BG(dc, sc) : COL_FG(dc, sc));
-    XSetLineAttributes(dc->dp, gc, w, line_style, CapButt, JoinMiter);
-    return XDrawLine(dc->dp, dc->back_buffer, gc, from.x, from.y, to.x, to.y);
+static void dc_cache_update_pm(struct DrawCtx* dc, Pixmap pm, XImage* im, Rect damage) {
+    dc_cache_update_pm_at(dc, pm, (Pt) {0, 0}, im, damage);
 }
 
-int draw_line(struct DrawCtx* dc, Pt from, Pt to, u32 w, enum Schm sc, Bool invert) {
-    return draw_line_ex(dc, from, to, w, LineSolid, sc, invert);
+static Bool is_shm_completion_event(__attribute__((unused)) Display* dp, XEvent* event, XPointer completion_type) {
+    return event->type == *(i32*)completion_type;
 }
 
-void draw_dash_line(struct DrawCtx* dc, Pt from, Pt to, u32 w) {
-    draw_line(dc, from, to, w, SchmNorm, True);
-    draw_line_ex(dc, from, to, w, LineOnOffDash, SchmNorm, False);
+void dc_view_reset(struct DrawCtx* dc) {
+    struct View* view = &dc->view;
+    Pt const wnd_dims = {(i32)dc->width, (i32)dc->height};
+    if (view->pm == 0 || !PT_EQ(view->dims, wnd_dims)) {
+        dc_view_free(dc);
+        view->pm = XCreatePixmap(dc->dp, dc->window, wnd_dims.x, wnd_dims.y, dc->sys.vinfo.depth);
+        view->dims = wnd_dims;
+    }
+
+    // first visible canvas pixel, aligned to mip level pixels
+    u32 const mip_level = dc_mip_level(dc);
+    double const mip_zoom = ZOOM_C(dc) * (double)(1U << mip_level);
+    Pt const scroll = dc->scr_damage.scroll;
+    Pt const cv_size = canvas_size(dc);
+    Rect const visible = rect_bound(
+        (Rect) {scroll.x, scroll.y, scroll.x + cv_size.x - 1, scroll.y + cv_size.y - 1},
+        (Rect) {0, 0, wnd_dims.x - 1, wnd_dims.y - 1}
+    );
+    if (is_valid_rect(visible)) {
+        view->anchor = (Pt) {
+            (i32)floor((visible.l - scroll.x) / mip_zoom) << mip_level,
+            (i32)floor((visible.t - scroll.y) / mip_zoom) << mip_level,
+        };
+    } else {
+        view->anchor = (Pt) {0, 0};
+    }
 }
 
-void draw_dash_rect(struct DrawCtx* dc, Pt pts[4]) {
-    for (u32 i = 0; i < 4; ++i) {
-        Pt const from = pt_from_cv_to_scr(dc, pts[i]);
-        Pt const to = pt_from_cv_to_scr(dc, pts[(i + 1) % 4]);
-        draw_dash_line(dc, from, to, 2);
+void dc_view_free(struct DrawCtx* dc) {
+    if (dc->view.pm != 0) {
+        XFreePixmap(dc->dp, dc->view.pm);
+        dc->view.pm = 0;
+    }
+    if (dc->view.im != NULL) {
+        XDestroyImage(dc->view.im);
+        dc->view.im = NULL;
     }
 }
 
-void draw_dash_cross(struct DrawCtx* dc, Pt cv_center, i32 radius) {
-    Pt lt = pt_from_cv_to_scr(dc, cv_center);
-    Pt rb = pt_from_cv_to_scr(dc, (Pt) {cv_center.x + 1, cv_center.y + 1});
-    Pt scr_center = (Pt) {(lt.x + rb.x) / 2, (lt.y + rb.y) / 2};
-    Rect const rect = {
-        scr_center.x - radius,
-        scr_center.y - radius,
-        scr_center.x + radius,
-        scr_center.y + radius,
+static Pt dc_view_anchor_scr(struct DrawCtx const* dc) {
+    double const zoom = ZOOM_C(dc);
+    return (Pt) {
+        dc->scr_damage.scroll.x + (i32)round(dc->view.anchor.x * zoom),
+        dc->scr_damage.scroll.y + (i32)round(dc->view.anchor.y * zoom),
     };
-
-    draw_dash_line(dc, (Pt) {rect.l, rect.b}, (Pt) {rect.r, rect.t}, 1);
-    draw_dash_line(dc, (Pt) {rect.l, rect.t}, (Pt) {rect.r, rect.b}, 1);
 }
 
-u32 get_string_width(struct DrawCtx const* dc, char const* str, u32 len) {
-    XGlyphInfo ext;
-    XftTextExtentsUtf8(dc->dp, dc->fnt, (XftChar8*)str, (i32)len, &ext);
-    return ext.xOff;
+Bool dc_view_anchor_fits(struct DrawCtx const* dc) {
+    if (dc->view.pm == 0) {
+        return False;
+    }
+    // keeps composite offsets far from 16-bit limits
+    Pt const origin = dc_view_anchor_scr(dc);
+    Pt const dims = dc->view.dims;
+    return origin.x >= -dims.x && origin.x <= dims.x * 2 && origin.y >= -dims.y && origin.y <= dims.y * 2;
 }
 
-Rect get_string_rect(struct DrawCtx const* dc, XftFont* font, char const* str, u32 len, Pt lt) {
-    XGlyphInfo ext = {0};
-    XftTextExtentsUtf8(dc->dp, font, (FcChar8 const*)str, (i32)len, &ext);
-    // XftDrawStringUtf8 seems like to accept left-baseline point
-    return (Rect) {
-        .l = lt.x,
-        .t = lt.y + font->descent - font->height,
-        .r = lt.x + ext.xOff,
-        .b = lt.y + font->descent,
-    };
+void dc_view_scroll(struct Ctx* ctx, Pt delta) {
+    struct DrawCtx* dc = &ctx->dc;
+    Pt const dims = dc->view.dims;
+    Pt const src = {MAX(0, -delta.x), MAX(0, -delta.y)};
+    Pt const dst = {MAX(0, delta.x), MAX(0, delta.y)};
+    XCopyArea(
+        dc->dp,
+        dc->view.pm,
+        dc->view.pm,
+        dc->screen_gc,
+        src.x,
+        src.y,
+        dims.x - abs(delta.x),
+        dims.y - abs(delta.y),
+        dst.x,
+        dst.y
+    );
+
+    // newly exposed strips
+    if (delta.x != 0) {
+        i32 const l = delta.x > 0 ? 0 : dims.x + delta.x;
+        dc_view_compose(ctx, (Rect) {l, 0, l + abs(delta.x) - 1, dims.y - 1});
+    }
+    if (delta.y != 0) {
+        i32 const t = delta.y > 0 ? 0 : dims.y + delta.y;
+        dc_view_compose(ctx, (Rect) {0, t, dims.x - 1, t + abs(delta.y) - 1});
+    }
 }
 
-void draw_selection_circle(
-    struct Ctx* ctx,
-    struct SelectionCircle const* sc,
-    i32 const pointer_x,
-    i32 const pointer_y
-) {
+void dc_view_compose(struct Ctx* ctx, Rect rect) {
     struct DrawCtx* dc = &ctx->dc;
-    if (sc->items_arr == NULL || arrlen(sc->items_arr) == 0) {
+    struct Input* inp = &ctx->input;
+    Pt const rect_size = rect_dims(rect);
+
+    if (dc->renderer == Renderer_Client && dc_view_compose_client(ctx, rect)) {
+        // single upload of whole rect
+        dc_cache_update_pm(dc, dc->view.pm, dc->view.im, rect);
         return;
     }
 
-    double const segment_icon_location = 0.58;  // 0.5 for center
-    i32 const outer_r = (i32)SEL_CIRC_OUTER_R_PX;
-    i32 const inner_r = (i32)SEL_CIRC_INNER_R_PX;
-    Pt const outer_c = {sc->x - outer_r, sc->y - outer_r};
-    Pt const outer_dims = {outer_r * 2, outer_r * 2};
-    Pt const inner_c = {sc->x - inner_r, sc->y - inner_r};
-    Pt const inner_dims = {inner_r * 2, inner_r * 2};
-
-    XSetLineAttributes(dc->dp, dc->screen_gc, SEL_CIRC_LINE_W, SEL_CIRC_LINE_STYLE, CapNotLast, JoinMiter);
-    fill_arc(dc, outer_c, outer_dims, 0.0, 360.0, COL_BG(dc, SchmNorm));
-
-    {
-        double const segment_rad = PI * 2 / MAX(1, arrlen(sc->items_arr));
-        double const segment_deg = segment_rad / PI * 180;
-
-        // item's properties
-        for (u32 item_num = 0; item_num < arrlen(sc->items_arr); ++item_num) {
-            struct Item const* item = &sc->items_arr[item_num];
-            XImage* icon = images[item->icon];
-            Pt center = {
-                (i32)(sc->x + (cos(-segment_rad * (item_num + 0.5)) * ((outer_r + inner_r) * segment_icon_location))),
-                (i32)(sc->y + (sin(-segment_rad * (item_num + 0.5)) * ((outer_r + inner_r) * segment_icon_location))),
-            };
+    XSetForeground(dc->dp, dc->screen_gc, WND_BACKGROUND);
+    XFillRectangle(dc->dp, dc->view.pm, dc->screen_gc, rect.l, rect.t, rect_size.x, rect_size.y);
 
-            if (item->col_outer) {
-                fill_arc(dc, outer_c, outer_dims, item_num * segment_deg, segment_deg + (1.0 / 64.0), item->col_outer);
-            }
+    Pt const scroll = dc->scr_damage.scroll;
+    Pt const cv_size = canvas_size(dc);
+    Rect const cv_scr = {scroll.x, scroll.y, scroll.x + cv_size.x - 1, scroll.y + cv_size.y - 1};
+    Rect const dst = rect_bound(rect, cv_scr);
+    if (!is_valid_rect(dst)) {
+        return;
+    }
+    //  https://stackoverflow.com/a/66896097
 
-            if (item->col_inner) {
-                fill_arc(dc, inner_c, inner_dims, item_num * segment_deg, segment_deg + (1.0 / 64.0), item->col_inner);
-            }
+    // zoomed out canvas is sampled from mip level with residual scale in (0.5, 1]
+    u32 const mip_level = dc_mip_level(dc);
+    Picture cv_pict = XRenderCreatePicture(
+        dc->dp,
+        dc_cache_mip(dc, mip_level),
+        dc->sys.xrnd_pic_format,
+        CPSubwindowMode | CPRepeat,
+        &(XRenderPictureAttributes) {
+            .subwindow_mode = IncludeInferiors,
+            .repeat = dc->cv.zoom < 0 ? RepeatPad : RepeatNone,
+        }
+    );
+    Picture view_pict = XRenderCreatePicture(
+        dc->dp,
+        dc->view.pm,
+        dc->sys.xrnd_pic_format,
+        0,
+        &(XRenderPictureAttributes) {.subwindow_mode = IncludeInferiors}
+    );
 
-            if (icon) {
-                XPutImage(
-                    dc->dp,
-                    dc->back_buffer,
-                    dc->screen_gc,
-                    icon,
-                    0,
-                    0,
-                    center.x - (icon->width / 2),
-                    center.y - (icon->height / 2),
-                    icon->width,
-                    icon->height
-                );
-            }
+    double const zoom = ZOOM_C(dc);
+    double const mip_zoom = zoom * (double)(1U << mip_level);
+    // transforms are relative to view anchor, so composite coordinates stay small at any zoom
+    Pt const cv_lt = dc->view.anchor;
+    Pt const mip_lt = {cv_lt.x >> mip_level, cv_lt.y >> mip_level};
+    Pt const origin = dc_view_anchor_scr(dc);
+    Pt const dst_dims = rect_dims(dst);
 
-            if (item->desc) {
-                Rect const desc_rect = get_string_rect(dc, dc->fnt, item->desc, strlen(item->desc), (Pt) {0, 0});
-                Pt const desc_dims = rect_dims(desc_rect);
-                Pt text_center = {
-                    center.x - (desc_dims.x / 2),
-                    center.y + (desc_dims.y / 2) + (i32)SEL_CIRC_ITEM_ICON_MARGIN_PX + (icon ? icon->height / 2 : 0),
-                };
+    // HACK xtrans_invert, because XRENDER missinterprets XTransform values
+    XTransform xtrans_canvas =
+        xtrans_invert(xtrans_mult(xtrans_scale(mip_zoom, mip_zoom), xtrans_move(-mip_lt.x, -mip_lt.y)));
+    if (dc->cv.zoom < 0) {
+        XRenderSetPictureFilter(dc->dp, cv_pict, FilterBilinear, NULL, 0);
+    }
+    // overlay point to view anchor relative screen point
+    XTransform const xtrans_overlay = xtrans_mult(
+        xtrans_mult(xtrans_scale(zoom, zoom), xtrans_move(-cv_lt.x, -cv_lt.y)),
+        xtrans_overlay_transform_mode(inp)
+    );
+    XRenderSetPictureTransform(dc->dp, cv_pict, &xtrans_canvas);
+
+    // clang-format off
+    XRenderComposite(
+        dc->dp, PictOpSrc,
+        cv_pict, None,
+        view_pict,
+        dst.l - origin.x, dst.t - origin.y,
+        0, 0,
+        dst.l, dst.t,
+        dst_dims.x, dst_dims.y
+    );
+    // clang-format on
 
-                draw_string(dc, item->desc, text_center, SchmNorm, False);
-            }
+    // only existing overlay tiles, each bounded by its transformed corners
+    struct OverlayTiles const* tiles = &dc->cache.overlay;
+    for (i32 i = 0; i < tiles->grid.x * tiles->grid.y; ++i) {
+        if (!tiles->pms_dyn[i]) {
+            continue;
         }
-
-        // selected item fill
-        i32 const current_item = sel_circ_curr_item(sc, pointer_x, pointer_y);
-        if (current_item != NIL) {
-            fill_arc(dc, outer_c, outer_dims, current_item * segment_deg, segment_deg, COL_BG(dc, SchmFocus));
-            fill_arc(dc, inner_c, inner_dims, current_item * segment_deg, segment_deg, COL_BG(dc, SchmNorm));
+        Rect const tile = dc_overlay_tile_rect(dc, i);
+        XTransform const xtrans_tile = xtrans_mult(xtrans_overlay, xtrans_move(tile.l, tile.t));
+        Pt const tile_dims = rect_dims(tile);
+        Rect tile_scr = RNIL;
+        for (u32 corner = 0; corner < 4; ++corner) {
+            DPt const p = xtrans_apply(
+                xtrans_tile,
+                (DPt) {(corner & 1) ? tile_dims.x : 0, (corner & 2) ? tile_dims.y : 0}
+            );
+            i32 const x = origin.x + (i32)floor(p.x);
+            i32 const y = origin.y + (i32)floor(p.y);
+            tile_scr = rect_expand(tile_scr, (Rect) {x - 1, y - 1, x + 1, y + 1});
         }
-
-        // separators
-        if (sc->draw_separators && arrlen(sc->items_arr) >= 2) {
-            XSetForeground(dc->dp, dc->screen_gc, COL_FG(dc, SchmNorm));
-            for (u32 line_num = 0; line_num < arrlen(sc->items_arr); ++line_num) {
-                XDrawLine(
-                    dc->dp,
-                    dc->back_buffer,
-                    dc->screen_gc,
-                    sc->x + (i32)(cos(segment_rad * line_num) * inner_r),
-                    sc->y + (i32)(sin(segment_rad * line_num) * inner_r),
-                    sc->x + (i32)(cos(segment_rad * line_num) * outer_r),
-                    sc->y + (i32)(sin(segment_rad * line_num) * outer_r)
-                );
-            }
+        Rect const tile_dst = rect_bound(dst, tile_scr);
+        if (!is_valid_rect(tile_dst)) {
+            continue;
         }
-    }
+        Pt const tile_dst_dims = rect_dims(tile_dst);
 
-    /* lines */ {
-        draw_arc(dc, inner_c, inner_dims, 0.0, 360.0, COL_FG(dc, SchmNorm));
-        draw_arc(dc, outer_c, outer_dims, 0.0, 360.0, COL_FG(dc, SchmNorm));
+        Picture tile_pict = XRenderCreatePicture(
+            dc->dp,
+            tiles->pms_dyn[i],
+            dc->sys.xrnd_pic_format,
+            0,
+            &(XRenderPictureAttributes) {.subwindow_mode = IncludeInferiors}
+        );
+        // HACK xtrans_invert, because XRENDER missinterprets XTransform values
+        XTransform xtrans_tile_pict = xtrans_invert(xtrans_tile);
+        XRenderSetPictureTransform(dc->dp, tile_pict, &xtrans_tile_pict);
+        // clang-format off
+        XRenderComposite(
+            dc->dp, PictOpOver,
+            tile_pict, None,
+            view_pict,
+            tile_dst.l - origin.x, tile_dst.t - origin.y,
+            0, 0,
+            tile_dst.l, tile_dst.t,
+            tile_dst_dims.x, tile_dst_dims.y
+        );
+        // clang-format on
+        XRenderFreePicture(dc->dp, tile_pict);
     }
 
-    swap_backbuffer(ctx);
+    XRenderFreePicture(dc->dp, cv_pict);
+    XRenderFreePicture(dc->dp, view_pict);
 }
 
-void update_screen(struct Ctx* ctx, Pt cur_scr, Bool full_redraw) {
-    struct DrawCtx* dc = &ctx->dc;
-    struct Input* inp = &ctx->input;
-    struct InputMode* mode = &inp->mode;
-    struct ToolCtx* tc = &CURR_TC(ctx);
-
-    Pt const cur = pt_from_scr_to_cv_xy(dc, cur_scr.x, cur_scr.y);
-
-    /* draw canvas */ {
-        fill_rect(dc, (Pt) {0, 0}, (Pt) {(i32)dc->width, (i32)dc->height}, WND_BACKGROUND);
-        /* put scaled image */ {
-            dc_cache_update(
-                ctx,
-                full_redraw ? (Rect) {0, 0, dc->cv.im->width, dc->cv.im->height}
-                            : rect_expand(inp->redraw_track[0], inp->redraw_track[1])
-            );
-            //  https://stackoverflow.com/a/66896097
-
-            Picture cv_pict = XRenderCreatePicture(
-                dc->dp,
-                dc->cache.pm,
-                dc->sys.xrnd_pic_format,
-                0,
-                &(XRenderPictureAttributes) {.subwindow_mode = IncludeInferiors}
-            );
-            Picture overlay_pict = XRenderCreatePicture(
-                dc->dp,
-                dc->cache.overlay,
-                dc->sys.xrnd_pic_format,
-                0,
-                &(XRenderPictureAttributes) {.subwindow_mode = IncludeInferiors}
-            );
-            Picture bb_pict = XRenderCreatePicture(
-                dc->dp,
-                dc->back_buffer,
-                dc->sys.xrnd_pic_format,
-                0,
-                &(XRenderPictureAttributes) {.subwindow_mode = IncludeInferiors}
-            );
-
-            XTransform const xtrans_zoom = xtrans_scale(ZOOM_C(dc), ZOOM_C(dc));
-
-            // HACK xtrans_invert, because XRENDER missinterprets XTransform values
-            XTransform xtrans_canvas = xtrans_invert(xtrans_zoom);
-            XTransform xtrans_overlay = xtrans_invert(xtrans_mult(xtrans_zoom, xtrans_overlay_transform_mode(inp)));
-            XRenderSetPictureTransform(dc->dp, cv_pict, &xtrans_canvas);
-            XRenderSetPictureTransform(dc->dp, overlay_pict, &xtrans_overlay);
+char const* renderer_to_string(enum Renderer renderer) {
+    switch (renderer) {
+        case Renderer_XRender: return "xrender";
+        case Renderer_Client: return "client";
+    }
+    UNREACHABLE();
+}
 
-            Pt const cv_size = canvas_size(dc);
-            // clang-format off
-            XRenderComposite(
-                dc->dp, PictOpSrc,
-                cv_pict, None,
-                bb_pict,
-                0, 0,
-                0, 0,
-                (i32)round(dc->cv.scroll.x), (i32)round(dc->cv.scroll.y),
-                cv_size.x, cv_size.y
-            );
-            XRenderComposite(
-                dc->dp, PictOpOver,
-                overlay_pict, None,
-                bb_pict,
-                0, 0,
-                0, 0,
-                (i32)round(dc->cv.scroll.x), (i32)round(dc->cv.scroll.y),
-                cv_size.x, cv_size.y
-            );
-            // clang-format on
+// rows of client renderer work, see dc_view_compose_client
+struct ClientJob {
+    XImage const* cv;  // mip level of canvas, anchor and inv_zoom are in its pixels
+    XImage const* ovr;
+    Rect ovr_rect;  // overlay content, nothing is sampled outside
+    XImage* dst;
+    Rect rect;  // canvas part of composited rect
+    i32 y_from;  // rows [y_from, y_to)
+    i32 y_to;
+    Bool bilinear;  // otherwise nearest
+    struct ClientCol {
+        i32 x0;
+        i32 x1;  // right neighbour for bilinear
+        u32 fx;  // weight of x1 in [0 .. 256]
+    } const* cols;  // per rect column
+    Pt origin;  // screen position of view anchor
+    Pt anchor;
+    double inv_zoom;
+    double ovr_m[2][3];  // view pixel center to overlay point
+};
 
-            XRenderFreePicture(dc->dp, cv_pict);
-            XRenderFreePicture(dc->dp, overlay_pict);
-            XRenderFreePicture(dc->dp, bb_pict);
+static double client_src_coord(i32 scr, i32 origin, i32 anchor, double inv_zoom) {
+    return anchor + (((scr - origin) + 0.5) * inv_zoom);
+}
+
+static u32 const* client_row(XImage const* im, i32 y) {
+    return (u32 const*)(im->data + ((usize)y * im->bytes_per_line));
+}
+
+// same as PictOpOver, src is treated as premultiplied
+static void client_blend_over4(u32* dst, u32 const src[4]) {
+#ifdef __SSE2__
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const c255 = _mm_set1_epi16(255);
+    __m128i const c128 = _mm_set1_epi16(128);
+    __m128i const s = _mm_loadu_si128((__m128i const*)src);
+    __m128i const d = _mm_loadu_si128((__m128i const*)dst);
+
+    __m128i const s_lo = _mm_unpacklo_epi8(s, zero);
+    __m128i const s_hi = _mm_unpackhi_epi8(s, zero);
+    // alpha of each pixel in all its channels
+    __m128i const a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i const a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i const inv_a_lo = _mm_sub_epi16(c255, a_lo);
+    __m128i const inv_a_hi = _mm_sub_epi16(c255, a_hi);
+    __m128i d_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv_a_lo), c128);
+    __m128i d_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv_a_hi), c128);
+    d_lo = _mm_srli_epi16(_mm_add_epi16(d_lo, _mm_srli_epi16(d_lo, 8)), 8);
+    d_hi = _mm_srli_epi16(_mm_add_epi16(d_hi, _mm_srli_epi16(d_hi, 8)), 8);
+
+    _mm_storeu_si128((__m128i*)dst, _mm_adds_epu8(s, _mm_packus_epi16(d_lo, d_hi)));
+#else
+    for (u32 i = 0; i < 4; ++i) {
+        u32 const inv_a = 255 - (src[i] >> 24);
+        u32 result = 0;
+        for (u32 shift = 0; shift < 32; shift += 8) {
+            u32 const d = (((dst[i] >> shift) & 0xFF) * inv_a) + 128;
+            u32 const c = ((src[i] >> shift) & 0xFF) + ((d + (d >> 8)) >> 8);
+            result |= MIN(c, 255U) << shift;
         }
+        dst[i] = result;
     }
+#endif
+}
 
-    // transform mode rectangle
-    if (ctx->input.mode.t == InputT_Transform) {
-        Transform const trans = OVERLAY_TRANSFORM(&ctx->input.mode);
-        Rect const rect = inp->ovr.rect;
-        Pt const pivot = {rect.l, rect.t};
-        draw_dash_rect(
-            dc,
-            (Pt[4]) {pt_apply_trans_pivot((Pt) {rect.l, rect.t}, trans, pivot),
-                     pt_apply_trans_pivot((Pt) {rect.r + 1, rect.t}, trans, pivot),
-                     pt_apply_trans_pivot((Pt) {rect.r + 1, rect.b + 1}, trans, pivot),
-                     pt_apply_trans_pivot((Pt) {rect.l, rect.b + 1}, trans, pivot)}
-        );
+static u32 client_bilinear(u32 p00, u32 p01, u32 p10, u32 p11, u32 fx, u32 fy) {
+#ifdef __SSE2__
+    __m128i const zero = _mm_setzero_si128();
+    __m128i const top = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, (i32)p01, (i32)p00), zero);
+    __m128i const bottom = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, (i32)p11, (i32)p10), zero);
+    __m128i const v = _mm_srli_epi16(
+        _mm_add_epi16(
+            _mm_mullo_epi16(top, _mm_set1_epi16((i16)(256 - fy))),
+            _mm_mullo_epi16(bottom, _mm_set1_epi16((i16)fy))
+        ),
+        8
+    );
+    // left pixel in low half, right pixel in high half
+    __m128i const w = _mm_set_epi16(
+        (i16)fx,
+        (i16)fx,
+        (i16)fx,
+        (i16)fx,
+        (i16)(256 - fx),
+        (i16)(256 - fx),
+        (i16)(256 - fx),
+        (i16)(256 - fx)
+    );
+    __m128i const h = _mm_mullo_epi16(v, w);
+    __m128i const sum = _mm_srli_epi16(_mm_add_epi16(h, _mm_srli_si128(h, 8)), 8);
+    return (u32)_mm_cvtsi128_si32(_mm_packus_epi16(sum, zero));
+#else
+    u32 result = 0;
+    for (u32 shift = 0; shift < 32; shift += 8) {
+        u32 const left = ((((p00 >> shift) & 0xFF) * (256 - fy)) + (((p10 >> shift) & 0xFF) * fy)) >> 8;
+        u32 const right = ((((p01 >> shift) & 0xFF) * (256 - fy)) + (((p11 >> shift) & 0xFF) * fy)) >> 8;
+        result |= (((left * (256 - fx)) + (right * fx)) >> 8) << shift;
     }
+    return result;
+#endif
+}
 
-    // rectangle around text
-    if (mode->t == InputT_Text) {
-        Rect const text_rect = get_string_rect(
-            dc,
-            tc->text_font,
-            mode->d.text.textarr,
-            arrlen(mode->d.text.textarr),
-            mode->d.text.tool_data.lb_corner
-        );
-        draw_dash_rect(
-            dc,
-            // +1 to match Transform rect (idk why it was added)
-            (Pt[4]) {(Pt) {text_rect.l, text_rect.t},
-                     (Pt) {text_rect.r + 1, text_rect.t},
-                     (Pt) {text_rect.r + 1, text_rect.b + 1},
-                     (Pt) {text_rect.l, text_rect.b + 1}}
-        );
-    }
+// 32.32 fixed point, clamped far beyond any image
+static i64 client_fixed(double v) {
+    return (i64)floor(CLAMP(v, -(double)(1 << 30), (double)(1 << 30)) * 4294967296.0);
+}
 
-    // anchor cross
-    if (WND_ANCHOR_CROSS_SIZE && ctx->input.mode.t == InputT_Interact && !IS_PNIL(inp->anchor)
-        && inp->c.state == CS_None) {
-        draw_dash_cross(dc, inp->anchor, WND_ANCHOR_CROSS_SIZE);
-    }
+static void client_compose_rows(struct ClientJob const* job) {
+    XImage const* cv = job->cv;
+    XImage const* ovr = job->ovr;
+    i32 const width = job->rect.r - job->rect.l + 1;
 
-    // drawer preview
-    if (ctx->input.mode.t == InputT_Interact && tc->t == Tool_Drawer) {
-        brush_cache_update(&tc->d.drawer, tc->line_w, *tc_curr_col(tc), &tc->brush_cache);
-        Pt brush_dims = tc->brush_cache.dims;
-        Pt lt = {cur.x - (brush_dims.x / 2), cur.y - (brush_dims.y / 2)};
-        draw_dash_rect(
-            dc,
-            (Pt[4]) {
-                (Pt) {lt.x, lt.y},
-                (Pt) {lt.x + brush_dims.x, lt.y},
-                (Pt) {lt.x + brush_dims.x, lt.y + brush_dims.y},
-                (Pt) {lt.x, lt.y + brush_dims.y},
+    for (i32 y = job->y_from; y < job->y_to; ++y) {
+        u32* dst = (u32*)(job->dst->data + ((usize)y * job->dst->bytes_per_line)) + job->rect.l;
+        double const sy = client_src_coord(y, job->origin.y, job->anchor.y, job->inv_zoom);
+
+        /* canvas */ {
+            if (job->bilinear) {
+                double const sy_c = sy - 0.5;
+                i32 const y0 = CLAMP((i32)floor(sy_c), 0, cv->height - 1);
+                i32 const y1 = MIN(y0 + 1, cv->height - 1);
+                u32 const fy = (u32)CLAMP((i32)((sy_c - floor(sy_c)) * 256), 0, 256);
+                u32 const* row0 = client_row(cv, y0);
+                u32 const* row1 = client_row(cv, y1);
+                for (i32 i = 0; i < width; ++i) {
+                    struct ClientCol const* col = &job->cols[i];
+                    dst[i] = client_bilinear(row0[col->x0], row0[col->x1], row1[col->x0], row1[col->x1], col->fx, fy);
+                }
+            } else {
+                u32 const* row = client_row(cv, CLAMP((i32)floor(sy), 0, cv->height - 1));
+                for (i32 i = 0; i < width; ++i) {
+                    dst[i] = row[job->cols[i].x0];
+                }
+            }
+        }
+
+        // overlay, skipped when it is empty
+        if (is_valid_rect(job->ovr_rect)) {
+            Rect const ovr_rect = job->ovr_rect;
+            double const (*m)[3] = job->ovr_m;
+            // mapping is affine, so overlay point moves by constant step along row
+            double const u = (job->rect.l - job->origin.x) + 0.5;
+            double const v = (y - job->origin.y) + 0.5;
+            i64 ox_fp = client_fixed((m[0][0] * u) + (m[0][1] * v) + m[0][2]);
+            i64 oy_fp = client_fixed((m[1][0] * u) + (m[1][1] * v) + m[1][2]);
+            i64 const step_x = client_fixed(m[0][0]);
+            i64 const step_y = client_fixed(m[1][0]);
+            for (i32 i = 0; i < width; i += 4) {
+                u32 src[4] = {0};
+                u32 const n = (u32)MIN(4, width - i);
+                u32 any = 0;
+                for (u32 k = 0; k < n; ++k) {
+                    // arithmetic shift floors negative points
+                    i64 const ox = ox_fp >> 32;
+                    i64 const oy = oy_fp >> 32;
+                    ox_fp += step_x;
+                    oy_fp += step_y;
+                    if (BETWEEN(ox, ovr_rect.l, ovr_rect.r) && BETWEEN(oy, ovr_rect.t, ovr_rect.b)) {
+                        src[k] = client_row(ovr, (i32)oy)[ox];
+                        any |= src[k];
+                    }
+                }
+                if (!any) {
+                    continue;
+                }
+                u32 buf[4];
+                memcpy(buf, &dst[i], n * sizeof(u32));
+                client_blend_over4(buf, src);
+                memcpy(&dst[i], buf, n * sizeof(u32));
             }
-        );
+        }
     }
+}
 
-    // brush line resize pivot
-    if (inp->mode.t == InputT_Interact && inp->c.state == CS_Drag && BTN_EQ(inp->c.btn, BTN_LINE_RESIZE)) {
-        draw_dash_cross(dc, inp->c.pos, WND_ANCHOR_CROSS_SIZE);
+static void* render_pool_worker(void* arg) {
+    struct RenderWorker const* self = arg;
+    struct RenderPool* pool = self->pool;
+
+    // generation was 0 when thread was created, run may have started it already
+    u32 seen = 0;
+    pthread_mutex_lock(&pool->mtx);
+    for (;;) {
+        while (pool->generation == seen && !pool->quit) {
+            pthread_cond_wait(&pool->start_cv, &pool->mtx);
+        }
+        if (pool->quit) {
+            break;
+        }
+        seen = pool->generation;
+        if (self->index < pool->parts) {
+            struct ClientJob const* job = &pool->jobs[self->index];
+            pthread_mutex_unlock(&pool->mtx);
+            client_compose_rows(job);
+            pthread_mutex_lock(&pool->mtx);
+        }
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cv);
+        }
     }
+    pthread_mutex_unlock(&pool->mtx);
+    return NULL;
+}
+
+static void render_pool_start(struct RenderPool* pool) {
+    i32 threads = CLIENT_RENDER_THREADS ? (i32)CLIENT_RENDER_THREADS : (i32)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = CLAMP(threads, 1, THREADS_MAX);
+
+    pthread_mutex_init(&pool->mtx, NULL);
+    pthread_cond_init(&pool->start_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+    pool->started = True;
+    pool->workers = 0;
+    pool->generation = 0;
+    pool->quit = False;
+    // composing thread is one of threads, fewer workers only make parts bigger
+    for (i32 t = 0; t < threads - 1; ++t) {
+        pool->args[t] = (struct RenderWorker) {.pool = pool, .index = (u32)t};
+        if (pthread_create(&pool->tids[t], NULL, &render_pool_worker, &pool->args[t]) != 0) {
+            break;
+        }
+        pool->workers += 1;
+    }
+}
+
+// composes parts of jobs in parallel, last one on calling thread, returns when all are done
+static void render_pool_run(struct RenderPool* pool, struct ClientJob const* jobs, u32 parts) {
+    assert(parts >= 1 && parts <= pool->workers + 1);
+    if (parts > 1) {
+        pthread_mutex_lock(&pool->mtx);
+        pool->jobs = jobs;
+        pool->parts = parts - 1;
+        pool->pending = pool->workers;
+        pool->generation += 1;
+        pthread_cond_broadcast(&pool->start_cv);
+        pthread_mutex_unlock(&pool->mtx);
+    }
+    client_compose_rows(&jobs[parts - 1]);
+    if (parts > 1) {
+        pthread_mutex_lock(&pool->mtx);
+        while (pool->pending != 0) {
+            pthread_cond_wait(&pool->done_cv, &pool->mtx);
+        }
+        pthread_mutex_unlock(&pool->mtx);
+    }
+}
 
-    // canvas resize graphics
-    if (inp->c.state == CS_Drag && BTN_EQ(ctx->input.c.btn, BTN_CANVAS_RESIZE) && inp->mode.t == InputT_Interact) {
-        draw_dash_rect(
-            dc,
-            (Pt[4]) {
-                (Pt) {0, 0},
-                (Pt) {cur.x, 0},
-                (Pt) {cur.x, cur.y},
-                (Pt) {0, cur.y},
-            }
-        );
+void render_pool_free(struct RenderPool* pool) {
+    if (!pool->started) {
+        return;
     }
+    pthread_mutex_lock(&pool->mtx);
+    pool->quit = True;
+    pthread_cond_broadcast(&pool->start_cv);
+    pthread_mutex_unlock(&pool->mtx);
+    for (u32 t = 0; t < pool->workers; ++t) {
+        pthread_join(pool->tids[t], NULL);
+    }
+    pthread_cond_destroy(&pool->done_cv);
+    pthread_cond_destroy(&pool->start_cv);
+    pthread_mutex_destroy(&pool->mtx);
+    pool->started = False;
+}
 
-    update_statusline(ctx);  // backbuffer swapped here
+static XImage* client_image_new(struct DrawCtx* dc, Pt dims) {
+    XImage* result = ximage_shm_new(dc, dims.x, dims.y);
+    if (result) {
+        return result;
+    }
+    char* data = ecalloc((u32)dims.x * dims.y, sizeof(u32));
+    result = XCreateImage(dc->dp, dc->sys.vinfo.visual, dc->sys.vinfo.depth, ZPixmap, 0, data, dims.x, dims.y, 32, 0);
+    if (!result) {
+        free(data);
+    }
+    return result;
 }
 
-static u32 draw_module(struct Ctx* ctx, SLModule const* module, Pt c) {
+Bool dc_view_compose_client(struct Ctx* ctx, Rect rect) {
     struct DrawCtx* dc = &ctx->dc;
-    struct ToolCtx* tc = &CURR_TC(ctx);
-    struct InputMode* mode = &ctx->input.mode;
-
-    switch (module->t) {
-        case SLM_Spacer: return module->d.spacer;
-        case SLM_Text: {
-            char const* str = module->d.text;
-            return draw_string(dc, str, c, SchmNorm, False);
-        } break;
-        case SLM_ToolCtx: {
-            u32 x = c.x;
-            for (u32 tc_name = 1; tc_name <= TCS_NUM; ++tc_name) {
-                enum Schm const schm = ctx->curr_tc == (tc_name - 1) ? SchmFocus : SchmNorm;
-                x += draw_int(dc, (i32)tc_name, (Pt) {(i32)x, c.y}, schm, False);
-                x += STATUSLINE_MODULE_SPACING_SMALL_PX;
-            }
-            return x - STATUSLINE_MODULE_SPACING_SMALL_PX;
-        } break;
-        case SLM_Mode: {
-            char const* name = input_mode_as_str(mode->t);
-            enum Schm const schm = mode->t == InputT_Interact ? SchmNorm : SchmFocus;
-            return draw_string(dc, name, c, schm, False);
-        } break;
-        case SLM_Tool: {
-            char const* name = tc_get_tool_name(tc);
-            return draw_string(dc, name, c, SchmNorm, False);
-        } break;
-        case SLM_ToolSettings: {
-            switch (mode->t) {
-                case InputT_Color:
-                case InputT_Console:
-                case InputT_Transform: return 0;
-                case InputT_Interact:
-                    switch (tc->t) {
-                        case Tool_Selection:
-                        case Tool_Fill:
-                        case Tool_Picker:
-                        case Tool_Figure:
-                        case Tool_Text: return 0;
-                        case Tool_Drawer: {
-                            // XXX shows spacing for pencil
-                            char const* fmt = "line_w: %d spacing: %.1f hardness: %.1f";
-                            u32 str_size =
-                                snprintf(NULL, 0, fmt, tc->line_w, tc->d.drawer.spacing, tc->d.drawer.hardness);
-                            char str[str_size + 1];  // +1 for null-terminator
-                            (void
-                            )snprintf(str, sizeof(str), fmt, tc->line_w, tc->d.drawer.spacing, tc->d.drawer.hardness);
+    struct Input* inp = &ctx->input;
+    struct View* view = &dc->view;
+
+    if (view->im && (view->im->width != view->dims.x || view->im->height != view->dims.y)) {
+        XDestroyImage(view->im);
+        view->im = NULL;
+    }
+    if (!view->im) {
+        view->im = client_image_new(dc, view->dims);
+        if (!view->im) {
+            trace("xpaint: can't create client renderer image, falling back to xrender");
+            dc->renderer = Renderer_XRender;
+            dc_cache_update(ctx, RNIL);  // uploads stale canvas
+            return False;
+        }
+    }
+    assert(view->im->bits_per_pixel == 32 && dc->cv.im->bits_per_pixel == 32 && inp->ovr.im->bits_per_pixel == 32);
 
-                            u32 const width = draw_string(dc, str, c, SchmNorm, False);
-                            return width;
-                        }
-                    }
-                    UNREACHABLE();
-                case InputT_Text: {
-                    char const* const separator = " ";
-                    char const* const font_name = xft_font_name(tc->text_font);
-                    usize const str_len = strlen(TEXT_FONT_PROMPT) + 2 /* 2 quotes */
-                        + strlen(font_name) + strlen(separator) + strlen(TEXT_FONT_PROMPT)
-                        + arrlen(mode->d.text.textarr);
-
-                    char* const str_dyn = ecalloc(str_len + 1, sizeof(char));
-                    usize actual_len = snprintf(
-                        str_dyn,
-                        str_len + 1,
-                        "%s\"%s\"%s%s%.*s",
-                        TEXT_FONT_PROMPT,
-                        font_name,
-                        separator,
-                        TEXT_MODE_PROMPT,
-                        (u32)arrlen(mode->d.text.textarr),
-                        mode->d.text.textarr
-                    );
-                    assert(actual_len == str_len);
-                    (void)actual_len;  // HACK for release mode
+    for (i32 y = rect.t; y <= rect.b; ++y) {
+        u32* row = (u32*)(view->im->data + ((usize)y * view->im->bytes_per_line));
+        for (i32 x = rect.l; x <= rect.r; ++x) {
+            row[x] = WND_BACKGROUND;
+        }
+    }
 
-                    u32 width = draw_string(dc, str_dyn, c, SchmNorm, False);
+    Pt const scroll = dc->scr_damage.scroll;
+    Pt const cv_size = canvas_size(dc);
+    Rect const dst = rect_bound(rect, (Rect) {scroll.x, scroll.y, scroll.x + cv_size.x - 1, scroll.y + cv_size.y - 1});
+    if (!is_valid_rect(dst)) {
+        return True;
+    }
+
+    double const zoom = ZOOM_C(dc);
+    // zoomed out canvas is sampled from mip level with residual scale in (0.5, 1], anchor is aligned to its pixels
+    u32 const mip_level = dc_mip_level(dc);
+    struct ClientJob job = {
+        .cv = dc_client_mip(dc, mip_level),
+        .ovr = inp->ovr.im,
+        .ovr_rect = rect_bound(inp->ovr.rect, ximage_rect(inp->ovr.im)),
+        .dst = view->im,
+        .rect = dst,
+        .bilinear = dc->cv.zoom < 0,
+        .origin = dc_view_anchor_scr(dc),
+        .anchor = {view->anchor.x >> mip_level, view->anchor.y >> mip_level},
+        .inv_zoom = 1.0 / (zoom * (double)(1U << mip_level)),
+    };
 
-                    free(str_dyn);
-                    return width;
-                }
+    /* overlay mapping */ {
+        XTransform const xtrans = xtrans_invert(xtrans_mult(
+            xtrans_mult(xtrans_scale(zoom, zoom), xtrans_move(-view->anchor.x, -view->anchor.y)),
+            xtrans_overlay_transform_mode(inp)
+        ));
+        for (u32 i = 0; i < 2; ++i) {
+            for (u32 j = 0; j < 3; ++j) {
+                job.ovr_m[i][j] = XFixedToDouble(xtrans.matrix[i][j]);
             }
-            UNREACHABLE();
         }
-        case SLM_ColorBox: {
-            fill_rect(
-                dc,
-                (Pt) {c.x, clientarea_size(dc).y},
-                (Pt) {(i32)module->d.color_box_w, (i32)statusline_height(dc)},
-                *tc_curr_col(tc)
-            );
-            return module->d.color_box_w;
+    }
+
+    Pt const dst_dims = rect_dims(dst);
+    struct ClientCol* cols = arena_alloc(&frame_arena, dst_dims.x, sizeof(struct ClientCol));
+    for (i32 i = 0; i < dst_dims.x; ++i) {
+        double const sx = client_src_coord(dst.l + i, job.origin.x, job.anchor.x, job.inv_zoom);
+        if (job.bilinear) {
+            double const sx_c = sx - 0.5;
+            cols[i].x0 = CLAMP((i32)floor(sx_c), 0, job.cv->width - 1);
+            cols[i].x1 = MIN(cols[i].x0 + 1, job.cv->width - 1);
+            cols[i].fx = (u32)CLAMP((i32)((sx_c - floor(sx_c)) * 256), 0, 256);
+        } else {
+            cols[i].x0 = CLAMP((i32)floor(sx), 0, job.cv->width - 1);
+            cols[i].x1 = cols[i].x0;
+            cols[i].fx = 0;
         }
-        case SLM_ColorName: {
-            static u32 const col_value_size = 1 + 6;
+    }
+    job.cols = cols;
 
-            char col_value[col_value_size + 1];
-            (void)sprintf(col_value, "#%06X", *tc_curr_col(tc) & 0xFFFFFF);
-            u32 width = draw_string(dc, col_value, c, SchmNorm, False);
-            // draw focused digit
-            if (mode->t == InputT_Color) {
-                static u32 const hash_w = 1;
-                u32 const curr_dig = mode->d.col.current_digit;
-                char const col_digit_value[] = {[0] = col_value[curr_dig + hash_w], [1] = '\0'};
-                u32 focus_offset = get_string_width(dc, col_value, curr_dig + hash_w);
-                draw_string(dc, col_digit_value, (Pt) {c.x + (i32)focus_offset, c.y}, SchmFocus, False);
-            }
-            return width;
+    /* split rows between threads */ {
+        struct RenderPool* pool = &dc->render_pool;
+        if (!pool->started) {
+            render_pool_start(pool);
         }
-        case SLM_ColorList: {
-            // FIXME why it compiles
-            char col_count[(digit_count(MAX_COLORS) * 2) + 1 + 1];
-            (void)sprintf(col_count, "%d/%td", tc->curr_col + 1, arrlen(tc->colarr));
-            return draw_string(dc, col_count, c, SchmNorm, False);
+        i32 const rows_per_thread_min = 16;
+        i32 const threads = CLAMP(dst_dims.y / rows_per_thread_min, 1, (i32)pool->workers + 1);
+
+        struct ClientJob jobs[THREADS_MAX];
+        for (i32 t = 0; t < threads; ++t) {
+            jobs[t] = job;
+            jobs[t].y_from = dst.t + (i32)((i64)dst_dims.y * t / threads);
+            jobs[t].y_to = dst.t + (i32)((i64)dst_dims.y * (t + 1) / threads);
         }
+        render_pool_run(pool, jobs, (u32)threads);
     }
 
-    UNREACHABLE();
+    return True;
 }
 
-void update_statusline(struct Ctx* ctx) {
+void dc_cache_update(struct Ctx* ctx, Rect damage) {
     struct DrawCtx* dc = &ctx->dc;
-    struct InputMode* mode = &ctx->input.mode;
-    u32 const statusline_h = statusline_height(dc);
-    Pt const clientarea = clientarea_size(dc);
-    Pt const line_dims = {(i32)dc->width, (i32)(statusline_h)};
-
-    fill_rect(dc, (Pt) {0, clientarea.y}, line_dims, COL_BG(dc, SchmNorm));
+    Rect const cv_rect = {0, 0, dc->cv.im->width, dc->cv.im->height};
+    assert(dc->cache.overlay.pms_dyn && dc->cache.pm);
 
-    if (mode->t == InputT_Console) {
-        struct InputConsoleData* cl = &mode->d.cl;
-        i32 const cmd_y = (i32)(dc->height - STATUSLINE_PADDING_BOTTOM);
+    // resize pixmaps if needed
+    if (dc->cache.dims.x != dc->cv.im->width || dc->cache.dims.y != dc->cv.im->height) {
+        dc_cache_free(dc);
+        dc_cache_init(ctx);
+        damage = cv_rect;
+    } else if (!IS_RNIL(damage)) {
+        for (u32 level = 1; level < MIP_LEVELS_MAX; ++level) {
+            struct Mip* mip = &dc->cache.mips[level];
+            mip->im_dirty = rect_expand(mip->im_dirty, damage);
+        }
+    }
 
-        i32 user_cmd_w = NIL;
-        /* draw command */ {
-            char const* command = cl->cmdarr;
-            u32 const command_len = arrlen(command);
-            usize const cl_str_len = strlen(CL_CMD_PROMPT) + command_len;
+    // uploaded when renderer is switched back
+    if (dc->renderer == Renderer_Client) {
+        dc->cache.stale = rect_expand(dc->cache.stale, damage);
+        return;
+    }
+    damage = rect_expand(damage, dc->cache.stale);
+    dc->cache.stale = RNIL;
 
-            char* cl_str_dyn = ecalloc(cl_str_len + 1, sizeof(char));
-            usize actual_len = snprintf(cl_str_dyn, cl_str_len + 1, "%s%.*s", CL_CMD_PROMPT, command_len, command);
-            assert(actual_len == cl_str_len);
-            (void)actual_len;  // HACK for release mode
+    dc_cache_update_pm(dc, dc->cache.pm, dc->cv.im, damage);
+    dc_cache_update_overlay(ctx, damage);
+    if (!IS_RNIL(damage)) {
+        for (u32 level = 1; level < MIP_LEVELS_MAX; ++level) {
+            struct Mip* mip = &dc->cache.mips[level];
+            mip->dirty = rect_expand(mip->dirty, damage);
+        }
+    }
+}
 
-            user_cmd_w = (i32)draw_string(dc, cl_str_dyn, (Pt) {0, cmd_y}, SchmNorm, False);
+Rect dc_overlay_tile_rect(struct DrawCtx const* dc, i32 i) {
+    Pt const grid = dc->cache.overlay.grid;
+    assert(BETWEEN(i, 0, (grid.x * grid.y) - 1));
+    i32 const l = (i % grid.x) * OVR_TILE_SIZE;
+    i32 const t = (i / grid.x) * OVR_TILE_SIZE;
+    return (Rect) {
+        l,
+        t,
+        MIN(l + OVR_TILE_SIZE, dc->cache.dims.x) - 1,
+        MIN(t + OVR_TILE_SIZE, dc->cache.dims.y) - 1,
+    };
+}
 
-            free(cl_str_dyn);
+void dc_cache_update_overlay(struct Ctx* ctx, Rect damage) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct OverlayTiles* tiles = &dc->cache.overlay;
+    XImage* im = ctx->input.ovr.im;
+    // overlay is empty outside of its rect
+    Rect const content = ctx->input.ovr.rect;
+
+    for (i32 i = 0; i < tiles->grid.x * tiles->grid.y; ++i) {
+        Pixmap* pm = &tiles->pms_dyn[i];
+        Rect const tile = dc_overlay_tile_rect(dc, i);
+        Pt const tile_lt = {tile.l, tile.t};
+
+        if (!is_valid_rect(rect_bound(tile, content))) {
+            if (*pm) {
+                XFreePixmap(dc->dp, *pm);
+                *pm = 0;
+            }
+        } else if (!*pm) {
+            Pt const dims = rect_dims(tile);
+            *pm = XCreatePixmap(dc->dp, dc->window, dims.x, dims.y, dc->sys.vinfo.depth);
+            dc_cache_update_pm_at(dc, *pm, tile_lt, im, tile);
+        } else {
+            dc_cache_update_pm_at(dc, *pm, tile_lt, im, rect_bound(damage, tile));
         }
+    }
+}
 
-        /* draw cursor */ {
-            i32 const indent = 2;
-            i32 const cursor_w = 1;
+u32 dc_mip_level(struct DrawCtx const* dc) {
+    if (dc->cv.zoom >= 0) {
+        return 0;
+    }
+    // largest level that is not smaller than displayed canvas
+    u32 level = (u32)floor(-log2(ZOOM_C(dc)));
+    while (level > 0 && (dc->cv.im->width >> level == 0 || dc->cv.im->height >> level == 0)) {
+        --level;
+    }
+    return MIN(level, MIP_LEVELS_MAX - 1);
+}
 
-            i32 const cursor_width = (i32)get_string_width(dc, "_", 1);
-            Pt const c = {user_cmd_w, cmd_y + indent};
-            draw_line(dc, c, (Pt) {c.x + cursor_width, c.y}, cursor_w, SchmNorm, False);
+Pixmap dc_cache_mip(struct DrawCtx* dc, u32 level) {
+    assert(level < MIP_LEVELS_MAX);
+    Pixmap src_pm = dc->cache.pm;
+    Pt src_dims = dc->cache.dims;
+
+    for (u32 i = 1; i <= level; ++i) {
+        struct Mip* mip = &dc->cache.mips[i];
+        if (!mip->pm) {
+            mip->dims = (Pt) {MAX(1, (src_dims.x + 1) / 2), MAX(1, (src_dims.y + 1) / 2)};
+            mip->pm = XCreatePixmap(dc->dp, dc->window, mip->dims.x, mip->dims.y, dc->sys.vinfo.depth);
+            mip->dirty = (Rect) {0, 0, dc->cache.dims.x - 1, dc->cache.dims.y - 1};
         }
 
-        if (cl->compls_arr) {
-            draw_string(dc, cl->compls_arr[cl->compls_curr].val_dyn, (Pt) {user_cmd_w, cmd_y}, SchmFocus, False);
+        Rect const dirty = rect_bound(
+            (Rect) {mip->dirty.l >> i, mip->dirty.t >> i, mip->dirty.r >> i, mip->dirty.b >> i},
+            (Rect) {0, 0, mip->dims.x - 1, mip->dims.y - 1}
+        );
+        mip->dirty = RNIL;
 
-            /* draw compls array */ {
-                u32 const list_pre_half = (STATUSLINE_COMPLS_LIST_MAX + 1) / 2;
-                u32 const len = arrlen(cl->compls_arr);
+        if (is_valid_rect(dirty)) {
+            Picture src = XRenderCreatePicture(
+                dc->dp,
+                src_pm,
+                dc->sys.xrnd_pic_format,
+                CPRepeat,
+                &(XRenderPictureAttributes) {.repeat = RepeatPad}  // odd edge is not blended with transparency
+            );
+            Picture dst = XRenderCreatePicture(dc->dp, mip->pm, dc->sys.xrnd_pic_format, 0, NULL);
+            // XRender maps destination to source, bilinear at pixel corners is 2x2 box filter
+            XTransform xtrans_half = xtrans_scale(2.0, 2.0);
+            XRenderSetPictureTransform(dc->dp, src, &xtrans_half);
+            XRenderSetPictureFilter(dc->dp, src, FilterBilinear, NULL, 0);
 
-                i32 const begin =
-                    MAX(0, MIN((i32)cl->compls_curr - (i32)list_pre_half, (i32)len - (i32)STATUSLINE_COMPLS_LIST_MAX));
-                i32 const end = MIN(len, begin + STATUSLINE_COMPLS_LIST_MAX);
+            Pt const dims = rect_dims(dirty);
+            // clang-format off
+            XRenderComposite(
+                dc->dp, PictOpSrc,
+                src, None,
+                dst,
+                dirty.l, dirty.t,
+                0, 0,
+                dirty.l, dirty.t,
+                dims.x, dims.y
+            );
+            // clang-format on
 
-                for (i32 i = begin; i < end; ++i) {
-                    char const* const compl_val = cl->compls_arr[i].val_dyn;
-                    char const* const compl_descr = cl->compls_arr[i].descr_optdyn;
+            XRenderFreePicture(dc->dp, src);
+            XRenderFreePicture(dc->dp, dst);
+        }
 
-                    u32 const row_num = end - i;
-                    i32 const y = (i32)(clientarea.y - (statusline_h * row_num));
-                    i32 const stry = (i32)(y + statusline_h - STATUSLINE_PADDING_BOTTOM);
-                    argb const bg_col = i != (i32)cl->compls_curr ? COL_BG(dc, SchmNorm) : COL_FG(dc, SchmNorm);
-                    Bool const invert = i == (i32)cl->compls_curr;
+        src_pm = mip->pm;
+        src_dims = mip->dims;
+    }
 
-                    fill_rect(dc, (Pt) {0, y}, line_dims, bg_col);
-                    draw_string(dc, compl_val, (Pt) {0, stry}, SchmNorm, invert);
+    return src_pm;
+}
 
-                    if (compl_descr) {
-                        i32 const padding = (i32)STATUSLINE_COMPLS_DESRCIPTION_PADDING_PX;
-                        i32 const val_w = (i32)get_string_width(dc, compl_val, strlen(compl_val));
-                        i32 const descr_w = (i32)get_string_width(dc, compl_descr, strlen(compl_descr));
-                        i32 const strx =
-                            val_w + descr_w + padding < clientarea.x ? clientarea.x - descr_w : val_w + padding;
-                        draw_string(dc, compl_descr, (Pt) {strx, stry}, SchmNorm, invert);
-                    }
-                }
-            }
-        }
-    } else {
-        u32 const y = dc->height - STATUSLINE_PADDING_BOTTOM;
+// 2x2 box filter of premultiplied pixels
+static u32 client_mip_pixel(u32 p00, u32 p01, u32 p10, u32 p11) {
+    u32 const rb = (p00 & 0x00FF00FF) + (p01 & 0x00FF00FF) + (p10 & 0x00FF00FF) + (p11 & 0x00FF00FF) + 0x00020002;
+    u32 const ag = ((p00 >> 8) & 0x00FF00FF) + ((p01 >> 8) & 0x00FF00FF) + ((p10 >> 8) & 0x00FF00FF)
+                 + ((p11 >> 8) & 0x00FF00FF) + 0x00020002;
+    return ((rb >> 2) & 0x00FF00FF) | (((ag >> 2) & 0x00FF00FF) << 8);
+}
 
-        {
-            // current module left-bottom corner
-            u32 x = 0;
-            for (u32 i = 0; i < LENGTH(LEFT_MODULES); ++i) {
-                SLModule const* module = &LEFT_MODULES[i];
+XImage* dc_client_mip(struct DrawCtx* dc, u32 level) {
+    assert(level < MIP_LEVELS_MAX);
+    XImage* src = dc->cv.im;
 
-                x += draw_module(ctx, module, (Pt) {(i32)x, (i32)y});
-                x += STATUSLINE_MODULE_SPACING_PX;
+    for (u32 i = 1; i <= level; ++i) {
+        struct Mip* mip = &dc->cache.mips[i];
+        if (!mip->im) {
+            Pt const dims = {MAX(1, (src->width + 1) / 2), MAX(1, (src->height + 1) / 2)};
+            char* data = ecalloc((usize)dims.x * dims.y, sizeof(u32));
+            mip->im = XCreateImage(
+                dc->dp,
+                dc->sys.vinfo.visual,
+                dc->sys.vinfo.depth,
+                ZPixmap,
+                0,
+                data,
+                dims.x,
+                dims.y,
+                32,
+                0
+            );
+            if (!mip->im) {
+                die("failed to create client mip image");
             }
+            mip->im_dirty = (Rect) {0, 0, dc->cache.dims.x - 1, dc->cache.dims.y - 1};
         }
+        XImage* dst = mip->im;
 
-        {
-            // current module left-bottom corner
-            u32 x = dc->width;
-            for (i32 i = LENGTH(RIGHT_MODULES) - 1; i >= 0; --i) {
-                SLModule const* module = &RIGHT_MODULES[i];
-                // HACK draw out of client area to get module width
-                x -= draw_module(ctx, module, (Pt) {1000000, (i32)y});
-                draw_module(ctx, module, (Pt) {(i32)x, (i32)y});
-                x -= STATUSLINE_MODULE_SPACING_PX;
+        Rect const dirty = rect_bound(
+            (Rect) {mip->im_dirty.l >> i, mip->im_dirty.t >> i, mip->im_dirty.r >> i, mip->im_dirty.b >> i},
+            ximage_rect(dst)
+        );
+        mip->im_dirty = RNIL;
+
+        // odd edge repeats last pixel as dc_cache_mip does
+        for (i32 y = dirty.t; y <= dirty.b; ++y) {
+            u32 const* row0 = client_row(src, MIN(y * 2, src->height - 1));
+            u32 const* row1 = client_row(src, MIN((y * 2) + 1, src->height - 1));
+            u32* out = (u32*)(dst->data + ((usize)y * dst->bytes_per_line));
+            for (i32 x = dirty.l; x <= dirty.r; ++x) {
+                i32 const x0 = MIN(x * 2, src->width - 1);
+                i32 const x1 = MIN((x * 2) + 1, src->width - 1);
+                out[x] = client_mip_pixel(row0[x0], row0[x1], row1[x0], row1[x1]);
             }
         }
+
+        src = dst;
+    }
+
+    return src;
+}
+
+void dc_shm_wait(struct DrawCtx* dc) {
+    XEvent event;
+    while (dc->shm.pending) {
+        XIfEvent(dc->dp, &event, &is_shm_completion_event, (XPointer)&dc->shm.completion_type);
+        --dc->shm.pending;
+    }
+}
+
+// MIT-SHM segment of XImage, stored in XImage::obdata
+struct ShmImageData {
+    XShmSegmentInfo info;  // must be first, XShm* functions read it from obdata
+    Display* dp;
+    Bool sparse;  // no swap reserved, pages are allocated on first touch
+};
+
+static int shm_attach_error_hdlr(__attribute__((unused)) Display* dp, __attribute__((unused)) XErrorEvent* e) {
+    shm_attach_failed = True;
+    return 0;
+}
+
+void shm_init(struct DrawCtx* dc) {
+    dc->shm = (struct Shm) {0};
+    if (!XShmQueryExtension(dc->dp)) {
+        trace("xpaint: no MIT-SHM extension support");
+        return;
+    }
+    dc->shm.available = True;
+    dc->shm.completion_type = XShmGetEventBase(dc->dp) + ShmCompletion;
+}
+
+static XImage* ximage_shm_create(struct DrawCtx* dc, u32 width, u32 height, Bool sparse) {
+    if (!dc->shm.available) {
+        return NULL;
+    }
+
+    struct ShmImageData* data = ecalloc(1, sizeof(struct ShmImageData));
+    data->dp = dc->dp;
+    data->sparse = sparse;
+    XImage* im =
+        XShmCreateImage(dc->dp, dc->sys.vinfo.visual, dc->sys.vinfo.depth, ZPixmap, NULL, &data->info, width, height);
+    if (!im) {
+        free(data);
+        return NULL;
+    }
+
+    i32 const flags = IPC_CREAT | 0600 | (sparse ? SHM_NORESERVE : 0);
+    data->info.shmid = shmget(IPC_PRIVATE, (usize)im->bytes_per_line * im->height, flags);
+    if (data->info.shmid == -1) {
+        trace("xpaint: shmget failed: %s", strerror(errno));
+        XFree(im);
+        free(data);
+        return NULL;
+    }
+    data->info.shmaddr = shmat(data->info.shmid, NULL, 0);
+    data->info.readOnly = False;
+
+    Bool attached = False;
+    if (data->info.shmaddr != (char*)-1) {
+        // attach error is reported asynchronously, e.g. on remote displays
+        XSync(dc->dp, False);
+        shm_attach_failed = False;
+        XErrorHandler const prev_hdlr = XSetErrorHandler(&shm_attach_error_hdlr);
+        attached = XShmAttach(dc->dp, &data->info);
+        XSync(dc->dp, False);
+        XSetErrorHandler(prev_hdlr);
+        attached = attached && !shm_attach_failed;
+    }
+    // segment is destroyed after both sides detach
+    shmctl(data->info.shmid, IPC_RMID, NULL);
+
+    if (!attached) {
+        trace("xpaint: failed to attach MIT-SHM segment, falling back to XPutImage");
+        dc->shm.available = False;
+        if (data->info.shmaddr != (char*)-1) {
+            shmdt(data->info.shmaddr);
+        }
+        XFree(im);
+        free(data);
+        return NULL;
     }
 
-    swap_backbuffer(ctx);
+    im->data = data->info.shmaddr;
+    im->obdata = (char*)data;
+    im->f.destroy_image = &ximage_shm_destroy;
+    return im;
+}
+
+XImage* ximage_shm_new(struct DrawCtx* dc, u32 width, u32 height) {
+    return ximage_shm_create(dc, width, height, False);
+}
+
+int ximage_shm_destroy(XImage* im) {
+    struct ShmImageData* data = (struct ShmImageData*)im->obdata;
+    XShmDetach(data->dp, &data->info);
+    shmdt(data->info.shmaddr);
+    free(data);
+    XFree(im);
+    return 1;
 }
 
-// FIXME DRY
-void show_message(struct Ctx* ctx, char const* msg) {
-    u32 const statusline_h = statusline_height(&ctx->dc);
-    fill_rect(
-        &ctx->dc,
-        (Pt) {0, (i32)(ctx->dc.height - statusline_h)},
-        (Pt) {(i32)ctx->dc.width, (i32)statusline_h},
-        COL_BG(&ctx->dc, SchmNorm)
-    );
-    draw_string(&ctx->dc, msg, (Pt) {0, (i32)(ctx->dc.height - STATUSLINE_PADDING_BOTTOM)}, SchmNorm, False);
+Bool ximage_is_shm(XImage const* im) {
+    return im->f.destroy_image == &ximage_shm_destroy;
+}
 
-    swap_backbuffer(ctx);
-    // HACK? message may not display if called mid-function without this
-    XFlush(ctx->dc.dp);
+Bool ximage_is_sparse_shm(XImage const* im) {
+    return ximage_is_shm(im) && ((struct ShmImageData const*)im->obdata)->sparse;
 }
 
-void swap_backbuffer(struct Ctx* ctx) {
-    XdbeSwapBuffers(
-        ctx->dc.dp,
-        &(XdbeSwapInfo) {
-            .swap_window = ctx->dc.window,
-            .swap_action = 0,
-        },
-        1
-    );
+XImage* ximage_to_shm(struct DrawCtx* dc, XImage* im) {
+    if (!im || ximage_is_shm(im)) {
+        return im;
+    }
+    XImage* result = ximage_shm_new(dc, im->width, im->height);
+    if (!result) {
+        return im;
+    }
+    assert(result->bits_per_pixel == im->bits_per_pixel);
 
-    XSyncSetCounter(ctx->dc.dp, ctx->xsync.counter, ctx->xsync.last_request_value);
+    usize const row_size = (usize)im->width * (im->bits_per_pixel / 8);
+    for (i32 y = 0; y < im->height; ++y) {
+        memcpy(
+            result->data + ((usize)y * result->bytes_per_line),
+            im->data + ((usize)y * im->bytes_per_line),
+            row_size
+        );
+    }
+    XDestroyImage(im);
+    return result;
 }
 
-static void dc_cache_update_pm(struct DrawCtx* dc, Pixmap pm, XImage* im, Rect damage) {
-    if (IS_RNIL(damage)) {
-        return;
+XImage* ximage_sparse_new(struct DrawCtx* dc, u32 width, u32 height) {
+    // shared memory segment is zero filled and allocated lazily too, tiles are uploaded from it
+    XImage* im = ximage_shm_create(dc, width, height, True);
+    if (im) {
+        return im;
+    }
+    im = XCreateImage(dc->dp, dc->sys.vinfo.visual, dc->sys.vinfo.depth, ZPixmap, 0, NULL, width, height, 32, 0);
+    if (!im) {
+        die("failed to create overlay image");
+    }
+    // untouched pages read as zero without being allocated
+    void* data = mmap(
+        NULL,
+        (usize)im->bytes_per_line * im->height,
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1,
+        0
+    );
+    if (data == MAP_FAILED) {
+        die("mmap: %s", strerror(errno));
     }
-    assert(im);
-    Pt dims = rect_dims(damage);
-    XPutImage(dc->dp, pm, dc->screen_gc, im, damage.l, damage.t, damage.l, damage.t, dims.x, dims.y);
+    im->data = data;
+    im->f.destroy_image = &ximage_sparse_destroy;
+    return im;
 }
 
-void dc_cache_update(struct Ctx* ctx, Rect damage) {
-    struct DrawCtx* dc = &ctx->dc;
-    struct Input* inp = &ctx->input;
-    Rect const cv_rect = {0, 0, dc->cv.im->width, dc->cv.im->height};
-    assert(dc->cache.overlay && dc->cache.pm);
-
-    // resize pixmaps if needed
-    if (dc->cache.dims.x != dc->cv.im->width || dc->cache.dims.y != dc->cv.im->height) {
-        dc_cache_free(dc);
-        dc_cache_init(ctx);
-        dc_cache_update_pm(dc, dc->cache.pm, dc->cv.im, cv_rect);
-        dc_cache_update_pm(dc, dc->cache.overlay, inp->ovr.im, cv_rect);
-    } else {
-        dc_cache_update_pm(dc, dc->cache.pm, dc->cv.im, damage);
-        dc_cache_update_pm(dc, dc->cache.overlay, inp->ovr.im, damage);
-    }
+int ximage_sparse_destroy(XImage* im) {
+    munmap(im->data, (usize)im->bytes_per_line * im->height);
+    XFree(im);
+    return 1;
 }
 
 void brush_cache_free(struct Brush* brush) {
@@ -4843,42 +9495,32 @@ void brush_cache_update(struct DrawerData const* data, u32 line_w, argb col, str
 
     if (force_cache_fail || par->data.shape != data->shape || par->data.hardness != data->hardness
         || par->line_w != line_w || par->col != col) {
-        free(brush_in_out->data);
-        brush_in_out->dims = PNIL;
-
         par->data.shape = data->shape;
         par->data.hardness = data->hardness;
         par->line_w = line_w;
         par->col = col;
 
+        brush_in_out->dims = par->data.shape == DS_Point ? (Pt) {1, 1} : (Pt) {(i32)par->line_w, (i32)par->line_w};
+        usize const len = (usize)brush_in_out->dims.x * brush_in_out->dims.y;
+        // random brush is regenerated on each use, so buffer is reused
+        if (len > brush_in_out->cap) {
+            free(brush_in_out->data);
+            brush_in_out->data = ecalloc(len, sizeof(argb));
+            brush_in_out->cap = len;
+        }
+
         switch (par->data.shape) {
-            case DS_Brush: {
-                brush_in_out->dims = (Pt) {(i32)par->line_w, (i32)par->line_w};
-                brush_in_out->data = new_circle_brush(par->col, par->data.hardness, par->line_w, False);
-                break;
-            }
-            case DS_Circle: {
-                brush_in_out->dims = (Pt) {(i32)par->line_w, (i32)par->line_w};
-                brush_in_out->data = new_circle_brush(par->col, 1.0, par->line_w, False);
-                break;
-            }
-            case DS_Square: {
-                brush_in_out->dims = (Pt) {(i32)par->line_w, (i32)par->line_w};
-                brush_in_out->data = ecalloc(brush_in_out->dims.x * brush_in_out->dims.y, sizeof(argb));
-                for (i32 i = 0; i < brush_in_out->dims.x * brush_in_out->dims.y; ++i) {
+            case DS_Brush: fill_circle_brush(brush_in_out->data, par->col, par->data.hardness, par->line_w, False); break;
+            case DS_Circle: fill_circle_brush(brush_in_out->data, par->col, 1.0, par->line_w, False); break;
+            case DS_Square:
+            case DS_Point: {
+                for (usize i = 0; i < len; ++i) {
                     brush_in_out->data[i] = par->col;
                 }
                 break;
             }
-            case DS_Point: {
-                brush_in_out->dims = (Pt) {1, 1};
-                brush_in_out->data = ecalloc(1, sizeof(argb));
-                brush_in_out->data[0] = par->col;
-                break;
-            }
             case DS_CircleRandom:
-                brush_in_out->dims = (Pt) {(i32)par->line_w, (i32)par->line_w};
-                brush_in_out->data = new_circle_brush(par->col, par->data.hardness, par->line_w, True);
+                fill_circle_brush(brush_in_out->data, par->col, par->data.hardness, par->line_w, True);
                 break;
         }
     }
@@ -4890,17 +9532,26 @@ int trigger_clipboard_paste(struct DrawCtx* dc, Atom selection_target) {
 
 void dc_cache_init(struct Ctx* ctx) {
     struct DrawCtx* dc = &ctx->dc;
-    struct Input* inp = &ctx->input;
-    assert(dc->cache.pm == 0 && dc->cache.overlay == 0);
-    assert(dc->cv.im->width == inp->ovr.im->width);
-    assert(dc->cv.im->height == inp->ovr.im->height);
+    assert(dc->cache.pm == 0 && dc->cache.overlay.pms_dyn == NULL);
+    assert(dc->cv.im->width == ctx->input.ovr.im->width);
+    assert(dc->cv.im->height == ctx->input.ovr.im->height);
 
     dc->cache.pm = XCreatePixmap(dc->dp, dc->window, dc->cv.im->width, dc->cv.im->height, dc->sys.vinfo.depth);
 
-    dc->cache.overlay = XCreatePixmap(dc->dp, dc->window, inp->ovr.im->width, inp->ovr.im->height, dc->sys.vinfo.depth);
+    dc->cache.overlay.grid = (Pt) {
+        (dc->cv.im->width + OVR_TILE_SIZE - 1) / OVR_TILE_SIZE,
+        (dc->cv.im->height + OVR_TILE_SIZE - 1) / OVR_TILE_SIZE,
+    };
+    // tiles are created in dc_cache_update_overlay
+    dc->cache.overlay.pms_dyn = ecalloc(dc->cache.overlay.grid.x * dc->cache.overlay.grid.y, sizeof(Pixmap));
 
     dc->cache.dims.x = dc->cv.im->width;
     dc->cache.dims.y = dc->cv.im->height;
+
+    for (u32 level = 0; level < MIP_LEVELS_MAX; ++level) {
+        dc->cache.mips[level] = (struct Mip) {.pm = 0, .dirty = RNIL, .im = NULL, .im_dirty = RNIL};
+    }
+    dc->cache.stale = RNIL;
 }
 
 void dc_cache_free(struct DrawCtx* dc) {
@@ -4908,9 +9559,24 @@ void dc_cache_free(struct DrawCtx* dc) {
         XFreePixmap(dc->dp, dc->cache.pm);
         dc->cache.pm = 0;
     }
-    if (dc->cache.overlay != 0) {
-        XFreePixmap(dc->dp, dc->cache.overlay);
-        dc->cache.overlay = 0;
+    if (dc->cache.overlay.pms_dyn) {
+        for (i32 i = 0; i < dc->cache.overlay.grid.x * dc->cache.overlay.grid.y; ++i) {
+            if (dc->cache.overlay.pms_dyn[i] != 0) {
+                XFreePixmap(dc->dp, dc->cache.overlay.pms_dyn[i]);
+            }
+        }
+        free(dc->cache.overlay.pms_dyn);
+        dc->cache.overlay = (struct OverlayTiles) {0};
+    }
+    for (u32 level = 1; level < MIP_LEVELS_MAX; ++level) {
+        if (dc->cache.mips[level].pm != 0) {
+            XFreePixmap(dc->dp, dc->cache.mips[level].pm);
+            dc->cache.mips[level].pm = 0;
+        }
+        if (dc->cache.mips[level].im != NULL) {
+            XDestroyImage(dc->cache.mips[level].im);
+            dc->cache.mips[level].im = NULL;
+        }
     }
 }
 
@@ -4929,6 +9595,18 @@ struct Ctx ctx_init(Display* dp) {
                         .scroll = {0.0, 0.0},
                     },
                 .cache = (struct Cache) {.pm = 0},
+                .scr_damage =
+                    (struct ScreenDamage) {
+                        .rects = {0},
+                        .ui = RNIL,
+                        .sel_circ_item = NIL,
+                        .drawn = {0},
+                        .zoom = NIL,
+                        .scroll = PNIL,
+                        .wnd_dims = PNIL,
+                        .cv_dims = PNIL,
+                    },
+                .renderer = RENDERER_DEFAULT,
             },
         .input =
             (struct Input) {
@@ -4945,6 +9623,19 @@ struct Ctx ctx_init(Display* dp) {
         .hist_nextarr = NULL,
         .hist_prevarr = NULL,
         .sc.items_arr = NULL,
+        .frame =
+            (struct Frame) {
+                .dirty = False,
+                .cur_scr = PNIL,
+                .cv_damage = {0},
+                .message_dyn = NULL,
+            },
+        .statusline =
+            (struct Statusline) {
+                .key = 0,
+                .rect = RNIL,
+                .modules_arr = NULL,
+            },
     };
 }
 
@@ -4976,6 +9667,7 @@ void setup(Display* dp, struct Ctx* ctx) {
         atoms[A_Targets] = XInternAtom(dp, "TARGETS", False);
         atoms[A_Utf8string] = XInternAtom(dp, "UTF8_STRING", False);
         atoms[A_ImagePng] = XInternAtom(dp, "image/png", False);
+        atoms[A_Incr] = XInternAtom(dp, "INCR", False);
         atoms[A_TextUriList] = XInternAtom(dp, "text/uri-list", False);
         atoms[A_XSelData] = XInternAtom(dp, "XSEL_DATA", False);
         atoms[A_WmProtocols] = XInternAtom(dp, "WM_PROTOCOLS", False);
@@ -4995,6 +9687,14 @@ void setup(Display* dp, struct Ctx* ctx) {
         assert(ctx->dc.sys.xrnd_pic_format);
     }
 
+    /* shared memory */ {
+        shm_init(&ctx->dc);
+    }
+
+    /* main loop */ {
+        loop_init(&ctx->loop);
+    }
+
     i32 screen = DefaultScreen(dp);
     Window root = DefaultRootWindow(dp);
     i32 const depth = 32;
@@ -5024,10 +9724,13 @@ void setup(Display* dp, struct Ctx* ctx) {
         &(XSetWindowAttributes) {.colormap = ctx->dc.sys.colmap,
                                  .border_pixel = 0,
                                  .background_pixel = WND_BACKGROUND,
+                                 // property events drive INCR selection transfers to own window
                                  .event_mask = ButtonPressMask | ButtonReleaseMask | KeyPressMask | ExposureMask
-                                     | PointerMotionMask | StructureNotifyMask}
+                                     | PointerMotionMask | StructureNotifyMask | PropertyChangeMask}
     );
     ctx->dc.screen_gc = XCreateGC(dp, ctx->dc.window, 0, 0);
+    // back buffer is always fully visible, no need for NoExpose events
+    XSetGraphicsExposures(dp, ctx->dc.screen_gc, False);
 
     XSetWMName(
         dp,
@@ -5144,21 +9847,22 @@ void setup(Display* dp, struct Ctx* ctx) {
         );
         // read canvas data from file or create empty
         if (ctx->inp.t != IO_None) {
-            struct Image im = read_image_io(&ctx->dc, &ctx->inp, 0);
+            // window will be at most that large
+            struct FullResJob* fullres = NULL;
+            struct Image im = read_image_io_scaled(&ctx->dc, &ctx->inp, NIL, WND_LAUNCH_MAX_SIZE, &fullres);
             if (!canvas_load(ctx, &im)) {
                 die("failed to read input file '%s'", ioctx_as_str(&ctx->inp));
             }
+            fullres_start(ctx, fullres);
         } else {
             Pixmap data = XCreatePixmap(dp, ctx->dc.window, ctx->dc.width, ctx->dc.height, ctx->dc.sys.vinfo.depth);
-            ctx->dc.cv.im = XGetImage(dp, data, 0, 0, ctx->dc.width, ctx->dc.height, AllPlanes, ZPixmap);
+            ctx->dc.cv.im =
+                ximage_to_shm(&ctx->dc, XGetImage(dp, data, 0, 0, ctx->dc.width, ctx->dc.height, AllPlanes, ZPixmap));
             XFreePixmap(dp, data);
             // initial canvas color
             canvas_fill(ctx->dc.cv.im, CANVAS_BACKGROUND);
 
-            struct InputOverlay* ovr = &ctx->input.ovr;
-            ovr->im = XSubImage(ctx->dc.cv.im, 0, 0, ctx->dc.cv.im->width, ctx->dc.cv.im->height);
-            ovr->rect = ximage_rect(ovr->im);
-            overlay_clear(ovr);
+            overlay_init(&ctx->dc, &ctx->input.ovr, ctx->dc.cv.im->width, ctx->dc.cv.im->height);
         }
 
         ctx->dc.width = CLAMP(ctx->dc.cv.im->width, WND_LAUNCH_MIN_SIZE.x, WND_LAUNCH_MAX_SIZE.x);
@@ -5193,6 +9897,83 @@ void setup(Display* dp, struct Ctx* ctx) {
 }
 
 void run(struct Ctx* ctx) {
+    HdlrResult running = HR_Ok;
+    XEvent event = {0};
+    Display* dp = ctx->dc.dp;
+    struct Frame* fr = &ctx->frame;
+    struct Loop* loop = &ctx->loop;
+
+    enum { FdX, FdTimer, FdWake, FdLast };
+    struct pollfd fds[FdLast] = {
+        [FdX] = {.fd = ConnectionNumber(dp), .events = POLLIN},
+        [FdTimer] = {.fd = loop->timer_fd, .events = POLLIN},
+        [FdWake] = {.fd = loop->wake_fd, .events = POLLIN},
+    };
+
+    XSync(dp, False);
+    while (running != HR_Quit) {
+        // bounded, so frame timer is not starved by event flood
+        for (i32 queued = XPending(dp); queued > 0 && running != HR_Quit; --queued) {
+            XNextEvent(dp, &event);
+            running = handle_event(ctx, &event);
+        }
+        if (running == HR_Quit) {
+            break;
+        }
+        fullres_apply_ready(ctx);
+
+        if (fr->dirty && !loop->timer_armed) {
+            loop_arm_frame_timer(loop, fr->deadline_us);
+        }
+
+        XFlush(dp);
+        // poll doesn't know about events already read by Xlib
+        i32 timeout = XEventsQueued(dp, QueuedAlready) > 0 ? 0 : -1;
+        // abandoned selection transfers are dropped even if no event comes
+        i32 const incr_timeout = incr_send_expire(ctx);
+        if (incr_timeout >= 0 && (timeout < 0 || incr_timeout < timeout)) {
+            timeout = incr_timeout;
+        }
+        if (poll(fds, FdLast, timeout) == -1) {
+            if (errno != EINTR) {
+                die("poll failed: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        if (fds[FdWake].revents & POLLIN) {
+            u64 count = 0;
+            ssize_t const read_res = read(loop->wake_fd, &count, sizeof(count));
+            (void)read_res;  // nonblocking, posted completions are checked anyway
+            loop_handle_posted(ctx);
+            if (ctx->saves.exit_when_done && !arrlen(ctx->saves.queue_arr)) {
+                break;  // :wq after last save
+            }
+        }
+
+        if (fds[FdTimer].revents & POLLIN) {
+            u64 expirations = 0;
+            ssize_t const read_res = read(loop->timer_fd, &expirations, sizeof(expirations));
+            (void)read_res;
+            loop->timer_armed = False;
+
+            // frame must show result of already received events
+            for (i32 queued = XEventsQueued(dp, QueuedAfterReading); queued > 0 && running != HR_Quit; --queued) {
+                XNextEvent(dp, &event);
+                running = handle_event(ctx, &event);
+            }
+            if (running != HR_Quit && fr->dirty) {
+                fr->deadline_us = monotonic_us() + FRAME_PERIOD_US;
+                frame_render(ctx);
+                arena_reset(&frame_arena);
+            }
+        }
+    }
+    // also for :q, pending saves are not dropped
+    workers_wait(ctx);
+}
+
+HdlrResult handle_event(struct Ctx* ctx, XEvent* event) {
     static HdlrResult (*const handlers[LASTEvent])(struct Ctx*, XEvent*) = {
         [KeyPress] = &key_press_hdlr,
         [ButtonPress] = &button_press_hdlr,
@@ -5203,22 +9984,94 @@ void run(struct Ctx* ctx) {
         [ConfigureNotify] = &configure_notify_hdlr,
         [SelectionRequest] = &selection_request_hdlr,
         [SelectionNotify] = &selection_notify_hdlr,
+        [PropertyNotify] = &property_notify_hdlr,
         [ClientMessage] = &client_message_hdlr,
         [MappingNotify] = &mapping_notify_hdlr,
     };
 
-    HdlrResult running = HR_Ok;
-    XEvent event = {0};
+    if (XFilterEvent(event, ctx->dc.window)) {
+        return HR_Ok;
+    }
+    // extension events (e.g. ShmCompletion) are handled in place
+    if (event->type >= LASTEvent || !handlers[event->type]) {
+        return HR_Ok;
+    }
 
-    XSync(ctx->dc.dp, False);
-    while (running != HR_Quit && !XNextEvent(ctx->dc.dp, &event)) {
-        if (XFilterEvent(&event, ctx->dc.window)) {
-            continue;
-        }
-        if (handlers[event.type]) {
-            running = handlers[event.type](ctx, &event);
-        }
+    u64 const allocs_before = heap_alloc_count;
+    HdlrResult const result = handlers[event->type](ctx, event);
+    // drawing with unchanged tool settings must not touch the heap
+    if (event->type == MotionNotify && heap_alloc_count != allocs_before) {
+        trace("xpaint: motion event made %llu heap allocations", (unsigned long long)(heap_alloc_count - allocs_before));
+    }
+    arena_reset(&frame_arena);
+    return result;
+}
+
+u64 monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u64)ts.tv_sec * 1000000) + ((u64)ts.tv_nsec / 1000);
+}
+
+void loop_init(struct Loop* loop) {
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer_fd == -1) {
+        die("failed to create frame timer: %s", strerror(errno));
     }
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd == -1) {
+        die("failed to create eventfd: %s", strerror(errno));
+    }
+    loop->timer_armed = False;
+    loop->done_arr = NULL;
+    pthread_mutex_init(&loop->mtx, NULL);
+}
+
+void loop_free(struct Loop* loop) {
+    // loop_post writes wake_fd under mtx, so no detached worker is writing it now
+    pthread_mutex_lock(&loop->mtx);
+    close(loop->timer_fd);
+    close(loop->wake_fd);
+    pthread_mutex_unlock(&loop->mtx);
+    pthread_mutex_destroy(&loop->mtx);
+    arrfree(loop->done_arr);
+}
+
+void loop_arm_frame_timer(struct Loop* loop, u64 deadline_us) {
+    // zero value disarms timer, past deadline expires immediately
+    deadline_us = MAX(deadline_us, 1);
+    struct itimerspec const spec = {
+        .it_value = {.tv_sec = (time_t)(deadline_us / 1000000), .tv_nsec = (long)(deadline_us % 1000000) * 1000},
+    };
+    if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        die("failed to arm frame timer: %s", strerror(errno));
+    }
+    loop->timer_armed = True;
+}
+
+void loop_post(struct Loop* loop, void (*on_done)(struct Ctx* ctx, void* data), void* data) {
+    u64 const one = 1;
+    pthread_mutex_lock(&loop->mtx);
+    arrpush(loop->done_arr, ((struct Completion) {.on_done = on_done, .data = data}));
+    // completion can't be handled and wake_fd closed before this write
+    ssize_t const write_res = write(loop->wake_fd, &one, sizeof(one));
+    (void)write_res;  // counter overflow is impossible in practice
+    pthread_mutex_unlock(&loop->mtx);
+}
+
+void loop_handle_posted(struct Ctx* ctx) {
+    struct Loop* loop = &ctx->loop;
+
+    pthread_mutex_lock(&loop->mtx);
+    struct Completion* done_arr = loop->done_arr;
+    loop->done_arr = NULL;
+    pthread_mutex_unlock(&loop->mtx);
+
+    // callbacks may post new completions
+    for (u32 i = 0; i < arrlen(done_arr); ++i) {
+        done_arr[i].on_done(ctx, done_arr[i].data);
+    }
+    arrfree(done_arr);
 }
 
 HdlrResult button_press_hdlr(struct Ctx* ctx, XEvent* event) {
@@ -5227,9 +10080,9 @@ HdlrResult button_press_hdlr(struct Ctx* ctx, XEvent* event) {
     struct Input* inp = &ctx->input;
     Button const button = get_btn(e);
 
-    inp->damage = RNIL;
-    inp->redraw_track[0] = RNIL;
-    inp->redraw_track[1] = RNIL;
+    inp->damage = (RectSet) {0};
+    inp->redraw_track[0] = (RectSet) {0};
+    inp->redraw_track[1] = (RectSet) {0};
 
     if (inp->mode.t == InputT_Transform || inp->mode.t == InputT_Text) {
         // do nothing
@@ -5240,12 +10093,15 @@ HdlrResult button_press_hdlr(struct Ctx* ctx, XEvent* event) {
         overlay_clear(&ctx->input.ovr);
         Rect const cv_damage = tc->on_press(ctx, e);
         overlay_expand_rect(&inp->ovr, cv_damage);
-        input_set_damage(inp, rect_expand(ovr_damage, cv_damage));
+        RectSet press_damage = rectset_from_rect(ovr_damage);
+        rectset_add(&press_damage, cv_damage);
+        input_set_damage_rects(inp, &press_damage);
     }
 
     update_screen(ctx, (Pt) {e->x, e->y}, False);
-    draw_selection_circle(ctx, &ctx->sc, e->x, e->y);
 
+    // motion history of drag starts here
+    inp->last_motion_time = e->time;
     inp->c = (struct CursorState) {
         .state = CS_Hold,
         .btn = button,
@@ -5294,11 +10150,15 @@ HdlrResult button_release_hdlr(struct Ctx* ctx, XEvent* event) {
         Rect const curr_damage = tc->on_release(ctx, e);
         overlay_expand_rect(&inp->ovr, curr_damage);
 
-        Rect final_damage = rect_expand(inp->damage, curr_damage);
-        if (!IS_RNIL(final_damage)) {
-            input_set_damage(inp, final_damage);
-            history_forward(ctx, history_new_as_damage(dc->cv.im, final_damage));
-            ximage_blend(dc->cv.im, inp->ovr.im, final_damage);
+        // only touched parts are saved and blended, not their bounding box
+        RectSet final_damage = inp->damage;
+        rectset_add(&final_damage, curr_damage);
+        if (final_damage.len) {
+            input_set_damage_rects(inp, &final_damage);
+            history_forward(ctx, history_new_as_damage_rects(dc->cv.im, &final_damage));
+            for (u32 i = 0; i < final_damage.len; ++i) {
+                ximage_blend(dc->cv.im, inp->ovr.im, final_damage.rects[i]);
+            }
             overlay_clear(&inp->ovr);
         }
 
@@ -5308,7 +10168,7 @@ HdlrResult button_release_hdlr(struct Ctx* ctx, XEvent* event) {
 
     inp->c = (struct CursorState) {0};
 
-    sel_circ_free_and_hide(&ctx->sc);
+    sel_circ_free_and_hide(&ctx->dc, &ctx->sc);
     update_screen(ctx, (Pt) {e->x, e->y}, False);
 
     return HR_Ok;
@@ -5321,6 +10181,7 @@ HdlrResult destroy_notify_hdlr(__attribute__((unused)) struct Ctx* ctx, __attrib
 HdlrResult expose_hdlr(struct Ctx* ctx, XEvent* event) {
     XExposeEvent* e = (XExposeEvent*)event;
 
+    dc_damage_scr(&ctx->dc, (Rect) {e->x, e->y, e->x + e->width - 1, e->y + e->height - 1});
     update_screen(ctx, (Pt) {e->x, e->y}, False);
     return HR_Ok;
 }
@@ -5552,6 +10413,7 @@ HdlrResult key_press_hdlr(struct Ctx* ctx, XEvent* event) {
         }
 
         assert(ctx->sel_buf.im != NULL);
+        clip_encode_start(ctx);
     }
     if (CAN_ACTION(inp, curr, MF_Int, ACT_SWAP_COLOR)) {
         tc_set_curr_col_num(&CURR_TC(ctx), CURR_TC(ctx).prev_col);
@@ -5599,17 +10461,7 @@ HdlrResult key_press_hdlr(struct Ctx* ctx, XEvent* event) {
         tc_set_curr_col_num(&CURR_TC(ctx), curr_col == 0 ? col_num - 1 : curr_col - 1);
     }
     if (CAN_ACTION(inp, curr, MF_Int | MF_Color, ACT_SAVE_TO_FILE)) {  // save to current file
-        struct IOCtx const* ioctx = &ctx->out;
-        /* relevant for long-running operations, as saving occurs on the main thread */ {
-            char* save_msg = str_new("saving image to '%s'", ioctx_as_str(ioctx));
-            show_message(ctx, save_msg);
-            str_free(&save_msg);
-        }
-        if (write_io(&ctx->dc, inp, ctx->dc.cv.type, ioctx)) {
-            cl_msg_to_show = str_new("changes saved");
-        } else {
-            cl_msg_to_show = str_new("failed to save changes");
-        }
+        save_start(ctx, &ctx->out, ctx->dc.cv.type);
     }
 
     // else-if chain to filter keys
@@ -5654,10 +10506,55 @@ HdlrResult mapping_notify_hdlr(__attribute__((unused)) struct Ctx* ctx, XEvent*
     return HR_Ok;
 }
 
+void motion_coalesce(struct Ctx* ctx, XMotionEvent* e) {
+    Display* dp = ctx->dc.dp;
+    struct Input* inp = &ctx->input;
+    Time const since = inp->last_motion_time;
+
+    // keeps capacity, drag path should not allocate
+    if (inp->motion_arr) {
+        arrdeln(inp->motion_arr, 0, arrlen(inp->motion_arr));
+    }
+    arrpush(inp->motion_arr, ((Pt) {e->x, e->y}));
+
+    // only events in front of queue, button events must stay ordered with motion
+    XEvent next;
+    while (XEventsQueued(dp, QueuedAfterReading) > 0) {
+        XPeekEvent(dp, &next);
+        if (next.type != MotionNotify || next.xmotion.window != e->window || next.xmotion.state != e->state) {
+            break;
+        }
+        XNextEvent(dp, &next);
+        *e = next.xmotion;
+        arrpush(inp->motion_arr, ((Pt) {e->x, e->y}));
+    }
+
+    // server motion buffer may have positions that were not reported as events
+    if (since != CurrentTime && XDisplayMotionBufferSize(dp) > 0) {
+        i32 count = 0;
+        XTimeCoord* history_xdyn = XGetMotionEvents(dp, e->window, since + 1, e->time, &count);
+        if (history_xdyn && count > arrlen(inp->motion_arr)) {
+            arrdeln(inp->motion_arr, 0, arrlen(inp->motion_arr));
+            for (i32 i = 0; i < count; ++i) {
+                arrpush(inp->motion_arr, ((Pt) {history_xdyn[i].x, history_xdyn[i].y}));
+            }
+            if (!PT_EQ(arrlast(inp->motion_arr), ((Pt) {e->x, e->y}))) {
+                arrpush(inp->motion_arr, ((Pt) {e->x, e->y}));
+            }
+        }
+        if (history_xdyn) {
+            XFree(history_xdyn);
+        }
+    }
+
+    inp->last_motion_time = e->time;
+}
+
 HdlrResult motion_notify_hdlr(struct Ctx* ctx, XEvent* event) {
     XMotionEvent* e = (XMotionEvent*)event;
     struct ToolCtx* tc = &CURR_TC(ctx);
     struct Input* inp = &ctx->input;
+    motion_coalesce(ctx, e);
     Pt const cur = pt_from_scr_to_cv_xy(&ctx->dc, e->x, e->y);
 
     if (ctx->input.c.state != CS_None) {
@@ -5665,19 +10562,9 @@ HdlrResult motion_notify_hdlr(struct Ctx* ctx, XEvent* event) {
             ctx->input.c.state = CS_Drag;
         }
 
-        struct timeval current_time;
-        gettimeofday(&current_time, 0x0);
-        // XXX mouse scroll and drag event are shared
-        u64 const elapsed_from_last = current_time.tv_usec - ctx->input.last_proc_drag_ev_us;
-
         if (BTN_EQ(inp->c.btn, BTN_SCROLL_DRAG)) {
             canvas_scroll(&ctx->dc.cv, (DPt) {e->x - inp->prev_c.x, e->y - inp->prev_c.y});
-            // last update will be in button_release_hdlr
-            if (elapsed_from_last >= MOUSE_SCROLL_UPDATE_PERIOD_US) {
-                ctx->input.last_proc_drag_ev_us = current_time.tv_usec;
-                update_screen(ctx, (Pt) {e->x, e->y}, False);
-            }
-        } else if (elapsed_from_last >= DRAG_EVENT_PROC_PERIOD_US) {
+        } else {
             if (inp->mode.t == InputT_Transform) {
                 struct InputTransformData* transd = &inp->mode.d.trans;
                 Pt const cur_delta = {cur.x - inp->c.pos.x, cur.y - inp->c.pos.y};
@@ -5740,20 +10627,15 @@ HdlrResult motion_notify_hdlr(struct Ctx* ctx, XEvent* event) {
 
                     transd->curr.move = snapped;
                 }
-
-                update_screen(ctx, (Pt) {e->x, e->y}, False);
             } else if (inp->mode.t == InputT_Interact && BTN_EQ(inp->c.btn, BTN_LINE_RESIZE)) {
                 tc->line_w = (u32)fabs(dpt_dist(pt_to_dpt(inp->c.pos), pt_to_dpt(cur))) * 2;
             } else if (tc->on_drag) {
-                Rect curr_damage = tc->on_drag(ctx, e);
-                overlay_expand_rect(&inp->ovr, curr_damage);
-
-                if (!IS_RNIL(curr_damage)) {
-                    input_set_damage(inp, rect_expand(inp->damage, curr_damage));
-                    inp->last_proc_drag_ev_us = current_time.tv_usec;
+                RectSet const curr_damage = tc->on_drag(ctx, e, inp->motion_arr, arrlen(inp->motion_arr));
+                for (u32 i = 0; i < curr_damage.len; ++i) {
+                    overlay_expand_rect(&inp->ovr, curr_damage.rects[i]);
                 }
-                // FIXME it here to draw selection tool (returns RNIL in on_drag)
-                update_screen(ctx, (Pt) {e->x, e->y}, False);
+
+                input_add_damage_rects(inp, &curr_damage);
             }
         }
     } else {
@@ -5762,16 +10644,11 @@ HdlrResult motion_notify_hdlr(struct Ctx* ctx, XEvent* event) {
             Rect curr_damage = tc->on_move(ctx, e);
             overlay_expand_rect(&inp->ovr, curr_damage);
 
-            if (!IS_RNIL(curr_damage)) {
-                input_set_damage(inp, rect_expand(inp->damage, curr_damage));
-                inp->last_proc_drag_ev_us = 0;
-                update_screen(ctx, (Pt) {e->x, e->y}, False);
-            }
+            input_add_damage(inp, curr_damage);
         }
     }
 
     update_screen(ctx, (Pt) {e->x, e->y}, False);
-    draw_selection_circle(ctx, &ctx->sc, e->x, e->y);
 
     inp->prev_c.x = e->x;
     inp->prev_c.y = e->y;
@@ -5805,6 +10682,21 @@ HdlrResult configure_notify_hdlr(struct Ctx* ctx, XEvent* event) {
     return HR_Ok;
 }
 
+static void clip_notify(Display* dp, XSelectionRequestEvent const* request, Atom property) {
+    XSelectionEvent sendEvent = {
+        .type = SelectionNotify,
+        .serial = request->serial,
+        .send_event = request->send_event,
+        .display = request->display,
+        .requestor = request->requestor,
+        .selection = request->selection,
+        .target = request->target,
+        .property = property,
+        .time = request->time,
+    };
+    XSendEvent(dp, request->requestor, 0, 0, (XEvent*)&sendEvent);
+}
+
 HdlrResult selection_request_hdlr(struct Ctx* ctx, XEvent* event) {
     XSelectionRequestEvent request = event->xselectionrequest;
 
@@ -5826,58 +10718,268 @@ HdlrResult selection_request_hdlr(struct Ctx* ctx, XEvent* event) {
             LENGTH(available_targets)
         );
     } else if (request.target == atoms[A_ImagePng]) {
-        u8* rgb_dyn = ximage_to_rgb(ctx->sel_buf.im, False);
-        i32 png_data_size = NIL;
-        stbi_uc* png_imdyn =
-            stbi_write_png_to_mem(rgb_dyn, 0, ctx->sel_buf.im->width, ctx->sel_buf.im->height, 3, &png_data_size);
-        if (png_imdyn != NULL) {
-            XChangeProperty(
-                request.display,
-                request.requestor,
-                request.property,
-                request.target,
-                8,
-                PropModeReplace,
-                png_imdyn,
-                png_data_size
-            );
+        if (!ctx->sel_buf.png) {
+            arrpush(ctx->sel_buf.waiting_arr, request);
         } else {
-            trace("selection request handler: stbi error: %s", stbi_failure_reason());
+            clip_send_png(ctx, &request);
         }
+        return HR_Ok;
+    }
+    clip_notify(ctx->dc.dp, &request, request.property);
+
+    return HR_Ok;
+}
 
-        free(rgb_dyn);
-        stbi_image_free(png_imdyn);
+void clip_send_png(struct Ctx* ctx, XSelectionRequestEvent const* request) {
+    struct ClipPng* png = ctx->sel_buf.png;
+    Display* dp = ctx->dc.dp;
+    if (!png->data_dyn) {
+        clip_notify(dp, request, None);  // refused
+        return;
     }
 
-    XSelectionEvent sendEvent = {
-        .type = SelectionNotify,
-        .serial = request.serial,
-        .send_event = request.send_event,
-        .display = request.display,
-        .requestor = request.requestor,
-        .selection = request.selection,
-        .target = request.target,
-        .property = request.property,
-        .time = request.time,
-    };
-    XSendEvent(ctx->dc.dp, request.requestor, 0, 0, (XEvent*)&sendEvent);
+    long const max_request = XExtendedMaxRequestSize(dp) ? XExtendedMaxRequestSize(dp) : XMaxRequestSize(dp);
+    // request size is in 4 byte units, part of it is taken by ChangeProperty fields
+    usize const chunk = MIN(INCR_CHUNK, ((usize)max_request * 4) - 256);
+    if ((usize)png->len <= chunk) {
+        XChangeProperty(
+            dp,
+            request->requestor,
+            request->property,
+            request->target,
+            8,
+            PropModeReplace,
+            png->data_dyn,
+            png->len
+        );
+        clip_notify(dp, request, request->property);
+        return;
+    }
+
+    (void)incr_send_expire(ctx);
+
+    // property value is lower bound of data size
+    long const size = png->len;
+    if (request->requestor != ctx->dc.window) {
+        XSelectInput(dp, request->requestor, PropertyChangeMask);  // own window selects it at creation
+    }
+    XChangeProperty(dp, request->requestor, request->property, atoms[A_Incr], 32, PropModeReplace, (u8*)&size, 1);
+    ++png->refs;
+    arrpush(
+        ctx->sel_buf.incr_arr,
+        ((struct IncrSend) {
+            .requestor = request->requestor,
+            .property = request->property,
+            .png = png,
+            .offset = 0,
+            .chunk = chunk,
+            .last_us = monotonic_us(),
+        })
+    );
+    clip_notify(dp, request, request->property);
+}
+
+static int incr_send_error_hdlr(__attribute__((unused)) Display* dp, __attribute__((unused)) XErrorEvent* e) {
+    incr_send_failed = True;
+    return 0;
+}
+
+Bool incr_send_next(struct Ctx* ctx, struct IncrSend* incr) {
+    Display* dp = ctx->dc.dp;
+    // zero length chunk ends transfer
+    u32 const len = MIN(incr->chunk, incr->png->len - incr->offset);
+
+    // requestor may be destroyed at any moment, errors must not be fatal
+    XSync(dp, False);
+    incr_send_failed = False;
+    XErrorHandler const prev_hdlr = XSetErrorHandler(&incr_send_error_hdlr);
+    XChangeProperty(
+        dp,
+        incr->requestor,
+        incr->property,
+        atoms[A_ImagePng],
+        8,
+        PropModeReplace,
+        incr->png->data_dyn + incr->offset,
+        (i32)len
+    );
+    XSync(dp, False);
+    XSetErrorHandler(prev_hdlr);
+
+    incr->offset += len;
+    incr->last_us = monotonic_us();
+    if (incr_send_failed) {
+        trace("xpaint: selection transfer to 0x%lx failed", incr->requestor);
+    }
+    return len && !incr_send_failed;
+}
+
+i32 incr_send_expire(struct Ctx* ctx) {
+    u64 const now_us = monotonic_us();
+    i32 result = -1;
+    for (u32 i = arrlen(ctx->sel_buf.incr_arr); i > 0; --i) {
+        u64 const idle_us = now_us - ctx->sel_buf.incr_arr[i - 1].last_us;
+        if (idle_us > INCR_TIMEOUT_US) {
+            trace("xpaint: selection transfer to 0x%lx timed out", ctx->sel_buf.incr_arr[i - 1].requestor);
+            incr_send_free(ctx, i - 1);
+            continue;
+        }
+        // rounded up, so transfer is past timeout on wakeup
+        i32 const left_ms = (i32)((INCR_TIMEOUT_US - idle_us) / 1000) + 1;
+        result = result < 0 ? left_ms : MIN(result, left_ms);
+    }
+    return result;
+}
+
+void incr_send_free(struct Ctx* ctx, u32 index) {
+    struct IncrSend* incr = &ctx->sel_buf.incr_arr[index];
+    Window const requestor = incr->requestor;
+    clip_png_release(&incr->png);
+    arrdel(ctx->sel_buf.incr_arr, index);
+
+    for (u32 i = 0; i < arrlen(ctx->sel_buf.incr_arr); ++i) {
+        if (ctx->sel_buf.incr_arr[i].requestor == requestor) {
+            return;  // still needs property events
+        }
+    }
+    if (requestor == ctx->dc.window) {
+        return;
+    }
+    XSync(ctx->dc.dp, False);
+    XErrorHandler const prev_hdlr = XSetErrorHandler(&incr_send_error_hdlr);
+    XSelectInput(ctx->dc.dp, requestor, NoEventMask);
+    XSync(ctx->dc.dp, False);
+    XSetErrorHandler(prev_hdlr);
+}
 
+HdlrResult property_notify_hdlr(struct Ctx* ctx, XEvent* event) {
+    XPropertyEvent const* e = &event->xproperty;
+    struct IncrRecv const* recv = &ctx->incr_recv;
+    if (e->window == ctx->dc.window && e->state == PropertyNewValue && recv->target != None
+        && e->atom == recv->property) {
+        incr_recv_chunk(ctx);
+        return HR_Ok;
+    }
+    if (e->state != PropertyDelete) {
+        return HR_Ok;
+    }
+    for (u32 i = 0; i < arrlen(ctx->sel_buf.incr_arr); ++i) {
+        struct IncrSend* incr = &ctx->sel_buf.incr_arr[i];
+        if (incr->requestor == e->window && incr->property == e->atom) {
+            if (!incr_send_next(ctx, incr)) {
+                incr_send_free(ctx, i);
+            }
+            break;
+        }
+    }
     return HR_Ok;
 }
 
+struct ClipJob {
+    struct Loop* loop;
+    XImage snapshot;  // selection with copied data
+    u32 generation;
+    struct ClipPng* png;
+};
+
+void clip_encode_start(struct Ctx* ctx) {
+    struct SelectionBuffer* sel = &ctx->sel_buf;
+    ++sel->generation;
+    clip_png_release(&sel->png);
+
+    XImage const* im = sel->im;
+    struct ClipJob* job = ecalloc(1, sizeof(struct ClipJob));
+    *job = (struct ClipJob) {.loop = &ctx->loop, .snapshot = *im, .generation = sel->generation};
+    // same as in save_start, XGetPixel works on copied struct
+    job->snapshot.data = ecalloc(im->height, im->bytes_per_line);
+    memcpy(job->snapshot.data, im->data, (usize)im->bytes_per_line * im->height);
+
+    ++sel->encoding;
+
+    pthread_t tid = 0;
+    if (pthread_create(&tid, NULL, &clip_encode_worker, job) == 0) {
+        pthread_detach(tid);
+    } else {
+        clip_encode_worker(job);  // completion is still posted
+    }
+}
+
+void* clip_encode_worker(void* arg) {
+    struct ClipJob* job = (struct ClipJob*)arg;
+    u64 const start_us = monotonic_us();
+    job->png = ecalloc(1, sizeof(struct ClipPng));
+    u8* rgb_dyn = ximage_to_rgb(&job->snapshot, False);
+    job->png->data_dyn =
+        stbi_write_png_to_mem(rgb_dyn, 0, job->snapshot.width, job->snapshot.height, 3, &job->png->len);
+    free(rgb_dyn);
+    if (job->png->data_dyn) {
+        trace(
+            "xpaint: selection encoded to %d bytes in %llu us",
+            job->png->len,
+            (unsigned long long)(monotonic_us() - start_us)
+        );
+    } else {
+        trace("xpaint: failed to encode selection: %s", stbi_failure_reason());
+    }
+    loop_post(job->loop, &clip_encode_done, job);
+    return NULL;
+}
+
+void clip_encode_done(struct Ctx* ctx, void* data) {
+    struct SelectionBuffer* sel = &ctx->sel_buf;
+    struct ClipJob* job = (struct ClipJob*)data;
+    job->png->refs = 1;
+    --sel->encoding;
+
+    if (job->generation == sel->generation) {
+        sel->png = job->png;
+        // requests made while encoding
+        for (u32 i = 0; i < arrlen(sel->waiting_arr); ++i) {
+            clip_send_png(ctx, &sel->waiting_arr[i]);
+        }
+        arrfree(sel->waiting_arr);
+    } else {
+        clip_png_release(&job->png);  // selection was copied again
+    }
+    free(job->snapshot.data);
+    free(job);
+}
+
+void clip_png_release(struct ClipPng** png) {
+    if (*png && --(*png)->refs == 0) {
+        stbi_image_free((*png)->data_dyn);
+        free(*png);
+    }
+    *png = NULL;
+}
+
 static void copy_image_to_transform_mode(struct Ctx* ctx, XImage* im) {
     struct InputOverlay* ovr = &ctx->input.ovr;
 
     overlay_clear(ovr);
-    ximage_blend(ovr->im, im, RNIL);
-    ovr->rect = ximage_calc_damage(ovr->im);
+    assert(im->bits_per_pixel == 32 && ovr->im->bits_per_pixel == 32);
+    assert(is_subrect(ximage_rect(ovr->im), ximage_rect(im)));
+    // placed at origin, so same result as ximage_blend into cleared overlay without scanning it afterwards
+    for (i32 y = 0; y < im->height; ++y) {
+        argb const* src = (argb const*)(im->data + ((usize)y * im->bytes_per_line));
+        argb* dst = (argb*)(ovr->im->data + ((usize)y * ovr->im->bytes_per_line));
+        for (i32 x = 0; x < im->width; ++x) {
+            u8 const alpha = src[x] >> 24;
+            if (alpha == 0xFF) {
+                dst[x] = src[x];
+            } else if (alpha) {
+                dst[x] = argb_blend(argb_normalize(src[x]), 0, alpha);
+            }
+            // transparent pixels are left untouched, so sparse overlay pages stay unallocated
+        }
+    }
+    ovr->rect = ximage_rect(im);
     input_set_damage(&ctx->input, ovr->rect);
     input_mode_set(ctx, InputT_Transform);
 }
 
 HdlrResult selection_notify_hdlr(struct Ctx* ctx, XEvent* event) {
     struct DrawCtx* dc = &ctx->dc;
-    struct ToolCtx* tc = &CURR_TC(ctx);
 
     XSelectionEvent e = event->xselection;
 
@@ -5905,8 +11007,36 @@ HdlrResult selection_notify_hdlr(struct Ctx* ctx, XEvent* event) {
         &data_xdyn
     );
 
-    if (e.target == atoms[A_ImagePng]) {
-        XImage* im = read_file_from_memory(dc, data_xdyn, count, 0x00000000).im;
+    if (actual_type == atoms[A_Incr]) {
+        // data follows in chunks, see property_notify_hdlr
+        struct IncrRecv* recv = &ctx->incr_recv;
+        arrfree(recv->data_arr);
+        *recv = (struct IncrRecv) {.target = e.target, .property = e.property};
+        // value is lower bound of size, only a hint from other client
+        long const size_hint = count == 1 && actual_format == 32 ? *(long*)data_xdyn : 0;
+        if (size_hint > 0) {
+            arrsetcap(recv->data_arr, MIN((usize)size_hint, INCR_HINT_MAX) + 1);
+        }
+        trace("xpaint: receiving selection incrementally");
+    } else {
+        selection_data_apply(ctx, e.target, data_xdyn, count);
+    }
+    // deletion also starts INCR transfer
+    XDeleteProperty(dc->dp, e.requestor, e.property);
+
+    if (data_xdyn) {
+        XFree(data_xdyn);
+    }
+
+    return HR_Ok;
+}
+
+void selection_data_apply(struct Ctx* ctx, Atom target, u8* data, usize count) {
+    struct DrawCtx* dc = &ctx->dc;
+    struct ToolCtx* tc = &CURR_TC(ctx);
+
+    if (target == atoms[A_ImagePng]) {
+        XImage* im = read_file_from_memory(dc, data, count, 0x00000000).im;
         if (im) {
             canvas_resize(ctx, MAX(dc->cv.im->width, im->width), MAX(dc->cv.im->height, im->height));
             copy_image_to_transform_mode(ctx, im);
@@ -5915,22 +11045,21 @@ HdlrResult selection_notify_hdlr(struct Ctx* ctx, XEvent* event) {
         } else {
             show_message(ctx, "failed to parse pasted image");
         }
-        XDeleteProperty(dc->dp, e.requestor, e.property);
-    } else if (e.target == atoms[A_TextUriList]) {
+    } else if (target == atoms[A_TextUriList]) {
         // last symbols always '\r\n' in valid uri-list
-        if (count >= 2 && data_xdyn[count - 2] == '\r') {
-            data_xdyn[count - 1] = '\0';
-            data_xdyn[count - 2] = '\0';
+        if (count >= 2 && data[count - 2] == '\r') {
+            data[count - 1] = '\0';
+            data[count - 2] = '\0';
         }
         for (u32 i = 0; i < count; ++i) {
-            if (data_xdyn[i] == '\r' || data_xdyn[i] == '\n') {
-                data_xdyn[i] = '\0';
+            if (data[i] == '\r' || data[i] == '\n') {
+                data[i] = '\0';
                 trace("xpaint: drag&drop only supports 1 file at a time");
                 break;
             }
         }
 
-        struct IOCtx ioctx = ioctx_new((char const*)data_xdyn);
+        struct IOCtx ioctx = ioctx_new((char const*)data);
         XImage* im = read_image_io(dc, &ioctx, 0x00000000).im;
         ioctx_free(&ioctx);
 
@@ -5942,21 +11071,20 @@ HdlrResult selection_notify_hdlr(struct Ctx* ctx, XEvent* event) {
         } else {
             show_message(ctx, "failed to parse dragged image");
         }
-        XDeleteProperty(dc->dp, e.requestor, e.property);
-    } else if (e.target == atoms[A_Utf8string]) {
+    } else if (target == atoms[A_Utf8string]) {
         switch (ctx->input.mode.t) {
             case InputT_Console:
                 for (u32 i = 0; i < count; ++i) {
                     // not letter, because utf-8 is multibyte enc
-                    char elem = (char)data_xdyn[i];
+                    char elem = (char)data[i];
                     cl_push(&ctx->input.mode.d.cl, elem);
                 }
-                update_statusline(ctx);
+                update_screen(ctx, PNIL, False);
                 break;
             case InputT_Color: {
-                if (data_xdyn) {
-                    if (argb_from_hex_col((char*)data_xdyn, tc_curr_col(tc))) {
-                        update_statusline(ctx);
+                if (data) {
+                    if (argb_from_hex_col((char*)data, tc_curr_col(tc))) {
+                        update_screen(ctx, PNIL, False);
                     } else {
                         show_message(ctx, "unexpected color format");
                     }
@@ -5966,7 +11094,7 @@ HdlrResult selection_notify_hdlr(struct Ctx* ctx, XEvent* event) {
             case InputT_Text:
                 for (u32 i = 0; i < count; ++i) {
                     // not letter, because utf-8 is multibyte enc
-                    char elem = (char)data_xdyn[i];
+                    char elem = (char)data[i];
                     text_mode_push(ctx, elem);
                 }
                 update_screen(ctx, PNIL, False);
@@ -5980,14 +11108,50 @@ HdlrResult selection_notify_hdlr(struct Ctx* ctx, XEvent* event) {
                 );
                 break;
         }
-        XDeleteProperty(dc->dp, e.requestor, e.property);
     }
+}
 
+void incr_recv_chunk(struct Ctx* ctx) {
+    struct IncrRecv* recv = &ctx->incr_recv;
+    Atom actual_type = 0;
+    i32 actual_format = 0;
+    u64 bytes_after = 0;
+    unsigned char* data_xdyn = NULL;
+    u64 count = 0;
+    // deletion requests next chunk
+    XGetWindowProperty(
+        ctx->dc.dp,
+        ctx->dc.window,
+        recv->property,
+        0,
+        LONG_MAX,
+        True,
+        AnyPropertyType,
+        &actual_type,
+        &actual_format,
+        &count,
+        &bytes_after,
+        &data_xdyn
+    );
+    if (actual_format != 8 && count) {
+        trace("xpaint: unexpected selection chunk format %d", actual_format);
+        arrfree(recv->data_arr);
+        recv->target = None;
+    } else if (count) {
+        memcpy(arraddnptr(recv->data_arr, count), data_xdyn, count);
+    } else {
+        // zero length chunk ends transfer
+        usize const len = arrlen(recv->data_arr);
+        arrput(recv->data_arr, '\0');  // text targets are used as strings
+        trace("xpaint: received %zu bytes of selection incrementally", len);
+        Atom const target = recv->target;
+        recv->target = None;
+        selection_data_apply(ctx, target, recv->data_arr, len);
+        arrfree(recv->data_arr);
+    }
     if (data_xdyn) {
         XFree(data_xdyn);
     }
-
-    return HR_Ok;
 }
 
 HdlrResult client_message_hdlr(struct Ctx* ctx, XEvent* event) {
@@ -6053,12 +11217,25 @@ void cleanup(struct Ctx* ctx) {
         if (ctx->sel_buf.im != NULL) {
             XDestroyImage(ctx->sel_buf.im);
         }
+        while (arrlen(ctx->sel_buf.incr_arr)) {
+            incr_send_free(ctx, arrlen(ctx->sel_buf.incr_arr) - 1);
+        }
+        arrfree(ctx->sel_buf.incr_arr);
+        arrfree(ctx->sel_buf.waiting_arr);
+        clip_png_release(&ctx->sel_buf.png);
+        arrfree(ctx->incr_recv.data_arr);
     }
     /* History */ {
         historyarr_clear(&ctx->hist_nextarr);
         historyarr_clear(&ctx->hist_prevarr);
     }
-    /* Selection circle */ { sel_circ_free_and_hide(&ctx->sc); }
+    /* Selection circle */ {
+        sel_circ_free_and_hide(&ctx->dc, &ctx->sc);
+        arrfree(ctx->sc.hue_items_arr);
+        if (ctx->sc.hue_pm) {
+            XFreePixmap(ctx->dc.dp, ctx->sc.hue_pm);
+        }
+    }
     /* ToolCtx */ {
         for (u32 i = 0; i < TCS_NUM; ++i) {
             tc_free(ctx->dc.dp, &ctx->tcarr[i]);
@@ -6066,6 +11243,13 @@ void cleanup(struct Ctx* ctx) {
         arrfree(ctx->tcarr);
     }
     /* Input */ { input_free(&ctx->input); }
+    /* Frame */ {
+        str_free(&ctx->frame.message_dyn);
+        arena_free(&frame_arena);
+    }
+    /* Statusline */ { arrfree(ctx->statusline.modules_arr); }
+    /* Saves */ { arrfree(ctx->saves.queue_arr); }
+    /* Loop */ { loop_free(&ctx->loop); }
     /* DrawCtx */ {
         dc_cache_free(&ctx->dc);
         /* Scheme */ {  // depends on VisualInfo and Colormap
@@ -6085,6 +11269,8 @@ void cleanup(struct Ctx* ctx) {
             XftFontClose(ctx->dc.dp, ctx->dc.fnt);
         }
         canvas_free(&ctx->dc.cv);
+        dc_view_free(&ctx->dc);
+        render_pool_free(&ctx->dc.render_pool);
         XdbeDeallocateBackBufferName(ctx->dc.dp, ctx->dc.back_buffer);
         XDestroyIC(ctx->dc.sys.xic);
         XCloseIM(ctx->dc.sys.xim);